@@ -0,0 +1,199 @@
+#include "abr.h"
+#include "check.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+
+static double abr_elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/// Decisions are not tied to frames, the bitrate is written right away.
+static enum vid_result abr_set_bitrate(struct abr *abr, unsigned bitrate) {
+    ctrls_set(abr->encoder_ctrls, V4L2_CID_MPEG_VIDEO_BITRATE, bitrate);
+    return ctrls_flush(abr->encoder_ctrls);
+}
+
+/// Set the frame rate of the sensor, which paces the pipeline, and of the
+/// encoder so that its rate control spreads the bitrate over actual frames.
+static enum vid_result abr_set_fps(struct abr *abr, unsigned fps) {
+
+    struct v4l2_streamparm param = {0};
+    param.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    param.parm.capture.timeperframe.numerator = 1;
+    param.parm.capture.timeperframe.denominator = fps;
+
+    enum vid_result res = vid_set_param(abr->sensor_fd, &param);
+    if (res != VID_OK)
+        return res;
+
+    param = (struct v4l2_streamparm) {0};
+    param.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    param.parm.output.timeperframe.numerator = 1;
+    param.parm.output.timeperframe.denominator = fps;
+
+    return vid_set_param(abr->encoder_ctrls->fd, &param);
+
+}
+
+static unsigned abr_clamp(const struct abr *abr, double bitrate) {
+    if (bitrate < abr->config.min_bitrate)
+        bitrate = abr->config.min_bitrate;
+    if (bitrate > abr->config.max_bitrate)
+        bitrate = abr->config.max_bitrate;
+    unsigned value = (unsigned) bitrate;
+    return value - (value - abr->config.min_bitrate) % abr->step;
+}
+
+void abr_init(struct abr *abr, const struct abr_config *config, int sensor_fd, struct ctrls *encoder_ctrls) {
+
+    memset(abr, 0, sizeof(struct abr));
+    abr->config = *config;
+    abr->sensor_fd = sensor_fd;
+    abr->encoder_ctrls = encoder_ctrls;
+
+    // The bitrate is read first, an encoder without it is fatal.
+    __s32 bitrate;
+    check_res(ctrls_get(encoder_ctrls, V4L2_CID_MPEG_VIDEO_BITRATE, &bitrate));
+    const struct ctrlreg_entry *query = ctrlreg_find(encoder_ctrls->registry, V4L2_CID_MPEG_VIDEO_BITRATE);
+
+    if (abr->config.min_bitrate < query->minimum)
+        abr->config.min_bitrate = query->minimum;
+    if (abr->config.max_bitrate > query->maximum)
+        abr->config.max_bitrate = query->maximum;
+    if (abr->config.max_bitrate < abr->config.min_bitrate) {
+        fprintf(stderr, "error: abr bitrate range is outside of the encoder range %lld-%lld\n", query->minimum, query->maximum);
+        exit(1);
+    }
+    abr->step = query->step ? query->step : 1;
+
+    abr->bitrate = abr_clamp(abr, bitrate);
+    if (abr->bitrate != (unsigned) bitrate)
+        check_res(abr_set_bitrate(abr, abr->bitrate));
+
+    // Without a frame rate reported by the sensor, only the bitrate is adapted.
+    struct v4l2_streamparm param = {0};
+    param.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (vid_get_param(sensor_fd, &param) == VID_OK && param.parm.capture.timeperframe.numerator) {
+        struct v4l2_fract tpf = param.parm.capture.timeperframe;
+        abr->max_fps = tpf.denominator / tpf.numerator;
+    }
+    if (!abr->max_fps || abr->config.min_fps >= abr->max_fps)
+        abr->config.min_fps = 0;
+    abr->fps = abr->max_fps;
+
+    clock_gettime(CLOCK_MONOTONIC, &abr->start);
+    abr->last = abr->start;
+
+    if (abr->config.log)
+        fprintf(abr->config.log, "time_ms,frames,answers,lost,loss,delay_ms,base_ms,queue_ms,action,bitrate,fps\n");
+
+    printf("info: abr bitrate %u (%u-%u step %u), fps %u (min %u)\n", abr->bitrate,
+        abr->config.min_bitrate, abr->config.max_bitrate, abr->step, abr->fps, abr->config.min_fps);
+
+}
+
+void abr_update(struct abr *abr, const struct packetizer *pkt) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (abr_elapsed_ms(&abr->last, &now) < abr->config.interval_ms)
+        return;
+
+    unsigned long frames = pkt->frames - abr->frames;
+    unsigned long answers = pkt->answers - abr->answers;
+    unsigned long lost = pkt->lost_frames - abr->lost_frames;
+    double delay_sum = pkt->delay_sum - abr->delay_sum;
+    abr->frames = pkt->frames;
+    abr->answers = pkt->answers;
+    abr->lost_frames = pkt->lost_frames;
+    abr->delay_sum = pkt->delay_sum;
+    abr->last = now;
+    abr->intervals++;
+
+    double loss = answers ? (double) lost / answers : 0;
+    double delay = answers > lost ? delay_sum / (answers - lost) : 0;
+
+    // The base delay is the lowest recent one, the path delay without queuing.
+    if (answers > lost)
+        abr->delays[abr->delays_count++ % ABR_BASE_INTERVALS] = delay;
+    unsigned count = abr->delays_count < ABR_BASE_INTERVALS ? abr->delays_count : ABR_BASE_INTERVALS;
+    double base = delay;
+    for (unsigned i = 0; i < count; i++)
+        if (abr->delays[i] < base)
+            base = abr->delays[i];
+    double queue = delay - base;
+
+    const char *action = "hold";
+    double bitrate = abr->bitrate;
+    bool congested = true;
+    abr->since_decrease++;
+
+    if (frames && !answers) {
+        // Nothing came back, the link is down or the receiver is gone.
+        action = "silent";
+        bitrate *= 0.5;
+    } else if (loss > abr->config.loss_high) {
+        action = "loss";
+        bitrate *= loss < 0.5 ? 1 - loss : 0.5;
+    } else if (queue > abr->config.delay_target_ms) {
+        action = "delay";
+        bitrate *= 0.85;
+    } else {
+        congested = false;
+        if (answers && loss <= abr->config.loss_low && queue < abr->config.delay_target_ms / 2 && abr->since_decrease > 2) {
+            action = "increase";
+            bitrate = bitrate * 1.05 + abr->step;
+        }
+    }
+
+    unsigned fps = abr->fps;
+    if (congested) {
+        abr->since_decrease = 0;
+        // At the floor, fewer frames give more bits to each of them.
+        if (abr->bitrate == abr->config.min_bitrate && abr->config.min_fps && fps > abr->config.min_fps) {
+            fps = fps / 2 > abr->config.min_fps ? fps / 2 : abr->config.min_fps;
+            action = "fps-down";
+        }
+    } else if (bitrate > abr->bitrate && abr->config.min_fps && fps < abr->max_fps && abr->bitrate >= 2 * abr->config.min_bitrate) {
+        // The frame rate is restored before the bitrate increases further.
+        fps = fps * 2 < abr->max_fps ? fps * 2 : abr->max_fps;
+        bitrate = abr->bitrate;
+        action = "fps-up";
+    }
+
+    unsigned value = abr_clamp(abr, bitrate);
+    if (value != abr->bitrate) {
+        if (abr_set_bitrate(abr, value) == VID_OK) {
+            if (value > abr->bitrate)
+                abr->increases++;
+            else
+                abr->decreases++;
+            abr->bitrate = value;
+        } else {
+            fprintf(stderr, "warn: abr failed to set bitrate %u\n", value);
+        }
+    }
+
+    if (fps != abr->fps) {
+        if (abr_set_fps(abr, fps) == VID_OK) {
+            abr->fps = fps;
+            abr->fps_changes++;
+        } else {
+            // The devices don't support changing the frame rate while streaming.
+            fprintf(stderr, "warn: abr failed to set frame rate %u, only the bitrate is adapted\n", fps);
+            abr->config.min_fps = 0;
+        }
+    }
+
+    if (abr->config.log)
+        fprintf(abr->config.log, "%.0f,%lu,%lu,%lu,%.4f,%.2f,%.2f,%.2f,%s,%u,%u\n", abr_elapsed_ms(&abr->start, &now),
+            frames, answers, lost, loss, delay, base, queue, action, abr->bitrate, abr->fps);
+
+}
+
+void abr_report(const struct abr *abr) {
+    printf("info: abr %lu intervals, %lu increases, %lu decreases, %lu fps changes, final bitrate %u, fps %u\n",
+        abr->intervals, abr->increases, abr->decreases, abr->fps_changes, abr->bitrate, abr->fps);
+}
@@ -0,0 +1,78 @@
+/// Closed-loop adaptive bitrate control of the running encoder, driven by the
+/// answers of the receiver to the UDP packetizer (see 'packetizer.h'). Feedback
+/// is aggregated over fixed intervals: losses and queuing delay above the lowest
+/// recent delay decrease the bitrate multiplicatively, a clean link increases it
+/// slowly. When the bitrate floor is reached the frame rate is halved, through
+/// the sensor and encoder stream parameters, and restored once the link recovers.
+///
+/// Every interval is logged as a CSV line to tune the controller on recorded traces.
+
+#pragma once
+
+#include "packetizer.h"
+#include "ctrls.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+
+/// Number of intervals over which the base delay is the minimum.
+#define ABR_BASE_INTERVALS 16
+
+struct abr_config {
+    unsigned min_bitrate;
+    unsigned max_bitrate;
+    /// Lowest frame rate, zero to never change the frame rate.
+    unsigned min_fps;
+    /// Length of the feedback intervals.
+    unsigned interval_ms;
+    /// Queuing delay above which the bitrate is decreased.
+    double delay_target_ms;
+    /// Lost frames ratio above which the bitrate is decreased, and under which
+    /// it may increase.
+    double loss_high;
+    double loss_low;
+    /// Decisions are appended to this file, NULL if none.
+    FILE *log;
+};
+
+struct abr {
+    struct abr_config config;
+    int sensor_fd;
+    /// Controls of the encoder, the bitrate is written through them.
+    struct ctrls *encoder_ctrls;
+    /// Bitrate bounds and step of the encoder control.
+    unsigned step;
+    unsigned bitrate;
+    unsigned fps;
+    unsigned max_fps;
+    struct timespec start;
+    struct timespec last;
+    /// Packetizer counters at the start of the interval.
+    unsigned long frames;
+    unsigned long answers;
+    unsigned long lost_frames;
+    double delay_sum;
+    /// Average delays of the last intervals, their minimum is the base delay.
+    double delays[ABR_BASE_INTERVALS];
+    unsigned delays_count;
+    /// Intervals since the last decrease, increases wait for the link to settle.
+    unsigned since_decrease;
+    unsigned long intervals;
+    unsigned long increases;
+    unsigned long decreases;
+    unsigned long fps_changes;
+};
+
+
+/// Initialize the controller from the current encoder bitrate and sensor frame
+/// rate, the bounds are clamped to the range of the encoder control.
+void abr_init(struct abr *abr, const struct abr_config *config, int sensor_fd, struct ctrls *encoder_ctrls);
+
+/// Update the controller after a frame was sent, a decision is taken at the end
+/// of each interval.
+void abr_update(struct abr *abr, const struct packetizer *pkt);
+
+/// Print the controller statistics.
+void abr_report(const struct abr *abr);
@@ -0,0 +1,152 @@
+#include "ae.h"
+#include "check.h"
+
+#include <string.h>
+#include <stdio.h>
+
+
+static double ae_gain(unsigned code) {
+    return 1024.0 / (1024 - code);
+}
+
+void ae_init(struct ae *ae, const struct ae_config *config, struct ctrls *sensor_ctrls) {
+
+    memset(ae, 0, sizeof(struct ae));
+    ae->config = *config;
+    ae->sensor_ctrls = sensor_ctrls;
+    int sensor_fd = sensor_ctrls->fd;
+
+    __s32 exposure, code, vblank;
+    check_res(ctrls_get(sensor_ctrls, V4L2_CID_EXPOSURE, &exposure));
+    check_res(ctrls_get(sensor_ctrls, V4L2_CID_ANALOGUE_GAIN, &code));
+    check_res(ctrls_get(sensor_ctrls, V4L2_CID_VBLANK, &vblank));
+
+    // Exposure is counted in lines, a frame lasts its active lines and the
+    // vertical blanking. Without a frame rate reported by the sensor, assume 30.
+    struct v4l2_format fmt = {0};
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    check_res(vid_get_format(sensor_fd, &fmt));
+    double period_us = 1000000.0 / 30;
+    struct v4l2_streamparm param = {0};
+    param.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (vid_get_param(sensor_fd, &param) == VID_OK && param.parm.capture.timeperframe.denominator) {
+        struct v4l2_fract tpf = param.parm.capture.timeperframe;
+        period_us = 1000000.0 * tpf.numerator / tpf.denominator;
+    }
+    ae->line_us = period_us / (fmt.fmt.pix.height + vblank);
+
+    double max_exposure_us = ae->config.max_exposure_us ? ae->config.max_exposure_us : period_us;
+    if (max_exposure_us > period_us)
+        max_exposure_us = period_us;
+    // The exposure range follows the vertical blanking, the one of the registry
+    // may come from a cache written with another blanking.
+    struct ctrlreg_entry exposure_query;
+    check_res(ctrlreg_query(sensor_fd, V4L2_CID_EXPOSURE, &exposure_query));
+    const struct ctrlreg_entry *gain_query = ctrlreg_find(sensor_ctrls->registry, V4L2_CID_ANALOGUE_GAIN);
+    ae->min_exposure = exposure_query.minimum;
+    ae->max_exposure = (unsigned) (max_exposure_us / ae->line_us);
+    if (ae->max_exposure > exposure_query.maximum)
+        ae->max_exposure = exposure_query.maximum;
+    if (ae->max_exposure < ae->min_exposure)
+        ae->max_exposure = ae->min_exposure;
+    ae->short_exposure = (unsigned) (ae->config.short_exposure_us / ae->line_us);
+    if (ae->short_exposure < ae->min_exposure)
+        ae->short_exposure = ae->min_exposure;
+    if (ae->short_exposure > ae->max_exposure)
+        ae->short_exposure = ae->max_exposure;
+
+    ae->max_code = gain_query->maximum;
+    if (ae->config.max_gain >= 1 && 1024 - 1024 / ae->config.max_gain < ae->max_code)
+        ae->max_code = (unsigned) (1024 - 1024 / ae->config.max_gain);
+
+    ae->exposure = exposure;
+    ae->code = code;
+
+    printf("info: ae exposure %u lines (%.0f us), gain %.2f, short exposure %u lines, max %u lines, max gain %.2f\n",
+        ae->exposure, ae->exposure * ae->line_us, ae_gain(ae->code), ae->short_exposure, ae->max_exposure, ae_gain(ae->max_code));
+
+}
+
+/// Split a total exposure, in lines at unit gain, between the exposure time and
+/// the analogue gain.
+static void ae_split(const struct ae *ae, double total, unsigned *exposure, unsigned *code) {
+
+    // Short exposures first, then gain, then long exposures.
+    double lines = total < ae->short_exposure ? total : ae->short_exposure;
+    double gain = total / lines;
+    double max_gain = ae_gain(ae->max_code);
+    if (gain > max_gain) {
+        gain = max_gain;
+        lines = total / max_gain;
+        if (lines > ae->max_exposure)
+            lines = ae->max_exposure;
+    }
+    if (lines < ae->min_exposure)
+        lines = ae->min_exposure;
+    if (gain < 1)
+        gain = 1;
+
+    *exposure = (unsigned) (lines + 0.5);
+    *code = (unsigned) (1024 - 1024 / gain + 0.5);
+    if (*code > ae->max_code)
+        *code = ae->max_code;
+
+}
+
+void ae_update(struct ae *ae, const struct stats *stats) {
+
+    // The controls written last were flushed by the caller since, the split
+    // starts from the ones the driver applied after clamping them.
+    __s32 exposure_applied, code_applied;
+    check_res(ctrls_get(ae->sensor_ctrls, V4L2_CID_EXPOSURE, &exposure_applied));
+    check_res(ctrls_get(ae->sensor_ctrls, V4L2_CID_ANALOGUE_GAIN, &code_applied));
+    ae->exposure = exposure_applied;
+    ae->code = code_applied;
+
+    ae->frames++;
+    if (ae->wait) {
+        ae->wait--;
+        return;
+    }
+    if (!stats->cells)
+        return;
+
+    uint64_t sum = 0;
+    for (unsigned bin = 0; bin < STATS_BINS; bin++)
+        sum += (uint64_t) stats->histogram[bin] * (2 * bin + 1);
+    ae->mean = (double) sum / (2.0 * STATS_BINS * stats->cells);
+    ae->updates++;
+
+    // The mean of a clipped frame is underestimated, so the exposure is lowered
+    // by at least half until the highlights are back in range.
+    double ratio = ae->mean > 0 ? ae->config.target / ae->mean : 8;
+    if (stats->histogram[STATS_BINS - 1] > ae->config.clipped * stats->cells && ratio > 0.5)
+        ratio = 0.5;
+    if (ratio < 1.0 / 8)
+        ratio = 1.0 / 8;
+    if (ratio > 8)
+        ratio = 8;
+    if (ratio < 1 + ae->config.deadband && ratio > 1 - ae->config.deadband) {
+        if (!ae->converged_frame)
+            ae->converged_frame = ae->frames;
+        return;
+    }
+
+    unsigned exposure, code;
+    ae_split(ae, ae->exposure * ae_gain(ae->code) * ratio, &exposure, &code);
+    if (exposure == ae->exposure && code == ae->code)
+        return;
+
+    ctrls_set(ae->sensor_ctrls, V4L2_CID_EXPOSURE, exposure);
+    ctrls_set(ae->sensor_ctrls, V4L2_CID_ANALOGUE_GAIN, code);
+    ae->exposure = exposure;
+    ae->code = code;
+    ae->wait = ae->config.latency;
+    ae->writes++;
+
+}
+
+void ae_report(const struct ae *ae) {
+    printf("info: ae exposure %u lines (%.0f us), gain %.2f, mean %.3f, %lu updates, %lu writes, converged after %lu frames\n",
+        ae->exposure, ae->exposure * ae->line_us, ae_gain(ae->code), ae->mean, ae->updates, ae->writes, ae->converged_frame);
+}
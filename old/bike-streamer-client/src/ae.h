@@ -0,0 +1,72 @@
+/// Automatic exposure and analogue gain of the sensor, driven by the luma
+/// histogram of the raw frames (see 'stats.h'). The mean luma is brought to a
+/// target, lowered when highlights clip, by scaling the total exposure, the
+/// product of the exposure time and the analogue gain.
+///
+/// The total exposure is split to limit motion blur: the exposure time is raised
+/// up to a short limit first, then the gain up to its maximum, and only then the
+/// exposure time up to the frame period. Sensor controls take effect a few frames
+/// after being written, the frames in between are not measured so that the loop
+/// converges in a few updates without oscillating.
+///
+/// Analogue gain codes follow the IMX477: the gain is 1024 / (1024 - code).
+
+#pragma once
+
+#include "stats.h"
+#include "ctrls.h"
+
+
+struct ae_config {
+    /// Target mean luma, as a fraction of the full range.
+    double target;
+    /// Share of the cells in the top bin of the histogram above which the frame
+    /// is considered clipped, the exposure is then at least halved.
+    double clipped;
+    /// Exposure time up to which the gain is not raised, and the maximum one, in
+    /// microseconds. The maximum is also bounded by the frame period.
+    unsigned short_exposure_us;
+    unsigned max_exposure_us;
+    /// Maximum analogue gain.
+    double max_gain;
+    /// Relative error of the mean under which nothing is changed.
+    double deadband;
+    /// Frames between a write of the controls and the first frame using them.
+    unsigned latency;
+};
+
+struct ae {
+    struct ae_config config;
+    /// Controls of the sensor, staged values are written when the caller flushes
+    /// them.
+    struct ctrls *sensor_ctrls;
+    /// Duration of a line and bounds of the controls.
+    double line_us;
+    unsigned min_exposure;
+    unsigned max_exposure;
+    unsigned short_exposure;
+    unsigned max_code;
+    /// Current controls, as applied by the driver once flushed.
+    unsigned exposure;
+    unsigned code;
+    /// Frames left before the controls written last take effect.
+    unsigned wait;
+    /// Mean luma of the last measured frame.
+    double mean;
+    unsigned long updates;
+    unsigned long writes;
+    /// Frames seen, and the first one whose mean was within the deadband.
+    unsigned long frames;
+    unsigned long converged_frame;
+};
+
+
+/// Initialize the controller from the current sensor controls, format and frame
+/// rate, errors are fatal.
+void ae_init(struct ae *ae, const struct ae_config *config, struct ctrls *sensor_ctrls);
+
+/// Update the controls from the statistics of a frame.
+void ae_update(struct ae *ae, const struct stats *stats);
+
+/// Print the controller statistics.
+void ae_report(const struct ae *ae);
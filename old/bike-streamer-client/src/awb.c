@@ -0,0 +1,123 @@
+#include "awb.h"
+#include "check.h"
+
+#include <string.h>
+#include <stdio.h>
+
+
+static double awb_clamp(const struct awb *awb, double gain) {
+    if (gain < awb->config.min_gain)
+        gain = awb->config.min_gain;
+    if (gain > awb->config.max_gain)
+        gain = awb->config.max_gain;
+    return gain;
+}
+
+void awb_init(struct awb *awb, const struct awb_config *config, struct ctrls *isp_ctrls) {
+
+    memset(awb, 0, sizeof(struct awb));
+    awb->config = *config;
+    awb->isp_ctrls = isp_ctrls;
+
+    __s32 red, blue;
+    check_res(ctrls_get(isp_ctrls, V4L2_CID_RED_BALANCE, &red));
+    check_res(ctrls_get(isp_ctrls, V4L2_CID_BLUE_BALANCE, &blue));
+
+    awb->red_written = red;
+    awb->blue_written = blue;
+    awb->red = awb_clamp(awb, red);
+    awb->blue = awb_clamp(awb, blue);
+
+    printf("info: awb gains red %u blue %u (%u-%u)\n", awb->red_written, awb->blue_written, awb->config.min_gain, awb->config.max_gain);
+
+}
+
+/// Estimate the gains that make the selected zones grey on average, zones are
+/// selected if their own gains are in range and, when a previous estimate is
+/// given, within the outlier ratio of it. Return the number of zones used.
+static unsigned awb_estimate(const struct awb *awb, const struct stats *stats, const double *previous, double gains[2]) {
+
+    // Zones darker than 1/64 of the range are mostly noise, and zones with more
+    // than a quarter of saturated cells are clipped.
+    double dark = 2.0 * (stats->saturation >> 6);
+    double ratio = awb->config.outlier_ratio;
+    double sums[STATS_CHANNELS] = { 0 };
+    unsigned zones = 0;
+
+    for (unsigned y = 0; y < STATS_ZONES_Y; y++) {
+        for (unsigned x = 0; x < STATS_ZONES_X; x++) {
+
+            const struct stats_zone *zone = &stats->zones[y][x];
+            if (!zone->cells || zone->cells * 4 < zone->total * 3)
+                continue;
+            if (!zone->sums[STATS_R] || !zone->sums[STATS_B] || zone->sums[STATS_G] < dark * zone->cells)
+                continue;
+
+            // Green sums both green samples of the cells.
+            double red = 500.0 * zone->sums[STATS_G] / zone->sums[STATS_R];
+            double blue = 500.0 * zone->sums[STATS_G] / zone->sums[STATS_B];
+            if (red < awb->config.min_gain || red > awb->config.max_gain || blue < awb->config.min_gain || blue > awb->config.max_gain)
+                continue;
+            if (previous && (red > previous[0] * ratio || red * ratio < previous[0] || blue > previous[1] * ratio || blue * ratio < previous[1]))
+                continue;
+
+            for (unsigned c = 0; c < STATS_CHANNELS; c++)
+                sums[c] += zone->sums[c];
+            zones++;
+
+        }
+    }
+
+    if (zones) {
+        gains[0] = 500.0 * sums[STATS_G] / sums[STATS_R];
+        gains[1] = 500.0 * sums[STATS_G] / sums[STATS_B];
+    }
+
+    return zones;
+
+}
+
+void awb_update(struct awb *awb, const struct stats *stats) {
+
+    // The gains written last were flushed by the caller since, compare with
+    // the ones the driver applied after rounding them.
+    __s32 red_applied, blue_applied;
+    check_res(ctrls_get(awb->isp_ctrls, V4L2_CID_RED_BALANCE, &red_applied));
+    check_res(ctrls_get(awb->isp_ctrls, V4L2_CID_BLUE_BALANCE, &blue_applied));
+    awb->red_written = red_applied;
+    awb->blue_written = blue_applied;
+
+    double first[2], gains[2];
+    unsigned zones = awb_estimate(awb, stats, NULL, first);
+    if (zones >= awb->config.min_zones)
+        zones = awb_estimate(awb, stats, first, gains);
+
+    awb->zones = zones;
+    if (zones < awb->config.min_zones) {
+        awb->skipped++;
+        return;
+    }
+
+    awb->red += (awb_clamp(awb, gains[0]) - awb->red) * awb->config.speed;
+    awb->blue += (awb_clamp(awb, gains[1]) - awb->blue) * awb->config.speed;
+    awb->updates++;
+
+    unsigned red = (unsigned) (awb->red + 0.5);
+    unsigned blue = (unsigned) (awb->blue + 0.5);
+    double deadband = awb->config.deadband;
+    if (red <= awb->red_written * (1 + deadband) && red >= awb->red_written * (1 - deadband)
+        && blue <= awb->blue_written * (1 + deadband) && blue >= awb->blue_written * (1 - deadband))
+        return;
+
+    ctrls_set(awb->isp_ctrls, V4L2_CID_RED_BALANCE, red);
+    ctrls_set(awb->isp_ctrls, V4L2_CID_BLUE_BALANCE, blue);
+    awb->red_written = red;
+    awb->blue_written = blue;
+    awb->writes++;
+
+}
+
+void awb_report(const struct awb *awb) {
+    printf("info: awb gains red %u blue %u, %lu updates, %lu skipped, %lu writes, %u grey zones\n",
+        awb->red_written, awb->blue_written, awb->updates, awb->skipped, awb->writes, awb->zones);
+}
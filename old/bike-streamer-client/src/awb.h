@@ -0,0 +1,58 @@
+/// Automatic white balance of the ISP, driven by the zone statistics of the raw
+/// sensor frames (see 'stats.h'). It is a constrained grey-world: zones that are
+/// too dark, mostly saturated, or whose color needs gains outside of the allowed
+/// range are ignored, then the gains that make the remaining zones grey on average
+/// are estimated twice, the second time without the zones far from the first
+/// estimate so that a dominant colored surface (foliage, sky) does not pull the
+/// balance. The gains move smoothly towards the estimate and are only written to
+/// the red and blue balance controls of the ISP when they changed noticeably.
+
+#pragma once
+
+#include "stats.h"
+#include "ctrls.h"
+
+#include <stdbool.h>
+
+
+struct awb_config {
+    /// Bounds of the balance gains, in thousandths like the ISP controls.
+    unsigned min_gain;
+    unsigned max_gain;
+    /// Ratio between the gains of a zone and the first estimate above which the
+    /// zone is left out of the second one.
+    double outlier_ratio;
+    /// Minimum number of grey zones to update the estimate.
+    unsigned min_zones;
+    /// Fraction of the error corrected on each frame.
+    double speed;
+    /// Relative change of a gain under which the controls are not written.
+    double deadband;
+};
+
+struct awb {
+    struct awb_config config;
+    /// Controls of the ISP output device owning the balance controls, staged
+    /// values are written when the caller flushes them.
+    struct ctrls *isp_ctrls;
+    /// Smoothed gains and the ones applied by the controls, read back after each
+    /// flush, in thousandths.
+    double red;
+    double blue;
+    unsigned red_written;
+    unsigned blue_written;
+    unsigned zones;
+    unsigned long updates;
+    unsigned long skipped;
+    unsigned long writes;
+};
+
+
+/// Initialize the white balance from the current controls of the ISP.
+void awb_init(struct awb *awb, const struct awb_config *config, struct ctrls *isp_ctrls);
+
+/// Update the gains from the statistics of a frame.
+void awb_update(struct awb *awb, const struct stats *stats);
+
+/// Print the white balance statistics.
+void awb_report(const struct awb *awb);
@@ -0,0 +1,48 @@
+/// Pluggable device backends under the vid_* API.
+/// A backend is selected when opening a device from the prefix of its path, any
+/// path without a known prefix is a real V4L2 device node (including vivid/vim2m).
+///
+/// Synthetic devices:     synth:<kind>[@fps]
+/// File replay devices:   replay:<kind>:<file>[@fps]
+/// Software ISP:          soft:isp-output, soft:isp-capture[:bilinear|edge[:threads]]
+///
+/// Where kind is one of 'sensor', 'isp-output', 'isp-capture' or 'encoder'.
+
+#pragma once
+
+#include <sys/types.h>
+#include <stddef.h>
+
+
+/// Operations implemented by a device backend. Every function follows the
+/// system call convention of returning -1 and setting errno on error.
+struct vid_backend {
+    /// Short name of the backend, for logging.
+    const char *name;
+    /// Path prefix selecting this backend, NULL for the default one.
+    const char *prefix;
+    /// Open the device at the given path (prefix excluded), returning its file
+    /// descriptor that can be polled for new events.
+    int (*open)(const char *path);
+    /// Close the device.
+    int (*close)(int fd);
+    /// Emulate a V4L2 ioctl on the device.
+    int (*ioctl)(int fd, unsigned long request, void *arg);
+    /// Map a buffer previously queried with VIDIOC_QUERYBUF.
+    void *(*mmap)(int fd, size_t length, off_t offset);
+    /// Compute the current poll events of the device, from its internal state,
+    /// this is NULL for kernel devices where poll events are reported by the kernel.
+    /// Backends implementing this can only be waited for POLLIN on their file
+    /// descriptor, which is signaled on every state change.
+    short (*revents)(int fd, short events);
+    /// Get the file descriptor to wait for the given events, which is signaled
+    /// only for them when a thread waits one queue of a memory-to-memory device
+    /// while another thread waits the other queue. NULL if the device file
+    /// descriptor is always waited.
+    int (*wait_fd)(int fd, short events);
+};
+
+extern const struct vid_backend vid_backend_v4l2;
+extern const struct vid_backend vid_backend_synth;
+extern const struct vid_backend vid_backend_replay;
+extern const struct vid_backend vid_backend_soft;
@@ -0,0 +1,476 @@
+/// Benchmark of the processing kernels of the client, each run on a single
+/// pinned core against the frame rate the sensor has to sustain, then of the
+/// software demosaic over threads and of an ISP through the vid_* API, and the
+/// cost of a traced span.
+
+#define _GNU_SOURCE
+
+#include "debayer.h"
+#include "stats.h"
+#include "unpack.h"
+#include "check.h"
+#include "trace.h"
+#include "v4l2.h"
+
+#include <linux/videodev2.h>
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+
+/// Pin the benchmark to the first core, or release it on all cores for the
+/// multithreaded runs, threads inherit the affinity when they are created.
+static void bench_pin(bool single) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    long count = single ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    for (long i = 0; i < count && i < CPU_SETSIZE; i++)
+        CPU_SET(i, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        fprintf(stderr, "warn: failed to pin the benchmark (%s)\n", strerror(errno));
+}
+
+/// Allocate a frame of random bytes, errors are fatal.
+static uint8_t *bench_frame(size_t size) {
+    uint8_t *frame = malloc(size);
+    if (!frame) {
+        fprintf(stderr, "error: failed to allocate frame\n");
+        exit(1);
+    }
+    srand(1);
+    for (size_t i = 0; i < size; i++)
+        frame[i] = (uint8_t) rand();
+    return frame;
+}
+
+static double bench_elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/// Compare the planes unpacked by the selected kernel to the scalar reference.
+static bool bench_check(const struct unpack_planes *planes, const struct unpack_planes *reference) {
+    for (unsigned c = 0; c < UNPACK_CHANNELS; c++)
+        for (unsigned y = 0; y < planes->height; y++)
+            if (memcmp(planes->planes[c] + (size_t) y * planes->stride, reference->planes[c] + (size_t) y * reference->stride, planes->width * sizeof(uint16_t)))
+                return false;
+    return true;
+}
+
+static void bench_unpack(uint32_t pixelformat, const char *name, unsigned width, unsigned height, double fps) {
+
+    // Same line alignment as the sensor.
+    unsigned depth = pixelformat == V4L2_PIX_FMT_SRGGB12P ? 12 : 10;
+    unsigned bytesperline = (width * depth / 8 + 31) & ~31u;
+    size_t size = (size_t) bytesperline * height;
+
+    uint8_t *frame = bench_frame(size);
+
+    struct unpack_planes planes, reference;
+    unpack_planes_alloc(&planes, width, height);
+    unpack_planes_alloc(&reference, width, height);
+    unpack_select_kernel("scalar");
+    unpack_frame(&reference, frame, pixelformat, width, height, bytesperline);
+
+    unsigned count;
+    const struct unpack_kernel *kernels = unpack_kernels(&count);
+    for (unsigned n = 0; n < count; n++) {
+
+        unpack_select_kernel(kernels[n].name);
+        for (unsigned c = 0; c < UNPACK_CHANNELS; c++)
+            memset(planes.planes[c], 0, (size_t) planes.stride * planes.height * sizeof(uint16_t));
+        unpack_frame(&planes, frame, pixelformat, width, height, bytesperline);
+        bool ok = bench_check(&planes, &reference);
+
+        struct timespec start;
+        unsigned long frames = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (unsigned i = 0; i < 8; i++, frames++)
+                unpack_frame(&planes, frame, pixelformat, width, height, bytesperline);
+        } while (bench_elapsed(&start) < 0.5);
+        double elapsed = bench_elapsed(&start);
+
+        double rate = frames / elapsed;
+        printf("%-8s %-8s %5ux%-5u %9.2f %8.0f %8.0f %6.0f%% %6s\n", kernels[n].name, name, width, height,
+            elapsed / frames * 1e3, rate, rate * size / 1e6, fps * 100 / rate, ok ? "ok" : "FAILED");
+
+    }
+
+    unpack_planes_free(&planes);
+    unpack_planes_free(&reference);
+    free(frame);
+
+}
+
+/// Statistics of a sensor frame at the decimation of the pipeline, each kernel
+/// checked against the scalar reference.
+static void bench_stats(unsigned width, unsigned height, double fps, unsigned decimation) {
+
+    unsigned bytesperline = (width * 12 / 8 + 31) & ~31u;
+    size_t size = (size_t) bytesperline * height;
+    uint8_t *frame = bench_frame(size);
+
+    struct stats stats, reference;
+    stats_init(&reference, width, height, V4L2_PIX_FMT_SRGGB12P, bytesperline, decimation);
+    stats_init(&stats, width, height, V4L2_PIX_FMT_SRGGB12P, bytesperline, decimation);
+    stats_select_kernel("scalar");
+    stats_frame(&reference, frame);
+
+    printf("\n%-8s %-8s %11s %9s %8s %7s %6s\n", "kernel", "rows", "size", "ms/frame", "fps", "load", "check");
+
+    unsigned count;
+    const struct stats_kernel *kernels = stats_kernels(&count);
+    for (unsigned n = 0; n < count; n++) {
+
+        stats_select_kernel(kernels[n].name);
+        stats_frame(&stats, frame);
+        bool ok = memcmp(stats.zones, reference.zones, sizeof(stats.zones)) == 0
+            && memcmp(stats.histogram, reference.histogram, sizeof(stats.histogram)) == 0;
+
+        struct timespec start;
+        unsigned long frames = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (unsigned i = 0; i < 8; i++, frames++)
+                stats_frame(&stats, frame);
+        } while (bench_elapsed(&start) < 0.5);
+        double elapsed = bench_elapsed(&start);
+
+        char rows[16];
+        snprintf(rows, sizeof(rows), "1/%u", decimation);
+        double rate = frames / elapsed;
+        printf("%-8s %-8s %5ux%-5u %9.3f %8.0f %6.2f%% %6s\n", kernels[n].name, rows, width, height,
+            elapsed / frames * 1e3, rate, fps * 100 / rate, ok ? "ok" : "FAILED");
+
+    }
+
+    stats_release(&stats);
+    stats_release(&reference);
+    free(frame);
+
+}
+
+/// Time a demosaic over the given number of threads, return the seconds per frame.
+static double bench_debayer_run(const struct debayer_source *src, const struct debayer_target *dst, enum debayer_mode mode, unsigned threads) {
+
+    const struct debayer_gains gains = { 1600, 1400, 1000 };
+    struct debayer d;
+    debayer_init(&d, mode, threads);
+
+    struct timespec start;
+    unsigned long frames = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (unsigned i = 0; i < 4; i++, frames++)
+            debayer_frame(&d, src, dst, &gains);
+    } while (bench_elapsed(&start) < 0.5);
+    double elapsed = bench_elapsed(&start);
+
+    debayer_release(&d);
+    return elapsed / frames;
+
+}
+
+/// Demosaic a frame of the sensor into an ISP output sized image, each kernel on
+/// one core and checked against the scalar reference, then the fastest kernel
+/// over an increasing number of threads.
+static void bench_debayer(unsigned width, unsigned height, double fps, unsigned max_threads) {
+
+    static const struct {
+        uint32_t pixelformat;
+        const char *name;
+    } formats[] = {
+        { V4L2_PIX_FMT_SRGGB12P, "rggb12p" },
+        { V4L2_PIX_FMT_SRGGB10P, "rggb10p" },
+    };
+    static const struct {
+        uint32_t pixelformat;
+        const char *name;
+    } targets[] = {
+        { V4L2_PIX_FMT_RGB24, "rgb24" },
+        { V4L2_PIX_FMT_NV12, "nv12" },
+    };
+    static const char *const modes[] = { "bilinear", "edge" };
+
+    unsigned out_width = (width < 1920 ? width : 1920) & ~3u;
+    unsigned out_height = (height < 1080 ? height : 1080) & ~1u;
+    size_t out_size = (size_t) out_width * out_height * 3;
+    uint8_t *image = malloc(out_size);
+    uint8_t *reference = malloc(out_size);
+    if (!image || !reference) {
+        fprintf(stderr, "error: failed to allocate image\n");
+        exit(1);
+    }
+
+    printf("\n%-8s %-8s %-8s %-6s %7s %9s %8s %7s %6s\n", "kernel", "mode", "format", "target", "threads", "ms/frame", "fps", "load", "check");
+
+    unsigned count;
+    const struct debayer_kernel *kernels = debayer_kernels(&count);
+    struct debayer_source src = { .width = width, .height = height, .crop = { 0, 0, out_width, out_height } };
+    struct debayer_target dst = { .width = out_width, .height = out_height };
+    const struct debayer_gains gains = { 1600, 1400, 1000 };
+
+    for (unsigned f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+
+        unsigned depth = formats[f].pixelformat == V4L2_PIX_FMT_SRGGB12P ? 12 : 10;
+        src.pixelformat = formats[f].pixelformat;
+        src.bytesperline = (width * depth / 8 + 31) & ~31u;
+        uint8_t *frame = bench_frame((size_t) src.bytesperline * height);
+        src.data = frame;
+
+        for (unsigned t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+
+            dst.pixelformat = targets[t].pixelformat;
+            dst.bytesperline = targets[t].pixelformat == V4L2_PIX_FMT_RGB24 ? out_width * 3 : out_width;
+            size_t size = targets[t].pixelformat == V4L2_PIX_FMT_RGB24 ? out_size : out_size / 2;
+
+            for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+
+                enum debayer_mode mode;
+                debayer_parse_mode(modes[m], &mode);
+
+                struct debayer d;
+                debayer_init(&d, mode, 1);
+                debayer_select_kernel("scalar");
+                dst.data = reference;
+                debayer_frame(&d, &src, &dst, &gains);
+
+                for (unsigned n = 0; n < count; n++) {
+
+                    debayer_select_kernel(kernels[n].name);
+                    memset(image, 0, out_size);
+                    dst.data = image;
+                    debayer_frame(&d, &src, &dst, &gains);
+                    bool ok = memcmp(image, reference, size) == 0;
+
+                    double frame_time = bench_debayer_run(&src, &dst, mode, 1);
+                    printf("%-8s %-8s %-8s %-6s %7u %9.2f %8.0f %6.0f%% %6s\n", kernels[n].name, modes[m], formats[f].name, targets[t].name, 1,
+                        frame_time * 1e3, 1 / frame_time, fps * frame_time * 100, ok ? "ok" : "FAILED");
+
+                }
+
+                debayer_release(&d);
+
+            }
+
+        }
+
+        if (f == 0) {
+
+            // Scaling of the fastest kernel, the load is the share of one core.
+            bench_pin(false);
+            dst.pixelformat = V4L2_PIX_FMT_RGB24;
+            dst.bytesperline = out_width * 3;
+            dst.data = image;
+            for (unsigned threads = 2; threads <= max_threads; threads *= 2) {
+                double frame_time = bench_debayer_run(&src, &dst, DEBAYER_BILINEAR, threads);
+                printf("%-8s %-8s %-8s %-6s %7u %9.2f %8.0f %6.0f%% %6s\n", kernels[count - 1].name, "bilinear", formats[f].name, "rgb24", threads,
+                    frame_time * 1e3, 1 / frame_time, fps * frame_time * 100, "-");
+            }
+            bench_pin(true);
+
+        }
+
+        free(frame);
+
+    }
+
+    free(image);
+    free(reference);
+
+}
+
+/// Dequeue a buffer of an ISP queue, waiting for it, errors are fatal.
+static unsigned bench_isp_dequeue(int fd, enum v4l2_buf_type type) {
+
+    for (;;) {
+
+        unsigned index = 0, size = 0;
+        if (check_ok_or_retry(vid_unqueue_mmap_buffer(fd, type, &index, &size)))
+            return index;
+
+        struct pollfd pfd = { .fd = fd, .events = vid_wait_events(fd, V4L2_TYPE_IS_OUTPUT(type) ? POLLOUT : POLLIN) };
+        if (vid_poll(&pfd, 1, 1000) == 0) {
+            fprintf(stderr, "error: isp timed out\n");
+            exit(1);
+        }
+
+    }
+
+}
+
+/// Run frames of the sensor size through an ISP, with the format and crop set
+/// up like the pipeline, and measure its frame rate. Output buffers are MMAP and
+/// filled once, the hardware processes them the same.
+static void bench_isp(const char *out_path, const char *cap_path, unsigned width, unsigned height, double fps) {
+
+    enum { BENCH_ISP_BUFFERS = 4 };
+
+    int out_fd, cap_fd;
+    check_res(vid_open(&out_fd, out_path));
+    check_res(vid_open(&cap_fd, cap_path));
+
+    unsigned out_width = (width < 1920 ? width : 1920) & ~3u;
+    unsigned out_height = (height < 1080 ? height : 1080) & ~1u;
+    check_res(vid_set_checked_format(cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, out_width, out_height, V4L2_PIX_FMT_RGB24));
+    check_res(vid_set_checked_format(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, width, height, V4L2_PIX_FMT_SRGGB12P));
+    struct v4l2_rect crop = { 0, 0, out_width, out_height };
+    check_res(vid_set_checked_selection(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, V4L2_SEL_TGT_CROP, V4L2_SEL_FLAG_GE | V4L2_SEL_FLAG_LE, crop));
+
+    check_res(vid_request_mmap_buffers(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, BENCH_ISP_BUFFERS));
+    check_res(vid_request_mmap_buffers(cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, BENCH_ISP_BUFFERS));
+
+    uint8_t *frame = NULL;
+    for (unsigned i = 0; i < BENCH_ISP_BUFFERS; i++) {
+        unsigned length = 0, offset = 0;
+        void *start;
+        check_res(vid_query_mmap_buffer(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, i, &length, &offset));
+        check_res(vid_mmap(out_fd, length, offset, &start));
+        if (!frame)
+            frame = bench_frame(length);
+        memcpy(start, frame, length);
+        check_res(vid_queue_mmap_buffer(cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, i));
+    }
+    free(frame);
+
+    check_res(vid_stream_on(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT));
+    check_res(vid_stream_on(cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE));
+    for (unsigned i = 0; i < BENCH_ISP_BUFFERS; i++)
+        check_res(vid_queue_mmap_buffer(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, i));
+
+    struct timespec start;
+    unsigned long frames = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        unsigned index = bench_isp_dequeue(cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE);
+        check_res(vid_queue_mmap_buffer(cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, index));
+        index = bench_isp_dequeue(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT);
+        check_res(vid_queue_mmap_buffer(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, index));
+        frames++;
+    } while (bench_elapsed(&start) < 2);
+    double elapsed = bench_elapsed(&start);
+
+    check_res(vid_stream_off(out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT));
+    check_res(vid_stream_off(cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE));
+    check_res(vid_close(out_fd));
+    check_res(vid_close(cap_fd));
+
+    double rate = frames / elapsed;
+    printf("\n%-30s %11s %9s %8s %7s\n", "isp", "size", "ms/frame", "fps", "target");
+    printf("%-30s %5ux%-5u %9.2f %8.0f %6.0f%%\n", cap_path, width, height, elapsed / frames * 1e3, rate, rate * 100 / fps);
+
+}
+
+/// Measure the cost of a span, with tracing disabled then enabled. Enabled
+/// spans are pushed in bursts of half a ring, the flusher drains them to
+/// /dev/null between bursts, outside of the measure.
+static void bench_trace(void) {
+
+#ifndef TRACE_DISABLED
+    enum { BENCH_TRACE_BURST = 4096, BENCH_TRACE_BURSTS = 200 };
+
+    printf("\n%-30s %9s\n", "trace", "ns/span");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned i = 0; i < BENCH_TRACE_BURST * BENCH_TRACE_BURSTS; i++) {
+        TRACE_BEGIN(span, "bench", "disabled", -1);
+        TRACE_END(span);
+    }
+    printf("%-30s %9.1f\n", "disabled", bench_elapsed(&start) * 1e9 / (BENCH_TRACE_BURST * BENCH_TRACE_BURSTS));
+
+    trace_open("/dev/null");
+    double elapsed = 0;
+    for (unsigned burst = 0; burst < BENCH_TRACE_BURSTS; burst++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned i = 0; i < BENCH_TRACE_BURST; i++) {
+            TRACE_BEGIN(span, "bench", "enabled", -1);
+            TRACE_END(span);
+        }
+        elapsed += bench_elapsed(&start);
+        struct timespec delay = { 0, 30000000 };
+        nanosleep(&delay, NULL);
+    }
+    printf("%-30s %9.1f\n", "enabled", elapsed * 1e9 / (BENCH_TRACE_BURST * BENCH_TRACE_BURSTS));
+    trace_close();
+#else
+    printf("\ntrace compiled out\n");
+#endif
+
+}
+
+int main(int argc, char **argv) {
+
+    unsigned width = 2028;
+    unsigned height = 1080;
+    double fps = 50;
+    unsigned threads = 4;
+    const char *isp_out_path = "soft:isp-output";
+    const char *isp_cap_path = "soft:isp-capture";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:t:i:c:")) != -1) {
+        switch (opt) {
+        case 's': {
+            char *str = optarg;
+            width = (unsigned) strtoul(str, &str, 10);
+            height = *str == 'x' ? (unsigned) strtoul(str + 1, NULL, 10) : 0;
+            break;
+        }
+        case 'r':
+            fps = strtod(optarg, NULL);
+            break;
+        case 't':
+            threads = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'i':
+            isp_out_path = optarg;
+            break;
+        case 'c':
+            isp_cap_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s widthxheight] [-r fps] [-t threads] [-i isp-output -c isp-capture]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (!width || width % 4 || !height || height % 2 || fps <= 0) {
+        fprintf(stderr, "error: width must be a multiple of 4, height even and the frame rate positive\n");
+        exit(1);
+    }
+
+    if (threads > DEBAYER_MAX_THREADS)
+        threads = DEBAYER_MAX_THREADS;
+
+    // The sensor frames are processed on one core, the others are left to the
+    // devices and the network.
+    bench_pin(true);
+
+    // The load is the share of the core used at the target frame rate.
+    printf("%-8s %-8s %11s %9s %8s %8s %7s %6s\n", "kernel", "format", "size", "ms/frame", "fps", "MB/s", "load", "check");
+    bench_unpack(V4L2_PIX_FMT_SRGGB12P, "rggb12p", width, height, fps);
+    bench_unpack(V4L2_PIX_FMT_SRGGB10P, "rggb10p", width, height, fps);
+    bench_stats(width, height, fps, 4);
+    bench_stats(width, height, fps, 8);
+    bench_debayer(width, height, fps, threads);
+
+    // The ISP runs unpinned, like in the pipeline, the software one on its own
+    // threads.
+    bench_pin(false);
+    bench_isp(isp_out_path, isp_cap_path, width, height, fps);
+
+    bench_pin(true);
+    bench_trace();
+
+    return 0;
+
+}
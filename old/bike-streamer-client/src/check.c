@@ -0,0 +1,44 @@
+#include "check.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+
+void check_res(enum vid_result res) {
+    switch (res) {
+    case VID_OK:
+        return;
+    case VID_ERR_STOP:
+        fprintf(stderr, "error: unhandled stop enumeration\n");
+        break;
+    case VID_ERR_RETRY:
+        fprintf(stderr, "error: unhandled retry\n");
+        break;
+    case VID_ERR_SYS:
+        fprintf(stderr, "error: system error (%s)\n", strerror(errno));
+        break;
+    case VID_ERR_NO_VIDEO:
+        fprintf(stderr, "error: device do not support video\n");
+        break;
+    case VID_ERR_NO_STREAMING:
+        fprintf(stderr, "error: device do not support streaming\n");
+        break;
+    case VID_ERR_NEGOCIATION:
+        fprintf(stderr, "error: failed to negociate\n");
+        break;
+    }
+    exit(1);
+}
+
+bool check_ok_or_retry(enum vid_result res) {
+    if (res == VID_OK) {
+        return true;
+    } else if (res == VID_ERR_RETRY) {
+        return false;
+    } else {
+        check_res(res);
+        exit(1);  // Ensure that the result is not undefined.
+    }
+}
@@ -0,0 +1,15 @@
+/// Fatal error checking of video results, shared by the pipeline modes.
+
+#pragma once
+
+#include "v4l2.h"
+
+#include <stdbool.h>
+
+
+/// Check that the result is ok, or print the error and exit.
+void check_res(enum vid_result res);
+
+/// Return true if the result is ok, false if the operation should be retried
+/// later, any other error is fatal.
+bool check_ok_or_retry(enum vid_result res);
@@ -0,0 +1,202 @@
+/// Reader of the recordings of the client through their frame index (see
+/// 'recindex.h'), printing a summary of a recording or extracting a clip. The
+/// index is mapped and searched by time, the clip starts at the key frame the
+/// first frame depends on and is copied from the recording as one range by the
+/// kernel, so seeking in a long ride doesn't read the stream.
+
+#define _GNU_SOURCE
+
+#include "recindex.h"
+
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s recording [-s start] [-d duration] [-o output]\n", prog);
+    fprintf(stderr, "  -s  start of the clip, seconds from the first frame or time of day HH:MM:SS (first frame)\n");
+    fprintf(stderr, "  -d  duration of the clip in seconds (until the last frame)\n");
+    fprintf(stderr, "  -o  output of the clip, '-' for stdout, only the summary is printed without it\n");
+    exit(1);
+}
+
+/// Wall clock time of a capture timestamp, in microseconds.
+static int64_t clip_realtime(const struct recindex *idx, uint64_t timestamp_us) {
+    return idx->header->realtime_us + ((int64_t) timestamp_us - idx->header->monotonic_us);
+}
+
+static void clip_format_time(const struct recindex *idx, uint64_t timestamp_us, char *buf, size_t size) {
+    int64_t realtime_us = clip_realtime(idx, timestamp_us);
+    time_t seconds = realtime_us / 1000000;
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    size_t len = strftime(buf, size, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + len, size - len, ".%03d", (int) (realtime_us % 1000000 / 1000));
+}
+
+/// Parse a start given in seconds from the first frame, or as the time of day
+/// on the day the recording started, into a capture timestamp.
+static uint64_t clip_parse_start(const struct recindex *idx, const char *str) {
+
+    const struct recindex_entry *first = &idx->entries[0];
+    unsigned hours, minutes, seconds;
+    if (sscanf(str, "%u:%u:%u", &hours, &minutes, &seconds) == 3) {
+        time_t start = clip_realtime(idx, first->timestamp_us) / 1000000;
+        struct tm tm;
+        localtime_r(&start, &tm);
+        tm.tm_hour = hours;
+        tm.tm_min = minutes;
+        tm.tm_sec = seconds;
+        tm.tm_isdst = -1;
+        int64_t realtime_us = (int64_t) mktime(&tm) * 1000000;
+        int64_t timestamp_us = realtime_us - idx->header->realtime_us + idx->header->monotonic_us;
+        return timestamp_us > 0 ? (uint64_t) timestamp_us : 0;
+    }
+
+    return first->timestamp_us + (uint64_t) (strtod(str, NULL) * 1e6);
+
+}
+
+/// Copy a range of the recording to the output, within the kernel.
+static int clip_copy(int in_fd, int out_fd, uint64_t offset, uint64_t size) {
+
+    // Files are cloned or copied by the filesystem, pipes and other
+    // filesystems fall back to sendfile.
+    bool range = true;
+    loff_t in_offset = offset;
+    off_t send_offset = offset;
+    while (size) {
+        ssize_t len;
+        if (range) {
+            len = copy_file_range(in_fd, &in_offset, out_fd, NULL, size, 0);
+            if (len == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EBADF || errno == EOPNOTSUPP)) {
+                range = false;
+                send_offset = in_offset;
+                continue;
+            }
+        } else {
+            len = sendfile(out_fd, in_fd, &send_offset, size);
+        }
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        size -= len;
+    }
+
+    return 0;
+
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 2 || argv[1][0] == '-')
+        usage(argv[0]);
+
+    const char *path = argv[1];
+    const char *start_str = NULL;
+    const char *out_path = NULL;
+    double duration = 0;
+
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "s:d:o:")) != -1) {
+        switch (opt) {
+        case 's':
+            start_str = optarg;
+            break;
+        case 'd':
+            duration = strtod(optarg, NULL);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    struct recindex idx;
+    if (recindex_open(&idx, path) == -1)
+        return 1;
+
+    if (!idx.count) {
+        fprintf(stderr, "error: recording '%s' has no frame\n", path);
+        return 1;
+    }
+
+    const struct recindex_entry *first = &idx.entries[0];
+    const struct recindex_entry *last = &idx.entries[idx.count - 1];
+    double length = (last->timestamp_us - first->timestamp_us) / 1e6;
+    uint64_t bytes = last->offset + last->size - first->offset;
+
+    if (!out_path) {
+        char first_time[64], last_time[64];
+        clip_format_time(&idx, first->timestamp_us, first_time, sizeof(first_time));
+        clip_format_time(&idx, last->timestamp_us, last_time, sizeof(last_time));
+        printf("info: recording '%s', %u frames, %llu bytes, %.3f s, %.0f kbit/s\n",
+            path, idx.count, (unsigned long long) bytes, length, length > 0 ? bytes * 8 / length / 1e3 : 0);
+        printf("info: from %s to %s\n", first_time, last_time);
+        recindex_close(&idx);
+        return 0;
+    }
+
+    uint64_t start_us = start_str ? clip_parse_start(&idx, start_str) : first->timestamp_us;
+    uint64_t end_us = duration > 0 ? start_us + (uint64_t) (duration * 1e6) : last->timestamp_us;
+
+    long start = recindex_find(&idx, start_us);
+    long end = recindex_find(&idx, end_us);
+    if (end < start)
+        end = start;
+
+    // Frames recorded before the first key frame of the file can't be decoded,
+    // the clip then starts at the beginning of the file.
+    uint32_t key = idx.entries[start].key == RECINDEX_NO_KEY ? 0 : idx.entries[start].key;
+    uint64_t offset = idx.entries[key].offset;
+    uint64_t size = idx.entries[end].offset + idx.entries[end].size - offset;
+
+    int in_fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (in_fd == -1 || fstat(in_fd, &st) == -1) {
+        fprintf(stderr, "error: failed to open recording '%s' (%s)\n", path, strerror(errno));
+        return 1;
+    }
+
+    if ((uint64_t) st.st_size < offset + size) {
+        fprintf(stderr, "error: recording '%s' is shorter than its index\n", path);
+        return 1;
+    }
+
+    int out_fd = STDOUT_FILENO;
+    if (strcmp(out_path, "-") != 0) {
+        out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd == -1) {
+            fprintf(stderr, "error: failed to open output file (%s)\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    if (clip_copy(in_fd, out_fd, offset, size) == -1) {
+        fprintf(stderr, "error: failed to copy the clip (%s)\n", strerror(errno));
+        return 1;
+    }
+
+    fprintf(stderr, "info: clip of frames %u to %ld (%.3f s to %.3f s), %llu bytes\n", key, end,
+        (idx.entries[key].timestamp_us - first->timestamp_us) / 1e6, (idx.entries[end].timestamp_us - first->timestamp_us) / 1e6,
+        (unsigned long long) size);
+
+    if (out_fd != STDOUT_FILENO)
+        close(out_fd);
+    close(in_fd);
+    recindex_close(&idx);
+    return 0;
+
+}
@@ -0,0 +1,272 @@
+#include "ctrlreg.h"
+#include "check.h"
+
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+#define CTRLREG_MAGIC "ctrlreg1"
+#define CTRLREG_NEXT (V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND)
+
+/// Header of the cache files, followed by the entries.
+struct ctrlreg_header {
+    char magic[8];
+    /// Version of the driver, the cache is ignored when it changed.
+    __u32 version;
+    __u32 count;
+    __u32 entry_size;
+};
+
+static void ctrlreg_entry_of(struct ctrlreg_entry *entry, const struct v4l2_query_ext_ctrl *query) {
+    memset(entry, 0, sizeof(struct ctrlreg_entry));
+    entry->id = query->id;
+    entry->type = query->type;
+    entry->flags = query->flags;
+    entry->elem_size = query->elem_size;
+    entry->elems = query->elems;
+    entry->minimum = query->minimum;
+    entry->maximum = query->maximum;
+    entry->step = query->step;
+    entry->default_value = query->default_value;
+    snprintf(entry->name, sizeof(entry->name), "%s", query->name);
+}
+
+/// Query the control following the given one, zero for the first.
+static enum vid_result ctrlreg_query_next(struct ctrlreg *reg, int fd, __u32 id, struct ctrlreg_entry *entry) {
+
+    struct v4l2_query_ext_ctrl query = {0};
+    query.id = id | CTRLREG_NEXT;
+    reg->queries++;
+
+    enum vid_result res = vid_query_control(fd, &query);
+    if (res == VID_OK)
+        ctrlreg_entry_of(entry, &query);
+    return res;
+
+}
+
+static void ctrlreg_enumerate(struct ctrlreg *reg, int fd) {
+
+    unsigned capacity = 0;
+    struct ctrlreg_entry entry;
+    __u32 id = 0;
+
+    while (ctrlreg_query_next(reg, fd, id, &entry) == VID_OK) {
+
+        if (reg->count == capacity) {
+            capacity = capacity ? capacity * 2 : 32;
+            reg->entries = realloc(reg->entries, sizeof(struct ctrlreg_entry) * capacity);
+            if (!reg->entries) {
+                fprintf(stderr, "error: failed to allocate the control registry\n");
+                exit(1);
+            }
+        }
+
+        reg->entries[reg->count++] = entry;
+        id = entry.id;
+
+    }
+
+    // Devices without controls fail the first query with EINVAL.
+    if (errno != EINVAL) {
+        perror("error: failed to enumerate controls");
+        exit(1);
+    }
+
+}
+
+static void ctrlreg_path(const struct ctrlreg *reg, const char *cache_dir, char *path, size_t size) {
+
+    char name[sizeof(reg->driver) + sizeof(reg->card) + 1];
+    snprintf(name, sizeof(name), "%s-%s", reg->driver, reg->card);
+    for (char *c = name; *c; c++)
+        if (!(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') && !(*c >= '0' && *c <= '9') && *c != '-')
+            *c = '_';
+
+    snprintf(path, size, "%s/%s.ctrls", cache_dir, name);
+
+}
+
+/// Load the cached entries, then check them with two probes: the first control
+/// and the one after the last must be unchanged.
+static bool ctrlreg_load_cache(struct ctrlreg *reg, int fd, const char *path, __u32 version) {
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return false;
+
+    struct ctrlreg_header header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1
+        && memcmp(header.magic, CTRLREG_MAGIC, sizeof(header.magic)) == 0
+        && header.version == version
+        && header.entry_size == sizeof(struct ctrlreg_entry)
+        && header.count <= 4096;
+
+    if (valid && header.count) {
+        reg->entries = malloc(sizeof(struct ctrlreg_entry) * header.count);
+        valid = reg->entries && fread(reg->entries, sizeof(struct ctrlreg_entry), header.count, file) == header.count;
+    }
+    fclose(file);
+
+    if (valid) {
+        reg->count = header.count;
+        struct ctrlreg_entry first;
+        if (reg->count) {
+            valid = ctrlreg_query_next(reg, fd, 0, &first) == VID_OK && memcmp(&first, &reg->entries[0], sizeof(first)) == 0
+                && ctrlreg_query_next(reg, fd, reg->entries[reg->count - 1].id, &first) != VID_OK;
+        } else {
+            valid = ctrlreg_query_next(reg, fd, 0, &first) != VID_OK;
+        }
+    }
+
+    if (!valid) {
+        printf("warn: control cache '%s' is stale, enumerating again\n", path);
+        free(reg->entries);
+        reg->entries = NULL;
+        reg->count = 0;
+    }
+    return valid;
+
+}
+
+/// Create the directory and its parents.
+static bool ctrlreg_mkdir(const char *dir) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *c = path + 1; *c; c++) {
+        if (*c == '/') {
+            *c = 0;
+            if (mkdir(path, 0755) == -1 && errno != EEXIST)
+                return false;
+            *c = '/';
+        }
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+/// Write the cache to a temporary file renamed over the previous one, so that
+/// concurrent starts never read a partial file.
+static void ctrlreg_save_cache(const struct ctrlreg *reg, const char *cache_dir, const char *path, __u32 version) {
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    struct ctrlreg_header header = {0};
+    memcpy(header.magic, CTRLREG_MAGIC, sizeof(header.magic));
+    header.version = version;
+    header.count = reg->count;
+    header.entry_size = sizeof(struct ctrlreg_entry);
+
+    FILE *file = ctrlreg_mkdir(cache_dir) ? fopen(tmp, "wb") : NULL;
+    bool ok = file
+        && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(reg->entries, sizeof(struct ctrlreg_entry), reg->count, file) == reg->count;
+    if (file && fclose(file) != 0)
+        ok = false;
+    if (!ok || rename(tmp, path) == -1) {
+        printf("warn: failed to save control cache '%s'\n", path);
+        remove(tmp);
+    }
+
+}
+
+void ctrlreg_load(struct ctrlreg *reg, int fd, const char *cache_dir) {
+
+    memset(reg, 0, sizeof(struct ctrlreg));
+
+    struct v4l2_capability cap = {0};
+    check_res(vid_query_capability(fd, &cap));
+    snprintf(reg->driver, sizeof(reg->driver), "%s", (const char *) cap.driver);
+    snprintf(reg->card, sizeof(reg->card), "%s", (const char *) cap.card);
+
+    char path[PATH_MAX];
+    if (cache_dir) {
+        ctrlreg_path(reg, cache_dir, path, sizeof(path));
+        if (ctrlreg_load_cache(reg, fd, path, cap.version)) {
+            reg->cached = true;
+            return;
+        }
+    }
+
+    ctrlreg_enumerate(reg, fd);
+
+    if (cache_dir)
+        ctrlreg_save_cache(reg, cache_dir, path, cap.version);
+
+}
+
+void ctrlreg_release(struct ctrlreg *reg) {
+    free(reg->entries);
+    reg->entries = NULL;
+    reg->count = 0;
+}
+
+const struct ctrlreg_entry *ctrlreg_find(const struct ctrlreg *reg, __u32 id) {
+
+    // Controls are enumerated in increasing order.
+    unsigned lo = 0, hi = reg->count;
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (reg->entries[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < reg->count && reg->entries[lo].id == id ? &reg->entries[lo] : NULL;
+
+}
+
+enum vid_result ctrlreg_query(int fd, __u32 id, struct ctrlreg_entry *entry) {
+
+    struct v4l2_query_ext_ctrl query = {0};
+    query.id = id;
+
+    enum vid_result res = vid_query_control(fd, &query);
+    if (res == VID_OK)
+        ctrlreg_entry_of(entry, &query);
+    return res;
+
+}
+
+const char *ctrlreg_default_dir(void) {
+
+    static char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg)
+        snprintf(dir, sizeof(dir), "%s/bike-streamer", xdg);
+    else if (home && *home)
+        snprintf(dir, sizeof(dir), "%s/.cache/bike-streamer", home);
+    else
+        return NULL;
+    return dir;
+
+}
+
+void ctrlreg_print(const struct ctrlreg *reg) {
+    for (unsigned i = 0; i < reg->count; i++) {
+        const struct ctrlreg_entry *entry = &reg->entries[i];
+        if (entry->type == V4L2_CTRL_TYPE_CTRL_CLASS) {
+            printf("      %s\n", entry->name);
+        } else if (entry->flags & V4L2_CTRL_FLAG_HAS_PAYLOAD) {
+            printf("      %30s 0x%08X (%d) : %u elements of %u bytes\n",
+                entry->name, entry->id, entry->type, entry->elems, entry->elem_size);
+        } else {
+            printf("      %30s 0x%08X (%d) : min=%lld max=%lld step=%llu default=%lld\n",
+                entry->name, entry->id, entry->type,
+                entry->minimum, entry->maximum,
+                entry->step, entry->default_value);
+        }
+    }
+}
+
+void ctrlreg_report(const struct ctrlreg *reg) {
+    printf("info: %u controls of '%s' (%s) %s with %u queries\n", reg->count, reg->card, reg->driver,
+        reg->cached ? "loaded from cache" : "enumerated", reg->queries);
+}
@@ -0,0 +1,69 @@
+/// Registry of the control metadata of a device. Controls are enumerated once
+/// with V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND, one query per
+/// existing control including compound ones, and kept sorted by identifier in a
+/// table of fixed size entries.
+///
+/// The table is persisted in a cache directory, in a file named after the
+/// driver and card of the device. Warm starts load it instead of enumerating,
+/// after two probes checking that the first control and the end of the list
+/// did not change, since some drivers expose the controls of the attached
+/// sensor behind a generic card name.
+///
+/// Ranges are the ones of the enumeration, possibly from an earlier run. The range
+/// of a control that depends on others, such as the exposure limited by the
+/// vertical blanking, is queried from the device with 'ctrlreg_query'.
+
+#pragma once
+
+#include "v4l2.h"
+
+#include <stdbool.h>
+
+
+struct ctrlreg_entry {
+    __u32 id;
+    __u32 type;
+    __u32 flags;
+    /// Size of an element and number of elements, the size of the payload of
+    /// compound controls is their product.
+    __u32 elem_size;
+    __u32 elems;
+    __s64 minimum;
+    __s64 maximum;
+    __u64 step;
+    __s64 default_value;
+    char name[32];
+};
+
+struct ctrlreg {
+    char driver[16];
+    char card[32];
+    struct ctrlreg_entry *entries;
+    unsigned count;
+    /// The entries were loaded from the cache.
+    bool cached;
+    /// Queries issued to fill the registry.
+    unsigned queries;
+};
+
+
+/// Fill the registry of a device from the cache directory, or by enumerating its
+/// controls then saving them if the directory is not NULL. Errors of the cache
+/// are only warnings, enumeration errors are fatal.
+void ctrlreg_load(struct ctrlreg *reg, int fd, const char *cache_dir);
+void ctrlreg_release(struct ctrlreg *reg);
+
+/// Find the metadata of a control, NULL if the device does not have it.
+const struct ctrlreg_entry *ctrlreg_find(const struct ctrlreg *reg, __u32 id);
+
+/// Query the current metadata of a control from the device, bypassing the registry.
+enum vid_result ctrlreg_query(int fd, __u32 id, struct ctrlreg_entry *entry);
+
+/// Get the default cache directory, under XDG_CACHE_HOME or HOME, NULL if none.
+const char *ctrlreg_default_dir(void);
+
+/// Print the controls grouped by class.
+void ctrlreg_print(const struct ctrlreg *reg);
+
+/// Print the number of controls and where they came from.
+void ctrlreg_report(const struct ctrlreg *reg);
@@ -0,0 +1,124 @@
+#include "ctrls.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+
+void ctrls_init(struct ctrls *ctrls, int fd, const struct ctrlreg *registry, const char *name) {
+    memset(ctrls, 0, sizeof(struct ctrls));
+    ctrls->fd = fd;
+    ctrls->registry = registry;
+    ctrls->name = name;
+}
+
+static struct ctrls_entry *ctrls_entry(struct ctrls *ctrls, __u32 id) {
+
+    for (unsigned i = 0; i < ctrls->count; i++)
+        if (ctrls->entries[i].id == id)
+            return &ctrls->entries[i];
+
+    if (!ctrlreg_find(ctrls->registry, id)) {
+        fprintf(stderr, "error: the %s has no control 0x%08X\n", ctrls->name, id);
+        exit(1);
+    }
+    if (ctrls->count == CTRLS_MAX) {
+        fprintf(stderr, "error: more than %d controls shadowed on the %s\n", CTRLS_MAX, ctrls->name);
+        exit(1);
+    }
+
+    struct ctrls_entry *entry = &ctrls->entries[ctrls->count++];
+    memset(entry, 0, sizeof(struct ctrls_entry));
+    entry->id = id;
+    return entry;
+
+}
+
+enum vid_result ctrls_get(struct ctrls *ctrls, __u32 id, __s32 *value) {
+
+    struct ctrls_entry *entry = ctrls_entry(ctrls, id);
+    if (!entry->known) {
+
+        struct v4l2_ext_control ctrl = {0};
+        ctrl.id = id;
+        struct v4l2_ext_controls ext = {0};
+        ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+        ext.count = 1;
+        ext.controls = &ctrl;
+
+        enum vid_result res = vid_get_control(ctrls->fd, &ext);
+        if (res != VID_OK)
+            return res;
+
+        entry->applied = ctrl.value;
+        entry->known = true;
+
+    }
+
+    *value = entry->dirty ? entry->staged : entry->applied;
+    return VID_OK;
+
+}
+
+void ctrls_set(struct ctrls *ctrls, __u32 id, __s32 value) {
+
+    struct ctrls_entry *entry = ctrls_entry(ctrls, id);
+    ctrls->sets++;
+
+    // Coming back to the applied value cancels a staged one.
+    if (entry->known && entry->applied == value) {
+        entry->dirty = false;
+        ctrls->noops++;
+        return;
+    }
+
+    entry->staged = value;
+    entry->dirty = true;
+
+}
+
+enum vid_result ctrls_flush(struct ctrls *ctrls) {
+
+    struct v4l2_ext_control ctrl[CTRLS_MAX] = {0};
+    unsigned count = 0;
+    for (unsigned i = 0; i < ctrls->count; i++) {
+        if (ctrls->entries[i].dirty) {
+            ctrl[count].id = ctrls->entries[i].id;
+            ctrl[count].value = ctrls->entries[i].staged;
+            count++;
+        }
+    }
+
+    if (!count)
+        return VID_OK;
+
+    struct v4l2_ext_controls ext = {0};
+    ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count = count;
+    ext.controls = ctrl;
+
+    enum vid_result res = vid_set_control(ctrls->fd, &ext);
+    if (res != VID_OK)
+        return res;
+
+    // The driver writes back the values it actually applied.
+    for (unsigned i = 0, j = 0; i < ctrls->count; i++) {
+        struct ctrls_entry *entry = &ctrls->entries[i];
+        if (entry->dirty) {
+            entry->applied = ctrl[j++].value;
+            entry->known = true;
+            entry->dirty = false;
+        }
+    }
+
+    ctrls->ioctls++;
+    ctrls->writes += count;
+    return VID_OK;
+
+}
+
+void ctrls_report(const struct ctrls *ctrls) {
+    unsigned long saved = ctrls->sets > ctrls->ioctls ? ctrls->sets - ctrls->ioctls : 0;
+    printf("info: %s controls %lu sets, %lu no-op, %lu values in %lu ioctls, %lu ioctls saved\n",
+        ctrls->name, ctrls->sets, ctrls->noops, ctrls->writes, ctrls->ioctls, saved);
+}
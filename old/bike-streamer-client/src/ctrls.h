@@ -0,0 +1,63 @@
+/// Shadow of the controls of a device, written in batches. Control loops stage
+/// their values during a frame, values equal to the ones applied are dropped,
+/// and the remaining ones are written with a single VIDIOC_S_EXT_CTRLS when the
+/// batch is flushed, once per frame. The applied values are the ones the driver
+/// wrote back, clamped or rounded to the step, and reads of controls already
+/// known are served from the shadow.
+///
+/// Only integer controls are shadowed. A shadow is not locked, each one must be
+/// driven by a single thread at a time.
+
+#pragma once
+
+#include "ctrlreg.h"
+#include "v4l2.h"
+
+#include <stdbool.h>
+
+
+#define CTRLS_MAX 16
+
+struct ctrls_entry {
+    __u32 id;
+    /// Value applied on the device if known, and the one staged if dirty.
+    __s32 applied;
+    __s32 staged;
+    bool known;
+    bool dirty;
+};
+
+struct ctrls {
+    int fd;
+    /// Metadata of the controls of the device, using an unknown control is fatal.
+    const struct ctrlreg *registry;
+    /// Name of the device in the report.
+    const char *name;
+    struct ctrls_entry entries[CTRLS_MAX];
+    unsigned count;
+    /// Values staged and dropped because already applied.
+    unsigned long sets;
+    unsigned long noops;
+    /// Batches written, and the values they carried.
+    unsigned long ioctls;
+    unsigned long writes;
+};
+
+
+void ctrls_init(struct ctrls *ctrls, int fd, const struct ctrlreg *registry, const char *name);
+
+/// Get the value of a control, read from the device the first time.
+enum vid_result ctrls_get(struct ctrls *ctrls, __u32 id, __s32 *value);
+
+/// Stage the value of a control for the next flush, too many distinct controls
+/// are fatal.
+void ctrls_set(struct ctrls *ctrls, __u32 id, __s32 value);
+
+/// Write the staged values that differ from the applied ones, with at most one
+/// ioctl, and keep the values the driver returned. On error nothing is
+/// considered applied.
+enum vid_result ctrls_flush(struct ctrls *ctrls);
+
+/// Print the number of values staged and the ioctls saved by batching them,
+/// compared to one ioctl per staged value.
+void ctrls_report(const struct ctrls *ctrls);
@@ -0,0 +1,856 @@
+#include "debayer.h"
+#include "unpack.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DEBAYER_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DEBAYER_NEON
+#endif
+
+
+// Planes are named after their position in the 2x2 cell: A on the top left (red
+// or blue), G1 on the top right, G2 on the bottom left and D on the bottom right.
+// The cell kernels read the rows i-1, i and i+1 of each plane, and one sample
+// before and after each row, to output the lines 2i and 2i+1 of the A, G and D
+// channels. Averages of four samples are averages of two averages, so that every
+// kernel rounds like the scalar reference.
+enum { DEBAYER_A, DEBAYER_G1, DEBAYER_G2, DEBAYER_D };
+
+/// Scratch of a band: its planes with one row and one sample of margin on each
+/// side, and the planar output lines.
+struct debayer_scratch {
+    uint16_t *planes;
+    size_t plane_size;
+    unsigned stride;
+    uint8_t *lines;
+    size_t size;
+    size_t lines_size;
+};
+
+/// Parameters of the frame being processed, shared by the workers.
+struct debayer_job {
+    const struct debayer_source *src;
+    const struct debayer_target *dst;
+    const enum unpack_channel *layout;
+    uint16_t gains[3];
+    unsigned shift;
+    unsigned width;
+    unsigned height;
+};
+
+struct debayer_worker {
+    pthread_t thread;
+    struct debayer *d;
+    unsigned index;
+    struct debayer_scratch scratch;
+};
+
+struct debayer_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    /// Incremented for each frame, workers process their band when it changes.
+    unsigned generation;
+    unsigned pending;
+    bool stop;
+    struct debayer_job job;
+    struct debayer_worker workers[DEBAYER_MAX_THREADS];
+};
+
+
+static pthread_once_t debayer_once = PTHREAD_ONCE_INIT;
+static const struct debayer_kernel *debayer_selected;
+/// Shuffles of the RGB24 interleaving, by output block then channel.
+static uint8_t debayer_rgb_shuffles[3][3][16] __attribute__((aligned(16)));
+
+
+///
+/// SCALAR
+///
+
+static inline unsigned debayer_avg2(unsigned a, unsigned b) {
+    return (a + b + 1) >> 1;
+}
+
+static inline unsigned debayer_avg4(unsigned a, unsigned b, unsigned c, unsigned d) {
+    return debayer_avg2(debayer_avg2(a, b), debayer_avg2(c, d));
+}
+
+/// Interpolate green from its horizontal and vertical neighbours.
+static inline unsigned debayer_green(unsigned h0, unsigned h1, unsigned v0, unsigned v1, bool edge) {
+    unsigned h = debayer_avg2(h0, h1), v = debayer_avg2(v0, v1);
+    if (edge) {
+        unsigned dh = h0 > h1 ? h0 - h1 : h1 - h0;
+        unsigned dv = v0 > v1 ? v0 - v1 : v1 - v0;
+        if (dh < dv)
+            return h;
+        if (dv < dh)
+            return v;
+    }
+    return debayer_avg2(h, v);
+}
+
+/// Scale a sample to 16 bits, apply the gain in 1/256 and clamp to 8 bits.
+static inline uint8_t debayer_scale(unsigned v, unsigned shift, unsigned gain) {
+    unsigned x = ((v << shift) & 0xFFFF) * gain >> 16;
+    return x > 255 ? 255 : (uint8_t) x;
+}
+
+static void debayer_cells_scalar(uint8_t *const out[2][3], const uint16_t *const rows[4][3], unsigned from, unsigned to, const uint16_t gains[3], unsigned shift, bool edge) {
+
+    const uint16_t *a = rows[DEBAYER_A][1], *an = rows[DEBAYER_A][2];
+    const uint16_t *g1 = rows[DEBAYER_G1][1], *g1n = rows[DEBAYER_G1][2];
+    const uint16_t *g2p = rows[DEBAYER_G2][0], *g2 = rows[DEBAYER_G2][1];
+    const uint16_t *dp = rows[DEBAYER_D][0], *d = rows[DEBAYER_D][1];
+
+    for (unsigned j = from; j < to; j++) {
+
+        // Left neighbours are read through pointers, the column before the first
+        // one is the margin.
+        const uint16_t *g1l = g1 + j - 1, *dpl = dp + j - 1, *dl = d + j - 1;
+        unsigned cells[2][3][2] = {
+            {
+                { a[j], debayer_avg2(a[j], a[j + 1]) },
+                { debayer_green(*g1l, g1[j], g2p[j], g2[j], edge), g1[j] },
+                { debayer_avg4(*dpl, dp[j], *dl, d[j]), debayer_avg2(dp[j], d[j]) },
+            },
+            {
+                { debayer_avg2(a[j], an[j]), debayer_avg4(a[j], a[j + 1], an[j], an[j + 1]) },
+                { g2[j], debayer_green(g2[j], g2[j + 1], g1[j], g1n[j], edge) },
+                { debayer_avg2(*dl, d[j]), d[j] },
+            },
+        };
+
+        for (unsigned r = 0; r < 2; r++) {
+            for (unsigned c = 0; c < 3; c++) {
+                out[r][c][2 * j] = debayer_scale(cells[r][c][0], shift, gains[c]);
+                out[r][c][2 * j + 1] = debayer_scale(cells[r][c][1], shift, gains[c]);
+            }
+        }
+
+    }
+
+}
+
+static void debayer_rgb24_scalar(uint8_t *dst, const uint8_t *r, const uint8_t *g, const uint8_t *b, unsigned width) {
+    for (unsigned x = 0; x < width; x++, dst += 3) {
+        dst[0] = r[x];
+        dst[1] = g[x];
+        dst[2] = b[x];
+    }
+}
+
+/// BT.601 limited range.
+static inline uint8_t debayer_luma(int r, int g, int b) {
+    return (uint8_t) (((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static void debayer_nv12_scalar(uint8_t *y0, uint8_t *y1, uint8_t *uv, const uint8_t *const rgb[2][3], unsigned width) {
+
+    for (unsigned x = 0; x < width; x++) {
+        y0[x] = debayer_luma(rgb[0][0][x], rgb[0][1][x], rgb[0][2][x]);
+        y1[x] = debayer_luma(rgb[1][0][x], rgb[1][1][x], rgb[1][2][x]);
+    }
+
+    for (unsigned x = 0; x + 1 < width; x += 2) {
+        int c[3];
+        for (unsigned k = 0; k < 3; k++)
+            c[k] = (rgb[0][k][x] + rgb[0][k][x + 1] + rgb[1][k][x] + rgb[1][k][x + 1] + 2) >> 2;
+        uv[x] = (uint8_t) (((-38 * c[0] - 74 * c[1] + 112 * c[2] + 128) >> 8) + 128);
+        uv[x + 1] = (uint8_t) (((112 * c[0] - 94 * c[1] - 18 * c[2] + 128) >> 8) + 128);
+    }
+
+}
+
+#ifdef DEBAYER_X86
+
+__attribute__((target("ssse3")))
+static inline __m128i debayer_green_sse(__m128i h0, __m128i h1, __m128i v0, __m128i v1, bool edge) {
+
+    __m128i h = _mm_avg_epu16(h0, h1), v = _mm_avg_epu16(v0, v1);
+    __m128i g = _mm_avg_epu16(h, v);
+    if (!edge)
+        return g;
+
+    // Saturated differences are zero when the first operand is not larger.
+    const __m128i zero = _mm_setzero_si128();
+    __m128i dh = _mm_or_si128(_mm_subs_epu16(h0, h1), _mm_subs_epu16(h1, h0));
+    __m128i dv = _mm_or_si128(_mm_subs_epu16(v0, v1), _mm_subs_epu16(v1, v0));
+    __m128i not_h = _mm_cmpeq_epi16(_mm_subs_epu16(dv, dh), zero);
+    __m128i not_v = _mm_cmpeq_epi16(_mm_subs_epu16(dh, dv), zero);
+    g = _mm_or_si128(_mm_and_si128(not_v, g), _mm_andnot_si128(not_v, v));
+    return _mm_or_si128(_mm_and_si128(not_h, g), _mm_andnot_si128(not_h, h));
+
+}
+
+/// Scale, clamp and store the samples of the even and odd columns of a line.
+__attribute__((target("ssse3")))
+static inline void debayer_store_sse(uint8_t *dst, __m128i even, __m128i odd, __m128i shift, __m128i gain) {
+    const __m128i max = _mm_set1_epi16(255);
+    even = _mm_mulhi_epu16(_mm_sll_epi16(even, shift), gain);
+    odd = _mm_mulhi_epu16(_mm_sll_epi16(odd, shift), gain);
+    even = _mm_sub_epi16(even, _mm_subs_epu16(even, max));
+    odd = _mm_sub_epi16(odd, _mm_subs_epu16(odd, max));
+    _mm_storeu_si128((__m128i *) dst, _mm_packus_epi16(_mm_unpacklo_epi16(even, odd), _mm_unpackhi_epi16(even, odd)));
+}
+
+__attribute__((target("ssse3")))
+static void debayer_cells_ssse3(uint8_t *const out[2][3], const uint16_t *const rows[4][3], unsigned from, unsigned to, const uint16_t gains[3], unsigned shift, bool edge) {
+
+    const uint16_t *a = rows[DEBAYER_A][1], *an = rows[DEBAYER_A][2];
+    const uint16_t *g1 = rows[DEBAYER_G1][1], *g1n = rows[DEBAYER_G1][2];
+    const uint16_t *g2p = rows[DEBAYER_G2][0], *g2 = rows[DEBAYER_G2][1];
+    const uint16_t *dp = rows[DEBAYER_D][0], *d = rows[DEBAYER_D][1];
+
+    const __m128i s = _mm_cvtsi32_si128((int) shift);
+    const __m128i ga = _mm_set1_epi16((short) gains[0]);
+    const __m128i gg = _mm_set1_epi16((short) gains[1]);
+    const __m128i gd = _mm_set1_epi16((short) gains[2]);
+
+    unsigned j = from;
+    for (; j + 8 <= to; j += 8) {
+
+#define DEBAYER_LOAD(p, o) _mm_loadu_si128((const __m128i *) ((p) + j + (o)))
+        __m128i a0 = DEBAYER_LOAD(a, 0), a0r = DEBAYER_LOAD(a, 1);
+        __m128i a1 = DEBAYER_LOAD(an, 0), a1r = DEBAYER_LOAD(an, 1);
+        __m128i g1l = DEBAYER_LOAD(g1, -1), g1c = DEBAYER_LOAD(g1, 0), g1d = DEBAYER_LOAD(g1n, 0);
+        __m128i g2u = DEBAYER_LOAD(g2p, 0), g2c = DEBAYER_LOAD(g2, 0), g2r = DEBAYER_LOAD(g2, 1);
+        __m128i dul = DEBAYER_LOAD(dp, -1), du = DEBAYER_LOAD(dp, 0), dl = DEBAYER_LOAD(d, -1), dc = DEBAYER_LOAD(d, 0);
+#undef DEBAYER_LOAD
+
+        __m128i a01 = _mm_avg_epu16(a0, a0r);
+        debayer_store_sse(out[0][0] + 2 * j, a0, a01, s, ga);
+        debayer_store_sse(out[0][1] + 2 * j, debayer_green_sse(g1l, g1c, g2u, g2c, edge), g1c, s, gg);
+        debayer_store_sse(out[0][2] + 2 * j, _mm_avg_epu16(_mm_avg_epu16(dul, du), _mm_avg_epu16(dl, dc)), _mm_avg_epu16(du, dc), s, gd);
+        debayer_store_sse(out[1][0] + 2 * j, _mm_avg_epu16(a0, a1), _mm_avg_epu16(a01, _mm_avg_epu16(a1, a1r)), s, ga);
+        debayer_store_sse(out[1][1] + 2 * j, g2c, debayer_green_sse(g2c, g2r, g1c, g1d, edge), s, gg);
+        debayer_store_sse(out[1][2] + 2 * j, _mm_avg_epu16(dl, dc), dc, s, gd);
+
+    }
+
+    debayer_cells_scalar(out, rows, j, to, gains, shift, edge);
+
+}
+
+/// Each output block of 16 bytes gathers bytes of the three channels.
+__attribute__((target("ssse3")))
+static void debayer_rgb24_ssse3(uint8_t *dst, const uint8_t *r, const uint8_t *g, const uint8_t *b, unsigned width) {
+
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16, dst += 48) {
+        __m128i c[3] = {
+            _mm_loadu_si128((const __m128i *) (r + x)),
+            _mm_loadu_si128((const __m128i *) (g + x)),
+            _mm_loadu_si128((const __m128i *) (b + x)),
+        };
+        for (unsigned k = 0; k < 3; k++) {
+            __m128i v = _mm_shuffle_epi8(c[0], _mm_load_si128((const __m128i *) debayer_rgb_shuffles[k][0]));
+            v = _mm_or_si128(v, _mm_shuffle_epi8(c[1], _mm_load_si128((const __m128i *) debayer_rgb_shuffles[k][1])));
+            v = _mm_or_si128(v, _mm_shuffle_epi8(c[2], _mm_load_si128((const __m128i *) debayer_rgb_shuffles[k][2])));
+            _mm_storeu_si128((__m128i *) (dst + 16 * k), v);
+        }
+    }
+
+    debayer_rgb24_scalar(dst, r + x, g + x, b + x, width - x);
+
+}
+
+/// Luma of 8 pixels widened to 16 bits.
+__attribute__((target("ssse3")))
+static inline __m128i debayer_luma_sse(__m128i r, __m128i g, __m128i b) {
+    __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129)));
+    y = _mm_add_epi16(y, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srli_epi16(y, 8), _mm_set1_epi16(16));
+}
+
+/// Sum of the 2x2 blocks of 16 pixels of two lines, into 8 words.
+__attribute__((target("ssse3")))
+static inline __m128i debayer_sum4_sse(__m128i top, __m128i bottom) {
+    const __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1);
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+    __m128i sum = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i debayer_chroma_sse(__m128i r, __m128i g, __m128i b, short kr, short kg, short kb) {
+    __m128i c = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(kr)), _mm_mullo_epi16(g, _mm_set1_epi16(kg)));
+    c = _mm_add_epi16(c, _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(kb)), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srai_epi16(c, 8), _mm_set1_epi16(128));
+}
+
+__attribute__((target("ssse3")))
+static void debayer_nv12_ssse3(uint8_t *y0, uint8_t *y1, uint8_t *uv, const uint8_t *const rgb[2][3], unsigned width) {
+
+    const __m128i zero = _mm_setzero_si128();
+
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16) {
+
+        __m128i c[2][3];
+        for (unsigned l = 0; l < 2; l++) {
+            for (unsigned k = 0; k < 3; k++)
+                c[l][k] = _mm_loadu_si128((const __m128i *) (rgb[l][k] + x));
+            __m128i lo = debayer_luma_sse(_mm_unpacklo_epi8(c[l][0], zero), _mm_unpacklo_epi8(c[l][1], zero), _mm_unpacklo_epi8(c[l][2], zero));
+            __m128i hi = debayer_luma_sse(_mm_unpackhi_epi8(c[l][0], zero), _mm_unpackhi_epi8(c[l][1], zero), _mm_unpackhi_epi8(c[l][2], zero));
+            _mm_storeu_si128((__m128i *) ((l ? y1 : y0) + x), _mm_packus_epi16(lo, hi));
+        }
+
+        __m128i r = debayer_sum4_sse(c[0][0], c[1][0]);
+        __m128i g = debayer_sum4_sse(c[0][1], c[1][1]);
+        __m128i b = debayer_sum4_sse(c[0][2], c[1][2]);
+        __m128i u = debayer_chroma_sse(r, g, b, -38, -74, 112);
+        __m128i v = debayer_chroma_sse(r, g, b, 112, -94, -18);
+        _mm_storeu_si128((__m128i *) (uv + x), _mm_unpacklo_epi8(_mm_packus_epi16(u, u), _mm_packus_epi16(v, v)));
+
+    }
+
+    const uint8_t *const tail[2][3] = {
+        { rgb[0][0] + x, rgb[0][1] + x, rgb[0][2] + x },
+        { rgb[1][0] + x, rgb[1][1] + x, rgb[1][2] + x },
+    };
+    debayer_nv12_scalar(y0 + x, y1 + x, uv + x, tail, width - x);
+
+}
+
+__attribute__((target("avx2")))
+static inline __m256i debayer_green_avx2(__m256i h0, __m256i h1, __m256i v0, __m256i v1, bool edge) {
+
+    __m256i h = _mm256_avg_epu16(h0, h1), v = _mm256_avg_epu16(v0, v1);
+    __m256i g = _mm256_avg_epu16(h, v);
+    if (!edge)
+        return g;
+
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i dh = _mm256_or_si256(_mm256_subs_epu16(h0, h1), _mm256_subs_epu16(h1, h0));
+    __m256i dv = _mm256_or_si256(_mm256_subs_epu16(v0, v1), _mm256_subs_epu16(v1, v0));
+    __m256i not_h = _mm256_cmpeq_epi16(_mm256_subs_epu16(dv, dh), zero);
+    __m256i not_v = _mm256_cmpeq_epi16(_mm256_subs_epu16(dh, dv), zero);
+    g = _mm256_blendv_epi8(v, g, not_v);
+    return _mm256_blendv_epi8(h, g, not_h);
+
+}
+
+/// The unpack and pack instructions work within lanes, which keeps the 16
+/// columns in order.
+__attribute__((target("avx2")))
+static inline void debayer_store_avx2(uint8_t *dst, __m256i even, __m256i odd, __m128i shift, __m256i gain) {
+    const __m256i max = _mm256_set1_epi16(255);
+    even = _mm256_mulhi_epu16(_mm256_sll_epi16(even, shift), gain);
+    odd = _mm256_mulhi_epu16(_mm256_sll_epi16(odd, shift), gain);
+    even = _mm256_min_epu16(even, max);
+    odd = _mm256_min_epu16(odd, max);
+    _mm256_storeu_si256((__m256i *) dst, _mm256_packus_epi16(_mm256_unpacklo_epi16(even, odd), _mm256_unpackhi_epi16(even, odd)));
+}
+
+// The tails use the scalar kernel, mixing SSE with AVX instructions costs
+// more than a few scalar pixels.
+__attribute__((target("avx2")))
+static void debayer_cells_avx2(uint8_t *const out[2][3], const uint16_t *const rows[4][3], unsigned from, unsigned to, const uint16_t gains[3], unsigned shift, bool edge) {
+
+    const uint16_t *a = rows[DEBAYER_A][1], *an = rows[DEBAYER_A][2];
+    const uint16_t *g1 = rows[DEBAYER_G1][1], *g1n = rows[DEBAYER_G1][2];
+    const uint16_t *g2p = rows[DEBAYER_G2][0], *g2 = rows[DEBAYER_G2][1];
+    const uint16_t *dp = rows[DEBAYER_D][0], *d = rows[DEBAYER_D][1];
+
+    const __m128i s = _mm_cvtsi32_si128((int) shift);
+    const __m256i ga = _mm256_set1_epi16((short) gains[0]);
+    const __m256i gg = _mm256_set1_epi16((short) gains[1]);
+    const __m256i gd = _mm256_set1_epi16((short) gains[2]);
+
+    unsigned j = from;
+    for (; j + 16 <= to; j += 16) {
+
+#define DEBAYER_LOAD(p, o) _mm256_loadu_si256((const __m256i *) ((p) + j + (o)))
+        __m256i a0 = DEBAYER_LOAD(a, 0), a0r = DEBAYER_LOAD(a, 1);
+        __m256i a1 = DEBAYER_LOAD(an, 0), a1r = DEBAYER_LOAD(an, 1);
+        __m256i g1l = DEBAYER_LOAD(g1, -1), g1c = DEBAYER_LOAD(g1, 0), g1d = DEBAYER_LOAD(g1n, 0);
+        __m256i g2u = DEBAYER_LOAD(g2p, 0), g2c = DEBAYER_LOAD(g2, 0), g2r = DEBAYER_LOAD(g2, 1);
+        __m256i dul = DEBAYER_LOAD(dp, -1), du = DEBAYER_LOAD(dp, 0), dl = DEBAYER_LOAD(d, -1), dc = DEBAYER_LOAD(d, 0);
+#undef DEBAYER_LOAD
+
+        __m256i a01 = _mm256_avg_epu16(a0, a0r);
+        debayer_store_avx2(out[0][0] + 2 * j, a0, a01, s, ga);
+        debayer_store_avx2(out[0][1] + 2 * j, debayer_green_avx2(g1l, g1c, g2u, g2c, edge), g1c, s, gg);
+        debayer_store_avx2(out[0][2] + 2 * j, _mm256_avg_epu16(_mm256_avg_epu16(dul, du), _mm256_avg_epu16(dl, dc)), _mm256_avg_epu16(du, dc), s, gd);
+        debayer_store_avx2(out[1][0] + 2 * j, _mm256_avg_epu16(a0, a1), _mm256_avg_epu16(a01, _mm256_avg_epu16(a1, a1r)), s, ga);
+        debayer_store_avx2(out[1][1] + 2 * j, g2c, debayer_green_avx2(g2c, g2r, g1c, g1d, edge), s, gg);
+        debayer_store_avx2(out[1][2] + 2 * j, _mm256_avg_epu16(dl, dc), dc, s, gd);
+
+    }
+
+    debayer_cells_scalar(out, rows, j, to, gains, shift, edge);
+
+}
+
+#endif
+
+#ifdef DEBAYER_NEON
+
+static inline uint16x8_t debayer_green_neon(uint16x8_t h0, uint16x8_t h1, uint16x8_t v0, uint16x8_t v1, bool edge) {
+
+    uint16x8_t h = vrhaddq_u16(h0, h1), v = vrhaddq_u16(v0, v1);
+    uint16x8_t g = vrhaddq_u16(h, v);
+    if (!edge)
+        return g;
+
+    uint16x8_t dh = vabdq_u16(h0, h1), dv = vabdq_u16(v0, v1);
+    g = vbslq_u16(vcltq_u16(dv, dh), v, g);
+    return vbslq_u16(vcltq_u16(dh, dv), h, g);
+
+}
+
+/// Scale and clamp 8 samples to bytes.
+static inline uint8x8_t debayer_scale_neon(uint16x8_t v, int16x8_t shift, uint16x4_t gain) {
+    v = vshlq_u16(v, shift);
+    uint16x8_t x = vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(v), gain), 16), vshrn_n_u32(vmull_u16(vget_high_u16(v), gain), 16));
+    return vqmovn_u16(x);
+}
+
+/// The interleaving store writes the even and odd columns of the line.
+static inline void debayer_store_neon(uint8_t *dst, uint16x8_t even, uint16x8_t odd, int16x8_t shift, uint16x4_t gain) {
+    uint8x8x2_t v = { { debayer_scale_neon(even, shift, gain), debayer_scale_neon(odd, shift, gain) } };
+    vst2_u8(dst, v);
+}
+
+static void debayer_cells_neon(uint8_t *const out[2][3], const uint16_t *const rows[4][3], unsigned from, unsigned to, const uint16_t gains[3], unsigned shift, bool edge) {
+
+    const uint16_t *a = rows[DEBAYER_A][1], *an = rows[DEBAYER_A][2];
+    const uint16_t *g1 = rows[DEBAYER_G1][1], *g1n = rows[DEBAYER_G1][2];
+    const uint16_t *g2p = rows[DEBAYER_G2][0], *g2 = rows[DEBAYER_G2][1];
+    const uint16_t *dp = rows[DEBAYER_D][0], *d = rows[DEBAYER_D][1];
+
+    const int16x8_t s = vdupq_n_s16((int16_t) shift);
+    const uint16x4_t ga = vdup_n_u16(gains[0]);
+    const uint16x4_t gg = vdup_n_u16(gains[1]);
+    const uint16x4_t gd = vdup_n_u16(gains[2]);
+
+    unsigned j = from;
+    for (; j + 8 <= to; j += 8) {
+
+        uint16x8_t a0 = vld1q_u16(a + j), a0r = vld1q_u16(a + j + 1);
+        uint16x8_t a1 = vld1q_u16(an + j), a1r = vld1q_u16(an + j + 1);
+        uint16x8_t g1l = vld1q_u16(g1 + j - 1), g1c = vld1q_u16(g1 + j), g1d = vld1q_u16(g1n + j);
+        uint16x8_t g2u = vld1q_u16(g2p + j), g2c = vld1q_u16(g2 + j), g2r = vld1q_u16(g2 + j + 1);
+        uint16x8_t dul = vld1q_u16(dp + j - 1), du = vld1q_u16(dp + j), dl = vld1q_u16(d + j - 1), dc = vld1q_u16(d + j);
+
+        uint16x8_t a01 = vrhaddq_u16(a0, a0r);
+        debayer_store_neon(out[0][0] + 2 * j, a0, a01, s, ga);
+        debayer_store_neon(out[0][1] + 2 * j, debayer_green_neon(g1l, g1c, g2u, g2c, edge), g1c, s, gg);
+        debayer_store_neon(out[0][2] + 2 * j, vrhaddq_u16(vrhaddq_u16(dul, du), vrhaddq_u16(dl, dc)), vrhaddq_u16(du, dc), s, gd);
+        debayer_store_neon(out[1][0] + 2 * j, vrhaddq_u16(a0, a1), vrhaddq_u16(a01, vrhaddq_u16(a1, a1r)), s, ga);
+        debayer_store_neon(out[1][1] + 2 * j, g2c, debayer_green_neon(g2c, g2r, g1c, g1d, edge), s, gg);
+        debayer_store_neon(out[1][2] + 2 * j, vrhaddq_u16(dl, dc), dc, s, gd);
+
+    }
+
+    debayer_cells_scalar(out, rows, j, to, gains, shift, edge);
+
+}
+
+static void debayer_rgb24_neon(uint8_t *dst, const uint8_t *r, const uint8_t *g, const uint8_t *b, unsigned width) {
+
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16, dst += 48) {
+        uint8x16x3_t v = { { vld1q_u8(r + x), vld1q_u8(g + x), vld1q_u8(b + x) } };
+        vst3q_u8(dst, v);
+    }
+
+    debayer_rgb24_scalar(dst, r + x, g + x, b + x, width - x);
+
+}
+
+static inline uint8x8_t debayer_luma_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+    uint16x8_t y = vmull_u8(r, vdup_n_u8(66));
+    y = vmlal_u8(y, g, vdup_n_u8(129));
+    y = vmlal_u8(y, b, vdup_n_u8(25));
+    return vadd_u8(vrshrn_n_u16(y, 8), vdup_n_u8(16));
+}
+
+static inline uint8x8_t debayer_chroma_neon(int16x8_t r, int16x8_t g, int16x8_t b, int16_t kr, int16_t kg, int16_t kb) {
+    int16x8_t c = vmulq_n_s16(r, kr);
+    c = vmlaq_n_s16(c, g, kg);
+    c = vmlaq_n_s16(c, b, kb);
+    return vmovn_u16(vreinterpretq_u16_s16(vaddq_s16(vrshrq_n_s16(c, 8), vdupq_n_s16(128))));
+}
+
+static void debayer_nv12_neon(uint8_t *y0, uint8_t *y1, uint8_t *uv, const uint8_t *const rgb[2][3], unsigned width) {
+
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16) {
+
+        uint8x16_t c[2][3];
+        for (unsigned l = 0; l < 2; l++) {
+            for (unsigned k = 0; k < 3; k++)
+                c[l][k] = vld1q_u8(rgb[l][k] + x);
+            uint8x8_t lo = debayer_luma_neon(vget_low_u8(c[l][0]), vget_low_u8(c[l][1]), vget_low_u8(c[l][2]));
+            uint8x8_t hi = debayer_luma_neon(vget_high_u8(c[l][0]), vget_high_u8(c[l][1]), vget_high_u8(c[l][2]));
+            vst1q_u8((l ? y1 : y0) + x, vcombine_u8(lo, hi));
+        }
+
+        int16x8_t s[3];
+        for (unsigned k = 0; k < 3; k++)
+            s[k] = vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(c[0][k]), c[1][k]), 2));
+        uint8x8x2_t v = { {
+            debayer_chroma_neon(s[0], s[1], s[2], -38, -74, 112),
+            debayer_chroma_neon(s[0], s[1], s[2], 112, -94, -18),
+        } };
+        vst2_u8(uv + x, v);
+
+    }
+
+    const uint8_t *const tail[2][3] = {
+        { rgb[0][0] + x, rgb[0][1] + x, rgb[0][2] + x },
+        { rgb[1][0] + x, rgb[1][1] + x, rgb[1][2] + x },
+    };
+    debayer_nv12_scalar(y0 + x, y1 + x, uv + x, tail, width - x);
+
+}
+
+#endif
+
+static struct debayer_kernel debayer_available[4];
+static unsigned debayer_available_count;
+
+static void debayer_init_once(void) {
+
+    // Byte n of the output block k is the channel (16k + n) % 3 of the pixel
+    // (16k + n) / 3, other channels are zeroed by the shuffle.
+    for (unsigned k = 0; k < 3; k++) {
+        for (unsigned n = 0; n < 16; n++) {
+            for (unsigned c = 0; c < 3; c++) {
+                unsigned byte = 16 * k + n;
+                debayer_rgb_shuffles[k][c][n] = byte % 3 == c ? byte / 3 : 0x80;
+            }
+        }
+    }
+
+    debayer_available[debayer_available_count++] = (struct debayer_kernel) { "scalar", debayer_cells_scalar, debayer_rgb24_scalar, debayer_nv12_scalar };
+#ifdef DEBAYER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        debayer_available[debayer_available_count++] = (struct debayer_kernel) { "ssse3", debayer_cells_ssse3, debayer_rgb24_ssse3, debayer_nv12_ssse3 };
+    // Interleaving does not cross the lanes, the SSSE3 kernels are kept.
+    if (__builtin_cpu_supports("avx2"))
+        debayer_available[debayer_available_count++] = (struct debayer_kernel) { "avx2", debayer_cells_avx2, debayer_rgb24_ssse3, debayer_nv12_ssse3 };
+#endif
+#ifdef DEBAYER_NEON
+    debayer_available[debayer_available_count++] = (struct debayer_kernel) { "neon", debayer_cells_neon, debayer_rgb24_neon, debayer_nv12_neon };
+#endif
+
+    debayer_selected = &debayer_available[debayer_available_count - 1];
+
+}
+
+static void debayer_init_kernels(void) {
+    pthread_once(&debayer_once, debayer_init_once);
+}
+
+const struct debayer_kernel *debayer_kernels(unsigned *count) {
+    debayer_init_kernels();
+    *count = debayer_available_count;
+    return debayer_available;
+}
+
+const char *debayer_kernel_name(void) {
+    debayer_init_kernels();
+    return debayer_selected->name;
+}
+
+bool debayer_select_kernel(const char *name) {
+    debayer_init_kernels();
+    for (unsigned i = 0; i < debayer_available_count; i++) {
+        if (strcmp(debayer_available[i].name, name) == 0) {
+            debayer_selected = &debayer_available[i];
+            unpack_select_kernel(name);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool debayer_parse_mode(const char *name, enum debayer_mode *mode) {
+    if (strcmp(name, "bilinear") == 0) {
+        *mode = DEBAYER_BILINEAR;
+        return true;
+    } else if (strcmp(name, "edge") == 0) {
+        *mode = DEBAYER_EDGE;
+        return true;
+    }
+    return false;
+}
+
+///
+/// BANDS
+///
+
+/// Grow the scratch of a worker for bands of the given size, errors are fatal.
+static void debayer_scratch_reserve(struct debayer_scratch *scratch, unsigned width, unsigned band_rows) {
+
+    // One sample of margin on each side, rows start on 32 bytes once offset.
+    unsigned stride = (width / 2 + 2 + 15) & ~15u;
+    size_t plane_size = (size_t) stride * (band_rows + 2);
+    size_t size = plane_size * 4 * sizeof(uint16_t);
+    size_t lines_size = (size_t) width * 6;
+
+    if (size > scratch->size) {
+        free(scratch->planes);
+        if (posix_memalign((void **) &scratch->planes, 32, size)) {
+            fprintf(stderr, "error: failed to allocate debayer planes\n");
+            exit(1);
+        }
+        scratch->size = size;
+    }
+
+    if (lines_size > scratch->lines_size) {
+        free(scratch->lines);
+        if (posix_memalign((void **) &scratch->lines, 32, lines_size)) {
+            fprintf(stderr, "error: failed to allocate debayer lines\n");
+            exit(1);
+        }
+        scratch->lines_size = lines_size;
+    }
+
+    scratch->stride = stride;
+    scratch->plane_size = plane_size;
+
+}
+
+/// Unpack and interpolate the rows [i0, i1) of the planes.
+static void debayer_band(const struct debayer *d, struct debayer_scratch *scratch, const struct debayer_job *job, unsigned i0, unsigned i1) {
+
+    const struct debayer_source *src = job->src;
+    const struct debayer_target *dst = job->dst;
+    unsigned half = job->width / 2, rows = job->height / 2;
+    if (i0 >= i1)
+        return;
+
+    debayer_scratch_reserve(scratch, job->width, i1 - i0);
+    unsigned stride = scratch->stride;
+
+    // Plane p, row i and column j is at base[p] + (i - i0 + 1) * stride + j + 1.
+    uint16_t *base[4];
+    for (unsigned p = 0; p < 4; p++)
+        base[p] = scratch->planes + p * scratch->plane_size;
+#define DEBAYER_AT(p, i) (base[p] + (size_t) ((i) - i0 + 1) * stride + 1)
+
+    // The rows around the band are unpacked too, except on the edges of the
+    // crop where the rows and columns are repeated.
+    unsigned first = i0 ? i0 - 1 : 0;
+    unsigned last = i1 < rows ? i1 + 1 : rows;
+    struct unpack_planes planes = { .width = half, .height = last - first, .stride = stride };
+    for (unsigned pos = 0; pos < 4; pos++)
+        planes.planes[job->layout[pos]] = DEBAYER_AT(pos, first);
+    unpack_region(&planes, src->data, src->pixelformat, src->bytesperline, src->crop.left, src->crop.top + 2 * first, job->width, 2 * (last - first));
+
+    for (unsigned p = 0; p < 4; p++) {
+        if (first == i0)
+            memcpy(DEBAYER_AT(p, i0) - stride - 1, DEBAYER_AT(p, i0) - 1, (half + 2) * sizeof(uint16_t));
+        if (last == i1)
+            memcpy(DEBAYER_AT(p, i1) - 1, DEBAYER_AT(p, i1 - 1) - 1, (half + 2) * sizeof(uint16_t));
+        for (int i = (int) i0 - 1; i <= (int) i1; i++) {
+            uint16_t *row = DEBAYER_AT(p, i);
+            row[-1] = row[0];
+            row[half] = row[half - 1];
+        }
+    }
+
+    // The A channel is red or blue, the lines are red, green and blue.
+    bool red = job->layout[0] == UNPACK_R;
+    uint8_t *lines = scratch->lines;
+    uint8_t *const out[2][3] = {
+        { lines + (red ? 0 : 2) * job->width, lines + job->width, lines + (red ? 2 : 0) * job->width },
+        { lines + (red ? 3 : 5) * job->width, lines + 4 * job->width, lines + (red ? 5 : 3) * job->width },
+    };
+    const uint8_t *const rgb[2][3] = {
+        { lines, lines + job->width, lines + 2 * job->width },
+        { lines + 3 * job->width, lines + 4 * job->width, lines + 5 * job->width },
+    };
+
+    uint8_t *image = dst->data;
+    for (unsigned i = i0; i < i1; i++) {
+
+        const uint16_t *const cells[4][3] = {
+            { DEBAYER_AT(0, i - 1), DEBAYER_AT(0, i), DEBAYER_AT(0, i + 1) },
+            { DEBAYER_AT(1, i - 1), DEBAYER_AT(1, i), DEBAYER_AT(1, i + 1) },
+            { DEBAYER_AT(2, i - 1), DEBAYER_AT(2, i), DEBAYER_AT(2, i + 1) },
+            { DEBAYER_AT(3, i - 1), DEBAYER_AT(3, i), DEBAYER_AT(3, i + 1) },
+        };
+        debayer_selected->cells(out, cells, 0, half, job->gains, job->shift, d->mode == DEBAYER_EDGE);
+
+        uint8_t *line = image + (size_t) 2 * i * dst->bytesperline;
+        if (dst->pixelformat == V4L2_PIX_FMT_RGB24) {
+            debayer_selected->rgb24(line, rgb[0][0], rgb[0][1], rgb[0][2], job->width);
+            debayer_selected->rgb24(line + dst->bytesperline, rgb[1][0], rgb[1][1], rgb[1][2], job->width);
+        } else {
+            uint8_t *uv = image + (size_t) dst->height * dst->bytesperline + (size_t) i * dst->bytesperline;
+            debayer_selected->nv12(line, line + dst->bytesperline, uv, rgb, job->width);
+        }
+
+    }
+
+#undef DEBAYER_AT
+
+}
+
+/// Band of a worker, the frame is split evenly in rows of planes.
+static void debayer_worker_band(struct debayer *d, struct debayer_worker *worker) {
+    const struct debayer_job *job = &d->pool->job;
+    unsigned rows = job->height / 2;
+    debayer_band(d, &worker->scratch, job, rows * worker->index / d->threads, rows * (worker->index + 1) / d->threads);
+}
+
+static void *debayer_worker_run(void *arg) {
+
+    struct debayer_worker *worker = arg;
+    struct debayer_pool *pool = worker->d->pool;
+    unsigned generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+
+        while (pool->generation == generation && !pool->stop)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->stop)
+            break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        debayer_worker_band(worker->d, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->done);
+
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+
+}
+
+void debayer_init(struct debayer *d, enum debayer_mode mode, unsigned threads) {
+
+    debayer_init_kernels();
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > DEBAYER_MAX_THREADS)
+        threads = DEBAYER_MAX_THREADS;
+
+    d->mode = mode;
+    d->threads = threads;
+    d->pool = calloc(1, sizeof(struct debayer_pool));
+    if (!d->pool) {
+        fprintf(stderr, "error: failed to allocate debayer pool\n");
+        exit(1);
+    }
+
+    struct debayer_pool *pool = d->pool;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (unsigned i = 0; i < threads; i++) {
+        pool->workers[i].d = d;
+        pool->workers[i].index = i;
+        if (i && pthread_create(&pool->workers[i].thread, NULL, debayer_worker_run, &pool->workers[i])) {
+            fprintf(stderr, "error: failed to start debayer thread\n");
+            exit(1);
+        }
+    }
+
+}
+
+void debayer_release(struct debayer *d) {
+
+    struct debayer_pool *pool = d->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < d->threads; i++) {
+        if (i)
+            pthread_join(pool->workers[i].thread, NULL);
+        free(pool->workers[i].scratch.planes);
+        free(pool->workers[i].scratch.lines);
+    }
+
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+    d->pool = NULL;
+
+}
+
+/// Gain of a channel in 1/256, from gains in thousandths.
+static uint16_t debayer_gain(unsigned balance, unsigned digital) {
+    unsigned long long gain = (unsigned long long) balance * digital * 256 / 1000000;
+    return gain > 0xFFFF ? 0xFFFF : (uint16_t) gain;
+}
+
+bool debayer_frame(struct debayer *d, const struct debayer_source *src, const struct debayer_target *dst, const struct debayer_gains *gains) {
+
+    struct debayer_pool *pool = d->pool;
+    struct debayer_job *job = &pool->job;
+
+    unsigned depth;
+    if (!unpack_layout(src->pixelformat, &job->layout, &depth))
+        return false;
+    if (job->layout[0] != UNPACK_R && job->layout[0] != UNPACK_B)
+        return false;
+
+    const struct v4l2_rect *crop = &src->crop;
+    if (crop->left < 0 || crop->top < 0 || crop->left % 4 || crop->top % 2
+        || crop->left + crop->width > src->width || crop->top + crop->height > src->height)
+        return false;
+
+    unsigned bytes = dst->pixelformat == V4L2_PIX_FMT_RGB24 ? 3 : 1;
+    if ((dst->pixelformat != V4L2_PIX_FMT_RGB24 && dst->pixelformat != V4L2_PIX_FMT_NV12) || dst->bytesperline < dst->width * bytes)
+        return false;
+
+    job->src = src;
+    job->dst = dst;
+    job->width = (crop->width < dst->width ? crop->width : dst->width) & ~3u;
+    job->height = (crop->height < dst->height ? crop->height : dst->height) & ~1u;
+    job->shift = 16 - depth;
+    unsigned red = debayer_gain(gains->red, gains->digital);
+    unsigned green = debayer_gain(1000, gains->digital);
+    unsigned blue = debayer_gain(gains->blue, gains->digital);
+    job->gains[0] = job->layout[0] == UNPACK_R ? red : blue;
+    job->gains[1] = green;
+    job->gains[2] = job->layout[0] == UNPACK_R ? blue : red;
+    if (!job->width || !job->height)
+        return true;
+
+    if (d->threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->generation++;
+        pool->pending = d->threads - 1;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    debayer_worker_band(d, &pool->workers[0]);
+
+    if (d->threads > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return true;
+
+}
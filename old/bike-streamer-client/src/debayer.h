@@ -0,0 +1,101 @@
+/// Software demosaic of packed Bayer frames into RGB24 or NV12, the fallback of
+/// the ISP on development machines and boards without it (see the 'soft' backend
+/// in 'backend.h').
+///
+/// Rows are unpacked into channel planes (see 'unpack.h'), then each 2x2 cell is
+/// interpolated from its neighbours, either bilinear or edge-aware where green is
+/// interpolated along the direction of the smallest gradient. The color balance
+/// and digital gain are applied like the ISP controls, in thousandths. Frames are
+/// split into bands of rows processed in parallel by a pool of threads.
+///
+/// Only the layouts with red and blue on the diagonal are supported (RGGB and
+/// BGGR), the crop left edge and width must be multiples of 4, its top edge and
+/// height even.
+
+#pragma once
+
+#include <linux/videodev2.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define DEBAYER_MAX_THREADS 16
+
+enum debayer_mode {
+    DEBAYER_BILINEAR,
+    DEBAYER_EDGE,
+};
+
+/// A packed Bayer frame and the region to process.
+struct debayer_source {
+    const void *data;
+    uint32_t pixelformat;
+    unsigned width;
+    unsigned height;
+    unsigned bytesperline;
+    struct v4l2_rect crop;
+};
+
+/// An RGB24 or NV12 image, the chroma plane of NV12 follows the luma plane. The
+/// processed region is the crop clipped to the image size.
+struct debayer_target {
+    void *data;
+    uint32_t pixelformat;
+    unsigned width;
+    unsigned height;
+    unsigned bytesperline;
+};
+
+/// Gains in thousandths, like V4L2_CID_RED_BALANCE, V4L2_CID_BLUE_BALANCE and
+/// V4L2_CID_DIGITAL_GAIN.
+struct debayer_gains {
+    unsigned red;
+    unsigned blue;
+    unsigned digital;
+};
+
+/// Interpolate the cells of a row of planes into the planar 8-bit rows of the
+/// two output lines, see 'debayer.c'.
+typedef void (*debayer_cells_fn)(uint8_t *const out[2][3], const uint16_t *const rows[4][3], unsigned from, unsigned to, const uint16_t gains[3], unsigned shift, bool edge);
+/// Interleave planar rows into RGB24.
+typedef void (*debayer_rgb24_fn)(uint8_t *dst, const uint8_t *r, const uint8_t *g, const uint8_t *b, unsigned width);
+/// Convert two planar rows into two NV12 luma rows and their chroma row.
+typedef void (*debayer_nv12_fn)(uint8_t *y0, uint8_t *y1, uint8_t *uv, const uint8_t *const rgb[2][3], unsigned width);
+
+struct debayer_kernel {
+    const char *name;
+    debayer_cells_fn cells;
+    debayer_rgb24_fn rgb24;
+    debayer_nv12_fn nv12;
+};
+
+/// Worker threads and their scratch rows, see 'debayer.c'.
+struct debayer_pool;
+
+struct debayer {
+    enum debayer_mode mode;
+    unsigned threads;
+    struct debayer_pool *pool;
+};
+
+
+/// Get the kernels available on this CPU, the fastest last.
+const struct debayer_kernel *debayer_kernels(unsigned *count);
+
+/// Get the name of the selected kernel, or select one by name, return false if
+/// it is not available. The unpacking kernel is selected with the same name.
+const char *debayer_kernel_name(void);
+bool debayer_select_kernel(const char *name);
+
+/// Parse a mode name ("bilinear", "edge"), return false if unknown.
+bool debayer_parse_mode(const char *name, enum debayer_mode *mode);
+
+/// Start the threads, the calling thread processes the first band so no thread
+/// is started for a single one. Errors are fatal.
+void debayer_init(struct debayer *d, enum debayer_mode mode, unsigned threads);
+void debayer_release(struct debayer *d);
+
+/// Process a frame, return false if the formats or the crop are not supported.
+bool debayer_frame(struct debayer *d, const struct debayer_source *src, const struct debayer_target *dst, const struct debayer_gains *gains);
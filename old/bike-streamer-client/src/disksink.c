@@ -0,0 +1,887 @@
+#define _GNU_SOURCE
+
+#include "disksink.h"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+
+enum disksink_kind {
+    /// Write reading from an encoder buffer.
+    DISKSINK_WRITE_BUFFER,
+    /// Write of an aligned chunk, with O_DIRECT.
+    DISKSINK_WRITE_CHUNK,
+    DISKSINK_FALLOCATE,
+    /// Zeroing of the stale tail of a reused segment.
+    DISKSINK_ZERO_RANGE,
+    DISKSINK_FSYNC,
+    /// Write of a batch of index entries.
+    DISKSINK_WRITE_INDEX,
+    /// Write of the header counting them, linked after them.
+    DISKSINK_WRITE_INDEX_HEADER,
+    /// Write of the header of an index without entries, when a file starts.
+    DISKSINK_WRITE_HEADER,
+};
+
+struct disksink_request {
+    enum disksink_kind kind;
+    /// Encoder buffer index, chunk index or index batch.
+    unsigned index;
+    int fd;
+    uint8_t flags;
+    const uint8_t *data;
+    uint64_t size;
+    uint64_t offset;
+    struct timespec submitted;
+};
+
+/// Entries of the index and the header counting them, written after them.
+struct disksink_index_batch {
+    struct recindex_header header;
+    struct recindex_entry entries[DISKSINK_INDEX_BATCH];
+};
+
+/// The rings are mapped from the io_uring instance, there is no liburing on the
+/// target so the system calls are made directly.
+struct disksink_ring {
+    int fd;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    /// Tail of the submission queue, published on submit.
+    unsigned tail;
+    struct disksink_request requests[DISKSINK_QUEUE_DEPTH];
+    unsigned free[DISKSINK_QUEUE_DEPTH];
+    unsigned free_count;
+    /// Requests queued since the last submit, their time is taken on submit.
+    unsigned queued[DISKSINK_QUEUE_DEPTH];
+    /// Encoder buffers released by completions, returned by 'disksink_complete'.
+    unsigned released[VIDEO_MAX_FRAME];
+    unsigned released_count;
+    /// Aligned chunks for O_DIRECT, the current one is being filled.
+    uint8_t *chunks;
+    bool chunk_busy[DISKSINK_CHUNKS];
+    unsigned chunk;
+    size_t chunk_fill;
+    uint64_t chunk_offset;
+    bool prealloc;
+    /// Batches of index entries, the current one is being filled, and the
+    /// writes in flight reading each of them.
+    struct disksink_index_batch index_batches[2];
+    unsigned index_busy[2];
+    unsigned index_batch;
+    unsigned index_fill;
+    /// First entry of each batch, and the slot of its header when it was
+    /// cancelled and waits for the entries written again, -1 otherwise.
+    uint32_t index_first[2];
+    int index_held[2];
+    /// Index whose entries failed to be written, -1 if none, and the number of
+    /// entries written before them, which its headers count at most.
+    int index_failed_fd;
+    uint32_t index_valid;
+    /// Header of an index without entries, with the clocks of the recording.
+    struct recindex_header index_empty;
+    /// Segment files and their size, which only grows.
+    int segment_fds[DISKSINK_MAX_SEGMENTS];
+    int segment_index_fds[DISKSINK_MAX_SEGMENTS];
+    uint64_t segment_sizes[DISKSINK_MAX_SEGMENTS];
+    bool zero_range;
+};
+
+
+static void disksink_start_index(struct disksink *sink);
+
+static int disksink_setup(unsigned entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int disksink_enter(int fd, unsigned submit, unsigned complete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int disksink_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static double disksink_elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static void disksink_map(struct disksink_ring *ring) {
+
+    struct io_uring_params params = {0};
+    ring->fd = disksink_setup(DISKSINK_QUEUE_DEPTH, &params);
+    if (ring->fd == -1) {
+        fprintf(stderr, "error: failed to setup io_uring (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Recent kernels map both rings at once.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = 0;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = ring->cq_size ? mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING) : ring->sq_ptr;
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        fprintf(stderr, "error: failed to map io_uring (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    uint8_t *sq = ring->sq_ptr, *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->tail = *ring->sq_tail;
+
+}
+
+/// Allocate the sink and its chunks, map the rings and register the eventfd.
+static void disksink_init(struct disksink *sink, bool direct, bool copy) {
+
+    memset(sink, 0, sizeof(struct disksink));
+    sink->direct = direct;
+    sink->copy = copy;
+    sink->index_fd = -1;
+
+    struct disksink_ring *ring = calloc(1, sizeof(struct disksink_ring));
+    if (!ring) {
+        fprintf(stderr, "error: failed to allocate disk sink\n");
+        exit(1);
+    }
+    sink->ring = ring;
+
+    if (copy && posix_memalign((void **) &ring->chunks, DISKSINK_ALIGN, (size_t) DISKSINK_CHUNKS * DISKSINK_CHUNK_SIZE)) {
+        fprintf(stderr, "error: failed to allocate aligned chunks\n");
+        exit(1);
+    }
+
+    recindex_header_init(&ring->index_empty);
+    ring->index_held[0] = ring->index_held[1] = -1;
+    ring->index_failed_fd = -1;
+
+    disksink_map(ring);
+    for (unsigned i = 0; i < DISKSINK_QUEUE_DEPTH; i++)
+        ring->free[ring->free_count++] = DISKSINK_QUEUE_DEPTH - 1 - i;
+
+    sink->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sink->event_fd == -1 || disksink_register(ring->fd, IORING_REGISTER_EVENTFD, &sink->event_fd, 1) == -1) {
+        fprintf(stderr, "error: failed to register io_uring eventfd (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+}
+
+void disksink_open(struct disksink *sink, const char *path, bool direct, unsigned buffers) {
+
+    disksink_init(sink, direct, direct);
+    struct disksink_ring *ring = sink->ring;
+    sink->max_held = buffers > 1 ? buffers / 2 : 1;
+
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (direct ? O_DIRECT : 0), 0644);
+    if (sink->fd == -1) {
+        fprintf(stderr, "error: failed to open recording file '%s' (%s)\n", path, strerror(errno));
+        exit(1);
+    }
+
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s%s", path, RECINDEX_SUFFIX);
+    sink->index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (sink->index_fd == -1) {
+        fprintf(stderr, "error: failed to open recording index '%s' (%s)\n", index_path, strerror(errno));
+        exit(1);
+    }
+
+    // The size is kept so that the file only grows with the data written, the
+    // blocks past the end are released when the file is closed.
+    ring->prealloc = fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, 0, DISKSINK_PREALLOC) == 0;
+    if (ring->prealloc)
+        sink->allocated = DISKSINK_PREALLOC;
+    else
+        fprintf(stderr, "warn: recording file can't be preallocated (%s)\n", strerror(errno));
+
+    disksink_start_index(sink);
+
+}
+
+void disksink_open_segments(struct disksink *sink, const char *prefix, unsigned count, unsigned seconds, unsigned capacity_mb, bool direct) {
+
+    if (!count || count > DISKSINK_MAX_SEGMENTS || !seconds || !capacity_mb) {
+        fprintf(stderr, "error: segments expect a duration, a count up to %d and a capacity\n", DISKSINK_MAX_SEGMENTS);
+        exit(1);
+    }
+
+    disksink_init(sink, direct, true);
+    struct disksink_ring *ring = sink->ring;
+    sink->segments = count;
+    sink->segment_ms = seconds * 1000;
+    sink->segment_capacity = (uint64_t) capacity_mb << 20;
+    ring->zero_range = true;
+
+    // Files are never truncated, their blocks are allocated once and reused by
+    // the following laps of the ring. Empty files are used first, then the
+    // oldest one, which is where the previous recording stopped.
+    struct timespec oldest = {0};
+    bool found = false;
+    for (unsigned i = 0; i < count; i++) {
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s-%03u.h264", prefix, i);
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (direct ? O_DIRECT : 0), 0644);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            fprintf(stderr, "error: failed to open segment file '%s' (%s)\n", path, strerror(errno));
+            exit(1);
+        }
+
+        struct timespec age = st.st_size ? st.st_mtim : (struct timespec) {0};
+        if (!found || age.tv_sec < oldest.tv_sec || (age.tv_sec == oldest.tv_sec && age.tv_nsec < oldest.tv_nsec)) {
+            oldest = age;
+            sink->segment = i;
+            found = true;
+        }
+
+        if ((uint64_t) st.st_size < sink->segment_capacity && fallocate(fd, 0, 0, sink->segment_capacity) == -1)
+            fprintf(stderr, "warn: segment file '%s' can't be preallocated (%s)\n", path, strerror(errno));
+        fstat(fd, &st);
+
+        ring->segment_fds[i] = fd;
+        ring->segment_sizes[i] = st.st_size;
+
+        // Indexes are small, they are overwritten without preallocation.
+        char index_path[4096 + 8];
+        snprintf(index_path, sizeof(index_path), "%s%s", path, RECINDEX_SUFFIX);
+        ring->segment_index_fds[i] = open(index_path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (ring->segment_index_fds[i] == -1) {
+            fprintf(stderr, "error: failed to open segment index '%s' (%s)\n", index_path, strerror(errno));
+            exit(1);
+        }
+
+    }
+
+    sink->fd = ring->segment_fds[sink->segment];
+    sink->index_fd = ring->segment_index_fds[sink->segment];
+    disksink_start_index(sink);
+
+}
+
+/// Release the encoder buffer or chunk read by a request, and its slot.
+static void disksink_retire(struct disksink *sink, unsigned slot) {
+
+    struct disksink_ring *ring = sink->ring;
+    struct disksink_request *req = &ring->requests[slot];
+
+    if (req->kind == DISKSINK_WRITE_BUFFER) {
+        if (--sink->outstanding[req->index] == 0) {
+            ring->released[ring->released_count++] = req->index;
+            sink->held--;
+        }
+    } else if (req->kind == DISKSINK_WRITE_CHUNK) {
+        ring->chunk_busy[req->index] = false;
+    } else if (req->kind == DISKSINK_WRITE_INDEX || req->kind == DISKSINK_WRITE_INDEX_HEADER) {
+        ring->index_busy[req->index]--;
+    }
+
+    ring->free[ring->free_count++] = slot;
+    sink->inflight--;
+
+}
+
+static void disksink_prepare(struct disksink *sink, unsigned slot) {
+
+    struct disksink_ring *ring = sink->ring;
+    struct disksink_request *req = &ring->requests[slot];
+
+    unsigned i = ring->tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = req->fd;
+    sqe->flags = req->flags;
+    sqe->off = req->offset;
+    sqe->user_data = slot;
+
+    if (req->kind == DISKSINK_FALLOCATE) {
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->addr = req->size;
+        sqe->len = FALLOC_FL_KEEP_SIZE;
+    } else if (req->kind == DISKSINK_ZERO_RANGE) {
+        sqe->opcode = IORING_OP_FALLOCATE;
+        sqe->addr = req->size;
+        sqe->len = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+    } else if (req->kind == DISKSINK_FSYNC) {
+        sqe->opcode = IORING_OP_FSYNC;
+    } else {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t) req->data;
+        sqe->len = req->size;
+    }
+
+    ring->sq_array[i] = i;
+    ring->tail++;
+    ring->queued[sink->queued++] = slot;
+
+}
+
+/// Queue the header of an index batch again, whole and counting only the entries
+/// written if some failed.
+static void disksink_rewrite_header(struct disksink *sink, unsigned slot) {
+
+    struct disksink_ring *ring = sink->ring;
+    struct disksink_request *req = &ring->requests[slot];
+    struct disksink_index_batch *batch = &ring->index_batches[req->index];
+
+    if (req->fd == ring->index_failed_fd && batch->header.count > ring->index_valid)
+        batch->header.count = ring->index_valid;
+    req->data = (const uint8_t *) &batch->header;
+    req->size = sizeof(struct recindex_header);
+    req->offset = 0;
+    // Counted in flight again when submitted.
+    sink->inflight--;
+    disksink_prepare(sink, slot);
+
+}
+
+/// Release the index entries of a request and the header waiting for them.
+static void disksink_retire_index(struct disksink *sink, unsigned slot, bool failed) {
+
+    struct disksink_ring *ring = sink->ring;
+    struct disksink_request *req = &ring->requests[slot];
+    unsigned batch = req->index;
+
+    // The index ends before the first entries lost, the headers of the batches
+    // in flight after them are written again with that count.
+    if (failed) {
+        uint32_t first = ring->index_first[batch];
+        if (ring->index_failed_fd != req->fd || first < ring->index_valid)
+            ring->index_valid = first;
+        ring->index_failed_fd = req->fd;
+    }
+
+    disksink_retire(sink, slot);
+    if (ring->index_held[batch] != -1) {
+        disksink_rewrite_header(sink, ring->index_held[batch]);
+        ring->index_held[batch] = -1;
+    }
+
+}
+
+/// Process the available completions, short writes are queued again for the
+/// remaining bytes.
+static void disksink_reap(struct disksink *sink) {
+
+    struct disksink_ring *ring = sink->ring;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned slot = cqe->user_data;
+        struct disksink_request *req = &ring->requests[slot];
+
+        if (req->kind == DISKSINK_FALLOCATE) {
+            if (cqe->res < 0) {
+                fprintf(stderr, "warn: recording file preallocation failed (%s)\n", strerror(-cqe->res));
+                ring->prealloc = false;
+            }
+            disksink_retire(sink, slot);
+            continue;
+        } else if (req->kind == DISKSINK_ZERO_RANGE) {
+            // Not supported by every filesystem, the stale tail is then left
+            // after the end of the segment.
+            if (cqe->res < 0 && ring->zero_range) {
+                fprintf(stderr, "warn: segment tail can't be zeroed (%s)\n", strerror(-cqe->res));
+                ring->zero_range = false;
+            }
+            disksink_retire(sink, slot);
+            continue;
+        } else if (req->kind == DISKSINK_FSYNC) {
+            double latency = disksink_elapsed_ms(&req->submitted, &now);
+            if (latency > sink->sync_latency_max)
+                sink->sync_latency_max = latency;
+            sink->syncs++;
+            if (cqe->res < 0) {
+                fprintf(stderr, "warn: segment sync failed (%s)\n", strerror(-cqe->res));
+                sink->errors++;
+            }
+            disksink_retire(sink, slot);
+            continue;
+        }
+
+        // The header linked to a short or failed write of its entries is
+        // cancelled, it is written again once they are done.
+        if (req->kind == DISKSINK_WRITE_INDEX_HEADER && cqe->res == -ECANCELED) {
+            if (ring->index_busy[req->index] == 2)
+                ring->index_held[req->index] = slot;
+            else
+                disksink_rewrite_header(sink, slot);
+            continue;
+        }
+
+        double latency = disksink_elapsed_ms(&req->submitted, &now);
+        sink->latency_sum += latency;
+        if (latency > sink->latency_max)
+            sink->latency_max = latency;
+        unsigned bucket = latency * 10;
+        sink->latency_hist[bucket < DISKSINK_LATENCY_BUCKETS ? bucket : DISKSINK_LATENCY_BUCKETS - 1]++;
+        sink->writes++;
+
+        if (cqe->res < 0) {
+            // The recording is damaged but the stream goes on.
+            if (!sink->errors)
+                fprintf(stderr, "warn: recording write failed (%s)\n", strerror(-cqe->res));
+            sink->errors++;
+            if (req->kind == DISKSINK_WRITE_INDEX)
+                disksink_retire_index(sink, slot, true);
+            else
+                disksink_retire(sink, slot);
+        } else if ((uint64_t) cqe->res < req->size) {
+            sink->short_writes++;
+            req->data += cqe->res;
+            req->offset += cqe->res;
+            req->size -= cqe->res;
+            // The link was consumed, keeping it would chain the write to whatever
+            // is queued next.
+            req->flags &= ~IOSQE_IO_LINK;
+            // Counted in flight again when submitted.
+            sink->inflight--;
+            disksink_prepare(sink, slot);
+        } else if (req->kind == DISKSINK_WRITE_INDEX) {
+            disksink_retire_index(sink, slot, false);
+        } else if (req->kind == DISKSINK_WRITE_INDEX_HEADER && req->fd == ring->index_failed_fd
+                && ring->index_batches[req->index].header.count > ring->index_valid) {
+            disksink_rewrite_header(sink, slot);
+        } else {
+            disksink_retire(sink, slot);
+        }
+
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+}
+
+void disksink_submit(struct disksink *sink) {
+
+    struct disksink_ring *ring = sink->ring;
+    if (!sink->queued)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (unsigned i = 0; i < sink->queued; i++)
+        ring->requests[ring->queued[i]].submitted = now;
+
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+    unsigned count = sink->queued;
+    while (count) {
+        int ret = disksink_enter(ring->fd, count, 0, 0);
+        if (ret == -1 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) {
+            continue;
+        } else if (ret == -1) {
+            fprintf(stderr, "error: io_uring submit failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+        count -= ret;
+    }
+
+    sink->inflight += sink->queued;
+    sink->queued = 0;
+    sink->submits++;
+    sink->depth_sum += sink->inflight;
+    if (sink->inflight > sink->depth_max)
+        sink->depth_max = sink->inflight;
+
+}
+
+/// Submit the queued requests and wait for all of them, only when closing.
+static void disksink_drain(struct disksink *sink) {
+    while (sink->inflight || sink->queued) {
+        disksink_submit(sink);
+        while (disksink_enter(sink->ring->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno == EINTR)
+            ;
+        disksink_reap(sink);
+    }
+}
+
+/// Take a free request slot, the callers checked that there is one (see
+/// 'disksink_room').
+static unsigned disksink_request(struct disksink *sink, enum disksink_kind kind, int fd, unsigned index, const uint8_t *data, uint64_t size, uint64_t offset, uint8_t flags) {
+
+    struct disksink_ring *ring = sink->ring;
+    unsigned slot = ring->free[--ring->free_count];
+    struct disksink_request *req = &ring->requests[slot];
+    req->kind = kind;
+    req->index = index;
+    req->fd = fd;
+    req->flags = flags;
+    req->data = data;
+    req->size = size;
+    req->offset = offset;
+    disksink_prepare(sink, slot);
+
+    if (sink->queued >= DISKSINK_BATCH)
+        disksink_submit(sink);
+    return slot;
+
+}
+
+/// Extend the preallocation when the writes get close to its end.
+static void disksink_extend(struct disksink *sink, uint64_t end) {
+    struct disksink_ring *ring = sink->ring;
+    if (ring->prealloc && end + DISKSINK_PREALLOC / 2 > sink->allocated) {
+        disksink_request(sink, DISKSINK_FALLOCATE, sink->fd, 0, NULL, DISKSINK_PREALLOC, sink->allocated, 0);
+        sink->allocated += DISKSINK_PREALLOC;
+    }
+}
+
+/// Queue the write of the batch of index entries being filled, then of the
+/// header counting them, linked so that the count never covers entries not
+/// written yet.
+static void disksink_write_index(struct disksink *sink) {
+
+    struct disksink_ring *ring = sink->ring;
+    if (!ring->index_fill)
+        return;
+
+    // Entries after a failed batch are dropped, the index ends before it.
+    if (ring->index_failed_fd == sink->index_fd) {
+        ring->index_fill = 0;
+        return;
+    }
+
+    // Both writes are submitted together, a submit between them would break
+    // the link.
+    if (sink->queued + 2 > DISKSINK_BATCH)
+        disksink_submit(sink);
+
+    struct disksink_index_batch *batch = &ring->index_batches[ring->index_batch];
+    uint64_t first = sink->index_count - ring->index_fill;
+    batch->header = ring->index_empty;
+    batch->header.count = sink->index_count;
+
+    ring->index_first[ring->index_batch] = first;
+    ring->index_busy[ring->index_batch] = 2;
+    disksink_request(sink, DISKSINK_WRITE_INDEX, sink->index_fd, ring->index_batch, (const uint8_t *) batch->entries,
+        ring->index_fill * sizeof(struct recindex_entry), sizeof(struct recindex_header) + first * sizeof(struct recindex_entry), IOSQE_IO_LINK);
+    disksink_request(sink, DISKSINK_WRITE_INDEX_HEADER, sink->index_fd, ring->index_batch, (const uint8_t *) &batch->header,
+        sizeof(struct recindex_header), 0, 0);
+    sink->index_batches++;
+
+    ring->index_batch ^= 1;
+    ring->index_fill = 0;
+
+}
+
+/// Start the index of the file being written, its previous entries are
+/// discarded by writing a header without entries.
+static void disksink_start_index(struct disksink *sink) {
+    if (sink->ring->index_failed_fd == sink->index_fd)
+        sink->ring->index_failed_fd = -1;
+    sink->index_count = 0;
+    sink->index_key = RECINDEX_NO_KEY;
+    disksink_request(sink, DISKSINK_WRITE_HEADER, sink->index_fd, 0, (const uint8_t *) &sink->ring->index_empty,
+        sizeof(struct recindex_header), 0, 0);
+}
+
+/// Add the entry of a frame written at the current offset to the index.
+static void disksink_index(struct disksink *sink, size_t size, const struct timeval *timestamp, bool keyframe) {
+
+    struct disksink_ring *ring = sink->ring;
+    if (keyframe)
+        sink->index_key = sink->index_count;
+
+    struct recindex_entry *entry = &ring->index_batches[ring->index_batch].entries[ring->index_fill++];
+    entry->offset = sink->offset;
+    entry->timestamp_us = (uint64_t) timestamp->tv_sec * 1000000 + timestamp->tv_usec;
+    entry->size = size;
+    entry->flags = keyframe ? RECINDEX_FLAG_KEYFRAME : 0;
+    entry->key = sink->index_key;
+    entry->reserved = 0;
+    sink->index_count++;
+
+    if (ring->index_fill == DISKSINK_INDEX_BATCH)
+        disksink_write_index(sink);
+
+}
+
+/// Queue the write of the current chunk and move to the next one, which the
+/// callers checked is free.
+static void disksink_write_chunk(struct disksink *sink, size_t size) {
+
+    struct disksink_ring *ring = sink->ring;
+    ring->chunk_busy[ring->chunk] = true;
+    disksink_request(sink, DISKSINK_WRITE_CHUNK, sink->fd, ring->chunk, ring->chunks + (size_t) ring->chunk * DISKSINK_CHUNK_SIZE, size, ring->chunk_offset, 0);
+    ring->chunk_offset += size;
+    ring->chunk = (ring->chunk + 1) % DISKSINK_CHUNKS;
+    ring->chunk_fill = 0;
+
+}
+
+/// Queue the write of the partial chunk, padded with zeros to the alignment
+/// with O_DIRECT.
+static void disksink_flush(struct disksink *sink) {
+    struct disksink_ring *ring = sink->ring;
+    if (ring->chunk_fill) {
+        size_t size = sink->direct ? (ring->chunk_fill + DISKSINK_ALIGN - 1) & ~(size_t) (DISKSINK_ALIGN - 1) : ring->chunk_fill;
+        memset(ring->chunks + (size_t) ring->chunk * DISKSINK_CHUNK_SIZE + ring->chunk_fill, 0, size - ring->chunk_fill);
+        disksink_write_chunk(sink, size);
+    }
+}
+
+/// Close the current segment: its stale tail is zeroed and it is synced. The
+/// sync drains the queue, the writes queued after it only start once the whole
+/// segment is on the storage.
+static void disksink_end_segment(struct disksink *sink) {
+
+    struct disksink_ring *ring = sink->ring;
+    disksink_flush(sink);
+    disksink_write_index(sink);
+
+    uint64_t end = ring->chunk_offset;
+    uint64_t *size = &ring->segment_sizes[sink->segment];
+    if (end < *size && ring->zero_range)
+        disksink_request(sink, DISKSINK_ZERO_RANGE, sink->fd, 0, NULL, *size - end, end, 0);
+    else if (end > *size)
+        *size = end;
+
+    disksink_request(sink, DISKSINK_FSYNC, sink->fd, 0, NULL, 0, 0, IOSQE_IO_DRAIN);
+    disksink_request(sink, DISKSINK_FSYNC, sink->index_fd, 0, NULL, 0, 0, 0);
+    sink->segments_closed++;
+
+}
+
+static void disksink_next_segment(struct disksink *sink) {
+    struct disksink_ring *ring = sink->ring;
+    disksink_end_segment(sink);
+    sink->segment = (sink->segment + 1) % sink->segments;
+    sink->fd = ring->segment_fds[sink->segment];
+    sink->index_fd = ring->segment_index_fds[sink->segment];
+    sink->offset = 0;
+    ring->chunk_offset = 0;
+    disksink_start_index(sink);
+}
+
+/// Check that a frame can be queued without waiting for a completion: there
+/// are free requests for all its writes, and the chunks and index batch it
+/// moves to are free, or its buffer can be held.
+static bool disksink_room(const struct disksink *sink, size_t size, bool cut) {
+
+    const struct disksink_ring *ring = sink->ring;
+
+    // A buffer held by its write is not returned to the encoder.
+    if (!sink->copy && sink->held >= sink->max_held)
+        return false;
+
+    // Chunks written, the partial one of a segment being closed first.
+    unsigned chunks = 0;
+    if (sink->copy) {
+        size_t fill = cut ? 0 : ring->chunk_fill;
+        chunks = (cut && ring->chunk_fill ? 1 : 0) + (fill + size) / DISKSINK_CHUNK_SIZE;
+    }
+    if (chunks >= DISKSINK_CHUNKS)
+        return false;
+    for (unsigned i = 1; i <= chunks; i++)
+        if (ring->chunk_busy[(ring->chunk + i) % DISKSINK_CHUNKS])
+            return false;
+
+    // The frame or its chunks, the preallocation, and an index batch with its
+    // header. Closing a segment also writes its index, zeroes its tail, syncs
+    // both files and starts the next index.
+    unsigned slots = (sink->copy ? chunks : 1) + 1 + 2 + (cut ? 6 : 0);
+    if (ring->free_count < slots)
+        return false;
+
+    // Writing the index moves to the other batch.
+    bool flip = cut ? ring->index_fill != 0 : ring->index_fill + 1 == DISKSINK_INDEX_BATCH;
+    return !flip || !ring->index_busy[ring->index_batch ^ 1];
+
+}
+
+bool disksink_write(struct disksink *sink, unsigned index, const void *data, size_t size, const struct timeval *timestamp, bool keyframe) {
+
+    struct disksink_ring *ring = sink->ring;
+
+    bool full = false, cut = false, start = false;
+    if (sink->segments) {
+        double elapsed = (timestamp->tv_sec - sink->segment_start.tv_sec) * 1e3 + (timestamp->tv_usec - sink->segment_start.tv_usec) / 1e3;
+        full = sink->offset && sink->offset + size > sink->segment_capacity;
+        start = full || (keyframe && (!sink->segment_started || elapsed >= sink->segment_ms));
+        cut = full || (start && sink->segment_started);
+    }
+
+    // Waiting for a completion would stall the capture, a frame that can't be
+    // queued right away is dropped, and the following ones up to the next key
+    // frame, which they depend on.
+    if ((sink->overrun && !keyframe) || !disksink_room(sink, size, cut)) {
+        sink->overrun = true;
+        sink->overruns++;
+        return true;
+    }
+    sink->overrun = false;
+
+    if (full)
+        sink->segments_full++;
+    if (cut)
+        disksink_next_segment(sink);
+    if (start) {
+        sink->segment_start = *timestamp;
+        sink->segment_started = true;
+    }
+
+    sink->frames++;
+    sink->bytes += size;
+    disksink_extend(sink, sink->offset + size);
+    disksink_index(sink, size, timestamp, keyframe);
+
+    if (!sink->copy) {
+        if (sink->outstanding[index]++ == 0)
+            sink->held++;
+        disksink_request(sink, DISKSINK_WRITE_BUFFER, sink->fd, index, data, size, sink->offset, 0);
+        sink->offset += size;
+        return false;
+    }
+
+    // Direct writes need aligned memory, offsets and sizes, frames are copied
+    // into the chunks and the buffer is released right away.
+    const uint8_t *ptr = data;
+    while (size) {
+        size_t len = DISKSINK_CHUNK_SIZE - ring->chunk_fill;
+        if (len > size)
+            len = size;
+        memcpy(ring->chunks + (size_t) ring->chunk * DISKSINK_CHUNK_SIZE + ring->chunk_fill, ptr, len);
+        ring->chunk_fill += len;
+        sink->offset += len;
+        ptr += len;
+        size -= len;
+        if (ring->chunk_fill == DISKSINK_CHUNK_SIZE)
+            disksink_write_chunk(sink, DISKSINK_CHUNK_SIZE);
+    }
+
+    return true;
+
+}
+
+unsigned disksink_complete(struct disksink *sink, unsigned *indices) {
+
+    struct disksink_ring *ring = sink->ring;
+
+    // The counter is cleared before reaping so that no completion is missed.
+    eventfd_t value;
+    eventfd_read(sink->event_fd, &value);
+    disksink_reap(sink);
+    disksink_submit(sink);
+
+    unsigned count = ring->released_count;
+    memcpy(indices, ring->released, count * sizeof(unsigned));
+    ring->released_count = 0;
+    return count;
+
+}
+
+void disksink_close(struct disksink *sink) {
+
+    struct disksink_ring *ring = sink->ring;
+
+    // The last partial chunk is written padded, then truncated. Segments keep
+    // their size, the padding is in their zeroed tail. The queue is drained
+    // first so that these writes find free requests and chunks.
+    disksink_drain(sink);
+    if (sink->segments) {
+        disksink_end_segment(sink);
+    } else {
+        disksink_flush(sink);
+        disksink_write_index(sink);
+    }
+    disksink_drain(sink);
+
+    if (sink->segments) {
+        for (unsigned i = 0; i < sink->segments; i++) {
+            close(ring->segment_fds[i]);
+            close(ring->segment_index_fds[i]);
+        }
+    } else {
+        if (ftruncate(sink->fd, sink->offset) == -1)
+            fprintf(stderr, "warn: failed to truncate recording file (%s)\n", strerror(errno));
+        close(sink->fd);
+        close(sink->index_fd);
+    }
+
+    close(sink->event_fd);
+    close(ring->fd);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_size)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    free(ring->chunks);
+    free(ring);
+
+    sink->fd = -1;
+    sink->index_fd = -1;
+    sink->event_fd = -1;
+    sink->ring = NULL;
+
+}
+
+double disksink_latency_percentile(const struct disksink *sink, double percentile) {
+    unsigned long target = sink->writes * percentile / 100.0;
+    unsigned long count = 0;
+    for (unsigned i = 0; i < DISKSINK_LATENCY_BUCKETS; i++) {
+        count += sink->latency_hist[i];
+        if (count > target)
+            return (i + 1) / 10.0;
+    }
+    return DISKSINK_LATENCY_BUCKETS / 10.0;
+}
+
+void disksink_report(const struct disksink *sink) {
+    printf("info: disk sink %lu frames, %lu bytes, %lu writes (%lu short, %lu errors), %lu submits, %lu overruns%s\n",
+        sink->frames, sink->bytes, sink->writes, sink->short_writes, sink->errors, sink->submits, sink->overruns,
+        sink->direct ? ", direct" : "");
+    if (sink->writes)
+        printf("info: disk sink queue depth avg %.2f, max %u, write latency avg %.2f ms, p99 %.1f ms, max %.2f ms\n",
+            sink->submits ? (double) sink->depth_sum / sink->submits : 0, sink->depth_max,
+            sink->latency_sum / sink->writes, disksink_latency_percentile(sink, 99), sink->latency_max);
+    printf("info: disk sink index %u entries in the last file, %lu batches\n", sink->index_count, sink->index_batches);
+    if (sink->segments)
+        printf("info: disk sink %lu segments closed (%lu full), %lu syncs, sync latency max %.2f ms\n",
+            sink->segments_closed, sink->segments_full, sink->syncs, sink->sync_latency_max);
+}
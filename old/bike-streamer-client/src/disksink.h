@@ -0,0 +1,146 @@
+/// Recording sink writing encoded frames to a file through io_uring, so that
+/// storage stalls never block the loop dequeuing from the devices. Writes are
+/// queued and submitted in batches; their completions are signaled on an
+/// eventfd that is polled like the devices.
+///
+/// Buffered writes read straight from the mapped encoder capture buffers, which
+/// are only released once their write completed. With O_DIRECT, frames are
+/// copied into aligned chunks written whole, and the buffers are released
+/// immediately. The file is preallocated ahead of the writes with fallocate.
+///
+/// Segmented recordings go to a ring of preallocated files, cut on the first key
+/// frame after the segment duration. Files are overwritten in place from the
+/// start, which keeps writes sequential on blocks already allocated, and the
+/// stale tail of a reused file is zeroed, Annex-B streams may end with zero bytes.
+/// A segment is synced on close and the next one is only written after that, so
+/// a crash loses at most one segment. Frames are always copied into the chunks
+/// so that the encoder buffers are never held during the sync.
+///
+/// Each file gets a frame index next to it (see 'recindex.h'). Its entries are
+/// collected in batches written through the same ring, each followed by the
+/// header counting them, and the index of a segment is synced with it.
+
+#pragma once
+
+#include "v4l2.h"
+#include "recindex.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+
+/// Number of entries of the submission queue, the maximum number of writes in flight.
+#define DISKSINK_QUEUE_DEPTH 64
+/// Writes queued before being submitted without waiting for the end of the wakeup.
+#define DISKSINK_BATCH 8
+/// Size and number of the aligned chunks used with O_DIRECT.
+#define DISKSINK_CHUNK_SIZE (1 << 20)
+#define DISKSINK_CHUNKS 8
+#define DISKSINK_ALIGN 4096
+/// The file is preallocated by this size ahead of the writes.
+#define DISKSINK_PREALLOC (64 << 20)
+/// Entries of the index written together.
+#define DISKSINK_INDEX_BATCH 128
+/// Maximum number of segment files of the ring.
+#define DISKSINK_MAX_SEGMENTS 256
+/// Write latencies are counted in buckets of 0.1 ms, up to one second.
+#define DISKSINK_LATENCY_BUCKETS 10000
+
+/// Ring mappings and requests in flight, see 'disksink.c'.
+struct disksink_ring;
+
+struct disksink {
+    int fd;
+    /// Index of the file being written.
+    int index_fd;
+    /// Signaled by the kernel for each completion.
+    int event_fd;
+    bool direct;
+    /// Frames are copied into aligned chunks, with O_DIRECT or segments.
+    bool copy;
+    /// Number of segment files, zero for a single file.
+    unsigned segments;
+    unsigned segment_ms;
+    uint64_t segment_capacity;
+    /// Segment being written and the capture time of its first frame.
+    unsigned segment;
+    bool segment_started;
+    struct timeval segment_start;
+    struct disksink_ring *ring;
+    /// Offset of the next write, and end of the preallocated space.
+    uint64_t offset;
+    uint64_t allocated;
+    /// Writes submitted and not completed, writes queued but not submitted.
+    unsigned inflight;
+    unsigned queued;
+    /// Number of writes in flight reading from each encoder buffer, the buffers
+    /// read and how many can be, leaving the others to the encoder.
+    unsigned outstanding[VIDEO_MAX_FRAME];
+    unsigned held;
+    unsigned max_held;
+    /// Entries in the index of the file being written, and entry of its last
+    /// key frame.
+    uint32_t index_count;
+    uint32_t index_key;
+    unsigned long index_batches;
+    unsigned long frames;
+    unsigned long bytes;
+    unsigned long writes;
+    unsigned long submits;
+    unsigned long short_writes;
+    unsigned long errors;
+    unsigned long segments_closed;
+    /// Segments cut before a key frame because they reached their capacity.
+    unsigned long segments_full;
+    unsigned long syncs;
+    double sync_latency_max;
+    /// Frames dropped because a queue entry, chunk or index batch was still
+    /// busy, the storage not keeping up, and whether the next frames are dropped
+    /// up to a key frame.
+    unsigned long overruns;
+    bool overrun;
+    /// Queue depth sampled on each submit.
+    unsigned long depth_sum;
+    unsigned depth_max;
+    /// Time from the submission of a write to its completion.
+    double latency_sum;
+    double latency_max;
+    unsigned latency_hist[DISKSINK_LATENCY_BUCKETS];
+};
+
+
+/// Create the file, its index and the io_uring instance, errors are fatal.
+/// Buffered writes hold at most half of the given encoder capture buffers.
+void disksink_open(struct disksink *sink, const char *path, bool direct, unsigned buffers);
+
+/// Open or create the ring of segment files 'prefix-NNN.h264' and their index
+/// 'prefix-NNN.h264.idx', each data file preallocated
+/// with the given capacity. Recording resumes at the oldest file, errors are fatal.
+/// A segment reaching its capacity is cut early, so the footprint stays bounded.
+void disksink_open_segments(struct disksink *sink, const char *prefix, unsigned count, unsigned seconds, unsigned capacity_mb, bool direct);
+
+/// Write the last index entries and wait for all the writes, then close the file
+/// with its exact size, or close the last segment.
+void disksink_close(struct disksink *sink);
+
+/// Queue the write of an encoded frame, return true if the buffer can be
+/// released now, otherwise it is returned by 'disksink_complete'. Key frames
+/// and capture timestamps are used to cut segments. The sink never waits for
+/// the storage: when the queue or the chunks are full the frame is dropped, and
+/// the next ones up to a key frame.
+bool disksink_write(struct disksink *sink, unsigned index, const void *data, size_t size, const struct timeval *timestamp, bool keyframe);
+
+/// Submit the queued writes, to be called at the end of each wakeup.
+void disksink_submit(struct disksink *sink);
+
+/// Process the completed writes, the indices of the buffers that are no longer
+/// read are stored in 'indices', return their number.
+unsigned disksink_complete(struct disksink *sink, unsigned *indices);
+
+/// Get the write latency percentile, in milliseconds.
+double disksink_latency_percentile(const struct disksink *sink, double percentile);
+
+/// Print the statistics of the sink.
+void disksink_report(const struct disksink *sink);
@@ -0,0 +1,286 @@
+#include "fec.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FEC_NEON
+#endif
+
+
+/// Field polynomial x^8 + x^4 + x^3 + x^2 + 1, with generator 2.
+#define FEC_POLY 0x11D
+
+static uint8_t fec_exp[512];
+static uint8_t fec_log[256];
+/// Full product table, used by the scalar kernel.
+static uint8_t fec_table[256][256];
+/// Products by the low and high nibbles, used by the shuffle kernels.
+static uint8_t fec_nib_lo[256][16] __attribute__((aligned(16)));
+static uint8_t fec_nib_hi[256][16] __attribute__((aligned(16)));
+
+static pthread_once_t fec_once = PTHREAD_ONCE_INIT;
+static fec_kernel_fn fec_selected;
+static const char *fec_selected_name;
+
+
+uint8_t fec_mul(uint8_t a, uint8_t b) {
+    if (!a || !b)
+        return 0;
+    return fec_exp[fec_log[a] + fec_log[b]];
+}
+
+uint8_t fec_inv(uint8_t a) {
+    return fec_exp[255 - fec_log[a]];
+}
+
+uint8_t fec_coef(enum fec_scheme scheme, unsigned parity, unsigned data) {
+    if (scheme == FEC_XOR)
+        return 1;
+    // Cauchy matrix 1 / (x_j + y_i), with x_j = 64 + j and y_i = i disjoint since
+    // blocks have at most 64 data shards.
+    return fec_inv((FEC_MAX_DATA + parity) ^ data);
+}
+
+///
+/// KERNELS
+///
+
+static void fec_xor_scalar(uint8_t *dst, const uint8_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+static void fec_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 1) {
+        fec_xor_scalar(dst, src, len);
+        return;
+    }
+    const uint8_t *row = fec_table[c];
+    for (size_t i = 0; i < len; i++)
+        dst[i] ^= row[src[i]];
+}
+
+#ifdef FEC_X86
+
+__attribute__((target("ssse3")))
+static void fec_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+
+    size_t i = 0;
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i lo = _mm_load_si128((const __m128i *) fec_nib_lo[c]);
+    const __m128i hi = _mm_load_si128((const __m128i *) fec_nib_hi[c]);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *) (dst + i));
+        __m128i p = _mm_xor_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(d, p));
+    }
+
+    fec_mul_add_scalar(dst + i, src + i, c, len - i);
+
+}
+
+__attribute__((target("avx2")))
+static void fec_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+
+    size_t i = 0;
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) fec_nib_lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) fec_nib_hi[c]));
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *) (dst + i));
+        __m256i p = _mm256_xor_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(d, p));
+    }
+
+    // The tail is scalar, legacy SSE code after 256-bit instructions would stall
+    // on the transition of the upper register halves.
+    fec_mul_add_scalar(dst + i, src + i, c, len - i);
+
+}
+
+#endif
+
+#ifdef FEC_NEON
+
+/// Table lookup of 16 bytes, AArch32 only has the 8 bytes variant.
+static inline uint8x16_t fec_neon_lookup(uint8x16_t table, uint8x16_t index) {
+#ifdef __aarch64__
+    return vqtbl1q_u8(table, index);
+#else
+    uint8x8x2_t halves = { { vget_low_u8(table), vget_high_u8(table) } };
+    return vcombine_u8(vtbl2_u8(halves, vget_low_u8(index)), vtbl2_u8(halves, vget_high_u8(index)));
+#endif
+}
+
+static void fec_mul_add_neon(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+
+    size_t i = 0;
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    const uint8x16_t lo = vld1q_u8(fec_nib_lo[c]);
+    const uint8x16_t hi = vld1q_u8(fec_nib_hi[c]);
+
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t s = vld1q_u8(src + i);
+        uint8x16_t d = vld1q_u8(dst + i);
+        uint8x16_t p = veorq_u8(fec_neon_lookup(lo, vandq_u8(s, mask)), fec_neon_lookup(hi, vshrq_n_u8(s, 4)));
+        vst1q_u8(dst + i, veorq_u8(d, p));
+    }
+
+    fec_mul_add_scalar(dst + i, src + i, c, len - i);
+
+}
+
+#endif
+
+static struct fec_kernel fec_available[4];
+static unsigned fec_available_count;
+
+static void fec_init_once(void) {
+
+    unsigned x = 1;
+    for (unsigned i = 0; i < 255; i++) {
+        fec_exp[i] = x;
+        fec_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= FEC_POLY;
+    }
+    for (unsigned i = 255; i < 512; i++)
+        fec_exp[i] = fec_exp[i - 255];
+
+    for (unsigned c = 0; c < 256; c++) {
+        for (unsigned v = 0; v < 256; v++)
+            fec_table[c][v] = fec_mul(c, v);
+        for (unsigned v = 0; v < 16; v++) {
+            fec_nib_lo[c][v] = fec_mul(c, v);
+            fec_nib_hi[c][v] = fec_mul(c, v << 4);
+        }
+    }
+
+    fec_available[fec_available_count++] = (struct fec_kernel) { "scalar", fec_mul_add_scalar };
+#ifdef FEC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        fec_available[fec_available_count++] = (struct fec_kernel) { "ssse3", fec_mul_add_ssse3 };
+    if (__builtin_cpu_supports("avx2"))
+        fec_available[fec_available_count++] = (struct fec_kernel) { "avx2", fec_mul_add_avx2 };
+#endif
+#ifdef FEC_NEON
+    fec_available[fec_available_count++] = (struct fec_kernel) { "neon", fec_mul_add_neon };
+#endif
+
+    fec_selected = fec_available[fec_available_count - 1].fn;
+    fec_selected_name = fec_available[fec_available_count - 1].name;
+
+}
+
+void fec_init(void) {
+    pthread_once(&fec_once, fec_init_once);
+}
+
+const struct fec_kernel *fec_kernels(unsigned *count) {
+    fec_init();
+    *count = fec_available_count;
+    return fec_available;
+}
+
+const char *fec_kernel_name(void) {
+    fec_init();
+    return fec_selected_name;
+}
+
+bool fec_select_kernel(const char *name) {
+    fec_init();
+    for (unsigned i = 0; i < fec_available_count; i++) {
+        if (strcmp(fec_available[i].name, name) == 0) {
+            fec_selected = fec_available[i].fn;
+            fec_selected_name = fec_available[i].name;
+            return true;
+        }
+    }
+    return false;
+}
+
+enum fec_scheme fec_parse_scheme(const char *name) {
+    if (strcmp(name, "xor") == 0)
+        return FEC_XOR;
+    if (strcmp(name, "rs") == 0)
+        return FEC_RS;
+    return FEC_NONE;
+}
+
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c)
+        fec_selected(dst, src, c, len);
+}
+
+bool fec_invert(uint8_t *matrix, unsigned n) {
+
+    // Gauss-Jordan elimination against the identity, in GF(2^8) additions and
+    // subtractions are both XOR.
+    uint8_t inverse[FEC_MAX_PARITY * FEC_MAX_PARITY] = {0};
+    for (unsigned i = 0; i < n; i++)
+        inverse[i * n + i] = 1;
+
+    for (unsigned col = 0; col < n; col++) {
+
+        unsigned pivot = col;
+        while (pivot < n && !matrix[pivot * n + col])
+            pivot++;
+        if (pivot == n)
+            return false;
+
+        if (pivot != col) {
+            for (unsigned i = 0; i < n; i++) {
+                uint8_t tmp = matrix[col * n + i];
+                matrix[col * n + i] = matrix[pivot * n + i];
+                matrix[pivot * n + i] = tmp;
+                tmp = inverse[col * n + i];
+                inverse[col * n + i] = inverse[pivot * n + i];
+                inverse[pivot * n + i] = tmp;
+            }
+        }
+
+        uint8_t scale = fec_inv(matrix[col * n + col]);
+        for (unsigned i = 0; i < n; i++) {
+            matrix[col * n + i] = fec_mul(matrix[col * n + i], scale);
+            inverse[col * n + i] = fec_mul(inverse[col * n + i], scale);
+        }
+
+        for (unsigned row = 0; row < n; row++) {
+            uint8_t factor = matrix[row * n + col];
+            if (row == col || !factor)
+                continue;
+            for (unsigned i = 0; i < n; i++) {
+                matrix[row * n + i] ^= fec_mul(factor, matrix[col * n + i]);
+                inverse[row * n + i] ^= fec_mul(factor, inverse[col * n + i]);
+            }
+        }
+
+    }
+
+    memcpy(matrix, inverse, n * n);
+    return true;
+
+}
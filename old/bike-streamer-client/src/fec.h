@@ -0,0 +1,78 @@
+/// Forward error correction of the UDP link. Packets of a frame are grouped in
+/// blocks of k data shards protected by m parity shards, either a single XOR
+/// parity or a systematic Reed-Solomon code over GF(2^8) built from a Cauchy
+/// matrix, so that any k of the k+m shards rebuild the block.
+///
+/// A data shard is the packet flags, the payload length on two bytes and the
+/// payload, zero padded to the shard size of the block.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Maximum data and parity shards of a block.
+#define FEC_MAX_DATA 64
+#define FEC_MAX_PARITY 32
+/// Maximum size of a shard.
+#define FEC_MAX_SHARD 4096
+/// Size of the flags and length prefixing the payload in data shards.
+#define FEC_SHARD_PREFIX 3
+
+enum fec_scheme {
+    FEC_NONE = 0,
+    FEC_XOR,
+    FEC_RS,
+};
+
+/// Header prefixing the parity shard in the payload of parity packets, fields are
+/// in network byte order.
+struct fec_header {
+    uint8_t scheme;
+    /// Number of data and parity shards of the block.
+    uint8_t k;
+    uint8_t m;
+    /// Index of this parity shard in the block.
+    uint8_t index;
+    /// Fragment index of the first data packet of the block.
+    uint16_t block_start;
+    uint16_t shard_size;
+} __attribute__((packed));
+
+/// Multiply-accumulate kernel: dst ^= c * src.
+typedef void (*fec_kernel_fn)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+struct fec_kernel {
+    const char *name;
+    fec_kernel_fn fn;
+};
+
+
+/// Initialize the tables and select the fastest kernel, can be called many times.
+void fec_init(void);
+
+/// Get the kernels available on this CPU, the fastest last.
+const struct fec_kernel *fec_kernels(unsigned *count);
+
+/// Get the name of the selected kernel, or select one by name, return false if
+/// it is not available.
+const char *fec_kernel_name(void);
+bool fec_select_kernel(const char *name);
+
+/// Parse a scheme name ("xor", "rs"), return FEC_NONE if unknown.
+enum fec_scheme fec_parse_scheme(const char *name);
+
+/// Multiplication and inverse in GF(2^8).
+uint8_t fec_mul(uint8_t a, uint8_t b);
+uint8_t fec_inv(uint8_t a);
+
+/// Coefficient of a data shard in a parity shard.
+uint8_t fec_coef(enum fec_scheme scheme, unsigned parity, unsigned data);
+
+/// Accumulate the product of a buffer by a coefficient: dst ^= c * src.
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+/// Invert a square matrix in place, stored by rows, return false if singular.
+bool fec_invert(uint8_t *matrix, unsigned n);
@@ -0,0 +1,239 @@
+#include "latency.h"
+#include "v4l2.h"
+
+#include <signal.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+
+/// Slots probed for a frame, from the one given by the hash of its timestamp.
+#define LATENCY_PROBES 4
+
+static const char *latency_stage_names[LATENCY_POINTS] = {
+    [LATENCY_SENSOR] = "sensor",
+    [LATENCY_ISP_QUEUE] = "isp-queue",
+    [LATENCY_ISP_DEQUEUE] = "isp",
+    [LATENCY_ENCODER_QUEUE] = "enc-queue",
+    [LATENCY_ENCODER_DEQUEUE] = "encoder",
+    [LATENCY_SINK] = "sink",
+};
+
+/// Set by the SIGUSR1 handler.
+static volatile sig_atomic_t latency_requested;
+
+
+static unsigned long long latency_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static unsigned long long latency_timeval_us(const struct timeval *tv) {
+    return (unsigned long long) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/// Values of each histogram and counter are only written by one thread, plain
+/// loads and stores are enough and cheaper than atomic additions.
+static inline void latency_add(_Atomic unsigned long *value, unsigned long n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void latency_add_ull(_Atomic unsigned long long *value, unsigned long long n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static unsigned latency_bucket(unsigned long long us) {
+
+    if (us >= 1ull << LATENCY_MAX_BITS)
+        us = (1ull << LATENCY_MAX_BITS) - 1;
+    if (us < 2u << LATENCY_SUB_BITS)
+        return us;
+
+    // The bucket keeps the LATENCY_SUB_BITS bits following the highest one.
+    unsigned shift = 63 - __builtin_clzll(us) - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) | ((us >> shift) & ((1u << LATENCY_SUB_BITS) - 1));
+
+}
+
+/// Highest value counted in a bucket.
+static unsigned long long latency_bucket_max(unsigned bucket) {
+    if (bucket < 2u << LATENCY_SUB_BITS)
+        return bucket;
+    unsigned shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    unsigned long long low = (unsigned long long) ((1u << LATENCY_SUB_BITS) | (bucket & ((1u << LATENCY_SUB_BITS) - 1))) << shift;
+    return low + (1ull << shift) - 1;
+}
+
+static void latency_record(struct latency_histogram *hist, unsigned long long us) {
+    latency_add(&hist->counts[latency_bucket(us)], 1);
+    latency_add(&hist->count, 1);
+    latency_add_ull(&hist->sum_us, us);
+    if (us > atomic_load_explicit(&hist->max_us, memory_order_relaxed))
+        atomic_store_explicit(&hist->max_us, us, memory_order_relaxed);
+}
+
+static unsigned latency_hash(unsigned long long key) {
+    return (key * 0x9E3779B97F4A7C15ull) >> 56 & (LATENCY_FRAMES - 1);
+}
+
+static struct latency_frame *latency_find(struct latency *lat, unsigned long long key) {
+    unsigned slot = latency_hash(key);
+    for (unsigned i = 0; i < LATENCY_PROBES; i++) {
+        struct latency_frame *frame = &lat->frames[(slot + i) & (LATENCY_FRAMES - 1)];
+        if (atomic_load_explicit(&frame->key_us, memory_order_acquire) == key)
+            return frame;
+    }
+    return NULL;
+}
+
+void latency_init(struct latency *lat) {
+    memset(lat, 0, sizeof(struct latency));
+}
+
+void latency_capture(struct latency *lat, const struct timeval *timestamp, unsigned flags) {
+
+    unsigned long long now = latency_now_us();
+    unsigned long long key = latency_timeval_us(timestamp);
+    unsigned long long origin = key;
+
+    // Without a monotonic timestamp, the time spent before the dequeue is unknown.
+    if ((flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC || key > now) {
+        if (!atomic_exchange(&lat->foreign_clock, true))
+            printf("warn: sensor timestamps are not monotonic, latency starts at dequeue\n");
+        origin = now;
+    }
+
+    if (!key) {
+        latency_add(&lat->untracked[LATENCY_SENSOR], 1);
+        return;
+    }
+
+    // The oldest frame of the probed slots is replaced, unless the same
+    // timestamp is already tracked.
+    unsigned slot = latency_hash(key);
+    struct latency_frame *frame = NULL;
+    for (unsigned i = 0; i < LATENCY_PROBES; i++) {
+        struct latency_frame *probe = &lat->frames[(slot + i) & (LATENCY_FRAMES - 1)];
+        unsigned long long probe_key = atomic_load_explicit(&probe->key_us, memory_order_relaxed);
+        if (probe_key == key || probe_key == 0) {
+            frame = probe;
+            break;
+        }
+        if (!frame || atomic_load_explicit(&probe->origin_us, memory_order_relaxed) < atomic_load_explicit(&frame->origin_us, memory_order_relaxed))
+            frame = probe;
+    }
+
+    // The key is published last so that other points never see the marks of
+    // the replaced frame.
+    atomic_store_explicit(&frame->key_us, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (unsigned i = 0; i < LATENCY_POINTS; i++)
+        atomic_store_explicit(&frame->marks[i], 0, memory_order_relaxed);
+    atomic_store_explicit(&frame->origin_us, origin, memory_order_relaxed);
+    atomic_store_explicit(&frame->marks[LATENCY_SENSOR], now, memory_order_relaxed);
+    atomic_store_explicit(&frame->key_us, key, memory_order_release);
+
+    latency_record(&lat->stages[LATENCY_SENSOR], now - origin);
+
+}
+
+void latency_mark(struct latency *lat, enum latency_point point, const struct timeval *timestamp) {
+
+    unsigned long long now = latency_now_us();
+    struct latency_frame *frame = latency_find(lat, latency_timeval_us(timestamp));
+    if (!frame) {
+        latency_add(&lat->untracked[point], 1);
+        return;
+    }
+
+    // Dropped frames skip points, the stage then starts at the last one reached.
+    unsigned long long origin = atomic_load_explicit(&frame->origin_us, memory_order_relaxed);
+    unsigned long long previous = origin;
+    for (int i = point - 1; i >= 0; i--) {
+        unsigned long long mark = atomic_load_explicit(&frame->marks[i], memory_order_relaxed);
+        if (mark) {
+            previous = mark;
+            break;
+        }
+    }
+
+    atomic_store_explicit(&frame->marks[point], now, memory_order_relaxed);
+    latency_record(&lat->stages[point], now > previous ? now - previous : 0);
+    if (point == LATENCY_SINK)
+        latency_record(&lat->total, now > origin ? now - origin : 0);
+
+}
+
+static void latency_report_histogram(const char *name, const struct latency_histogram *hist) {
+
+    // Counts are copied first, they keep growing while reporting on signal.
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    unsigned long counts[LATENCY_BUCKETS];
+    unsigned long count = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        count += counts[i];
+    }
+
+    if (!count) {
+        printf("info: latency %-9s %8u\n", name, 0);
+        return;
+    }
+
+    double avg = (double) atomic_load_explicit(&hist->sum_us, memory_order_relaxed) / atomic_load_explicit(&hist->count, memory_order_relaxed);
+    printf("info: latency %-9s %8lu %8.2f", name, count, avg / 1e3);
+
+    // Buckets are reported by their highest value, bounded by the maximum.
+    unsigned long long max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+    unsigned bucket = 0;
+    unsigned long seen = counts[0];
+    for (unsigned i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        unsigned long rank = (unsigned long) (quantiles[i] * count + 0.5);
+        if (rank < 1)
+            rank = 1;
+        while (seen < rank)
+            seen += counts[++bucket];
+        unsigned long long value = latency_bucket_max(bucket);
+        printf(" %8.2f", (value < max ? value : max) / 1e3);
+    }
+
+    printf(" %8.2f\n", max / 1e3);
+
+}
+
+void latency_report(const struct latency *lat) {
+
+    printf("info: latency %-9s %8s %8s %8s %8s %8s %8s %8s\n", "(ms)", "frames", "avg", "p50", "p90", "p99", "p99.9", "max");
+    for (unsigned i = 0; i < LATENCY_POINTS; i++)
+        latency_report_histogram(latency_stage_names[i], &lat->stages[i]);
+    latency_report_histogram("total", &lat->total);
+
+    unsigned long untracked = 0;
+    for (unsigned i = 0; i < LATENCY_POINTS; i++)
+        untracked += atomic_load_explicit(&lat->untracked[i], memory_order_relaxed);
+    if (untracked) {
+        printf("info: latency untracked");
+        for (unsigned i = 0; i < LATENCY_POINTS; i++)
+            printf(" %s=%lu", latency_stage_names[i], atomic_load_explicit(&lat->untracked[i], memory_order_relaxed));
+        printf("\n");
+    }
+
+}
+
+static void latency_signal(int sig) {
+    (void) sig;
+    latency_requested = 1;
+}
+
+void latency_catch_signal(void) {
+    signal(SIGUSR1, latency_signal);
+}
+
+void latency_poll(const struct latency *lat) {
+    if (latency_requested) {
+        latency_requested = 0;
+        latency_report(lat);
+        fflush(stdout);
+    }
+}
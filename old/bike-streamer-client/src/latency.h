@@ -0,0 +1,90 @@
+/// Glass-to-wire latency of the frames, traced at each point of the chain: the
+/// sensor dequeue, the queue and dequeue of the ISP and of the encoder, and the
+/// write to the sink. Frames are identified by their capture timestamp, copied
+/// along the chain by the drivers, and every point is stamped with
+/// CLOCK_MONOTONIC, the clock of the V4L2 timestamps.
+///
+/// Each stage, from the previous point reached by the frame to the next one, and
+/// the whole chain feed a log-linear histogram in microseconds, with exact
+/// buckets below 64 µs and 32 buckets per power of two above, so percentiles
+/// are within 3%. Each point is only marked by one thread at a time and its
+/// histogram is updated without read-modify-write, so tracing every frame
+/// costs a clock read and a few stores per point.
+///
+/// Histograms are printed at exit, or during the run when SIGUSR1 is received.
+
+#pragma once
+
+#include <sys/time.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+
+/// Points of the chain, in the order frames reach them.
+enum latency_point {
+    LATENCY_SENSOR,
+    LATENCY_ISP_QUEUE,
+    LATENCY_ISP_DEQUEUE,
+    LATENCY_ENCODER_QUEUE,
+    LATENCY_ENCODER_DEQUEUE,
+    LATENCY_SINK,
+    LATENCY_POINTS,
+};
+
+/// Exact buckets below 2^(LATENCY_SUB_BITS+1) µs, then 2^LATENCY_SUB_BITS
+/// buckets per power of two up to 2^LATENCY_MAX_BITS µs.
+#define LATENCY_SUB_BITS 5
+#define LATENCY_MAX_BITS 27
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+/// Frames tracked at the same time, a power of two well above the number of
+/// buffers in flight.
+#define LATENCY_FRAMES 256
+
+struct latency_histogram {
+    _Atomic unsigned long counts[LATENCY_BUCKETS];
+    _Atomic unsigned long count;
+    _Atomic unsigned long long sum_us;
+    _Atomic unsigned long long max_us;
+};
+
+/// A frame in flight, times are in microseconds.
+struct latency_frame {
+    /// Capture timestamp identifying the frame, zero if the slot is unused.
+    _Atomic unsigned long long key_us;
+    /// Start of the chain, the capture timestamp if it is monotonic.
+    _Atomic unsigned long long origin_us;
+    /// Time at which each point was reached, zero if not.
+    _Atomic unsigned long long marks[LATENCY_POINTS];
+};
+
+struct latency {
+    struct latency_frame frames[LATENCY_FRAMES];
+    /// Time from the previous point reached, or the capture for the sensor.
+    struct latency_histogram stages[LATENCY_POINTS];
+    /// Time from the capture to the sink.
+    struct latency_histogram total;
+    /// Marks of frames no longer tracked, or with a timestamp not copied.
+    _Atomic unsigned long untracked[LATENCY_POINTS];
+    /// The sensor timestamps are not monotonic, the sensor dequeue is then the
+    /// start of the chain.
+    _Atomic bool foreign_clock;
+};
+
+
+void latency_init(struct latency *lat);
+
+/// Start tracing a frame dequeued from the sensor, given the timestamp and
+/// flags of its buffer.
+void latency_capture(struct latency *lat, const struct timeval *timestamp, unsigned flags);
+
+/// Mark a later point of the frame with the given capture timestamp.
+void latency_mark(struct latency *lat, enum latency_point point, const struct timeval *timestamp);
+
+/// Print the percentiles of each stage and of the whole chain.
+void latency_report(const struct latency *lat);
+
+/// Request a report with SIGUSR1, printed by the next 'latency_poll'.
+void latency_catch_signal(void);
+void latency_poll(const struct latency *lat);
@@ -0,0 +1,442 @@
+#define _GNU_SOURCE
+
+#include "lsc.h"
+#include "check.h"
+
+#include <linux/dma-heap.h>
+#include <linux/dma-buf.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+
+/// Maximum size of the calibration grids.
+#define LSC_MAX_CALIBRATION 64
+
+/// Largest grid of the ISP in cells, before adding the corners.
+#define LSC_MAX_GRID_WIDTH 63
+#define LSC_MAX_GRID_HEIGHT 48
+
+/// DMA heaps tried in order, the ISP needs contiguous memory.
+static const char *const lsc_heaps[] = { "/dev/dma_heap/vidbuf_cached", "/dev/dma_heap/linux,cma" };
+
+/// Fixed point encoding of each gain format.
+static const struct {
+    const char *name;
+    unsigned fraction;
+    unsigned offset;
+    unsigned maximum;
+} lsc_formats[] = {
+    [GAIN_FORMAT_U0P8_1] = { "u0p8_1", 8, 1, 255 },
+    [GAIN_FORMAT_U1P7_0] = { "u1p7_0", 7, 0, 255 },
+    [GAIN_FORMAT_U1P7_1] = { "u1p7_1", 7, 1, 255 },
+    [GAIN_FORMAT_U2P6_0] = { "u2p6_0", 6, 0, 255 },
+    [GAIN_FORMAT_U2P6_1] = { "u2p6_1", 6, 1, 255 },
+    [GAIN_FORMAT_U3P5_0] = { "u3p5_0", 5, 0, 255 },
+    [GAIN_FORMAT_U3P5_1] = { "u3p5_1", 5, 1, 255 },
+    [GAIN_FORMAT_U4P10] = { "u4p10", 10, 0, 16383 },
+};
+
+/// Calibration as read from the file, tables are row major.
+struct lsc_calibration {
+    unsigned width;
+    unsigned height;
+    double *luminance;
+    unsigned count;
+    struct lsc_table tables[LSC_MAX_TEMPERATURES];
+    double *red[LSC_MAX_TEMPERATURES];
+    double *blue[LSC_MAX_TEMPERATURES];
+};
+
+bool lsc_parse_format(const char *name, enum bcm2835_isp_gain_format *format) {
+    for (unsigned i = 0; i < sizeof(lsc_formats) / sizeof(lsc_formats[0]); i++) {
+        if (strcasecmp(name, lsc_formats[i].name) == 0) {
+            *format = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+///
+/// CALIBRATION
+///
+
+/// Read the next token of the calibration, skipping comments.
+static bool lsc_token(FILE *file, char *token, size_t size) {
+
+    int c;
+    for (;;) {
+        while ((c = fgetc(file)) == ' ' || c == '\t' || c == '\n' || c == '\r');
+        if (c != '#')
+            break;
+        while ((c = fgetc(file)) != '\n' && c != EOF);
+    }
+    if (c == EOF)
+        return false;
+
+    size_t len = 0;
+    do {
+        if (len + 1 < size)
+            token[len++] = (char) c;
+    } while ((c = fgetc(file)) != EOF && c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '#');
+    if (c == '#')
+        ungetc(c, file);
+    token[len] = 0;
+    return true;
+
+}
+
+static double lsc_number(FILE *file, const char *path) {
+    char token[64] = "";
+    char *end = token;
+    double value = 0;
+    if (lsc_token(file, token, sizeof(token)))
+        value = strtod(token, &end);
+    if (!token[0] || *end) {
+        fprintf(stderr, "error: lens shading calibration '%s' expects a number, got '%s'\n", path, token);
+        exit(1);
+    }
+    return value;
+}
+
+static double *lsc_read_grid(FILE *file, const char *path, const struct lsc_calibration *cal) {
+
+    if (!cal->width) {
+        fprintf(stderr, "error: lens shading calibration '%s' must start with its grid size\n", path);
+        exit(1);
+    }
+
+    double *grid = malloc(sizeof(double) * cal->width * cal->height);
+    if (!grid) {
+        fprintf(stderr, "error: failed to allocate the lens shading calibration\n");
+        exit(1);
+    }
+
+    for (unsigned i = 0; i < cal->width * cal->height; i++) {
+        grid[i] = lsc_number(file, path);
+        if (grid[i] <= 0) {
+            fprintf(stderr, "error: lens shading calibration '%s' has a non positive gain\n", path);
+            exit(1);
+        }
+    }
+
+    return grid;
+
+}
+
+static void lsc_read_calibration(struct lsc_calibration *cal, const char *path) {
+
+    memset(cal, 0, sizeof(struct lsc_calibration));
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "error: failed to open lens shading calibration '%s'\n", path);
+        exit(1);
+    }
+
+    char token[64];
+    while (lsc_token(file, token, sizeof(token))) {
+
+        if (strcmp(token, "grid") == 0) {
+            cal->width = (unsigned) lsc_number(file, path);
+            cal->height = (unsigned) lsc_number(file, path);
+            if (cal->width < 2 || cal->height < 2 || cal->width > LSC_MAX_CALIBRATION || cal->height > LSC_MAX_CALIBRATION) {
+                fprintf(stderr, "error: lens shading calibration grid must be between 2 and %d cells\n", LSC_MAX_CALIBRATION);
+                exit(1);
+            }
+        } else if (strcmp(token, "luminance") == 0) {
+            free(cal->luminance);
+            cal->luminance = lsc_read_grid(file, path, cal);
+        } else if (strcmp(token, "temperature") == 0) {
+            if (cal->count == LSC_MAX_TEMPERATURES) {
+                fprintf(stderr, "error: lens shading calibration has more than %d temperatures\n", LSC_MAX_TEMPERATURES);
+                exit(1);
+            }
+            struct lsc_table *table = &cal->tables[cal->count++];
+            table->temperature = (unsigned) lsc_number(file, path);
+            table->red = 1000 * lsc_number(file, path);
+            table->blue = 1000 * lsc_number(file, path);
+            table->dmabuf_fd = -1;
+        } else if (cal->count && strcmp(token, "red") == 0 && !cal->red[cal->count - 1]) {
+            cal->red[cal->count - 1] = lsc_read_grid(file, path, cal);
+        } else if (cal->count && strcmp(token, "blue") == 0 && !cal->blue[cal->count - 1]) {
+            cal->blue[cal->count - 1] = lsc_read_grid(file, path, cal);
+        } else {
+            fprintf(stderr, "error: unexpected '%s' in lens shading calibration '%s'\n", token, path);
+            exit(1);
+        }
+
+    }
+
+    fclose(file);
+
+    if (!cal->luminance || !cal->count) {
+        fprintf(stderr, "error: lens shading calibration '%s' needs a luminance table and a temperature\n", path);
+        exit(1);
+    }
+    for (unsigned i = 0; i < cal->count; i++) {
+        if (!cal->red[i] || !cal->blue[i] || cal->tables[i].red <= 0 || cal->tables[i].blue <= 0) {
+            fprintf(stderr, "error: lens shading temperature %u needs white balance gains and red and blue tables\n", cal->tables[i].temperature);
+            exit(1);
+        }
+    }
+
+}
+
+static void lsc_free_calibration(struct lsc_calibration *cal) {
+    free(cal->luminance);
+    for (unsigned i = 0; i < cal->count; i++) {
+        free(cal->red[i]);
+        free(cal->blue[i]);
+    }
+}
+
+///
+/// TABLES
+///
+
+/// Choose the smallest cell size that fits the grid of the ISP, tables are
+/// sampled at the corners of the cells.
+static void lsc_geometry(struct lsc *lsc, unsigned width, unsigned height) {
+
+    unsigned cell = 16;
+    while (cell < 256 && ((width + cell - 1) / cell > LSC_MAX_GRID_WIDTH || (height + cell - 1) / cell > LSC_MAX_GRID_HEIGHT))
+        cell *= 2;
+
+    struct bcm2835_isp_lens_shading *shading = &lsc->shading;
+    shading->enabled = 1;
+    shading->grid_cell_size = cell;
+    shading->grid_width = (width + cell - 1) / cell + 1;
+    shading->grid_stride = shading->grid_width;
+    shading->grid_height = (height + cell - 1) / cell + 1;
+    shading->corner_sampled = 1;
+    shading->gain_format = lsc->config.gain_format;
+
+    unsigned sample = lsc->config.gain_format == GAIN_FORMAT_U4P10 ? 2 : 1;
+    lsc->size = (size_t) 4 * shading->grid_stride * shading->grid_height * sample;
+
+}
+
+/// Bilinear sample of a calibration grid at a position in the image, in the
+/// range 0 to 1 on both axes.
+static double lsc_sample(const struct lsc_calibration *cal, const double *grid, double x, double y) {
+
+    // Calibration gains are at the centers of their cells.
+    x = x * cal->width - 0.5;
+    y = y * cal->height - 0.5;
+    if (x < 0)
+        x = 0;
+    if (x > cal->width - 1)
+        x = cal->width - 1;
+    if (y < 0)
+        y = 0;
+    if (y > cal->height - 1)
+        y = cal->height - 1;
+
+    unsigned x0 = (unsigned) x, y0 = (unsigned) y;
+    unsigned x1 = x0 + 1 < cal->width ? x0 + 1 : x0;
+    unsigned y1 = y0 + 1 < cal->height ? y0 + 1 : y0;
+    double fx = x - x0, fy = y - y0;
+
+    const double *above = grid + y0 * cal->width;
+    const double *below = grid + y1 * cal->width;
+    double top = above[x0] * (1 - fx) + above[x1] * fx;
+    double bottom = below[x0] * (1 - fx) + below[x1] * fx;
+    return top * (1 - fy) + bottom * fy;
+
+}
+
+/// Fill a table with the red, both green and blue planes, each of the grid size.
+static void lsc_build(const struct lsc *lsc, const struct lsc_calibration *cal, unsigned index, unsigned width, unsigned height, void *dst) {
+
+    const struct bcm2835_isp_lens_shading *shading = &lsc->shading;
+    enum bcm2835_isp_gain_format format = shading->gain_format;
+    unsigned plane = shading->grid_stride * shading->grid_height;
+    uint16_t *dst16 = dst;
+    uint8_t *dst8 = dst;
+
+    for (unsigned j = 0; j < shading->grid_height; j++) {
+        for (unsigned i = 0; i < shading->grid_width; i++) {
+
+            unsigned x = i * shading->grid_cell_size, y = j * shading->grid_cell_size;
+            double fx = x < width ? (double) x / width : 1;
+            double fy = y < height ? (double) y / height : 1;
+
+            double luminance = lsc_sample(cal, cal->luminance, fx, fy);
+            double gains[4] = {
+                luminance * lsc_sample(cal, cal->red[index], fx, fy),
+                luminance,
+                luminance,
+                luminance * lsc_sample(cal, cal->blue[index], fx, fy),
+            };
+
+            for (unsigned c = 0; c < 4; c++) {
+                double value = (gains[c] - lsc_formats[format].offset) * (1u << lsc_formats[format].fraction) + 0.5;
+                unsigned code = value < 0 ? 0 : value > lsc_formats[format].maximum ? lsc_formats[format].maximum : (unsigned) value;
+                unsigned offset = c * plane + j * shading->grid_stride + i;
+                if (format == GAIN_FORMAT_U4P10)
+                    dst16[offset] = (uint16_t) code;
+                else
+                    dst8[offset] = (uint8_t) code;
+            }
+
+        }
+    }
+
+}
+
+/// Allocate a table from the DMA heap, or from a memfd without heaps.
+static int lsc_alloc(struct lsc *lsc, int heap_fd) {
+
+    int fd;
+    if (heap_fd >= 0) {
+        struct dma_heap_allocation_data alloc = {0};
+        alloc.len = lsc->size;
+        alloc.fd_flags = O_RDWR | O_CLOEXEC;
+        if (ioctl(heap_fd, DMA_HEAP_IOCTL_ALLOC, &alloc) == -1) {
+            perror("error: failed to allocate a lens shading table");
+            exit(1);
+        }
+        fd = (int) alloc.fd;
+    } else {
+        fd = memfd_create("lsc", MFD_CLOEXEC);
+        if (fd == -1 || ftruncate(fd, (off_t) lsc->size) == -1) {
+            perror("error: failed to allocate a lens shading table");
+            exit(1);
+        }
+    }
+
+    return fd;
+
+}
+
+static void lsc_sync(struct lsc *lsc, int fd, __u64 flags) {
+    struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_WRITE };
+    if (lsc->heap)
+        ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+static enum vid_result lsc_set_table(struct lsc *lsc, unsigned index) {
+
+    struct bcm2835_isp_lens_shading shading = lsc->shading;
+    shading.dmabuf = lsc->tables[index].dmabuf_fd;
+
+    struct v4l2_ext_control ctrl = {0};
+    ctrl.id = V4L2_CID_USER_BCM2835_ISP_LENS_SHADING;
+    ctrl.size = sizeof(shading);
+    ctrl.ptr = &shading;
+
+    struct v4l2_ext_controls ctrls = {0};
+    ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ctrls.count = 1;
+    ctrls.controls = &ctrl;
+
+    return vid_set_control(lsc->isp_fd, &ctrls);
+
+}
+
+void lsc_init(struct lsc *lsc, const struct lsc_config *config, int isp_fd, unsigned width, unsigned height) {
+
+    memset(lsc, 0, sizeof(struct lsc));
+    lsc->config = *config;
+    lsc->isp_fd = isp_fd;
+
+    struct lsc_calibration cal;
+    lsc_read_calibration(&cal, config->path);
+    lsc_geometry(lsc, width, height);
+
+    int heap_fd = -1;
+    for (unsigned i = 0; i < sizeof(lsc_heaps) / sizeof(lsc_heaps[0]) && heap_fd < 0; i++)
+        heap_fd = open(lsc_heaps[i], O_RDWR | O_CLOEXEC);
+    lsc->heap = heap_fd >= 0;
+    if (!lsc->heap)
+        printf("warn: no dma heap, lens shading tables are kept in memfds\n");
+
+    // Tables are written once, then only selected by the control.
+    for (unsigned i = 0; i < cal.count; i++) {
+
+        struct lsc_table *table = &lsc->tables[i];
+        *table = cal.tables[i];
+        table->dmabuf_fd = lsc_alloc(lsc, heap_fd);
+
+        void *map = mmap(NULL, lsc->size, PROT_READ | PROT_WRITE, MAP_SHARED, table->dmabuf_fd, 0);
+        if (map == MAP_FAILED) {
+            perror("error: failed to map a lens shading table");
+            exit(1);
+        }
+        lsc_sync(lsc, table->dmabuf_fd, DMA_BUF_SYNC_START);
+        lsc_build(lsc, &cal, i, width, height, map);
+        lsc_sync(lsc, table->dmabuf_fd, DMA_BUF_SYNC_END);
+        munmap(map, lsc->size);
+
+        lsc->count++;
+
+    }
+
+    if (heap_fd >= 0)
+        close(heap_fd);
+    lsc_free_calibration(&cal);
+
+    for (unsigned i = 1; i < lsc->count; i++) {
+        int distance = (int) lsc->tables[i].temperature - (int) config->temperature;
+        int current = (int) lsc->tables[lsc->current].temperature - (int) config->temperature;
+        if (abs(distance) < abs(current))
+            lsc->current = i;
+    }
+    check_res(lsc_set_table(lsc, lsc->current));
+
+    printf("info: lens shading %u tables of %ux%u cells of %u, %zu bytes, %s, temperature %u\n",
+        lsc->count, lsc->shading.grid_width, lsc->shading.grid_height, lsc->shading.grid_cell_size,
+        lsc->size, lsc_formats[config->gain_format].name, lsc->tables[lsc->current].temperature);
+
+}
+
+void lsc_release(struct lsc *lsc) {
+    for (unsigned i = 0; i < lsc->count; i++)
+        close(lsc->tables[i].dmabuf_fd);
+}
+
+/// Distance between white balance gains, as the product of their ratios.
+static double lsc_distance(const struct lsc_table *table, double red, double blue) {
+    double r = red > table->red ? red / table->red : table->red / red;
+    double b = blue > table->blue ? blue / table->blue : table->blue / blue;
+    return r * b;
+}
+
+void lsc_update(struct lsc *lsc, unsigned red, unsigned blue) {
+
+    if (!red || !blue)
+        return;
+
+    unsigned best = lsc->current;
+    double best_distance = lsc_distance(&lsc->tables[best], red, blue);
+    double current_distance = best_distance;
+    for (unsigned i = 0; i < lsc->count; i++) {
+        double distance = lsc_distance(&lsc->tables[i], red, blue);
+        if (distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
+    }
+
+    if (best == lsc->current || best_distance * lsc->config.hysteresis > current_distance)
+        return;
+
+    check_res(lsc_set_table(lsc, best));
+    lsc->current = best;
+    lsc->switches++;
+
+}
+
+void lsc_report(const struct lsc *lsc) {
+    printf("info: lens shading temperature %u, %lu switches\n", lsc->tables[lsc->current].temperature, lsc->switches);
+}
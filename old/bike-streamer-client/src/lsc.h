@@ -0,0 +1,80 @@
+/// Lens shading correction by the ISP. Gain grids are built from a calibration
+/// file, encoded in one of the gain formats of the bcm2835 ISP and written once
+/// to dmabufs allocated from a DMA heap, one per calibrated color temperature.
+/// The lens shading control of the ISP then only points at the dmabuf of the
+/// temperature whose white balance gains are the closest to the current ones, so
+/// switching tables neither allocates nor copies them.
+///
+/// The calibration file is a list of whitespace separated keywords and numbers,
+/// '#' starts a comment. Gains are sampled at the centers of the cells of a grid
+/// covering the whole sensor image, the color tables are the gains of the red
+/// and blue channels relative to green at one temperature, in kelvin, following
+/// the red and blue white balance gains measured at that temperature:
+///
+///     grid 16 12
+///     luminance <16x12 gains>
+///     temperature 3000 1.45 2.40
+///     red <16x12 gains>
+///     blue <16x12 gains>
+///     temperature 5000 ...
+///
+/// Without DMA heaps, as with the emulated devices, tables are kept in memfds.
+
+#pragma once
+
+#include "bcm2835-isp.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define LSC_MAX_TEMPERATURES 8
+
+struct lsc_config {
+    const char *path;
+    enum bcm2835_isp_gain_format gain_format;
+    /// Temperature of the first table in use, the closest one is selected.
+    unsigned temperature;
+    /// Ratio by which a table must be closer to the white balance gains than the
+    /// current one to switch to it.
+    double hysteresis;
+};
+
+struct lsc_table {
+    unsigned temperature;
+    /// White balance gains at this temperature, in thousandths.
+    double red;
+    double blue;
+    int dmabuf_fd;
+};
+
+struct lsc {
+    struct lsc_config config;
+    /// ISP output device owning the lens shading control.
+    int isp_fd;
+    /// Geometry of the tables, the dmabuf is set when writing the control.
+    struct bcm2835_isp_lens_shading shading;
+    size_t size;
+    struct lsc_table tables[LSC_MAX_TEMPERATURES];
+    unsigned count;
+    unsigned current;
+    /// Tables were allocated from a DMA heap.
+    bool heap;
+    unsigned long switches;
+};
+
+
+/// Parse the name of a gain format, like 'u4p10' or 'u0p8_1'.
+bool lsc_parse_format(const char *name, enum bcm2835_isp_gain_format *format);
+
+/// Build the tables for frames of the given size entering the ISP and enable the
+/// correction, errors are fatal.
+void lsc_init(struct lsc *lsc, const struct lsc_config *config, int isp_fd, unsigned width, unsigned height);
+void lsc_release(struct lsc *lsc);
+
+/// Switch to the table of the temperature closest to the given white balance
+/// gains, in thousandths.
+void lsc_update(struct lsc *lsc, unsigned red, unsigned blue);
+
+/// Print the table in use and the number of switches.
+void lsc_report(const struct lsc *lsc);
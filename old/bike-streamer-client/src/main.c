@@ -11,56 +11,28 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "bcm2835-isp.h"
+#include "pipeline.h"
+#include "packetizer.h"
+#include "netsink.h"
+#include "tssink.h"
+#include "rtsp.h"
+#include "pool.h"
+#include "reactor.h"
+#include "check.h"
+#include "stats.h"
+#include "awb.h"
+#include "ae.h"
+#include "lsc.h"
+#include "ctrls.h"
+#include "ctrlreg.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
 
 
-/// Internal structure to keep track of sensor memory mapped buffers.
-struct buffer_map {
-    /// Userspace pointer where the buffer starts.
-    void *start;
-    /// The length of the buffer.
-    unsigned length;
-};
-
-
-static void check_res(enum vid_result res) {
-    switch (res) {
-    case VID_OK:
-        return;
-    case VID_ERR_STOP:
-        fprintf(stderr, "error: unhandled stop enumeration\n");
-        break;
-    case VID_ERR_RETRY:
-        fprintf(stderr, "error: unhandled retry\n");
-        break;
-    case VID_ERR_SYS:
-        fprintf(stderr, "error: system error (%s)\n", strerror(errno));
-        break;
-    case VID_ERR_NO_VIDEO:
-        fprintf(stderr, "error: device do not support video\n");
-        break;
-    case VID_ERR_NO_STREAMING:
-        fprintf(stderr, "error: device do not support streaming\n");
-        break;
-    case VID_ERR_NEGOCIATION:
-        fprintf(stderr, "error: failed to negociate\n");
-        break;
-    }
-    exit(1);
-}
-
-static bool check_ok_or_retry(enum vid_result res) {
-    if (res == VID_OK) {
-        return true;
-    } else if (res == VID_ERR_RETRY) {
-        return false;
-    } else {
-        check_res(res);
-        exit(1);  // Ensure that the result is not undefined.
-    }
-}
-
 static void check_cap(struct v4l2_capability *cap, unsigned flag, const char *err) {
     if (!(cap->capabilities & flag)) {
         fprintf(stderr, "error: %s\n", err);
@@ -77,34 +49,415 @@ static void print_formats(int fd, enum v4l2_buf_type type) {
     }
 }
 
-static void print_class_ctrls(int fd, int base) {   
-    struct v4l2_query_ext_ctrl query = {0};
-    for (query.id = base; query.id < base + 50; query.id++) {
-        if (vid_query_control(fd, &query) == VID_OK) {
-            printf("      %30s 0x%08X (%d) : min=%lld max=%lld step=%llu default=%llu\n", 
-                query.name, query.id, query.type, 
-                query.minimum, query.maximum,
-                query.step, query.default_value);
+#define BUFFERS_COUNT 4
+
+/// Queues of the chain, in the order of the '-D' option.
+enum queue_id {
+    QUEUE_SENSOR,
+    QUEUE_ADAPTER_OUT,
+    QUEUE_ADAPTER_CAP,
+    QUEUE_ENCODER_OUT,
+    QUEUE_ENCODER_CAP,
+    QUEUE_COUNT,
+};
+
+/// Devices whose control metadata is loaded, see 'ctrlreg.h'.
+enum registry_id {
+    REGISTRY_SENSOR,
+    REGISTRY_ADAPTER,
+    REGISTRY_ENCODER,
+    REGISTRY_COUNT,
+};
+
+
+/// Command line configuration, device paths can select another backend than the
+/// real V4L2 devices, see 'backend.h'.
+struct config {
+    const char *sensor_path;
+    const char *adapter_out_path;
+    const char *adapter_cap_path;
+    const char *encoder_path;
+    unsigned loops;
+    /// Run each stage on its own thread, see 'pipeline.h'.
+    bool threaded;
+    /// Run the epoll reactor, see 'reactor.h'.
+    bool reactor;
+    bool edge_triggered;
+    /// In threaded and reactor modes, the number of frames to encode.
+    unsigned frames;
+    /// Address of the network sink replacing the output file, see 'netsink.h'.
+    const char *netsink_address;
+    /// Address of the UDP receiver of packetized frames, see 'packetizer.h'.
+    const char *packetizer_address;
+    unsigned mtu;
+    /// Address served or pushed as an MPEG transport stream, see 'tssink.h'.
+    const char *tssink_address;
+    /// Address served or published over RTSP, see 'rtsp.h'.
+    const char *rtsp_address;
+    /// Path of the io_uring recording replacing the output file, see 'disksink.h'.
+    const char *record_path;
+    bool record_direct;
+    /// Rolling recording in segment files named after 'record_path', zero for a
+    /// single file.
+    unsigned segment_seconds;
+    unsigned segment_count;
+    unsigned segment_capacity_mb;
+    /// Forward error correction of the UDP link, redundancy in percent of key
+    /// frames and other frames.
+    enum fec_scheme fec;
+    unsigned fec_key_percent;
+    unsigned fec_percent;
+    /// Adaptive bitrate range, zero if disabled, see 'abr.h'.
+    unsigned abr_min_bitrate;
+    unsigned abr_max_bitrate;
+    unsigned abr_min_fps;
+    const char *abr_log_path;
+    /// Automatic white balance from the sensor frame statistics, see 'awb.h'.
+    bool awb;
+    /// Exposure time up to which the sensor gain is not raised, zero if automatic
+    /// exposure is disabled, see 'ae.h'.
+    unsigned ae_short_exposure_us;
+    /// Lens shading calibration of the ISP tables and their gain format, NULL if
+    /// disabled, see 'lsc.h'.
+    const char *lsc_path;
+    enum bcm2835_isp_gain_format lsc_format;
+    /// Directory caching the control metadata of the devices, NULL to always
+    /// enumerate them, see 'ctrlreg.h'.
+    const char *ctrl_cache_dir;
+    bool print_ctrls;
+    /// Shared memory object publishing the metrics, NULL to keep them private,
+    /// see 'metrics.h'.
+    const char *metrics_name;
+    /// Chrome trace file of the ioctls and stages, NULL if disabled, see 'trace.h'.
+    const char *trace_path;
+    /// Number of buffers of each queue, see 'pool.h'.
+    unsigned depths[QUEUE_COUNT];
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-S] [-s sensor] [-i isp-output] [-c isp-capture] [-e encoder] [-n loops] [-T frames] [-R frames [-E]] [-D depths] [-N host:port] [-U host:port [-M mtu] [-F fec] [-A bitrates [-L log]]] [-Y tcp:port|udp:host:port] [-V rtsp:port|rtsp://host:port/path] [-W file [-O] [-G segments]] [-B] [-X exposure-us] [-H calibration] [-K dir] [-P] [-Q name] [-Z trace.json]\n", prog);
+    fprintf(stderr, "  -S  use synthetic devices for the whole chain\n");
+    fprintf(stderr, "  -s  sensor device (/dev/video0, synth:sensor@fps, replay:sensor:out.raw@fps)\n");
+    fprintf(stderr, "  -i  isp output device (/dev/video13, synth:isp-output, soft:isp-output)\n");
+    fprintf(stderr, "  -c  isp capture device (/dev/video14, synth:isp-capture, soft:isp-capture[:bilinear|edge[:threads]])\n");
+    fprintf(stderr, "  -e  encoder device (/dev/video11, synth:encoder, replay:encoder:out.h264)\n");
+    fprintf(stderr, "  -n  number of loop iterations (1000)\n");
+    fprintf(stderr, "  -T  run each stage on its own pinned thread until the number of frames is encoded\n");
+    fprintf(stderr, "  -R  run the epoll reactor until the number of frames is encoded\n");
+    fprintf(stderr, "  -E  register devices as edge-triggered in the epoll reactor\n");
+    fprintf(stderr, "  -D  buffers of each queue: sensor,isp-output,isp-capture,encoder-output,encoder-capture (4,4,4,4,4)\n");
+    fprintf(stderr, "  -N  send encoded frames over TCP with zerocopy instead of writing 'out.h264'\n");
+    fprintf(stderr, "  -U  send encoded frames over UDP, packetized along NAL units, instead of writing 'out.h264'\n");
+    fprintf(stderr, "  -M  maximum size of UDP datagrams (%d)\n", PACKETIZER_DEFAULT_MTU);
+    fprintf(stderr, "  -F  forward error correction of UDP packets: xor|rs[:key-percent[:percent]] (rs:30:10)\n");
+    fprintf(stderr, "  -A  adapt the encoder bitrate to the receiver feedback: min:max bits/s[:min-fps]\n");
+    fprintf(stderr, "  -L  append the adaptive bitrate decisions to this CSV file\n");
+    fprintf(stderr, "  -Y  serve encoded frames as an MPEG transport stream over TCP or push it over UDP instead of writing 'out.h264'\n");
+    fprintf(stderr, "  -V  serve encoded frames over RTSP or publish them to an RTSP server, in RTP packets of at most -M bytes, instead of writing 'out.h264'\n");
+    fprintf(stderr, "  -W  record encoded frames to this file asynchronously with io_uring instead of writing 'out.h264'\n");
+    fprintf(stderr, "  -O  record with O_DIRECT through aligned chunks\n");
+    fprintf(stderr, "  -G  record to a ring of segment files 'file-NNN.h264' cut on key frames: seconds:count[:capacity-mb] (64)\n");
+    fprintf(stderr, "  -B  balance the isp red and blue gains from the statistics of the sensor frames\n");
+    fprintf(stderr, "  -X  control the sensor exposure and gain from the statistics of the sensor frames, raising the gain above this exposure in us\n");
+    fprintf(stderr, "  -H  correct the lens shading in the isp from this calibration, following the white balance: file[:gain-format] (u4p10)\n");
+    fprintf(stderr, "  -K  cache the control metadata of the devices in this directory, 'none' to enumerate them on each start (~/.cache/bike-streamer)\n");
+    fprintf(stderr, "  -P  print the controls of the devices\n");
+    fprintf(stderr, "  -Q  publish the metrics in this shared memory object, 'none' to keep them private (%s)\n", METRICS_DEFAULT_NAME);
+    fprintf(stderr, "  -Z  trace the ioctls, polls and stages to this Chrome trace file, for Perfetto\n");
+    exit(1);
+}
+
+static void parse_config(struct config *config, int argc, char **argv) {
+
+    config->sensor_path = "/dev/video0";       // IMX477
+    config->adapter_out_path = "/dev/video13"; // BCM2835-ISP0 (out)
+    config->adapter_cap_path = "/dev/video14"; // BCM2835-ISP0 (cap)
+    config->encoder_path = "/dev/video11";     // BCM2835-CODEC-ENCODE
+    config->loops = 1000;
+    config->threaded = false;
+    config->reactor = false;
+    config->edge_triggered = false;
+    config->frames = 0;
+    config->netsink_address = NULL;
+    config->packetizer_address = NULL;
+    config->mtu = PACKETIZER_DEFAULT_MTU;
+    config->tssink_address = NULL;
+    config->rtsp_address = NULL;
+    config->record_path = NULL;
+    config->record_direct = false;
+    config->segment_seconds = 0;
+    config->segment_count = 0;
+    config->segment_capacity_mb = 64;
+    config->fec = FEC_NONE;
+    config->fec_key_percent = 30;
+    config->fec_percent = 10;
+    config->abr_min_bitrate = 0;
+    config->abr_max_bitrate = 0;
+    config->abr_min_fps = 0;
+    config->abr_log_path = NULL;
+    config->awb = false;
+    config->ae_short_exposure_us = 0;
+    config->lsc_path = NULL;
+    config->lsc_format = GAIN_FORMAT_U4P10;
+    config->ctrl_cache_dir = ctrlreg_default_dir();
+    config->print_ctrls = false;
+    config->metrics_name = METRICS_DEFAULT_NAME;
+    config->trace_path = NULL;
+    for (unsigned i = 0; i < QUEUE_COUNT; i++)
+        config->depths[i] = BUFFERS_COUNT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "Ss:i:c:e:n:T:R:ED:N:U:M:F:A:L:Y:V:W:OG:BX:H:K:PQ:Z:")) != -1) {
+        switch (opt) {
+        case 'S':
+            config->sensor_path = "synth:sensor@30";
+            config->adapter_out_path = "synth:isp-output";
+            config->adapter_cap_path = "synth:isp-capture";
+            config->encoder_path = "synth:encoder";
+            break;
+        case 's':
+            config->sensor_path = optarg;
+            break;
+        case 'i':
+            config->adapter_out_path = optarg;
+            break;
+        case 'c':
+            config->adapter_cap_path = optarg;
+            break;
+        case 'e':
+            config->encoder_path = optarg;
+            break;
+        case 'n':
+            config->loops = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            config->threaded = true;
+            config->frames = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            config->reactor = true;
+            config->frames = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'E':
+            config->edge_triggered = true;
+            break;
+        case 'N':
+            config->netsink_address = optarg;
+            break;
+        case 'U':
+            config->packetizer_address = optarg;
+            break;
+        case 'Y':
+            config->tssink_address = optarg;
+            break;
+        case 'V':
+            config->rtsp_address = optarg;
+            break;
+        case 'M':
+            config->mtu = (unsigned) strtoul(optarg, NULL, 10);
+            if (config->mtu < 256 || config->mtu > 65507) {
+                fprintf(stderr, "error: mtu must be between 256 and 65507\n");
+                exit(1);
+            }
+            break;
+        case 'F': {
+            char *str = strchr(optarg, ':');
+            if (str)
+                *str++ = '\0';
+            config->fec = fec_parse_scheme(optarg);
+            if (config->fec == FEC_NONE) {
+                fprintf(stderr, "error: unknown fec scheme '%s', expected xor or rs\n", optarg);
+                exit(1);
+            }
+            // Key frames get the first percentage, other frames the second one.
+            if (str && *str)
+                config->fec_key_percent = (unsigned) strtoul(str, &str, 10);
+            if (str && *str == ':')
+                config->fec_percent = (unsigned) strtoul(str + 1, NULL, 10);
+            if (config->fec_key_percent > 100 || config->fec_percent > 100) {
+                fprintf(stderr, "error: fec redundancy must be between 0 and 100 percent\n");
+                exit(1);
+            }
+            break;
+        }
+        case 'A': {
+            char *str = optarg;
+            config->abr_min_bitrate = (unsigned) strtoul(str, &str, 10);
+            config->abr_max_bitrate = *str == ':' ? (unsigned) strtoul(str + 1, &str, 10) : 0;
+            if (*str == ':')
+                config->abr_min_fps = (unsigned) strtoul(str + 1, NULL, 10);
+            if (!config->abr_min_bitrate || config->abr_max_bitrate < config->abr_min_bitrate) {
+                fprintf(stderr, "error: abr expects min:max bitrates with min <= max\n");
+                exit(1);
+            }
+            break;
+        }
+        case 'L':
+            config->abr_log_path = optarg;
+            break;
+        case 'W':
+            config->record_path = optarg;
+            break;
+        case 'O':
+            config->record_direct = true;
+            break;
+        case 'G': {
+            char *str = optarg;
+            config->segment_seconds = (unsigned) strtoul(str, &str, 10);
+            config->segment_count = *str == ':' ? (unsigned) strtoul(str + 1, &str, 10) : 0;
+            if (*str == ':')
+                config->segment_capacity_mb = (unsigned) strtoul(str + 1, NULL, 10);
+            if (!config->segment_seconds || !config->segment_count) {
+                fprintf(stderr, "error: segments expect seconds:count[:capacity-mb]\n");
+                exit(1);
+            }
+            break;
+        }
+        case 'B':
+            config->awb = true;
+            break;
+        case 'H': {
+            char *format = strchr(optarg, ':');
+            if (format) {
+                *format++ = 0;
+                if (!lsc_parse_format(format, &config->lsc_format)) {
+                    fprintf(stderr, "error: unknown lens shading gain format '%s'\n", format);
+                    exit(1);
+                }
+            }
+            config->lsc_path = optarg;
+            break;
+        }
+        case 'K':
+            config->ctrl_cache_dir = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case 'P':
+            config->print_ctrls = true;
+            break;
+        case 'Q':
+            config->metrics_name = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case 'Z':
+            config->trace_path = optarg;
+            break;
+        case 'X':
+            config->ae_short_exposure_us = (unsigned) strtoul(optarg, NULL, 10);
+            if (!config->ae_short_exposure_us) {
+                fprintf(stderr, "error: short exposure must be a positive number of microseconds\n");
+                exit(1);
+            }
+            break;
+        case 'D': {
+            // Missing trailing depths keep their default.
+            char *str = optarg;
+            for (unsigned i = 0; i < QUEUE_COUNT && *str; i++) {
+                unsigned long depth = strtoul(str, &str, 10);
+                if (depth < 1 || depth > RING_CAPACITY) {
+                    fprintf(stderr, "error: queue depth must be between 1 and %d\n", RING_CAPACITY);
+                    exit(1);
+                }
+                config->depths[i] = depth;
+                if (*str == ',')
+                    str++;
+            }
+            break;
+        }
+        default:
+            usage(argv[0]);
         }
     }
+
+    if (config->abr_min_bitrate && !config->packetizer_address) {
+        fprintf(stderr, "error: adaptive bitrate needs the receiver feedback of the UDP link (-U)\n");
+        exit(1);
+    }
+
+    // Frames go to a single sink, whichever mode runs the pipeline.
+    unsigned sinks = !!config->netsink_address + !!config->packetizer_address + !!config->tssink_address
+        + !!config->rtsp_address + !!config->record_path;
+    if (sinks > 1) {
+        fprintf(stderr, "error: only one output among -N, -U, -Y, -V and -W can be given\n");
+        exit(1);
+    }
+
+    if (config->segment_count && !config->record_path) {
+        fprintf(stderr, "error: segments need the recording file prefix (-W)\n");
+        exit(1);
+    }
+
 }
 
-static void print_ctrls(int fd) {
-    printf("      User controls\n");
-    print_class_ctrls(fd, V4L2_CID_USER_BASE);
-    printf("      Camera controls\n");
-    print_class_ctrls(fd, V4L2_CID_CAMERA_CLASS_BASE);
-    printf("      Image source controls\n");
-    print_class_ctrls(fd, V4L2_CID_IMAGE_SOURCE_CLASS_BASE);
-    printf("      Image processing controls\n");
-    print_class_ctrls(fd, V4L2_CID_IMAGE_PROC_CLASS_BASE);
+static double timespec_ms(const struct timespec *ts) {
+    return ts->tv_sec * 1e3 + ts->tv_nsec / 1e6;
 }
 
+/// Report and close the sinks and controllers of the pipeline, then the metrics
+/// and the trace, whichever mode ran it.
+static void cleanup(const struct pipeline *pipeline, struct ctrls *encoder_ctrls, struct ctrlreg *registries, FILE *abr_log) {
 
-#define BUFFERS_COUNT 4
+    if (pipeline->netsink) {
+        netsink_report(pipeline->netsink);
+        netsink_close(pipeline->netsink);
+    }
+
+    if (pipeline->packetizer) {
+        packetizer_report(pipeline->packetizer);
+        packetizer_close(pipeline->packetizer);
+    }
+
+    if (pipeline->tssink) {
+        tssink_report(pipeline->tssink);
+        tssink_close(pipeline->tssink);
+    }
+
+    if (pipeline->rtsp) {
+        rtsp_report(pipeline->rtsp);
+        rtsp_close(pipeline->rtsp);
+    }
+
+    if (pipeline->disksink) {
+        disksink_close(pipeline->disksink);
+        disksink_report(pipeline->disksink);
+    }
 
+    if (pipeline->abr)
+        abr_report(pipeline->abr);
+    if (abr_log)
+        fclose(abr_log);
 
-int main() {
+    ctrls_report(pipeline->sensor_ctrls);
+    ctrls_report(pipeline->adapter_ctrls);
+    ctrls_report(encoder_ctrls);
+    for (unsigned i = 0; i < REGISTRY_COUNT; i++)
+        ctrlreg_release(&registries[i]);
+
+    if (pipeline->lsc) {
+        lsc_report(pipeline->lsc);
+        lsc_release(pipeline->lsc);
+    }
+    if (pipeline->stats) {
+        stats_report(pipeline->stats);
+        if (pipeline->awb)
+            awb_report(pipeline->awb);
+        if (pipeline->ae)
+            ae_report(pipeline->ae);
+        stats_release(pipeline->stats);
+    }
+
+    trace_close();
+    metrics_close();
+
+}
+
+
+int main(int argc, char **argv) {
+
+    struct config config;
+    parse_config(&config, argc, argv);
+
+    // Tracing starts first so that the setup of the devices is traced too.
+    if (config.trace_path)
+        trace_open(config.trace_path);
 
     FILE *out_file = fopen("out.h264", "w");
     if (!out_file) {
@@ -127,12 +480,47 @@ int main() {
     struct v4l2_capability cap = {0};
     struct v4l2_rect rect = {0};
     
+    struct netsink netsink;
+    if (config.netsink_address) {
+        printf("info: connecting network sink...\n");
+        netsink_open(&netsink, config.netsink_address);
+    }
+
+    struct disksink disksink;
+    if (config.record_path) {
+        printf("info: opening recording file...\n");
+        if (config.segment_count)
+            disksink_open_segments(&disksink, config.record_path, config.segment_count, config.segment_seconds, config.segment_capacity_mb, config.record_direct);
+        else
+            disksink_open(&disksink, config.record_path, config.record_direct, config.depths[QUEUE_ENCODER_CAP]);
+    }
+
+    struct packetizer packetizer;
+    if (config.packetizer_address) {
+        printf("info: opening packetizer socket...\n");
+        packetizer_open(&packetizer, config.packetizer_address, config.mtu);
+        if (config.fec != FEC_NONE)
+            packetizer_set_fec(&packetizer, config.fec, config.fec_key_percent, config.fec_percent);
+    }
+
+    struct tssink tssink;
+    if (config.tssink_address) {
+        printf("info: opening transport stream sink...\n");
+        tssink_open(&tssink, config.tssink_address);
+    }
+
+    struct rtsp rtsp;
+    if (config.rtsp_address) {
+        printf("info: opening rtsp session...\n");
+        rtsp_open(&rtsp, config.rtsp_address, config.mtu);
+    }
+
     printf("info: opening video devices...\n");
-    check_res(vid_open(&sensor_fd, "/dev/video0"));        // IMX477
+    check_res(vid_open(&sensor_fd, config.sensor_path));
     // check_res(vid_open(&adapter_fd, "/dev/video12"));      // BCM2835-CODEC-ISP
-    check_res(vid_open(&adapter_out_fd, "/dev/video13"));  // BCM2835-ISP0 (out)
-    check_res(vid_open(&adapter_cap_fd, "/dev/video14"));  // BCM2835-ISP0 (cap)
-    check_res(vid_open(&encoder_fd, "/dev/video11"));      // BCM2835-CODEC-ENCODE
+    check_res(vid_open(&adapter_out_fd, config.adapter_out_path));
+    check_res(vid_open(&adapter_cap_fd, config.adapter_cap_path));
+    check_res(vid_open(&encoder_fd, config.encoder_path));
 
     printf("info: checking capabilities...\n");
     check_res(vid_query_capability(sensor_fd, &cap));
@@ -146,37 +534,42 @@ int main() {
     check_res(vid_query_capability(encoder_fd, &cap));
     check_cap(&cap, V4L2_CAP_VIDEO_M2M_MPLANE, "encoder device must support video 'mplane m2m'");
 
-    printf("info: setting sensor controls...\n");
-
-    struct v4l2_ext_control sensor_set_ctrl[2] = {0};
-    sensor_set_ctrl[0].id = V4L2_CID_TEST_PATTERN;
-    sensor_set_ctrl[0].value = 0;
-    sensor_set_ctrl[1].id = V4L2_CID_ANALOGUE_GAIN;
-    sensor_set_ctrl[1].value = 700;
+    printf("info: loading controls...\n");
+    struct ctrlreg registries[REGISTRY_COUNT];
+    ctrlreg_load(&registries[REGISTRY_SENSOR], sensor_fd, config.ctrl_cache_dir);
+    ctrlreg_report(&registries[REGISTRY_SENSOR]);
+    ctrlreg_load(&registries[REGISTRY_ADAPTER], adapter_out_fd, config.ctrl_cache_dir);
+    ctrlreg_report(&registries[REGISTRY_ADAPTER]);
+    ctrlreg_load(&registries[REGISTRY_ENCODER], encoder_fd, config.ctrl_cache_dir);
+    ctrlreg_report(&registries[REGISTRY_ENCODER]);
+    if (config.print_ctrls) {
+        printf("info: sensor controls\n");
+        ctrlreg_print(&registries[REGISTRY_SENSOR]);
+        printf("info: adapter controls\n");
+        ctrlreg_print(&registries[REGISTRY_ADAPTER]);
+        printf("info: encoder controls\n");
+        ctrlreg_print(&registries[REGISTRY_ENCODER]);
+    }
 
-    struct v4l2_ext_controls sensor_set_ctrls = {0};
-    sensor_set_ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
-    sensor_set_ctrls.count = sizeof(sensor_set_ctrl) / sizeof(struct v4l2_ext_control);
-    sensor_set_ctrls.controls = sensor_set_ctrl;
+    // Controls go through a shadow of each device, values staged by the control
+    // loops are written in one batch per frame, see 'ctrls.h'.
+    struct ctrls sensor_ctrls;
+    struct ctrls adapter_ctrls;
+    struct ctrls encoder_ctrls;
+    ctrls_init(&sensor_ctrls, sensor_fd, &registries[REGISTRY_SENSOR], "sensor");
+    ctrls_init(&adapter_ctrls, adapter_out_fd, &registries[REGISTRY_ADAPTER], "adapter");
+    ctrls_init(&encoder_ctrls, encoder_fd, &registries[REGISTRY_ENCODER], "encoder");
 
-    check_res(vid_set_control(sensor_fd, &sensor_set_ctrls));
+    printf("info: setting sensor controls...\n");
+    ctrls_set(&sensor_ctrls, V4L2_CID_TEST_PATTERN, 0);
+    ctrls_set(&sensor_ctrls, V4L2_CID_ANALOGUE_GAIN, 700);
+    check_res(ctrls_flush(&sensor_ctrls));
 
     printf("info: setting adapter controls...\n");
-
-    struct v4l2_ext_control adapter_set_ctrl[3] = {0};
-    adapter_set_ctrl[0].id = V4L2_CID_RED_BALANCE;
-    adapter_set_ctrl[0].value = 1000;
-    adapter_set_ctrl[1].id = V4L2_CID_BLUE_BALANCE;
-    adapter_set_ctrl[1].value = 1000;
-    adapter_set_ctrl[2].id = V4L2_CID_DIGITAL_GAIN;
-    adapter_set_ctrl[2].value = 1000;
-
-    struct v4l2_ext_controls adapter_set_ctrls = {0};
-    adapter_set_ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
-    adapter_set_ctrls.count = sizeof(adapter_set_ctrl) / sizeof(struct v4l2_ext_control);
-    adapter_set_ctrls.controls = adapter_set_ctrl;
-
-    check_res(vid_set_control(adapter_out_fd, &adapter_set_ctrls));
+    ctrls_set(&adapter_ctrls, V4L2_CID_RED_BALANCE, 1000);
+    ctrls_set(&adapter_ctrls, V4L2_CID_BLUE_BALANCE, 1000);
+    ctrls_set(&adapter_ctrls, V4L2_CID_DIGITAL_GAIN, 1000);
+    check_res(ctrls_flush(&adapter_ctrls));
 
     printf("info: setting sensor capture format...\n");
     // struct v4l2_format sensor_cap_fmt = {0};
@@ -228,25 +621,50 @@ int main() {
     printf("info: encoder framerate: %d/%d\n", param.parm.output.timeperframe.numerator, param.parm.output.timeperframe.denominator);
 
     printf("info: requesting buffers...\n");
-    check_res(vid_request_mmap_buffers(sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, BUFFERS_COUNT));
-    check_res(vid_request_dma_buffers(adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, BUFFERS_COUNT));
-    check_res(vid_request_mmap_buffers(adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, BUFFERS_COUNT));
-    check_res(vid_request_dma_buffers(encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, BUFFERS_COUNT));
-    check_res(vid_request_mmap_buffers(encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, BUFFERS_COUNT));
+    const unsigned *depths = config.depths;
+    check_res(vid_request_mmap_buffers(sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, depths[QUEUE_SENSOR]));
+    check_res(vid_request_dma_buffers(adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, depths[QUEUE_ADAPTER_OUT]));
+    check_res(vid_request_mmap_buffers(adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, depths[QUEUE_ADAPTER_CAP]));
+    check_res(vid_request_dma_buffers(encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, depths[QUEUE_ENCODER_OUT]));
+    check_res(vid_request_mmap_buffers(encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, depths[QUEUE_ENCODER_CAP]));
+
+    // Each queue is tracked by its own pool, capture buffers start queued and
+    // DMABUF output slots start free until an upstream buffer is imported.
+    struct pool sensor_pool, adapter_out_pool, adapter_cap_pool, encoder_out_pool, encoder_cap_pool;
+    pool_init(&sensor_pool, "sensor", depths[QUEUE_SENSOR], POOL_QUEUED);
+    pool_init(&adapter_out_pool, "isp-output", depths[QUEUE_ADAPTER_OUT], POOL_FREE);
+    pool_init(&adapter_cap_pool, "isp-capture", depths[QUEUE_ADAPTER_CAP], POOL_QUEUED);
+    pool_init(&encoder_out_pool, "enc-output", depths[QUEUE_ENCODER_OUT], POOL_FREE);
+    pool_init(&encoder_cap_pool, "enc-capture", depths[QUEUE_ENCODER_CAP], POOL_QUEUED);
+
+    // Frames are traced from the sensor to the sink, the output queues mark
+    // when frames are queued since they may wait for a free slot.
+    static struct latency latency;
+    latency_init(&latency);
+    latency_catch_signal();
+    adapter_out_pool.latency = &latency;
+    adapter_out_pool.latency_point = LATENCY_ISP_QUEUE;
+    encoder_out_pool.latency = &latency;
+    encoder_out_pool.latency_point = LATENCY_ENCODER_QUEUE;
+
+    // Metrics are published before any stage thread starts.
+    metrics_open(config.metrics_name);
+    pool_publish(&sensor_pool, METRIC_QUEUED_SENSOR);
+    pool_publish(&adapter_out_pool, METRIC_QUEUED_ISP_OUTPUT);
+    pool_publish(&adapter_cap_pool, METRIC_QUEUED_ISP_CAPTURE);
+    pool_publish(&encoder_out_pool, METRIC_QUEUED_ENCODER_OUTPUT);
+    pool_publish(&encoder_cap_pool, METRIC_QUEUED_ENCODER_CAPTURE);
     
     printf("info: init sensor capture buffers...\n");
-    int sensor_dmabuf_fd[BUFFERS_COUNT] = {0};
-    struct buffer_map sensor_buffers_map[BUFFERS_COUNT] = {0};
-    for (unsigned i = 0; i < BUFFERS_COUNT; i++) {
+    int sensor_dmabuf_fd[RING_CAPACITY] = {0};
+    struct buffer_map sensor_buffers_map[RING_CAPACITY] = {0};
+    for (unsigned i = 0; i < depths[QUEUE_SENSOR]; i++) {
 
-        unsigned length, offset;
+        unsigned length = 0, offset = 0;
         check_res(vid_query_mmap_buffer(sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, i, &length, &offset));
         
-        void *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, sensor_fd, offset);
-        if (!start) {
-            printf("error: failed to memory map\n");
-            exit(1);
-        }
+        void *start;
+        check_res(vid_mmap(sensor_fd, length, offset, &start));
 
         sensor_buffers_map[i].start = start;
         sensor_buffers_map[i].length = length;
@@ -257,18 +675,15 @@ int main() {
     }
 
     printf("info: init adapter capture buffer...\n");
-    int adapter_dmabuf_fd[BUFFERS_COUNT] = {0};
-    struct buffer_map adapter_buffers_map[BUFFERS_COUNT] = {0};
-    for (unsigned i = 0; i < BUFFERS_COUNT; i++) {
+    int adapter_dmabuf_fd[RING_CAPACITY] = {0};
+    struct buffer_map adapter_buffers_map[RING_CAPACITY] = {0};
+    for (unsigned i = 0; i < depths[QUEUE_ADAPTER_CAP]; i++) {
         
-        unsigned length, offset;
+        unsigned length = 0, offset = 0;
         check_res(vid_query_mmap_buffer(adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, i, &length, &offset));
         
-        void *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, adapter_cap_fd, offset);
-        if (!start) {
-            printf("error: failed to memory map\n");
-            exit(1);
-        }
+        void *start;
+        check_res(vid_mmap(adapter_cap_fd, length, offset, &start));
 
         adapter_buffers_map[i].start = start;
         adapter_buffers_map[i].length = length;
@@ -279,17 +694,14 @@ int main() {
     }
 
     printf("info: init encoder capture buffer...\n");
-    struct buffer_map encoder_buffers_map[BUFFERS_COUNT] = {0};
-    for (unsigned i = 0; i < BUFFERS_COUNT; i++) {
+    struct buffer_map encoder_buffers_map[RING_CAPACITY] = {0};
+    for (unsigned i = 0; i < depths[QUEUE_ENCODER_CAP]; i++) {
 
-        unsigned length, offset;
+        unsigned length = 0, offset = 0;
         check_res(vid_query_mmap_buffer_mp(encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, i, 1, &length, &offset));
 
-        void *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, encoder_fd, offset);
-        if (!start) {
-            printf("error: failed to memory map\n");
-            exit(1);
-        }
+        void *start;
+        check_res(vid_mmap(encoder_fd, length, offset, &start));
 
         encoder_buffers_map[i].start = start;
         encoder_buffers_map[i].length = length;
@@ -305,9 +717,148 @@ int main() {
     check_res(vid_stream_on(encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE));
     check_res(vid_stream_on(encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE));
 
+    // The controller adjusts the devices while they are streaming.
+    struct abr abr;
+    FILE *abr_log = NULL;
+    if (config.abr_min_bitrate) {
+        if (config.abr_log_path) {
+            abr_log = fopen(config.abr_log_path, "a");
+            if (!abr_log) {
+                fprintf(stderr, "error: failed to open abr log file (%s)\n", strerror(errno));
+                exit(1);
+            }
+        }
+        struct abr_config abr_config = {
+            .min_bitrate = config.abr_min_bitrate,
+            .max_bitrate = config.abr_max_bitrate,
+            .min_fps = config.abr_min_fps,
+            .interval_ms = 500,
+            .delay_target_ms = 40,
+            .loss_high = 0.05,
+            .loss_low = 0.01,
+            .log = abr_log,
+        };
+        printf("info: starting adaptive bitrate...\n");
+        abr_init(&abr, &abr_config, sensor_fd, &encoder_ctrls);
+    }
+
+    // The statistics of the sensor frames drive the white balance of the ISP and
+    // the exposure of the sensor, one row of cells out of 8 still leaves hundreds
+    // of cells per zone.
+    struct stats stats;
+    struct awb awb;
+    struct ae ae;
+    bool sensor_stats = config.awb || config.ae_short_exposure_us;
+    if (sensor_stats) {
+        struct v4l2_format sensor_fmt = {0};
+        sensor_fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        check_res(vid_get_format(sensor_fd, &sensor_fmt));
+        stats_init(&stats, sensor_fmt.fmt.pix.width, sensor_fmt.fmt.pix.height, sensor_fmt.fmt.pix.pixelformat, sensor_fmt.fmt.pix.bytesperline, 8);
+    }
+    if (config.awb) {
+        struct awb_config awb_config = {
+            .min_gain = 500,
+            .max_gain = 4000,
+            .outlier_ratio = 1.25,
+            .min_zones = 8,
+            .speed = 0.1,
+            .deadband = 0.005,
+        };
+        printf("info: starting white balance...\n");
+        awb_init(&awb, &awb_config, &adapter_ctrls);
+    }
+    if (config.ae_short_exposure_us) {
+        // Aim at a mean of 16% of the range, bright enough for the encoder while
+        // keeping headroom for the highlights, and wait 2 frames for the sensor
+        // to apply new controls.
+        struct ae_config ae_config = {
+            .target = 0.16,
+            .clipped = 0.02,
+            .short_exposure_us = config.ae_short_exposure_us,
+            .max_exposure_us = 0,
+            .max_gain = 16,
+            .deadband = 0.05,
+            .latency = 2,
+        };
+        printf("info: starting auto exposure...\n");
+        ae_init(&ae, &ae_config, &sensor_ctrls);
+    }
+
+    // Shading tables cover the whole frame entering the ISP, before its crop.
+    struct lsc lsc;
+    if (config.lsc_path) {
+        struct v4l2_format isp_fmt = {0};
+        isp_fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        check_res(vid_get_format(adapter_out_fd, &isp_fmt));
+        struct lsc_config lsc_config = {
+            .path = config.lsc_path,
+            .gain_format = config.lsc_format,
+            .temperature = 5000,
+            .hysteresis = 1.02,
+        };
+        printf("info: starting lens shading...\n");
+        lsc_init(&lsc, &lsc_config, adapter_out_fd, isp_fmt.fmt.pix.width, isp_fmt.fmt.pix.height);
+    }
+
+    // Every mode runs the same devices into the same sinks.
+    struct pipeline pipeline = {0};
+    pipeline.sensor_fd = sensor_fd;
+    pipeline.adapter_out_fd = adapter_out_fd;
+    pipeline.adapter_cap_fd = adapter_cap_fd;
+    pipeline.encoder_fd = encoder_fd;
+    pipeline.sensor_pool = &sensor_pool;
+    pipeline.adapter_out_pool = &adapter_out_pool;
+    pipeline.adapter_cap_pool = &adapter_cap_pool;
+    pipeline.encoder_out_pool = &encoder_out_pool;
+    pipeline.encoder_cap_pool = &encoder_cap_pool;
+    pipeline.sensor_dmabuf_fd = sensor_dmabuf_fd;
+    pipeline.adapter_dmabuf_fd = adapter_dmabuf_fd;
+    pipeline.encoder_buffers_map = encoder_buffers_map;
+    pipeline.out_file = out_file;
+    pipeline.netsink = config.netsink_address ? &netsink : NULL;
+    pipeline.disksink = config.record_path ? &disksink : NULL;
+    pipeline.packetizer = config.packetizer_address ? &packetizer : NULL;
+    pipeline.tssink = config.tssink_address ? &tssink : NULL;
+    pipeline.rtsp = config.rtsp_address ? &rtsp : NULL;
+    pipeline.abr = config.abr_min_bitrate ? &abr : NULL;
+    pipeline.sensor_buffers_map = sensor_buffers_map;
+    pipeline.stats = sensor_stats ? &stats : NULL;
+    pipeline.awb = config.awb ? &awb : NULL;
+    pipeline.ae = config.ae_short_exposure_us ? &ae : NULL;
+    pipeline.lsc = config.lsc_path ? &lsc : NULL;
+    pipeline.sensor_ctrls = &sensor_ctrls;
+    pipeline.adapter_ctrls = &adapter_ctrls;
+    pipeline.latency = &latency;
+    pipeline.frames = config.frames;
+    pipeline.pin = true;
+    pipeline.edge_triggered = config.edge_triggered;
+
+    if (config.threaded || config.reactor) {
+
+        if (config.threaded) {
+            printf("info: running threaded pipeline...\n");
+            pipeline_run(&pipeline);
+        } else {
+            printf("info: running epoll reactor...\n");
+            reactor_run(&pipeline);
+        }
+
+        cleanup(&pipeline, &encoder_ctrls, registries, abr_log);
+        return 0;
+
+    }
+
     printf("info: looping...\n");
 
-    struct pollfd fds[4] = {0};
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    unsigned encoded_frames = 0;
+    // Polls that returned ready descriptors, timeouts and interruptions aside.
+    unsigned wakeups = 0;
+    struct pool_pending adapter_out_pending = {0};
+    struct pool_pending encoder_out_pending = {0};
+
+    struct pollfd fds[6] = {0};
     fds[0].fd = sensor_fd;
     fds[0].events = POLLIN;
     fds[1].fd = adapter_out_fd;
@@ -316,24 +867,36 @@ int main() {
     fds[2].events = POLLIN;
     fds[3].fd = encoder_fd;
     fds[3].events = POLLIN | POLLOUT;
+    // Zerocopy completions are signaled with POLLERR, negative fds are ignored.
+    fds[4].fd = config.netsink_address ? netsink.fd : -1;
+    fds[4].events = 0;
+    fds[5].fd = config.record_path ? disksink.event_fd : -1;
+    fds[5].events = POLLIN;
+
+    for (unsigned z = 0; z < config.loops; z++) {
 
-    for (int z = 0; z < 1000; z++) {
+        latency_poll(&latency);
 
-        int ret = poll(fds, 4, 2000);
+        int ret = vid_poll(fds, 6, 2000);
         if (ret == 0) {
-            fprintf(stderr, "error: poll timed out\n");
-            exit(1);
+            // The loop keeps waiting, a stalled device shows in the metrics.
+            metrics_add(METRIC_POLL_TIMEOUTS, 1);
+            printf("warn: poll timed out\n");
+            continue;
         } else if (ret == -1 && errno == EINTR) {
             continue;
         } else if (ret == -1) {
             fprintf(stderr, "error: poll error (%s)\n", strerror(errno));
             exit(1);
         }
+        wakeups++;
 
         short int sensor_events = fds[0].revents;
         short int adapter_out_events = fds[1].revents;
         short int adapter_cap_events = fds[2].revents;
         short int encoder_events = fds[3].revents;
+        short int netsink_events = fds[4].revents;
+        short int disksink_events = fds[5].revents;
 
         // Checking errors here...
         if (sensor_events & POLLERR) {
@@ -355,27 +918,43 @@ int main() {
         // Now checking actual events and process pipeline...
         if (sensor_events & POLLIN) {
 
+            TRACE_BEGIN(span, "stage", "sensor", sensor_fd);
+
             // Start by unqueueing a potential captured buffer.            
             struct v4l2_buffer cap_buf = {0};
             cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
             cap_buf.memory = V4L2_MEMORY_MMAP;
 
-            if (check_ok_or_retry(vid_unqueue_buffer(sensor_fd, &cap_buf))) {
+            // Buffers with errors are queued back right away.
+            if (check_ok_or_retry(vid_unqueue_buffer(sensor_fd, &cap_buf))
+                && !pool_requeue_error(&sensor_pool, sensor_fd, &cap_buf, METRIC_SENSOR_ERRORS)) {
 
-                if (cap_buf.flags & V4L2_BUF_FLAG_ERROR) {
-                    printf("warn: sensor buffer has error!\n");
-                }
+                pool_set_state(&sensor_pool, cap_buf.index, POOL_HELD);
+                latency_capture(&latency, &cap_buf.timestamp, cap_buf.flags);
+                metrics_add(METRIC_SENSOR_FRAMES, 1);
 
                 // For debug purpose, we write the frame in the raw output file.
                 struct buffer_map *map = &sensor_buffers_map[cap_buf.index];
 
-                if (z >= 990) {
+                if (z + 10 >= config.loops) {
                     printf("info: writing raw file...\n");
                     ftruncate(fileno(out_raw_file), 0);
                     fseek(out_raw_file, 0, 0);
                     fwrite(map->start, 1, cap_buf.bytesused, out_raw_file);
                 }
 
+                if (sensor_stats) {
+                    stats_frame(&stats, map->start);
+                    if (config.awb)
+                        awb_update(&awb, &stats);
+                    if (config.awb && config.lsc_path)
+                        lsc_update(&lsc, awb.red_written, awb.blue_written);
+                    if (config.ae_short_exposure_us)
+                        ae_update(&ae, &stats);
+                    check_res(ctrls_flush(&sensor_ctrls));
+                    check_res(ctrls_flush(&adapter_ctrls));
+                }
+
                 // Once we successfully captured a buffer, we get the DMABUF file 
                 // descriptor associated to that buffer in order to pass it to the
                 // adapter device that convert the image format, in order to be later
@@ -383,27 +962,33 @@ int main() {
                 int dmabuf_fd = sensor_dmabuf_fd[cap_buf.index];
                 // printf("info: sensor buffer %d with %d bytes (fd %d)\n", cap_buf.index, cap_buf.bytesused, dmabuf_fd);
                 
-                // Note that we are importing most of the parameters from captured buffer
-                // like the index, because we configured as many sensor capture buffers as
-                // adapter output buffers.
-                struct v4l2_buffer out_buf = {0};
-                out_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-                out_buf.memory = V4L2_MEMORY_DMABUF;
-                out_buf.timestamp = cap_buf.timestamp;
-                out_buf.field = cap_buf.field;
-                out_buf.index = cap_buf.index;
-                out_buf.length = cap_buf.length;
-                out_buf.bytesused = cap_buf.bytesused;
-                out_buf.m.fd = dmabuf_fd;
-
-                check_res(vid_queue_buffer(adapter_out_fd, &out_buf));
+                // The adapter output slot is not tied to the captured buffer index, the
+                // pool imports it in any free slot. If none is free the frame waits and
+                // a newer frame replaces it, the replaced one going back to the sensor.
+                struct frame_ref ref, dropped;
+                ref.index = cap_buf.index;
+                ref.dmabuf_fd = dmabuf_fd;
+                ref.bytesused = cap_buf.bytesused;
+                ref.length = cap_buf.length;
+                ref.flags = cap_buf.flags;
+                ref.field = cap_buf.field;
+                ref.timestamp = cap_buf.timestamp;
+
+                if (pool_offer(&adapter_out_pool, adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &adapter_out_pending, &ref, &dropped)) {
+                    check_res(vid_queue_mmap_buffer(sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, dropped.index));
+                    pool_set_state(&sensor_pool, dropped.index, POOL_QUEUED);
+                }
 
             }
 
+            TRACE_END(span);
+
         }
 
         if (adapter_out_events & POLLOUT) {
 
+            TRACE_BEGIN(span, "stage", "isp-output", adapter_out_fd);
+
             // Try unqueuing a previous output buffer.
             struct v4l2_buffer out_buf = {0};
             out_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
@@ -411,22 +996,30 @@ int main() {
 
             if (check_ok_or_retry(vid_unqueue_buffer(adapter_out_fd, &out_buf))) {
                 // printf("info: adapter output buffer %d unqueued (fd %d)\n", out_buf.index, out_plane.m.fd);
-                check_res(vid_queue_mmap_buffer(sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, out_buf.index));
+                unsigned index = pool_release(&adapter_out_pool, out_buf.index);
+                check_res(vid_queue_mmap_buffer(sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, index));
+                pool_set_state(&sensor_pool, index, POOL_QUEUED);
+                pool_flush(&adapter_out_pool, adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &adapter_out_pending);
             }
 
+            TRACE_END(span);
+
         }
         
         if (adapter_cap_events & POLLIN) {
 
+            TRACE_BEGIN(span, "stage", "isp-capture", adapter_cap_fd);
+
             struct v4l2_buffer cap_buf = {0};
             cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
             cap_buf.memory = V4L2_MEMORY_MMAP;
 
-            if (check_ok_or_retry(vid_unqueue_buffer(adapter_cap_fd, &cap_buf))) {
+            if (check_ok_or_retry(vid_unqueue_buffer(adapter_cap_fd, &cap_buf))
+                && !pool_requeue_error(&adapter_cap_pool, adapter_cap_fd, &cap_buf, METRIC_ISP_ERRORS)) {
 
-                if (cap_buf.flags & V4L2_BUF_FLAG_ERROR) {
-                    printf("warn: adapter buffer has error!\n");
-                }
+                pool_set_state(&adapter_cap_pool, cap_buf.index, POOL_HELD);
+                latency_mark(&latency, LATENCY_ISP_DEQUEUE, &cap_buf.timestamp);
+                metrics_add(METRIC_ISP_FRAMES, 1);
                 
                 // // For debug purpose, we write the frame in the raw output file.
                 // struct buffer_map *map = &adapter_buffers_map[cap_buf.index];
@@ -444,28 +1037,30 @@ int main() {
                 int dmabuf_fd = adapter_dmabuf_fd[cap_buf.index];
                 // printf("info: adapter buffer %d with %d bytes (fd %d)\n", cap_buf.index, cap_plane.bytesused, dmabuf_fd);
 
-                struct v4l2_plane out_plane = {0};
-                out_plane.m.fd = dmabuf_fd;
-                out_plane.length = cap_buf.length;
-                out_plane.bytesused = cap_buf.bytesused;
-
-                struct v4l2_buffer out_buf = {0};
-                out_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-                out_buf.memory = V4L2_MEMORY_DMABUF;
-                out_buf.timestamp = cap_buf.timestamp;
-                out_buf.field = cap_buf.field;
-                out_buf.index = cap_buf.index;
-                out_buf.m.planes = &out_plane;
-                out_buf.length = 1;
-
-                check_res(vid_queue_buffer(encoder_fd, &out_buf));
+                struct frame_ref ref, dropped;
+                ref.index = cap_buf.index;
+                ref.dmabuf_fd = dmabuf_fd;
+                ref.bytesused = cap_buf.bytesused;
+                ref.length = cap_buf.length;
+                ref.flags = cap_buf.flags;
+                ref.field = cap_buf.field;
+                ref.timestamp = cap_buf.timestamp;
+
+                if (pool_offer(&encoder_out_pool, encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &encoder_out_pending, &ref, &dropped)) {
+                    check_res(vid_queue_mmap_buffer(adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, dropped.index));
+                    pool_set_state(&adapter_cap_pool, dropped.index, POOL_QUEUED);
+                }
 
             }
 
+            TRACE_END(span);
+
         }
         
         if (encoder_events & POLLIN) {
             
+            TRACE_BEGIN(span, "stage", "enc-capture", encoder_fd);
+
             struct v4l2_plane cap_plane = {0};     
             struct v4l2_buffer cap_buf = {0};
             cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
@@ -473,32 +1068,42 @@ int main() {
             cap_buf.m.planes = &cap_plane;
             cap_buf.length = 1;
 
-            if (check_ok_or_retry(vid_unqueue_buffer(encoder_fd, &cap_buf))) {
+            if (check_ok_or_retry(vid_unqueue_buffer(encoder_fd, &cap_buf))
+                && !pool_requeue_error(&encoder_cap_pool, encoder_fd, &cap_buf, METRIC_ENCODER_ERRORS)) {
+
+                pool_set_state(&encoder_cap_pool, cap_buf.index, POOL_HELD);
+                latency_mark(&latency, LATENCY_ENCODER_DEQUEUE, &cap_buf.timestamp);
+                metrics_add(METRIC_ENCODER_FRAMES, 1);
+                metrics_add(METRIC_ENCODED_BYTES, cap_plane.bytesused);
 
                 // We reached the end of our pipeline! The fully encoded frame should be
-                // available in the buffer that we just unqueued, we just need to know
-                // we this frame is mapped in our memory.
-                struct buffer_map *map = &encoder_buffers_map[cap_buf.index];
+                // available in the buffer that we just unqueued.
 
-                printf("info: encoded buffer %d with %d bytes at %p\n", cap_buf.index, cap_plane.bytesused, map->start);
-                // TODO: Process frame.
+                // The network sink reads the buffer until the kernel notifies the
+                // completion of the zerocopy send, it is queued back only then.
+                bool release = pipeline_sink_frame(&pipeline, cap_buf.index, cap_plane.bytesused, &cap_buf.timestamp, cap_buf.flags & V4L2_BUF_FLAG_KEYFRAME);
 
-                if (cap_buf.flags & V4L2_BUF_FLAG_ERROR) {
-                    printf("warn: encoded buffer has error!\n");
-                }
-
-                unsigned long written_size = fwrite(map->start, 1, cap_plane.bytesused, out_file);
-                printf("info: written size %lu\n", written_size);
+                // Capture timestamps are monotonic and copied along the chain.
+                latency_mark(&latency, LATENCY_SINK, &cap_buf.timestamp);
+                metrics_add(METRIC_SINK_FRAMES, 1);
+                encoded_frames++;
 
                 // Queue the capture buffer after frame has been processed.
-                check_res(vid_queue_buffer(encoder_fd, &cap_buf));
+                if (release) {
+                    check_res(vid_queue_buffer(encoder_fd, &cap_buf));
+                    pool_set_state(&encoder_cap_pool, cap_buf.index, POOL_QUEUED);
+                }
 
             }
 
+            TRACE_END(span);
+
         }
 
         if (encoder_events & POLLOUT) {
 
+            TRACE_BEGIN(span, "stage", "enc-output", encoder_fd);
+
             // Try unqueuing a previous output buffer.
             struct v4l2_plane out_plane = {0};     
             struct v4l2_buffer out_buf = {0};
@@ -509,13 +1114,71 @@ int main() {
 
             if (check_ok_or_retry(vid_unqueue_buffer(encoder_fd, &out_buf))) {
                 // printf("info: encoder output buffer %d unqueued (fd %d)\n", out_buf.index, out_plane.m.fd);
-                check_res(vid_queue_mmap_buffer(adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, out_buf.index));
+                unsigned index = pool_release(&encoder_out_pool, out_buf.index);
+                check_res(vid_queue_mmap_buffer(adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, index));
+                pool_set_state(&adapter_cap_pool, index, POOL_QUEUED);
+                pool_flush(&encoder_out_pool, encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &encoder_out_pending);
             }
+
+            TRACE_END(span);
             
         }
 
+        if (netsink_events & POLLERR) {
+
+            TRACE_BEGIN(span, "stage", "netsink", netsink.fd);
+
+            // Queue back the encoder capture buffers released by the kernel.
+            unsigned indices[VIDEO_MAX_FRAME];
+            unsigned count = netsink_complete(&netsink, indices);
+            for (unsigned i = 0; i < count; i++) {
+                check_res(vid_queue_mmap_buffer_mp(encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, indices[i], 1));
+                pool_set_state(&encoder_cap_pool, indices[i], POOL_QUEUED);
+            }
+
+            TRACE_END(span);
+
+        }
+
+        if (config.record_path) {
+
+            TRACE_BEGIN(span, "stage", "disksink", disksink.event_fd);
+
+            // Writes queued by this iteration are submitted together, then the
+            // buffers of completed writes are queued back.
+            disksink_submit(&disksink);
+            if (disksink_events & POLLIN) {
+                unsigned indices[VIDEO_MAX_FRAME];
+                unsigned count = disksink_complete(&disksink, indices);
+                for (unsigned i = 0; i < count; i++) {
+                    check_res(vid_queue_mmap_buffer_mp(encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, indices[i], 1));
+                    pool_set_state(&encoder_cap_pool, indices[i], POOL_QUEUED);
+                }
+            }
+
+            TRACE_END(span);
+
+        }
+
     }
 
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double elapsed = (timespec_ms(&end_time) - timespec_ms(&start_time)) / 1e3;
+
+    printf("info: encoded %u frames in %.3f s (%.2f fps)\n", encoded_frames, elapsed, encoded_frames / elapsed);
+    if (encoded_frames) {
+        printf("info: %u wakeups, %.2f wakeups per frame\n", wakeups, (double) wakeups / encoded_frames);
+    }
+
+    pool_report(&sensor_pool);
+    pool_report(&adapter_out_pool);
+    pool_report(&adapter_cap_pool);
+    pool_report(&encoder_out_pool);
+    pool_report(&encoder_cap_pool);
+    latency_report(&latency);
+
+    cleanup(&pipeline, &encoder_ctrls, registries, abr_log);
     return 0;
 
 }
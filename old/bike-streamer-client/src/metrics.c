@@ -0,0 +1,115 @@
+#include "metrics.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+
+static const struct metrics_desc metrics_descs[METRIC_COUNT] = {
+    [METRIC_SENSOR_FRAMES] = { "bike_streamer_frames_total", "stage=\"sensor\"", "Frames dequeued by each stage, or written by the sink.", METRIC_COUNTER },
+    [METRIC_ISP_FRAMES] = { "bike_streamer_frames_total", "stage=\"isp\"", "", METRIC_COUNTER },
+    [METRIC_ENCODER_FRAMES] = { "bike_streamer_frames_total", "stage=\"encoder\"", "", METRIC_COUNTER },
+    [METRIC_SINK_FRAMES] = { "bike_streamer_frames_total", "stage=\"sink\"", "", METRIC_COUNTER },
+    [METRIC_ENCODED_BYTES] = { "bike_streamer_encoded_bytes_total", "", "Bytes of encoded frames.", METRIC_COUNTER },
+    [METRIC_SENSOR_ERRORS] = { "bike_streamer_buffer_errors_total", "stage=\"sensor\"", "Buffers dequeued with V4L2_BUF_FLAG_ERROR.", METRIC_COUNTER },
+    [METRIC_ISP_ERRORS] = { "bike_streamer_buffer_errors_total", "stage=\"isp\"", "", METRIC_COUNTER },
+    [METRIC_ENCODER_ERRORS] = { "bike_streamer_buffer_errors_total", "stage=\"encoder\"", "", METRIC_COUNTER },
+    [METRIC_POLL_TIMEOUTS] = { "bike_streamer_poll_timeouts_total", "", "Waits for the devices that timed out.", METRIC_COUNTER },
+    [METRIC_QUEUED_SENSOR] = { "bike_streamer_queued_buffers", "queue=\"sensor\"", "Buffers queued in the driver of each queue.", METRIC_GAUGE },
+    [METRIC_QUEUED_ISP_OUTPUT] = { "bike_streamer_queued_buffers", "queue=\"isp-output\"", "", METRIC_GAUGE },
+    [METRIC_QUEUED_ISP_CAPTURE] = { "bike_streamer_queued_buffers", "queue=\"isp-capture\"", "", METRIC_GAUGE },
+    [METRIC_QUEUED_ENCODER_OUTPUT] = { "bike_streamer_queued_buffers", "queue=\"enc-output\"", "", METRIC_GAUGE },
+    [METRIC_QUEUED_ENCODER_CAPTURE] = { "bike_streamer_queued_buffers", "queue=\"enc-capture\"", "", METRIC_GAUGE },
+};
+
+_Thread_local struct metrics_block *metrics_local;
+
+/// The calling thread came after all blocks were claimed.
+static _Thread_local bool metrics_overflow;
+
+/// Published metrics, NULL before 'metrics_open'.
+static struct metrics_shared *metrics_shared;
+static char metrics_name[64];
+
+/// Updates done before the metrics are published are not kept.
+static struct metrics_block metrics_unpublished;
+
+
+struct metrics_block *metrics_claim(void) {
+
+    if (!metrics_shared)
+        return &metrics_unpublished;
+
+    if (!metrics_overflow) {
+        unsigned index = atomic_fetch_add(&metrics_shared->threads, 1);
+        if (index < METRICS_THREADS - 1) {
+            metrics_local = &metrics_shared->blocks[index];
+            return metrics_local;
+        }
+        metrics_overflow = true;
+    }
+
+    return &metrics_shared->blocks[METRICS_THREADS - 1];
+
+}
+
+void metrics_open(const char *name) {
+
+    int fd = -1;
+    if (name) {
+        snprintf(metrics_name, sizeof(metrics_name), "/%s", name);
+        fd = shm_open(metrics_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, sizeof(struct metrics_shared)) == -1) {
+            printf("warn: failed to create shared memory '%s' (%s), metrics are not published\n", metrics_name, strerror(errno));
+            if (fd != -1) {
+                close(fd);
+                shm_unlink(metrics_name);
+                fd = -1;
+            }
+            metrics_name[0] = 0;
+        }
+    }
+
+    void *start = fd == -1
+        ? mmap(NULL, sizeof(struct metrics_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)
+        : mmap(NULL, sizeof(struct metrics_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd != -1)
+        close(fd);
+    if (start == MAP_FAILED) {
+        fprintf(stderr, "error: failed to map metrics (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    struct metrics_shared *shared = start;
+    memset(shared, 0, sizeof(struct metrics_shared));
+    shared->version = METRICS_VERSION;
+    shared->count = METRIC_COUNT;
+    shared->pid = getpid();
+    shared->start_time = time(NULL);
+    memcpy(shared->descs, metrics_descs, sizeof(metrics_descs));
+
+    // The magic is written last, scrapers ignore the object until then.
+    atomic_thread_fence(memory_order_release);
+    memcpy(shared->magic, METRICS_MAGIC, sizeof(shared->magic));
+
+    metrics_local = NULL;
+    metrics_shared = shared;
+
+    if (metrics_name[0])
+        printf("info: publishing metrics in shared memory '%s'\n", metrics_name);
+
+}
+
+void metrics_close(void) {
+    if (metrics_name[0]) {
+        shm_unlink(metrics_name);
+        metrics_name[0] = 0;
+    }
+}
@@ -0,0 +1,103 @@
+/// Counters and gauges of the pipeline, published in a shared memory object so
+/// that an external scraper reads them without disturbing the stages (see
+/// 'scrape.c', printing them in the Prometheus text format).
+///
+/// Each thread updating metrics claims its own block of values on first use
+/// and is the only writer of it, updates are then a relaxed load and store to
+/// memory already mapped, without any syscall or lock. The scraper sums the
+/// blocks of all threads, gauges are updated with deltas so that their sum is
+/// the value even when several threads move the same gauge. Threads beyond the
+/// number of blocks share the last one with atomic additions.
+///
+/// The shared object starts with a header and the descriptions of the metrics,
+/// so the scraper does not depend on the list below, only on this layout.
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+#define METRICS_MAGIC "bsmetric"
+#define METRICS_VERSION 1
+#define METRICS_DEFAULT_NAME "bike-streamer"
+
+#define METRICS_MAX 32
+#define METRICS_THREADS 16
+
+enum metric_id {
+    METRIC_SENSOR_FRAMES,
+    METRIC_ISP_FRAMES,
+    METRIC_ENCODER_FRAMES,
+    METRIC_SINK_FRAMES,
+    METRIC_ENCODED_BYTES,
+    METRIC_SENSOR_ERRORS,
+    METRIC_ISP_ERRORS,
+    METRIC_ENCODER_ERRORS,
+    METRIC_POLL_TIMEOUTS,
+    METRIC_QUEUED_SENSOR,
+    METRIC_QUEUED_ISP_OUTPUT,
+    METRIC_QUEUED_ISP_CAPTURE,
+    METRIC_QUEUED_ENCODER_OUTPUT,
+    METRIC_QUEUED_ENCODER_CAPTURE,
+    METRIC_COUNT,
+};
+
+enum metric_type {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+};
+
+/// Description of a metric, metrics of the same name follow each other and
+/// only differ by their labels.
+struct metrics_desc {
+    char name[48];
+    char labels[48];
+    char help[80];
+    uint32_t type;
+};
+
+/// Values written by one thread, on their own cache lines.
+struct metrics_block {
+    _Alignas(64) _Atomic int64_t values[METRICS_MAX];
+};
+
+/// Layout of the shared object.
+struct metrics_shared {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    /// Process publishing the metrics, and its start in CLOCK_REALTIME seconds.
+    uint64_t pid;
+    uint64_t start_time;
+    /// Blocks claimed so far, the scraper only sums those.
+    _Atomic uint32_t threads;
+    struct metrics_desc descs[METRICS_MAX];
+    struct metrics_block blocks[METRICS_THREADS];
+};
+
+
+/// Block of the calling thread, NULL until its first update.
+extern _Thread_local struct metrics_block *metrics_local;
+
+/// Claim the block of the calling thread.
+struct metrics_block *metrics_claim(void);
+
+/// Publish the metrics in the shared memory object of the given name, created
+/// or truncated. Without shared memory, or if the name is NULL, the metrics are
+/// kept in private memory. Must be called before the threads start.
+void metrics_open(const char *name);
+
+/// Remove the name of the shared object, the mapping is kept since threads may
+/// still hold their block.
+void metrics_close(void);
+
+static inline void metrics_add(enum metric_id id, int64_t n) {
+    struct metrics_block *block = metrics_local ? metrics_local : metrics_claim();
+    _Atomic int64_t *value = &block->values[id];
+    if (metrics_local)
+        atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(value, n, memory_order_relaxed);
+}
@@ -0,0 +1,111 @@
+#include "net.h"
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+
+int net_connect(const char *address, int type) {
+
+    char host[256];
+    const char *port = strrchr(address, ':');
+    if (!port || port == address || (size_t) (port - address) >= sizeof(host)) {
+        fprintf(stderr, "error: invalid network address '%s', expected host:port\n", address);
+        exit(1);
+    }
+
+    memcpy(host, address, port - address);
+    host[port - address] = '\0';
+    port++;
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type;
+
+    struct addrinfo *res;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "error: failed to resolve '%s' (%s)\n", address, gai_strerror(err));
+        exit(1);
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        fprintf(stderr, "error: failed to connect to '%s' (%s)\n", address, strerror(errno));
+        exit(1);
+    }
+
+    return fd;
+
+}
+
+int net_listen(const char *address, int type) {
+
+    char host[256] = "";
+    const char *port = strrchr(address, ':');
+    if (port && (size_t) (port - address) >= sizeof(host)) {
+        fprintf(stderr, "error: invalid network address '%s', expected [host:]port\n", address);
+        exit(1);
+    }
+
+    if (port) {
+        memcpy(host, address, port - address);
+        host[port - address] = '\0';
+        port++;
+    } else {
+        port = address;
+    }
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *res;
+    int err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+    if (err) {
+        fprintf(stderr, "error: failed to resolve '%s' (%s)\n", address, gai_strerror(err));
+        exit(1);
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, type | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+            (hints.ai_socktype == SOCK_STREAM && listen(fd, 16) == -1)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        fprintf(stderr, "error: failed to listen on '%s' (%s)\n", address, strerror(errno));
+        exit(1);
+    }
+
+    return fd;
+
+}
@@ -0,0 +1,12 @@
+/// Socket helpers shared by the network sinks.
+
+#pragma once
+
+
+/// Connect a socket of the given type (SOCK_STREAM, SOCK_DGRAM) to a 'host:port'
+/// address, errors are fatal.
+int net_connect(const char *address, int type);
+
+/// Listen on a socket of the given type, flags such as SOCK_NONBLOCK included,
+/// bound to a 'port' or 'host:port' address, errors are fatal.
+int net_listen(const char *address, int type);
@@ -0,0 +1,143 @@
+#define _GNU_SOURCE
+
+#include "netsink.h"
+#include "net.h"
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+
+void netsink_open(struct netsink *sink, const char *address) {
+
+    memset(sink, 0, sizeof(struct netsink));
+
+    sink->fd = net_connect(address, SOCK_STREAM);
+
+    int one = 1;
+    setsockopt(sink->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Kernels before 4.14 don't support zerocopy, data is copied as usual.
+    sink->zerocopy = setsockopt(sink->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    if (!sink->zerocopy)
+        fprintf(stderr, "warn: zerocopy unsupported, sends are copied (%s)\n", strerror(errno));
+
+}
+
+void netsink_close(struct netsink *sink) {
+    close(sink->fd);
+    sink->fd = -1;
+}
+
+bool netsink_send(struct netsink *sink, unsigned index, const void *data, size_t size) {
+
+    const char *ptr = data;
+    bool copy = false;
+    sink->frames++;
+    sink->bytes += size;
+
+    while (size) {
+
+        struct iovec iov = { (void *) ptr, size };
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        bool zerocopy = sink->zerocopy && !copy && sink->inflight < NETSINK_MAX_INFLIGHT;
+        ssize_t len = sendmsg(sink->fd, &msg, MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0));
+
+        if (len == -1 && zerocopy && errno == ENOBUFS) {
+            // The socket option memory limit is reached, copy the remaining data.
+            copy = true;
+            continue;
+        } else if (len == -1 && errno == EINTR) {
+            continue;
+        } else if (len == -1) {
+            fprintf(stderr, "error: network sink send failed (%s)\n", strerror(errno));
+            exit(1);
+        }
+
+        if (zerocopy) {
+            // Partial sends also take an identifier.
+            sink->inflight_index[sink->next_id % NETSINK_MAX_INFLIGHT] = index;
+            sink->next_id++;
+            sink->inflight++;
+            sink->outstanding[index]++;
+            sink->zerocopy_sends++;
+        } else if (sink->zerocopy) {
+            sink->fallback_sends++;
+        }
+
+        ptr += len;
+        size -= len;
+
+    }
+
+    return sink->outstanding[index] == 0;
+
+}
+
+unsigned netsink_complete(struct netsink *sink, unsigned *indices) {
+
+    unsigned count = 0;
+
+    for (;;) {
+
+        char control[128];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sink->fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error: network sink error queue (%s)\n", strerror(errno));
+            exit(1);
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                fprintf(stderr, "error: network sink error (%s)\n", strerror(serr->ee_errno));
+                exit(1);
+            }
+
+            // The notification covers the inclusive range of identifiers [info, data].
+            uint32_t lo = serr->ee_info, hi = serr->ee_data;
+            sink->notifications++;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                sink->copied_sends += hi - lo + 1;
+
+            for (uint32_t id = lo; id != hi + 1; id++) {
+                unsigned index = sink->inflight_index[id % NETSINK_MAX_INFLIGHT];
+                sink->inflight--;
+                if (--sink->outstanding[index] == 0)
+                    indices[count++] = index;
+            }
+
+        }
+
+    }
+
+    return count;
+
+}
+
+void netsink_report(const struct netsink *sink) {
+    printf("info: network sink %lu frames, %lu bytes, %lu zerocopy sends (%lu copied by kernel), %lu fallback sends, %lu notifications\n",
+        sink->frames, sink->bytes, sink->zerocopy_sends, sink->copied_sends, sink->fallback_sends, sink->notifications);
+}
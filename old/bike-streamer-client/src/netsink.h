@@ -0,0 +1,55 @@
+/// Network sink sending encoded frames straight from the mapped encoder capture
+/// buffers over TCP with MSG_ZEROCOPY. A buffer is only released, to be queued
+/// back to the encoder, once the kernel has notified the completion of all the
+/// sends reading from it.
+
+#pragma once
+
+#include "v4l2.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/// Maximum number of zerocopy sends in flight, a power of two. Sends are copied
+/// when it is reached.
+#define NETSINK_MAX_INFLIGHT 1024
+
+struct netsink {
+    int fd;
+    /// False if the socket doesn't support zerocopy, all sends are then copied.
+    bool zerocopy;
+    /// Identifier of the next zerocopy send, the kernel counts one per sendmsg call.
+    uint32_t next_id;
+    unsigned inflight;
+    /// Buffer read by each send in flight, indexed by identifier.
+    unsigned inflight_index[NETSINK_MAX_INFLIGHT];
+    /// Number of sends in flight reading from each buffer.
+    unsigned outstanding[VIDEO_MAX_FRAME];
+    unsigned long frames;
+    unsigned long bytes;
+    unsigned long zerocopy_sends;
+    /// Completed sends for which the kernel fell back to copying the data.
+    unsigned long copied_sends;
+    /// Sends copied because zerocopy failed or too many sends were in flight.
+    unsigned long fallback_sends;
+    unsigned long notifications;
+};
+
+
+/// Connect the sink to the given 'host:port' address, errors are fatal.
+void netsink_open(struct netsink *sink, const char *address);
+void netsink_close(struct netsink *sink);
+
+/// Send a frame read from the given buffer, return true if the buffer can be
+/// released immediately because its data was copied.
+bool netsink_send(struct netsink *sink, unsigned index, const void *data, size_t size);
+
+/// Process the completion notifications, the socket has POLLERR set when some
+/// are available. Indices of released buffers are written to 'indices' that must
+/// hold VIDEO_MAX_FRAME items, their number is returned.
+unsigned netsink_complete(struct netsink *sink, unsigned *indices);
+
+/// Print the send statistics.
+void netsink_report(const struct netsink *sink);
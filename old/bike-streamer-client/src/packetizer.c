@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+
+#include "packetizer.h"
+#include "net.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+
+/// Maximum number of data packets of a frame protected by parity packets.
+#define PACKETIZER_MAX_FRAGMENTS 4096
+
+/// A data packet of the frame being sent, kept to compute the parity shards.
+struct packet_fragment {
+    const uint8_t *payload;
+    uint16_t size;
+    uint8_t flags;
+};
+
+/// Headers are in the slab while payloads point into the encoded buffer, except
+/// for parity packets which are computed in the slab.
+struct packet_slab {
+    unsigned count;
+    struct packet_header headers[PACKETIZER_SLAB];
+    struct iovec iovs[PACKETIZER_SLAB][2];
+    struct mmsghdr msgs[PACKETIZER_SLAB];
+    uint8_t parity[PACKETIZER_SLAB][sizeof(struct fec_header) + FEC_MAX_SHARD];
+    struct packet_fragment fragments[PACKETIZER_MAX_FRAGMENTS];
+};
+
+
+void packetizer_open(struct packetizer *pkt, const char *address, unsigned mtu) {
+
+    memset(pkt, 0, sizeof(struct packetizer));
+    pkt->mtu = mtu;
+    pkt->fd = net_connect(address, SOCK_DGRAM);
+
+    struct packet_slab *slab = calloc(1, sizeof(struct packet_slab));
+    if (!slab) {
+        fprintf(stderr, "error: failed to allocate packet slab\n");
+        exit(1);
+    }
+
+    // Messages of the slab are bound once to their header and payload vectors.
+    for (unsigned i = 0; i < PACKETIZER_SLAB; i++) {
+        slab->iovs[i][0].iov_base = &slab->headers[i];
+        slab->iovs[i][0].iov_len = sizeof(struct packet_header);
+        slab->msgs[i].msg_hdr.msg_iov = slab->iovs[i];
+        slab->msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    pkt->slab = slab;
+
+    // Answers are only read after sending the next frame, their arrival time is
+    // taken from the kernel to measure the delay.
+    int one = 1;
+    setsockopt(pkt->fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+
+}
+
+void packetizer_set_fec(struct packetizer *pkt, enum fec_scheme scheme, unsigned key_percent, unsigned percent) {
+
+    if (scheme != FEC_NONE && pkt->mtu - sizeof(struct packet_header) > FEC_MAX_SHARD) {
+        fprintf(stderr, "error: mtu too large for forward error correction, max %zu\n", FEC_MAX_SHARD + sizeof(struct packet_header));
+        exit(1);
+    }
+
+    fec_init();
+    pkt->fec = scheme;
+    pkt->fec_key_percent = key_percent;
+    pkt->fec_percent = percent;
+
+}
+
+void packetizer_close(struct packetizer *pkt) {
+    close(pkt->fd);
+    free(pkt->slab);
+    pkt->fd = -1;
+    pkt->slab = NULL;
+}
+
+/// Send all the packets of the slab.
+static void packetizer_flush(struct packetizer *pkt) {
+
+    struct packet_slab *slab = pkt->slab;
+    unsigned sent = 0;
+    while (sent < slab->count) {
+        int ret = sendmmsg(pkt->fd, slab->msgs + sent, slab->count - sent, 0);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret == -1) {
+            // A previous datagram may have been refused by the peer, the remaining
+            // packets are dropped like they would be on the network.
+            pkt->errors += slab->count - sent;
+            break;
+        }
+        sent += ret;
+        pkt->batches++;
+    }
+
+    slab->count = 0;
+
+}
+
+/// Add a packet to the slab, which is flushed first if full so that the last
+/// packet of a frame is always in the slab when the frame ends. Return the
+/// index of the packet in the slab.
+static unsigned packetizer_emit(struct packetizer *pkt, const uint8_t *payload, size_t size, uint8_t flags, uint16_t fragment, uint64_t timestamp) {
+
+    struct packet_slab *slab = pkt->slab;
+    if (slab->count == PACKETIZER_SLAB)
+        packetizer_flush(pkt);
+
+    unsigned i = slab->count++;
+    struct packet_header *header = &slab->headers[i];
+    header->version = PACKET_VERSION;
+    header->flags = flags;
+    header->fragment = htons(fragment);
+    header->frame = htonl(pkt->frame);
+    header->sequence = htonl(pkt->sequence++);
+    header->timestamp = htobe64(timestamp);
+
+    slab->iovs[i][1].iov_base = (void *) payload;
+    slab->iovs[i][1].iov_len = size;
+
+    pkt->packets++;
+    pkt->bytes += sizeof(struct packet_header) + size;
+
+    if (pkt->fec != FEC_NONE && !(flags & PACKET_FLAG_PARITY) && fragment < PACKETIZER_MAX_FRAGMENTS) {
+        struct packet_fragment *frag = &slab->fragments[fragment];
+        frag->payload = payload;
+        frag->size = size;
+        frag->flags = flags;
+    }
+
+    return i;
+
+}
+
+/// Emit the parity packets of a block of data packets. The parity shard is
+/// computed in the slab from the flags, length and payload of each data packet,
+/// the zero padding of shorter shards doesn't change the parity.
+static void packetizer_emit_parity(struct packetizer *pkt, unsigned start, unsigned k, unsigned m, uint16_t *parity_fragment, uint8_t key, uint64_t timestamp) {
+
+    struct packet_slab *slab = pkt->slab;
+    const struct packet_fragment *frags = &slab->fragments[start];
+
+    unsigned shard_size = 0;
+    for (unsigned i = 0; i < k; i++) {
+        unsigned size = FEC_SHARD_PREFIX + frags[i].size;
+        if (size > shard_size)
+            shard_size = size;
+    }
+
+    for (unsigned j = 0; j < m; j++) {
+
+        // The payload is bound to the parity buffer of the slot it will occupy.
+        if (slab->count == PACKETIZER_SLAB)
+            packetizer_flush(pkt);
+        uint8_t *buffer = slab->parity[slab->count];
+        size_t size = sizeof(struct fec_header) + shard_size;
+
+        struct fec_header fec = {
+            .scheme = pkt->fec,
+            .k = k,
+            .m = m,
+            .index = j,
+            .block_start = htons(start),
+            .shard_size = htons(shard_size),
+        };
+        memcpy(buffer, &fec, sizeof(fec));
+
+        uint8_t *shard = buffer + sizeof(fec);
+        memset(shard, 0, shard_size);
+        for (unsigned i = 0; i < k; i++) {
+            uint8_t c = fec_coef(pkt->fec, j, i);
+            uint8_t prefix[FEC_SHARD_PREFIX] = { frags[i].flags, frags[i].size >> 8, frags[i].size & 0xFF };
+            fec_mul_add(shard, prefix, c, FEC_SHARD_PREFIX);
+            fec_mul_add(shard + FEC_SHARD_PREFIX, frags[i].payload, c, frags[i].size);
+        }
+
+        packetizer_emit(pkt, buffer, size, PACKET_FLAG_PARITY | key, (*parity_fragment)++, timestamp);
+        pkt->parity_packets++;
+
+    }
+
+}
+
+/// Emit the parity packets of the frame, data packets are split in blocks of
+/// up to 64 packets for Reed-Solomon, while XOR protects smaller blocks with a
+/// single parity packet each.
+static void packetizer_protect_frame(struct packetizer *pkt, unsigned count, uint8_t key, uint64_t timestamp) {
+
+    unsigned percent = key ? pkt->fec_key_percent : pkt->fec_percent;
+    if (!percent)
+        return;
+
+    if (count > PACKETIZER_MAX_FRAGMENTS) {
+        pkt->unprotected_frames++;
+        return;
+    }
+
+    unsigned block = FEC_MAX_DATA;
+    if (pkt->fec == FEC_XOR) {
+        block = (100 + percent - 1) / percent;
+        if (block > FEC_MAX_DATA)
+            block = FEC_MAX_DATA;
+    }
+
+    uint16_t parity_fragment = 0;
+    for (unsigned start = 0; start < count; start += block) {
+        unsigned k = count - start < block ? count - start : block;
+        unsigned m = 1;
+        if (pkt->fec == FEC_RS) {
+            m = (k * percent + 99) / 100;
+            if (m > FEC_MAX_PARITY)
+                m = FEC_MAX_PARITY;
+        }
+        packetizer_emit_parity(pkt, start, k, m, &parity_fragment, key, timestamp);
+    }
+
+}
+
+/// Find the next Annex-B start code, including the leading zero of four bytes
+/// start codes, return 'end' if none.
+static const uint8_t *packetizer_next_nal(const uint8_t *ptr, const uint8_t *end) {
+    for (; ptr + 3 <= end; ptr++) {
+        if (ptr[0] == 0 && ptr[1] == 0 && ptr[2] == 1)
+            return ptr;
+        if (ptr + 4 <= end && ptr[0] == 0 && ptr[1] == 0 && ptr[2] == 0 && ptr[3] == 1)
+            return ptr;
+    }
+    return end;
+}
+
+void packetizer_send_frame(struct packetizer *pkt, const void *data, size_t size, const struct timeval *timestamp, bool keyframe) {
+
+    if (!size)
+        return;
+
+    const uint8_t *end = (const uint8_t *) data + size;
+    size_t payload_max = pkt->mtu - sizeof(struct packet_header);
+    if (pkt->fec != FEC_NONE)
+        payload_max -= sizeof(struct fec_header) + FEC_SHARD_PREFIX;
+    const uint8_t key = keyframe ? PACKET_FLAG_KEYFRAME : 0;
+    uint64_t ts = (uint64_t) timestamp->tv_sec * 1000000 + timestamp->tv_usec;
+    uint16_t fragment = 0;
+
+    // Pending aggregation of consecutive whole NAL units.
+    const uint8_t *agg = NULL;
+    size_t agg_size = 0;
+
+    const uint8_t *nal = data;
+    while (nal < end) {
+
+        const uint8_t *next = packetizer_next_nal(nal + 3, end);
+        size_t nal_size = next - nal;
+
+        if (agg && agg_size + nal_size <= payload_max) {
+            agg_size += nal_size;
+            nal = next;
+            continue;
+        }
+
+        if (agg) {
+            packetizer_emit(pkt, agg, agg_size, PACKET_FLAG_NAL_START | PACKET_FLAG_NAL_END | key, fragment++, ts);
+            agg = NULL;
+        }
+
+        if (nal_size <= payload_max) {
+            agg = nal;
+            agg_size = nal_size;
+        } else {
+            for (size_t offset = 0; offset < nal_size; offset += payload_max) {
+                size_t len = nal_size - offset < payload_max ? nal_size - offset : payload_max;
+                uint8_t flags = key;
+                if (offset == 0)
+                    flags |= PACKET_FLAG_NAL_START;
+                if (offset + len == nal_size)
+                    flags |= PACKET_FLAG_NAL_END;
+                packetizer_emit(pkt, nal + offset, len, flags, fragment++, ts);
+            }
+            pkt->fragmented_nals++;
+        }
+
+        nal = next;
+
+    }
+
+    if (agg)
+        packetizer_emit(pkt, agg, agg_size, PACKET_FLAG_NAL_START | PACKET_FLAG_NAL_END | key, fragment++, ts);
+
+    pkt->slab->headers[pkt->slab->count - 1].flags |= PACKET_FLAG_FRAME_END;
+    if (pkt->fec != FEC_NONE) {
+        if (fragment <= PACKETIZER_MAX_FRAGMENTS)
+            pkt->slab->fragments[fragment - 1].flags |= PACKET_FLAG_FRAME_END;
+        packetizer_protect_frame(pkt, fragment, key, ts);
+    }
+    packetizer_flush(pkt);
+    pkt->frame++;
+    pkt->frames++;
+
+    packetizer_read_answers(pkt);
+
+}
+
+void packetizer_read_answers(struct packetizer *pkt) {
+
+    struct packet_answer answer;
+    char control[64];
+    ssize_t len;
+
+    struct timespec now, now_real;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &now_real);
+
+    for (;;) {
+
+        struct iovec iov = { &answer, sizeof(answer) };
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        len = recvmsg(pkt->fd, &msg, MSG_DONTWAIT);
+        if (len == -1 && (errno == EINTR || errno == ECONNREFUSED))
+            continue;
+        if (len == -1)
+            break;
+
+        if (len != sizeof(answer) || answer.version != PACKET_VERSION)
+            continue;
+
+        pkt->answers++;
+        if (answer.status != PACKET_ANSWER_COMPLETE) {
+            pkt->lost_frames++;
+            continue;
+        }
+
+        // Capture timestamps are monotonic, like the V4L2 buffer timestamps, while
+        // the kernel arrival timestamp is real time.
+        double age = 0;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec arrival;
+                memcpy(&arrival, CMSG_DATA(cm), sizeof(arrival));
+                age = (now_real.tv_sec - arrival.tv_sec) * 1e3 + (now_real.tv_nsec - arrival.tv_nsec) / 1e6;
+            }
+        }
+
+        uint64_t ts = be64toh(answer.timestamp);
+        double delay = (now.tv_sec * 1e6 + now.tv_nsec / 1e3 - (double) ts) / 1e3 - age;
+        pkt->delay_sum += delay;
+        if (delay > pkt->delay_max)
+            pkt->delay_max = delay;
+
+    }
+
+}
+
+void packetizer_report(const struct packetizer *pkt) {
+    printf("info: packetizer %lu frames, %lu packets (%.2f per frame), %lu bytes, %lu batches, %lu fragmented nals, %lu errors\n",
+        pkt->frames, pkt->packets, pkt->frames ? (double) pkt->packets / pkt->frames : 0,
+        pkt->bytes, pkt->batches, pkt->fragmented_nals, pkt->errors);
+    if (pkt->fec != FEC_NONE)
+        printf("info: fec %s (%s kernel) %lu parity packets, %lu unprotected frames\n",
+            pkt->fec == FEC_XOR ? "xor" : "rs", fec_kernel_name(), pkt->parity_packets, pkt->unprotected_frames);
+    unsigned long complete = pkt->answers - pkt->lost_frames;
+    if (pkt->answers)
+        printf("info: receiver answered %lu frames, %lu lost, delay avg %.2f ms, max %.2f ms\n",
+            pkt->answers, pkt->lost_frames, complete ? pkt->delay_sum / complete : 0, pkt->delay_max);
+}
@@ -0,0 +1,122 @@
+/// Packetizer of encoded access units for the UDP link. Access units are split
+/// along NAL unit boundaries into datagrams no larger than the MTU: consecutive
+/// small NAL units are aggregated and larger ones are fragmented, similarly to
+/// RTP STAP-A and FU-A. Payloads keep the Annex-B start codes so the receiver
+/// rebuilds the access unit by concatenating the payloads of a frame.
+///
+/// With forward error correction, parity packets follow the data packets of each
+/// frame so that the receiver rebuilds lost packets without retransmission.
+
+#pragma once
+
+#include "fec.h"
+
+#include <sys/time.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define PACKET_VERSION 1
+
+/// Default size of datagrams, small enough to avoid IP fragmentation on mobile
+/// networks.
+#define PACKETIZER_DEFAULT_MTU 1200
+
+/// Number of packets of a slab, sent with one sendmmsg call.
+#define PACKETIZER_SLAB 64
+
+/// The payload starts at the beginning of a NAL unit.
+#define PACKET_FLAG_NAL_START   0x01
+/// The payload ends at the end of a NAL unit.
+#define PACKET_FLAG_NAL_END     0x02
+/// Last packet of the frame.
+#define PACKET_FLAG_FRAME_END   0x04
+/// The frame is a key frame.
+#define PACKET_FLAG_KEYFRAME    0x08
+/// Parity packet, the payload is a 'struct fec_header' followed by the parity
+/// shard and the fragment is the index of the parity packet in its frame.
+#define PACKET_FLAG_PARITY      0x10
+
+/// Header of each datagram, fields are in network byte order.
+struct packet_header {
+    uint8_t version;
+    uint8_t flags;
+    /// Index of the packet in its frame.
+    uint16_t fragment;
+    /// Sequence number of the frame.
+    uint32_t frame;
+    /// Sequence number of the packet, over all frames.
+    uint32_t sequence;
+    /// Capture timestamp of the frame, in microseconds.
+    uint64_t timestamp;
+} __attribute__((packed));
+
+/// The frame has been received entirely.
+#define PACKET_ANSWER_COMPLETE  0
+/// The frame left the receiver's reorder window with missing packets.
+#define PACKET_ANSWER_LOST      1
+
+/// Answer of the receiver for each frame, sent back to the sender to detect
+/// losses, lost frames are not recovered. Fields are in network byte order.
+struct packet_answer {
+    uint8_t version;
+    uint8_t status;
+    /// Number of packets received for the frame.
+    uint16_t packets;
+    uint32_t frame;
+    /// Capture timestamp of the frame echoed, zero if no packet was received.
+    uint64_t timestamp;
+} __attribute__((packed));
+
+/// Packets being built, see 'packetizer.c'.
+struct packet_slab;
+
+struct packetizer {
+    int fd;
+    /// Maximum size of a datagram, header included.
+    unsigned mtu;
+    uint32_t frame;
+    uint32_t sequence;
+    /// Slab of packets allocated on open so that packing never allocates.
+    struct packet_slab *slab;
+    /// Forward error correction, parity packets per hundred data packets of key
+    /// frames and other frames.
+    enum fec_scheme fec;
+    unsigned fec_key_percent;
+    unsigned fec_percent;
+    unsigned long frames;
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long batches;
+    unsigned long fragmented_nals;
+    unsigned long parity_packets;
+    /// Frames sent without parity because they have too many packets.
+    unsigned long unprotected_frames;
+    /// Packets that could not be sent, such as when no receiver is listening.
+    unsigned long errors;
+    /// Answers of the receiver, the delay goes from capture to the answer.
+    unsigned long answers;
+    unsigned long lost_frames;
+    double delay_sum;
+    double delay_max;
+};
+
+
+/// Open the UDP socket to the given 'host:port' address, errors are fatal.
+void packetizer_open(struct packetizer *pkt, const char *address, unsigned mtu);
+void packetizer_close(struct packetizer *pkt);
+
+/// Enable forward error correction with the given redundancy in percent, the
+/// payload of data packets is reduced so that parity packets fit the MTU.
+void packetizer_set_fec(struct packetizer *pkt, enum fec_scheme scheme, unsigned key_percent, unsigned percent);
+
+/// Packetize and send an Annex-B access unit, the data is no longer read on return.
+void packetizer_send_frame(struct packetizer *pkt, const void *data, size_t size, const struct timeval *timestamp, bool keyframe);
+
+/// Read the pending answers of the receiver, done after sending each frame.
+void packetizer_read_answers(struct packetizer *pkt);
+
+/// Print the packetization statistics.
+void packetizer_report(const struct packetizer *pkt);
@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+
+#include "pipeline.h"
+#include "check.h"
+#include "ring.h"
+#include "v4l2.h"
+#include "trace.h"
+
+#include <sys/eventfd.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <time.h>
+
+
+/// Rings between stages, the forward rings carry filled buffers down the chain
+/// and the return rings carry consumed buffers back to the stage owning them.
+enum ring_id {
+    RING_ISP_IN,
+    RING_SENSOR_RETURN,
+    RING_ENCODER_IN,
+    RING_ISP_RETURN,
+    RING_SINK,
+    RING_ENCODER_RETURN,
+    RING_COUNT,
+};
+
+enum stage_id {
+    STAGE_SENSOR,
+    STAGE_ISP_IN,
+    STAGE_ISP_OUT,
+    STAGE_ENCODER_IN,
+    STAGE_ENCODER_OUT,
+    STAGE_SINK,
+    STAGE_COUNT,
+};
+
+struct runtime;
+
+/// A pipeline stage running on its own thread.
+struct stage {
+    const char *name;
+    struct runtime *rt;
+    pthread_t thread;
+    /// Device waited by the stage, -1 if none.
+    int fd;
+    short events;
+    /// Ring consumed by the stage.
+    enum ring_id in;
+    /// Eventfd used by producers to wake the stage, and set while it is waiting.
+    int notify_fd;
+    atomic_bool waiting;
+    /// Perform all the available work, return true if something was done.
+    bool (*step)(struct stage *stage);
+    /// Upstream buffer waiting for a free slot of the output queue fed by the stage.
+    struct pool_pending pending;
+    unsigned long frames;
+    unsigned long wakeups;
+};
+
+/// Runtime state of the running pipeline.
+struct runtime {
+    const struct pipeline *pipeline;
+    struct ring rings[RING_COUNT];
+    struct stage stages[STAGE_COUNT];
+    atomic_bool stop;
+};
+
+/// Stage consuming each ring, to be notified on push.
+static const enum stage_id ring_consumers[RING_COUNT] = {
+    [RING_ISP_IN] = STAGE_ISP_IN,
+    [RING_SENSOR_RETURN] = STAGE_SENSOR,
+    [RING_ENCODER_IN] = STAGE_ENCODER_IN,
+    [RING_ISP_RETURN] = STAGE_ISP_OUT,
+    [RING_SINK] = STAGE_SINK,
+    [RING_ENCODER_RETURN] = STAGE_ENCODER_OUT,
+};
+
+static const char *ring_names[RING_COUNT] = {
+    [RING_ISP_IN] = "isp-in",
+    [RING_SENSOR_RETURN] = "sensor-return",
+    [RING_ENCODER_IN] = "encoder-in",
+    [RING_ISP_RETURN] = "isp-return",
+    [RING_SINK] = "sink",
+    [RING_ENCODER_RETURN] = "encoder-return",
+};
+
+
+static void stage_notify(struct stage *stage) {
+    // Pairs with the fence in 'stage_wait', either the consumer sees the pushed
+    // item when checking its ring, or we see it waiting and wake it.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&stage->waiting, false))
+        eventfd_write(stage->notify_fd, 1);
+}
+
+static void stage_push(struct stage *stage, enum ring_id id, const struct frame_ref *ref) {
+    struct runtime *rt = stage->rt;
+    if (!ring_push(&rt->rings[id], ref)) {
+        fprintf(stderr, "error: ring %s is full\n", ring_names[id]);
+        exit(1);
+    }
+    stage_notify(&rt->stages[ring_consumers[id]]);
+}
+
+static void stage_wait(struct stage *stage) {
+
+    atomic_store(&stage->waiting, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring_len(&stage->rt->rings[stage->in]) || atomic_load(&stage->rt->stop)) {
+        atomic_store(&stage->waiting, false);
+        return;
+    }
+
+    struct pollfd fds[2] = {0};
+    fds[0].fd = stage->notify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stage->fd;
+    fds[1].events = stage->events;
+
+    int ret = vid_poll(fds, 2, 2000);
+    atomic_store(&stage->waiting, false);
+    stage->wakeups++;
+
+    if (ret == 0) {
+        // The stage keeps waiting, a stalled device shows in the metrics.
+        metrics_add(METRIC_POLL_TIMEOUTS, 1);
+        printf("warn: %s stage timed out\n", stage->name);
+        return;
+    } else if (ret == -1 && errno != EINTR) {
+        fprintf(stderr, "error: %s stage poll error (%s)\n", stage->name, strerror(errno));
+        exit(1);
+    }
+
+    if (fds[0].revents & POLLIN) {
+        eventfd_t value;
+        eventfd_read(stage->notify_fd, &value);
+    }
+
+    // The network sink socket signals zerocopy completions with POLLERR.
+    if ((fds[1].revents & POLLERR) && stage->events)
+        fprintf(stderr, "error: %s stage device error\n", stage->name);
+
+}
+
+static void *stage_main(void *arg) {
+    struct stage *stage = arg;
+    while (!atomic_load(&stage->rt->stop)) {
+        TRACE_BEGIN(span, "stage", stage->name, stage->fd);
+        bool progress = stage->step(stage);
+        TRACE_END(span);
+        if (!progress)
+            stage_wait(stage);
+    }
+    return NULL;
+}
+
+///
+/// STAGES
+///
+
+static bool sensor_step(struct stage *stage) {
+
+    const struct pipeline *p = stage->rt->pipeline;
+    bool progress = false;
+
+    struct frame_ref ref;
+    while (ring_pop(&stage->rt->rings[RING_SENSOR_RETURN], &ref)) {
+        check_res(vid_queue_mmap_buffer(p->sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, ref.index));
+        pool_set_state(p->sensor_pool, ref.index, POOL_QUEUED);
+        progress = true;
+    }
+
+    struct v4l2_buffer cap_buf = {0};
+    cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cap_buf.memory = V4L2_MEMORY_MMAP;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->sensor_fd, &cap_buf))) {
+        if (pool_requeue_error(p->sensor_pool, p->sensor_fd, &cap_buf, METRIC_SENSOR_ERRORS))
+            continue;
+        pool_set_state(p->sensor_pool, cap_buf.index, POOL_HELD);
+        latency_capture(p->latency, &cap_buf.timestamp, cap_buf.flags);
+        metrics_add(METRIC_SENSOR_FRAMES, 1);
+        if (p->stats) {
+            stats_frame(p->stats, p->sensor_buffers_map[cap_buf.index].start);
+            if (p->awb)
+                awb_update(p->awb, p->stats);
+            if (p->awb && p->lsc)
+                lsc_update(p->lsc, p->awb->red_written, p->awb->blue_written);
+            if (p->ae)
+                ae_update(p->ae, p->stats);
+            check_res(ctrls_flush(p->sensor_ctrls));
+            check_res(ctrls_flush(p->adapter_ctrls));
+        }
+        ref.index = cap_buf.index;
+        ref.dmabuf_fd = p->sensor_dmabuf_fd[cap_buf.index];
+        ref.bytesused = cap_buf.bytesused;
+        ref.length = cap_buf.length;
+        ref.flags = cap_buf.flags;
+        ref.field = cap_buf.field;
+        ref.timestamp = cap_buf.timestamp;
+        stage_push(stage, RING_ISP_IN, &ref);
+        stage->frames++;
+        progress = true;
+    }
+
+    return progress;
+
+}
+
+static bool isp_in_step(struct stage *stage) {
+
+    const struct pipeline *p = stage->rt->pipeline;
+    bool progress = false;
+
+    struct frame_ref ref, dropped;
+
+    // Slots are freed first so that the pending frame can take one.
+    struct v4l2_buffer out_buf = {0};
+    out_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    out_buf.memory = V4L2_MEMORY_DMABUF;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->adapter_out_fd, &out_buf))) {
+        ref.index = pool_release(p->adapter_out_pool, out_buf.index);
+        stage_push(stage, RING_SENSOR_RETURN, &ref);
+        stage->frames++;
+        progress = true;
+    }
+
+    pool_flush(p->adapter_out_pool, p->adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &stage->pending);
+
+    while (ring_pop(&stage->rt->rings[RING_ISP_IN], &ref)) {
+        if (pool_offer(p->adapter_out_pool, p->adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &stage->pending, &ref, &dropped))
+            stage_push(stage, RING_SENSOR_RETURN, &dropped);
+        progress = true;
+    }
+
+    return progress;
+
+}
+
+static bool isp_out_step(struct stage *stage) {
+
+    const struct pipeline *p = stage->rt->pipeline;
+    bool progress = false;
+
+    struct frame_ref ref;
+    while (ring_pop(&stage->rt->rings[RING_ISP_RETURN], &ref)) {
+        check_res(vid_queue_mmap_buffer(p->adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, ref.index));
+        pool_set_state(p->adapter_cap_pool, ref.index, POOL_QUEUED);
+        progress = true;
+    }
+
+    struct v4l2_buffer cap_buf = {0};
+    cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cap_buf.memory = V4L2_MEMORY_MMAP;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->adapter_cap_fd, &cap_buf))) {
+        if (pool_requeue_error(p->adapter_cap_pool, p->adapter_cap_fd, &cap_buf, METRIC_ISP_ERRORS))
+            continue;
+        pool_set_state(p->adapter_cap_pool, cap_buf.index, POOL_HELD);
+        latency_mark(p->latency, LATENCY_ISP_DEQUEUE, &cap_buf.timestamp);
+        metrics_add(METRIC_ISP_FRAMES, 1);
+        ref.index = cap_buf.index;
+        ref.dmabuf_fd = p->adapter_dmabuf_fd[cap_buf.index];
+        ref.bytesused = cap_buf.bytesused;
+        ref.length = cap_buf.length;
+        ref.flags = cap_buf.flags;
+        ref.field = cap_buf.field;
+        ref.timestamp = cap_buf.timestamp;
+        stage_push(stage, RING_ENCODER_IN, &ref);
+        stage->frames++;
+        progress = true;
+    }
+
+    return progress;
+
+}
+
+static bool encoder_in_step(struct stage *stage) {
+
+    const struct pipeline *p = stage->rt->pipeline;
+    bool progress = false;
+
+    struct frame_ref ref, dropped;
+
+    struct v4l2_plane out_plane = {0};
+    struct v4l2_buffer out_buf = {0};
+    out_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    out_buf.memory = V4L2_MEMORY_DMABUF;
+    out_buf.m.planes = &out_plane;
+    out_buf.length = 1;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->encoder_fd, &out_buf))) {
+        ref.index = pool_release(p->encoder_out_pool, out_buf.index);
+        stage_push(stage, RING_ISP_RETURN, &ref);
+        stage->frames++;
+        progress = true;
+    }
+
+    pool_flush(p->encoder_out_pool, p->encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &stage->pending);
+
+    while (ring_pop(&stage->rt->rings[RING_ENCODER_IN], &ref)) {
+        if (pool_offer(p->encoder_out_pool, p->encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &stage->pending, &ref, &dropped))
+            stage_push(stage, RING_ISP_RETURN, &dropped);
+        progress = true;
+    }
+
+    return progress;
+
+}
+
+static bool encoder_out_step(struct stage *stage) {
+
+    const struct pipeline *p = stage->rt->pipeline;
+    bool progress = false;
+
+    struct frame_ref ref;
+    while (ring_pop(&stage->rt->rings[RING_ENCODER_RETURN], &ref)) {
+        check_res(vid_queue_mmap_buffer_mp(p->encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, ref.index, 1));
+        pool_set_state(p->encoder_cap_pool, ref.index, POOL_QUEUED);
+        progress = true;
+    }
+
+    struct v4l2_plane cap_plane = {0};
+    struct v4l2_buffer cap_buf = {0};
+    cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    cap_buf.memory = V4L2_MEMORY_MMAP;
+    cap_buf.m.planes = &cap_plane;
+    cap_buf.length = 1;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->encoder_fd, &cap_buf))) {
+        if (pool_requeue_error(p->encoder_cap_pool, p->encoder_fd, &cap_buf, METRIC_ENCODER_ERRORS))
+            continue;
+        pool_set_state(p->encoder_cap_pool, cap_buf.index, POOL_HELD);
+        latency_mark(p->latency, LATENCY_ENCODER_DEQUEUE, &cap_buf.timestamp);
+        metrics_add(METRIC_ENCODER_FRAMES, 1);
+        metrics_add(METRIC_ENCODED_BYTES, cap_plane.bytesused);
+        ref.index = cap_buf.index;
+        ref.bytesused = cap_plane.bytesused;
+        ref.length = cap_plane.length;
+        ref.flags = cap_buf.flags;
+        ref.field = cap_buf.field;
+        ref.timestamp = cap_buf.timestamp;
+        stage_push(stage, RING_SINK, &ref);
+        stage->frames++;
+        progress = true;
+    }
+
+    return progress;
+
+}
+
+bool pipeline_sink_frame(const struct pipeline *pipeline, unsigned index, size_t size, const struct timeval *timestamp, bool keyframe) {
+
+    const void *data = pipeline->encoder_buffers_map[index].start;
+    if (pipeline->netsink) {
+        return netsink_send(pipeline->netsink, index, data, size);
+    } else if (pipeline->packetizer) {
+        packetizer_send_frame(pipeline->packetizer, data, size, timestamp, keyframe);
+        if (pipeline->abr)
+            abr_update(pipeline->abr, pipeline->packetizer);
+    } else if (pipeline->tssink) {
+        tssink_send(pipeline->tssink, data, size, timestamp, keyframe);
+    } else if (pipeline->rtsp) {
+        rtsp_send_frame(pipeline->rtsp, data, size, timestamp, keyframe);
+    } else if (pipeline->disksink) {
+        return disksink_write(pipeline->disksink, index, data, size, timestamp, keyframe);
+    } else {
+        fwrite(data, 1, size, pipeline->out_file);
+    }
+    return true;
+
+}
+
+static bool sink_step(struct stage *stage) {
+
+    struct runtime *rt = stage->rt;
+    const struct pipeline *p = rt->pipeline;
+    bool progress = false;
+
+    struct frame_ref ref;
+    while (ring_pop(&rt->rings[RING_SINK], &ref)) {
+
+        if (pipeline_sink_frame(p, ref.index, ref.bytesused, &ref.timestamp, ref.flags & V4L2_BUF_FLAG_KEYFRAME))
+            stage_push(stage, RING_ENCODER_RETURN, &ref);
+
+        latency_mark(p->latency, LATENCY_SINK, &ref.timestamp);
+        metrics_add(METRIC_SINK_FRAMES, 1);
+        progress = true;
+
+        if (++stage->frames >= p->frames) {
+            atomic_store(&rt->stop, true);
+            for (unsigned i = 0; i < STAGE_COUNT; i++)
+                eventfd_write(rt->stages[i].notify_fd, 1);
+            break;
+        }
+
+    }
+
+    // Buffers sent with zerocopy are returned once the kernel released them.
+    if (p->netsink) {
+        unsigned indices[VIDEO_MAX_FRAME];
+        unsigned count = netsink_complete(p->netsink, indices);
+        for (unsigned i = 0; i < count; i++) {
+            ref.index = indices[i];
+            stage_push(stage, RING_ENCODER_RETURN, &ref);
+            progress = true;
+        }
+    }
+
+    // Writes queued by this step are submitted together, buffers are returned
+    // once written.
+    if (p->disksink) {
+        disksink_submit(p->disksink);
+        unsigned indices[VIDEO_MAX_FRAME];
+        unsigned count = disksink_complete(p->disksink, indices);
+        for (unsigned i = 0; i < count; i++) {
+            ref.index = indices[i];
+            stage_push(stage, RING_ENCODER_RETURN, &ref);
+            progress = true;
+        }
+    }
+
+    return progress;
+
+}
+
+///
+/// RUNNING
+///
+
+static void stage_init(struct runtime *rt, enum stage_id id, const char *name, int fd, short events, enum ring_id in, bool (*step)(struct stage *)) {
+
+    struct stage *stage = &rt->stages[id];
+    stage->name = name;
+    stage->rt = rt;
+    stage->fd = fd;
+    stage->events = events;
+    stage->in = in;
+    stage->step = step;
+    atomic_init(&stage->waiting, false);
+
+    stage->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stage->notify_fd == -1) {
+        fprintf(stderr, "error: failed to create eventfd (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+}
+
+static void pipeline_report(struct runtime *rt, bool final) {
+
+    printf("info: occupancy");
+    for (unsigned i = 0; i < RING_COUNT; i++) {
+        struct ring *ring = &rt->rings[i];
+        if (final) {
+            double avg = ring->pushes ? (double) ring->occupancy_sum / ring->pushes : 0;
+            printf(" %s=%.2f/%u", ring_names[i], avg, ring->occupancy_max);
+        } else {
+            printf(" %s=%u", ring_names[i], ring_len(ring));
+        }
+    }
+    printf("\n");
+
+    if (final) {
+        for (unsigned i = 0; i < STAGE_COUNT; i++) {
+            struct stage *stage = &rt->stages[i];
+            printf("info: stage %-11s frames=%lu wakeups=%lu\n", stage->name, stage->frames, stage->wakeups);
+        }
+        pool_report(rt->pipeline->sensor_pool);
+        pool_report(rt->pipeline->adapter_out_pool);
+        pool_report(rt->pipeline->adapter_cap_pool);
+        pool_report(rt->pipeline->encoder_out_pool);
+        pool_report(rt->pipeline->encoder_cap_pool);
+    }
+
+}
+
+void pipeline_run(const struct pipeline *pipeline) {
+
+    struct runtime *rt = aligned_alloc(64, (sizeof(struct runtime) + 63) & ~63ul);
+    if (!rt) {
+        fprintf(stderr, "error: failed to allocate pipeline\n");
+        exit(1);
+    }
+
+    memset(rt, 0, sizeof(struct runtime));
+    rt->pipeline = pipeline;
+    for (unsigned i = 0; i < RING_COUNT; i++)
+        rt->rings[i].name = ring_names[i];
+
+    struct stage *stages = rt->stages;
+    stage_init(rt, STAGE_SENSOR, "sensor", pipeline->sensor_fd, POLLIN, RING_SENSOR_RETURN, sensor_step);
+    stage_init(rt, STAGE_ISP_IN, "isp-in", pipeline->adapter_out_fd, POLLOUT, RING_ISP_IN, isp_in_step);
+    stage_init(rt, STAGE_ISP_OUT, "isp-out", pipeline->adapter_cap_fd, POLLIN, RING_ISP_RETURN, isp_out_step);
+    stage_init(rt, STAGE_ENCODER_IN, "encoder-in", pipeline->encoder_fd, POLLOUT, RING_ENCODER_IN, encoder_in_step);
+    stage_init(rt, STAGE_ENCODER_OUT, "encoder-out", pipeline->encoder_fd, POLLIN, RING_ENCODER_RETURN, encoder_out_step);
+    if (pipeline->disksink)
+        stage_init(rt, STAGE_SINK, "sink", pipeline->disksink->event_fd, POLLIN, RING_SINK, sink_step);
+    else
+        stage_init(rt, STAGE_SINK, "sink", pipeline->netsink ? pipeline->netsink->fd : -1, 0, RING_SINK, sink_step);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+
+    for (unsigned i = 0; i < STAGE_COUNT; i++) {
+
+        int err = pthread_create(&stages[i].thread, NULL, stage_main, &stages[i]);
+        if (err) {
+            fprintf(stderr, "error: failed to create %s thread (%s)\n", stages[i].name, strerror(err));
+            exit(1);
+        }
+
+        pthread_setname_np(stages[i].thread, stages[i].name);
+
+        // Stages are spread over all CPUs, sharing some when there are fewer CPUs.
+        if (pipeline->pin) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            err = pthread_setaffinity_np(stages[i].thread, sizeof(set), &set);
+            if (err)
+                fprintf(stderr, "warn: failed to pin %s thread (%s)\n", stages[i].name, strerror(err));
+        }
+
+    }
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    for (unsigned tick = 1; !atomic_load(&rt->stop); tick++) {
+        struct timespec delay = { 0, 100000000 };
+        nanosleep(&delay, NULL);
+        if (tick % 10 == 0)
+            pipeline_report(rt, false);
+        latency_poll(pipeline->latency);
+    }
+
+    for (unsigned i = 0; i < STAGE_COUNT; i++) {
+        pthread_join(stages[i].thread, NULL);
+        close(stages[i].notify_fd);
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double elapsed = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    unsigned long frames = stages[STAGE_SINK].frames;
+
+    pipeline_report(rt, true);
+    printf("info: encoded %lu frames in %.3f s (%.2f fps)\n", frames, elapsed, frames / elapsed);
+    latency_report(pipeline->latency);
+
+    free(rt);
+
+}
@@ -0,0 +1,94 @@
+/// Multi-threaded pipeline mode, each stage runs on its own pinned thread and
+/// buffers are handed over between stages through lock-free rings.
+
+#pragma once
+
+#include "packetizer.h"
+#include "abr.h"
+#include "netsink.h"
+#include "tssink.h"
+#include "rtsp.h"
+#include "disksink.h"
+#include "pool.h"
+#include "stats.h"
+#include "awb.h"
+#include "ae.h"
+#include "lsc.h"
+#include "ctrls.h"
+#include "latency.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+
+/// Internal structure to keep track of memory mapped buffers.
+struct buffer_map {
+    /// Userspace pointer where the buffer starts.
+    void *start;
+    /// The length of the buffer.
+    unsigned length;
+};
+
+/// Devices and buffers of a configured and streaming pipeline.
+struct pipeline {
+    int sensor_fd;
+    int adapter_out_fd;
+    int adapter_cap_fd;
+    int encoder_fd;
+    /// Sensor capture buffers mapped in memory.
+    const struct buffer_map *sensor_buffers_map;
+    /// DMABUF exported from sensor and adapter capture buffers.
+    const int *sensor_dmabuf_fd;
+    const int *adapter_dmabuf_fd;
+    /// Buffer pools of each queue, the output queues have their own depth and
+    /// import upstream buffers in any free slot.
+    struct pool *sensor_pool;
+    struct pool *adapter_out_pool;
+    struct pool *adapter_cap_pool;
+    struct pool *encoder_out_pool;
+    struct pool *encoder_cap_pool;
+    /// Encoder capture buffers mapped in memory.
+    const struct buffer_map *encoder_buffers_map;
+    /// Encoded frames are written to this file.
+    FILE *out_file;
+    /// Encoded frames are sent to this sink instead of the file, NULL if none. At
+    /// most one of the sinks below is set.
+    struct netsink *netsink;
+    /// Encoded frames are recorded through io_uring instead of the file, NULL if none.
+    struct disksink *disksink;
+    /// Encoded frames are packetized over UDP instead of written to the file, NULL if none.
+    struct packetizer *packetizer;
+    /// Encoded frames are muxed into a transport stream instead of written to the file, NULL if none.
+    struct tssink *tssink;
+    /// Encoded frames are sent over RTSP instead of written to the file, NULL if none.
+    struct rtsp *rtsp;
+    /// Adaptive bitrate controller fed by the answers to the packetizer, NULL if none.
+    struct abr *abr;
+    /// Statistics of the sensor frames and the white balance and exposure loops they
+    /// drive, NULL if none.
+    struct stats *stats;
+    struct awb *awb;
+    struct ae *ae;
+    /// Lens shading tables switched with the white balance, NULL if none.
+    struct lsc *lsc;
+    /// Controls staged by the loops above, flushed once per sensor frame.
+    struct ctrls *sensor_ctrls;
+    struct ctrls *adapter_ctrls;
+    /// Latency of each stage, the output queue pools mark the queue points.
+    struct latency *latency;
+    /// Number of frames to encode before stopping.
+    unsigned frames;
+    /// Pin each stage thread to its own CPU.
+    bool pin;
+    /// Register devices as edge-triggered in the epoll reactor.
+    bool edge_triggered;
+};
+
+/// Run the pipeline until the given number of frames have been encoded, per-stage
+/// occupancy is reported every second and at the end.
+void pipeline_run(const struct pipeline *pipeline);
+
+/// Send an encoded frame of the encoder capture queue to the sink of the pipeline,
+/// or write it to the file without one. Return true if the buffer can be queued
+/// back, false if the sink releases it later (see 'netsink.h' and 'disksink.h').
+bool pipeline_sink_frame(const struct pipeline *pipeline, unsigned index, size_t size, const struct timeval *timestamp, bool keyframe);
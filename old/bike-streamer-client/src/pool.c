@@ -0,0 +1,174 @@
+#include "pool.h"
+#include "check.h"
+
+#include <string.h>
+#include <stdio.h>
+
+
+static const char *pool_state_names[POOL_STATE_COUNT] = {
+    [POOL_FREE] = "free",
+    [POOL_QUEUED] = "queued",
+    [POOL_HELD] = "held",
+};
+
+
+void pool_init(struct pool *pool, const char *name, unsigned depth, enum pool_state state) {
+
+    memset(pool, 0, sizeof(struct pool));
+    pool->name = name;
+    pool->depth = depth > VIDEO_MAX_FRAME ? VIDEO_MAX_FRAME : depth;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (unsigned i = 0; i < pool->depth; i++) {
+        pool->slots[i].state = state;
+        pool->slots[i].since = now;
+        pool->slots[i].dmabuf_fd = -1;
+    }
+
+}
+
+void pool_publish(struct pool *pool, enum metric_id metric) {
+    pool->published = true;
+    pool->queued_metric = metric;
+    for (unsigned i = 0; i < pool->depth; i++)
+        if (pool->slots[i].state == POOL_QUEUED)
+            metrics_add(metric, 1);
+}
+
+void pool_set_state(struct pool *pool, unsigned index, enum pool_state state) {
+
+    struct pool_slot *slot = &pool->slots[index];
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double ms = (now.tv_sec - slot->since.tv_sec) * 1e3 + (now.tv_nsec - slot->since.tv_nsec) / 1e6;
+    struct pool_stats *stats = &pool->stats[slot->state];
+    stats->count++;
+    stats->sum_ms += ms;
+    if (ms > stats->max_ms)
+        stats->max_ms = ms;
+
+    if (pool->published && (slot->state == POOL_QUEUED) != (state == POOL_QUEUED))
+        metrics_add(pool->queued_metric, state == POOL_QUEUED ? 1 : -1);
+
+    slot->state = state;
+    slot->since = now;
+
+}
+
+int pool_acquire(struct pool *pool, int dmabuf_fd, unsigned upstream) {
+
+    int found = -1;
+    for (unsigned i = 0; i < pool->depth; i++) {
+        struct pool_slot *slot = &pool->slots[i];
+        if (slot->state != POOL_FREE)
+            continue;
+        if (slot->dmabuf_fd == dmabuf_fd) {
+            found = i;
+            break;
+        }
+        // Never used slots come next, then any free slot.
+        if (found == -1 || (slot->dmabuf_fd == -1 && pool->slots[found].dmabuf_fd != -1))
+            found = i;
+    }
+
+    if (found == -1) {
+        pool->starved++;
+        return -1;
+    }
+
+    pool->slots[found].dmabuf_fd = dmabuf_fd;
+    pool->slots[found].upstream = upstream;
+    pool_set_state(pool, found, POOL_QUEUED);
+    return found;
+
+}
+
+bool pool_queue_dmabuf(struct pool *pool, int fd, enum v4l2_buf_type type, const struct frame_ref *ref) {
+
+    int index = pool_acquire(pool, ref->dmabuf_fd, ref->index);
+    if (index == -1)
+        return false;
+
+    struct v4l2_plane plane = {0};
+    struct v4l2_buffer buf = {0};
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_DMABUF;
+    buf.timestamp = ref->timestamp;
+    buf.field = ref->field;
+    buf.index = index;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(type)) {
+        plane.m.fd = ref->dmabuf_fd;
+        plane.length = ref->length;
+        plane.bytesused = ref->bytesused;
+        buf.m.planes = &plane;
+        buf.length = 1;
+    } else {
+        buf.m.fd = ref->dmabuf_fd;
+        buf.length = ref->length;
+        buf.bytesused = ref->bytesused;
+    }
+
+    // Marked first, the frame may be dequeued downstream before the ioctl returns.
+    if (pool->latency)
+        latency_mark(pool->latency, pool->latency_point, &ref->timestamp);
+    check_res(vid_queue_buffer(fd, &buf));
+    return true;
+
+}
+
+unsigned pool_release(struct pool *pool, unsigned index) {
+    pool_set_state(pool, index, POOL_FREE);
+    return pool->slots[index].upstream;
+}
+
+bool pool_offer(struct pool *pool, int fd, enum v4l2_buf_type type, struct pool_pending *pending, const struct frame_ref *ref, struct frame_ref *dropped) {
+
+    if (!pending->valid && pool_queue_dmabuf(pool, fd, type, ref))
+        return false;
+
+    bool drop = pending->valid;
+    if (drop) {
+        *dropped = pending->ref;
+        pool->dropped++;
+    }
+
+    pending->ref = *ref;
+    pending->valid = true;
+    return drop;
+
+}
+
+void pool_flush(struct pool *pool, int fd, enum v4l2_buf_type type, struct pool_pending *pending) {
+    if (pending->valid && pool_queue_dmabuf(pool, fd, type, &pending->ref))
+        pending->valid = false;
+}
+
+bool pool_requeue_error(struct pool *pool, int fd, const struct v4l2_buffer *buf, enum metric_id metric) {
+
+    if (!(buf->flags & V4L2_BUF_FLAG_ERROR))
+        return false;
+
+    metrics_add(metric, 1);
+    printf("warn: %s buffer %u has error\n", pool->name, buf->index);
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf->type))
+        check_res(vid_queue_mmap_buffer_mp(fd, buf->type, buf->index, buf->length));
+    else
+        check_res(vid_queue_mmap_buffer(fd, buf->type, buf->index));
+    return true;
+
+}
+
+void pool_report(const struct pool *pool) {
+    printf("info: pool %-11s depth=%u", pool->name, pool->depth);
+    for (unsigned i = 0; i < POOL_STATE_COUNT; i++) {
+        const struct pool_stats *stats = &pool->stats[i];
+        if (stats->count)
+            printf(" %s=%.2f/%.2fms", pool_state_names[i], stats->sum_ms / stats->count, stats->max_ms);
+    }
+    printf(" starved=%lu dropped=%lu\n", pool->starved, pool->dropped);
+}
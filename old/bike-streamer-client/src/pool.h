@@ -0,0 +1,104 @@
+/// Buffer pools, tracking the ownership of the buffers of each queue so that
+/// every queue of the chain can have its own depth. Output queues importing
+/// DMABUF get a free slot assigned dynamically for each upstream buffer.
+
+#pragma once
+
+#include "v4l2.h"
+#include "ring.h"
+#include "latency.h"
+#include "metrics.h"
+
+#include <time.h>
+
+
+/// State of a buffer slot, as seen from the application.
+enum pool_state {
+    /// Owned by the application and unused, only for DMABUF output queues.
+    POOL_FREE,
+    /// Queued in the driver.
+    POOL_QUEUED,
+    /// Dequeued and held by the application or a downstream queue.
+    POOL_HELD,
+    POOL_STATE_COUNT,
+};
+
+struct pool_slot {
+    enum pool_state state;
+    /// Time of the last transition.
+    struct timespec since;
+    /// DMABUF imported in the slot, -1 if never used.
+    int dmabuf_fd;
+    /// Index of the upstream buffer imported in the slot.
+    unsigned upstream;
+};
+
+/// Time spent by buffers in a state.
+struct pool_stats {
+    unsigned long count;
+    double sum_ms;
+    double max_ms;
+};
+
+struct pool {
+    const char *name;
+    unsigned depth;
+    struct pool_slot slots[VIDEO_MAX_FRAME];
+    struct pool_stats stats[POOL_STATE_COUNT];
+    /// Number of acquisitions that failed because no slot was free.
+    unsigned long starved;
+    /// Number of upstream buffers dropped while waiting for a free slot.
+    unsigned long dropped;
+    /// Latency traced when upstream buffers are queued, NULL if none.
+    struct latency *latency;
+    enum latency_point latency_point;
+    /// Gauge of the buffers queued in the driver, if published.
+    bool published;
+    enum metric_id queued_metric;
+};
+
+/// Upstream buffer waiting for a free slot, only the most recent one is kept so
+/// that a slow queue drops frames instead of accumulating latency.
+struct pool_pending {
+    bool valid;
+    struct frame_ref ref;
+};
+
+
+/// Initialize a pool with all its slots in the given state.
+void pool_init(struct pool *pool, const char *name, unsigned depth, enum pool_state state);
+
+/// Publish the number of buffers queued in the driver in the given gauge.
+void pool_publish(struct pool *pool, enum metric_id metric);
+
+/// Move a slot to a new state, accounting the time spent in the previous one.
+void pool_set_state(struct pool *pool, unsigned index, enum pool_state state);
+
+/// Acquire a free slot to import a DMABUF, slots that previously imported the
+/// same DMABUF are preferred so that the driver can reuse its mapping. The slot
+/// is moved to the queued state and -1 is returned if no slot is free.
+int pool_acquire(struct pool *pool, int dmabuf_fd, unsigned upstream);
+
+/// Import an upstream buffer in a free slot of a DMABUF output queue and queue
+/// it in the driver, return false if no slot is free.
+bool pool_queue_dmabuf(struct pool *pool, int fd, enum v4l2_buf_type type, const struct frame_ref *ref);
+
+/// Free a slot of a DMABUF output queue once dequeued, return the index of the
+/// upstream buffer it imported.
+unsigned pool_release(struct pool *pool, unsigned index);
+
+/// Offer an upstream buffer to a DMABUF output queue, it is queued if a slot is
+/// free or kept pending otherwise. Return true if a previously pending buffer has
+/// been replaced, it is then given in 'dropped' to be returned upstream.
+bool pool_offer(struct pool *pool, int fd, enum v4l2_buf_type type, struct pool_pending *pending, const struct frame_ref *ref, struct frame_ref *dropped);
+
+/// Queue the pending upstream buffer if a slot has been freed.
+void pool_flush(struct pool *pool, int fd, enum v4l2_buf_type type, struct pool_pending *pending);
+
+/// Queue back a capture buffer dequeued with V4L2_BUF_FLAG_ERROR, which holds no
+/// usable frame, and count it in the given metric. Return false if the buffer
+/// has no error and is to be processed.
+bool pool_requeue_error(struct pool *pool, int fd, const struct v4l2_buffer *buf, enum metric_id metric);
+
+/// Print the time spent by buffers in each state.
+void pool_report(const struct pool *pool);
@@ -0,0 +1,424 @@
+#include "reactor.h"
+#include "check.h"
+#include "v4l2.h"
+#include "trace.h"
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+
+/// Interval of the watchdog timer, intervals without any frame encoded are
+/// counted as poll timeouts, and a stall of two intervals is reported.
+#define REACTOR_WATCHDOG_MS 1000
+
+/// Tags of the epoll registrations.
+enum reactor_tag {
+    REACTOR_SENSOR,
+    REACTOR_ADAPTER_OUT,
+    REACTOR_ADAPTER_CAP,
+    REACTOR_ENCODER,
+    REACTOR_NETSINK,
+    REACTOR_DISKSINK,
+    REACTOR_WATCHDOG,
+    REACTOR_STOP,
+};
+
+struct reactor {
+    const struct pipeline *p;
+    int epoll_fd;
+    int watchdog_fd;
+    int stop_fd;
+    unsigned long frames;
+    unsigned long wakeups;
+    unsigned long dequeues;
+    /// Upstream buffers waiting for a free slot of the ISP and encoder output queues.
+    struct pool_pending adapter_out_pending;
+    struct pool_pending encoder_out_pending;
+};
+
+#ifndef TRACE_DISABLED
+/// Name of the traced events.
+static const char *reactor_tag_names[] = {
+    [REACTOR_SENSOR] = "sensor",
+    [REACTOR_ADAPTER_OUT] = "isp-output",
+    [REACTOR_ADAPTER_CAP] = "isp-capture",
+    [REACTOR_ENCODER] = "encoder",
+    [REACTOR_NETSINK] = "netsink",
+    [REACTOR_DISKSINK] = "disksink",
+    [REACTOR_WATCHDOG] = "watchdog",
+    [REACTOR_STOP] = "stop",
+};
+#endif
+
+/// Stop eventfd written by the SIGINT handler.
+static int reactor_stop_fd = -1;
+
+
+static void reactor_sigint(int sig) {
+    (void) sig;
+    eventfd_write(reactor_stop_fd, 1);
+}
+
+static void reactor_add(struct reactor *r, int fd, unsigned events, enum reactor_tag tag) {
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.u32 = tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        fprintf(stderr, "error: failed to register in epoll (%s)\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static void reactor_add_device(struct reactor *r, int fd, short events, enum reactor_tag tag) {
+    short wait = vid_wait_events(fd, events);
+    unsigned ev = ((wait & POLLIN) ? EPOLLIN : 0) | ((wait & POLLOUT) ? EPOLLOUT : 0);
+    if (r->p->edge_triggered)
+        ev |= EPOLLET;
+    reactor_add(r, fd, ev, tag);
+}
+
+///
+/// DRAINING
+///
+
+static void reactor_drain_sensor(struct reactor *r) {
+
+    const struct pipeline *p = r->p;
+
+    struct v4l2_buffer cap_buf = {0};
+    cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cap_buf.memory = V4L2_MEMORY_MMAP;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->sensor_fd, &cap_buf))) {
+
+        r->dequeues++;
+        if (pool_requeue_error(p->sensor_pool, p->sensor_fd, &cap_buf, METRIC_SENSOR_ERRORS))
+            continue;
+
+        pool_set_state(p->sensor_pool, cap_buf.index, POOL_HELD);
+        latency_capture(p->latency, &cap_buf.timestamp, cap_buf.flags);
+        metrics_add(METRIC_SENSOR_FRAMES, 1);
+
+        if (p->stats) {
+            stats_frame(p->stats, p->sensor_buffers_map[cap_buf.index].start);
+            if (p->awb)
+                awb_update(p->awb, p->stats);
+            if (p->awb && p->lsc)
+                lsc_update(p->lsc, p->awb->red_written, p->awb->blue_written);
+            if (p->ae)
+                ae_update(p->ae, p->stats);
+            check_res(ctrls_flush(p->sensor_ctrls));
+            check_res(ctrls_flush(p->adapter_ctrls));
+        }
+
+        struct frame_ref ref, dropped;
+        ref.index = cap_buf.index;
+        ref.dmabuf_fd = p->sensor_dmabuf_fd[cap_buf.index];
+        ref.bytesused = cap_buf.bytesused;
+        ref.length = cap_buf.length;
+        ref.flags = cap_buf.flags;
+        ref.field = cap_buf.field;
+        ref.timestamp = cap_buf.timestamp;
+
+        if (pool_offer(p->adapter_out_pool, p->adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &r->adapter_out_pending, &ref, &dropped)) {
+            check_res(vid_queue_mmap_buffer(p->sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, dropped.index));
+            pool_set_state(p->sensor_pool, dropped.index, POOL_QUEUED);
+        }
+
+    }
+
+}
+
+static void reactor_drain_adapter_out(struct reactor *r) {
+
+    const struct pipeline *p = r->p;
+
+    struct v4l2_buffer out_buf = {0};
+    out_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    out_buf.memory = V4L2_MEMORY_DMABUF;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->adapter_out_fd, &out_buf))) {
+        unsigned index = pool_release(p->adapter_out_pool, out_buf.index);
+        check_res(vid_queue_mmap_buffer(p->sensor_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, index));
+        pool_set_state(p->sensor_pool, index, POOL_QUEUED);
+        r->dequeues++;
+    }
+
+    pool_flush(p->adapter_out_pool, p->adapter_out_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT, &r->adapter_out_pending);
+
+}
+
+static void reactor_drain_adapter_cap(struct reactor *r) {
+
+    const struct pipeline *p = r->p;
+
+    struct v4l2_buffer cap_buf = {0};
+    cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cap_buf.memory = V4L2_MEMORY_MMAP;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->adapter_cap_fd, &cap_buf))) {
+
+        r->dequeues++;
+        if (pool_requeue_error(p->adapter_cap_pool, p->adapter_cap_fd, &cap_buf, METRIC_ISP_ERRORS))
+            continue;
+
+        pool_set_state(p->adapter_cap_pool, cap_buf.index, POOL_HELD);
+        latency_mark(p->latency, LATENCY_ISP_DEQUEUE, &cap_buf.timestamp);
+        metrics_add(METRIC_ISP_FRAMES, 1);
+
+        struct frame_ref ref, dropped;
+        ref.index = cap_buf.index;
+        ref.dmabuf_fd = p->adapter_dmabuf_fd[cap_buf.index];
+        ref.bytesused = cap_buf.bytesused;
+        ref.length = cap_buf.length;
+        ref.flags = cap_buf.flags;
+        ref.field = cap_buf.field;
+        ref.timestamp = cap_buf.timestamp;
+
+        if (pool_offer(p->encoder_out_pool, p->encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &r->encoder_out_pending, &ref, &dropped)) {
+            check_res(vid_queue_mmap_buffer(p->adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, dropped.index));
+            pool_set_state(p->adapter_cap_pool, dropped.index, POOL_QUEUED);
+        }
+
+    }
+
+}
+
+static void reactor_drain_encoder(struct reactor *r) {
+
+    const struct pipeline *p = r->p;
+
+    struct v4l2_plane cap_plane = {0};
+    struct v4l2_buffer cap_buf = {0};
+    cap_buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    cap_buf.memory = V4L2_MEMORY_MMAP;
+    cap_buf.m.planes = &cap_plane;
+    cap_buf.length = 1;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->encoder_fd, &cap_buf))) {
+
+        r->dequeues++;
+        if (pool_requeue_error(p->encoder_cap_pool, p->encoder_fd, &cap_buf, METRIC_ENCODER_ERRORS))
+            continue;
+
+        pool_set_state(p->encoder_cap_pool, cap_buf.index, POOL_HELD);
+        latency_mark(p->latency, LATENCY_ENCODER_DEQUEUE, &cap_buf.timestamp);
+        metrics_add(METRIC_ENCODER_FRAMES, 1);
+        metrics_add(METRIC_ENCODED_BYTES, cap_plane.bytesused);
+
+        bool release = pipeline_sink_frame(p, cap_buf.index, cap_plane.bytesused, &cap_buf.timestamp, cap_buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+
+        latency_mark(p->latency, LATENCY_SINK, &cap_buf.timestamp);
+        metrics_add(METRIC_SINK_FRAMES, 1);
+
+        if (release) {
+            check_res(vid_queue_buffer(p->encoder_fd, &cap_buf));
+            pool_set_state(p->encoder_cap_pool, cap_buf.index, POOL_QUEUED);
+        }
+
+        r->frames++;
+
+    }
+
+    struct v4l2_plane out_plane = {0};
+    struct v4l2_buffer out_buf = {0};
+    out_buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    out_buf.memory = V4L2_MEMORY_DMABUF;
+    out_buf.m.planes = &out_plane;
+    out_buf.length = 1;
+
+    while (check_ok_or_retry(vid_unqueue_buffer(p->encoder_fd, &out_buf))) {
+        unsigned index = pool_release(p->encoder_out_pool, out_buf.index);
+        check_res(vid_queue_mmap_buffer(p->adapter_cap_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE, index));
+        pool_set_state(p->adapter_cap_pool, index, POOL_QUEUED);
+        r->dequeues++;
+    }
+
+    pool_flush(p->encoder_out_pool, p->encoder_fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, &r->encoder_out_pending);
+
+}
+
+/// Queue back the encoder capture buffers released by the network sink.
+static void reactor_drain_netsink(struct reactor *r) {
+
+    const struct pipeline *p = r->p;
+
+    unsigned indices[VIDEO_MAX_FRAME];
+    unsigned count = netsink_complete(p->netsink, indices);
+    for (unsigned i = 0; i < count; i++) {
+        check_res(vid_queue_mmap_buffer_mp(p->encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, indices[i], 1));
+        pool_set_state(p->encoder_cap_pool, indices[i], POOL_QUEUED);
+    }
+
+}
+
+/// Queue back the encoder capture buffers of which the writes completed.
+static void reactor_drain_disksink(struct reactor *r) {
+
+    const struct pipeline *p = r->p;
+
+    unsigned indices[VIDEO_MAX_FRAME];
+    unsigned count = disksink_complete(p->disksink, indices);
+    for (unsigned i = 0; i < count; i++) {
+        check_res(vid_queue_mmap_buffer_mp(p->encoder_fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, indices[i], 1));
+        pool_set_state(p->encoder_cap_pool, indices[i], POOL_QUEUED);
+    }
+
+}
+
+/// Drain a device until no buffer is left, devices emulated in userspace are
+/// re-armed and drained again if they have pending events.
+static void reactor_drain(struct reactor *r, int fd, short events, void (*drain)(struct reactor *)) {
+    do {
+        drain(r);
+    } while (vid_pending_events(fd, events));
+}
+
+///
+/// RUNNING
+///
+
+void reactor_run(const struct pipeline *pipeline) {
+
+    struct reactor r = {0};
+    r.p = pipeline;
+
+    r.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    r.watchdog_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    r.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r.epoll_fd == -1 || r.watchdog_fd == -1 || r.stop_fd == -1) {
+        fprintf(stderr, "error: failed to create reactor (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    reactor_stop_fd = r.stop_fd;
+    signal(SIGINT, reactor_sigint);
+
+    struct itimerspec watchdog = {0};
+    watchdog.it_interval.tv_sec = REACTOR_WATCHDOG_MS / 1000;
+    watchdog.it_interval.tv_nsec = (REACTOR_WATCHDOG_MS % 1000) * 1000000;
+    watchdog.it_value = watchdog.it_interval;
+    timerfd_settime(r.watchdog_fd, 0, &watchdog, NULL);
+
+    reactor_add_device(&r, pipeline->sensor_fd, POLLIN, REACTOR_SENSOR);
+    reactor_add_device(&r, pipeline->adapter_out_fd, POLLOUT, REACTOR_ADAPTER_OUT);
+    reactor_add_device(&r, pipeline->adapter_cap_fd, POLLIN, REACTOR_ADAPTER_CAP);
+    reactor_add_device(&r, pipeline->encoder_fd, POLLIN | POLLOUT, REACTOR_ENCODER);
+    // Zerocopy completions are signaled with EPOLLERR, always reported.
+    if (pipeline->netsink)
+        reactor_add(&r, pipeline->netsink->fd, 0, REACTOR_NETSINK);
+    if (pipeline->disksink)
+        reactor_add(&r, pipeline->disksink->event_fd, EPOLLIN, REACTOR_DISKSINK);
+    reactor_add(&r, r.watchdog_fd, EPOLLIN, REACTOR_WATCHDOG);
+    reactor_add(&r, r.stop_fd, EPOLLIN, REACTOR_STOP);
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    unsigned long watchdog_frames = 0;
+    unsigned stalled_ticks = 0;
+    bool stop = false;
+
+    while (!stop && r.frames < pipeline->frames) {
+
+        struct epoll_event events[8];
+        TRACE_BEGIN(wait_span, "poll", "epoll_wait", r.epoll_fd);
+        int count = epoll_wait(r.epoll_fd, events, 8, -1);
+        TRACE_END(wait_span);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        } else if (count == -1) {
+            fprintf(stderr, "error: epoll error (%s)\n", strerror(errno));
+            exit(1);
+        }
+
+        r.wakeups++;
+        latency_poll(pipeline->latency);
+
+        for (int i = 0; i < count; i++) {
+
+            if ((events[i].events & EPOLLERR) && events[i].data.u32 != REACTOR_NETSINK)
+                fprintf(stderr, "error: device %u error\n", events[i].data.u32);
+
+            TRACE_BEGIN(span, "stage", reactor_tag_names[events[i].data.u32], -1);
+            switch (events[i].data.u32) {
+            case REACTOR_SENSOR:
+                reactor_drain(&r, pipeline->sensor_fd, POLLIN, reactor_drain_sensor);
+                break;
+            case REACTOR_ADAPTER_OUT:
+                reactor_drain(&r, pipeline->adapter_out_fd, POLLOUT, reactor_drain_adapter_out);
+                break;
+            case REACTOR_ADAPTER_CAP:
+                reactor_drain(&r, pipeline->adapter_cap_fd, POLLIN, reactor_drain_adapter_cap);
+                break;
+            case REACTOR_ENCODER:
+                reactor_drain(&r, pipeline->encoder_fd, POLLIN | POLLOUT, reactor_drain_encoder);
+                break;
+            case REACTOR_NETSINK:
+                reactor_drain_netsink(&r);
+                break;
+            case REACTOR_DISKSINK:
+                reactor_drain_disksink(&r);
+                break;
+            case REACTOR_WATCHDOG: {
+                uint64_t expirations;
+                if (read(r.watchdog_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                    break;
+                if (r.frames == watchdog_frames) {
+                    // The reactor keeps waiting, a stalled device shows in the metrics.
+                    metrics_add(METRIC_POLL_TIMEOUTS, expirations);
+                    if (stalled_ticks < 2 && stalled_ticks + expirations >= 2)
+                        printf("warn: pipeline stalled\n");
+                    stalled_ticks += expirations;
+                } else {
+                    stalled_ticks = 0;
+                }
+                watchdog_frames = r.frames;
+                break;
+            }
+            case REACTOR_STOP:
+                stop = true;
+                break;
+            }
+            TRACE_END(span);
+
+        }
+
+        // Writes queued while draining are submitted once per wakeup.
+        if (pipeline->disksink)
+            disksink_submit(pipeline->disksink);
+
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double elapsed = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+
+    signal(SIGINT, SIG_DFL);
+    reactor_stop_fd = -1;
+    close(r.stop_fd);
+    close(r.watchdog_fd);
+    close(r.epoll_fd);
+
+    printf("info: encoded %lu frames in %.3f s (%.2f fps)\n", r.frames, elapsed, r.frames / elapsed);
+    if (r.frames) {
+        printf("info: %lu wakeups, %.2f wakeups per frame, %.2f buffers per wakeup\n",
+            r.wakeups, (double) r.wakeups / r.frames, (double) r.dequeues / r.wakeups);
+    }
+
+    pool_report(pipeline->sensor_pool);
+    pool_report(pipeline->adapter_out_pool);
+    pool_report(pipeline->adapter_cap_pool);
+    pool_report(pipeline->encoder_out_pool);
+    pool_report(pipeline->encoder_cap_pool);
+    latency_report(pipeline->latency);
+
+}
@@ -0,0 +1,12 @@
+/// Event loop mode based on epoll, each device is registered once and every
+/// ready buffer is drained on each wakeup.
+
+#pragma once
+
+#include "pipeline.h"
+
+
+/// Run the pipeline in a single epoll reactor until the given number of frames
+/// have been encoded or SIGINT is received. A timerfd watchdog replaces the poll
+/// timeout and the number of wakeups per frame is reported at the end.
+void reactor_run(const struct pipeline *pipeline);
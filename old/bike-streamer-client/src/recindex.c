@@ -0,0 +1,103 @@
+#include "recindex.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+
+void recindex_header_init(struct recindex_header *header) {
+
+    memset(header, 0, sizeof(struct recindex_header));
+    memcpy(header->magic, RECINDEX_MAGIC, sizeof(header->magic));
+    header->version = RECINDEX_VERSION;
+    header->entry_size = sizeof(struct recindex_entry);
+
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    header->realtime_us = (int64_t) realtime.tv_sec * 1000000 + realtime.tv_nsec / 1000;
+    header->monotonic_us = (int64_t) monotonic.tv_sec * 1000000 + monotonic.tv_nsec / 1000;
+
+}
+
+int recindex_open(struct recindex *idx, const char *recording_path) {
+
+    memset(idx, 0, sizeof(struct recindex));
+    idx->fd = -1;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s", recording_path, RECINDEX_SUFFIX);
+
+    idx->fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (idx->fd == -1 || fstat(idx->fd, &st) == -1) {
+        fprintf(stderr, "error: failed to open index '%s' (%s)\n", path, strerror(errno));
+        recindex_close(idx);
+        return -1;
+    }
+
+    if ((size_t) st.st_size < sizeof(struct recindex_header)) {
+        fprintf(stderr, "error: index '%s' is truncated\n", path);
+        recindex_close(idx);
+        return -1;
+    }
+
+    idx->map_size = st.st_size;
+    idx->map = mmap(NULL, idx->map_size, PROT_READ, MAP_SHARED, idx->fd, 0);
+    if (idx->map == MAP_FAILED) {
+        fprintf(stderr, "error: failed to map index '%s' (%s)\n", path, strerror(errno));
+        idx->map = NULL;
+        recindex_close(idx);
+        return -1;
+    }
+
+    idx->header = idx->map;
+    if (memcmp(idx->header->magic, RECINDEX_MAGIC, sizeof(idx->header->magic)) != 0 ||
+        idx->header->version != RECINDEX_VERSION || idx->header->entry_size != sizeof(struct recindex_entry)) {
+        fprintf(stderr, "error: index '%s' has an unknown format\n", path);
+        recindex_close(idx);
+        return -1;
+    }
+
+    // Entries past the end of the file are not on the storage yet.
+    size_t available = (idx->map_size - sizeof(struct recindex_header)) / sizeof(struct recindex_entry);
+    idx->entries = (const struct recindex_entry *) (idx->header + 1);
+    idx->count = idx->header->count < available ? idx->header->count : available;
+    return 0;
+
+}
+
+void recindex_close(struct recindex *idx) {
+    if (idx->map)
+        munmap(idx->map, idx->map_size);
+    if (idx->fd != -1)
+        close(idx->fd);
+    idx->fd = -1;
+    idx->map = NULL;
+}
+
+long recindex_find(const struct recindex *idx, uint64_t timestamp_us) {
+
+    if (!idx->count)
+        return -1;
+
+    // First entry captured after the timestamp, the frame is the previous one.
+    unsigned low = 0, high = idx->count;
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (idx->entries[mid].timestamp_us <= timestamp_us)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low ? (long) low - 1 : 0;
+
+}
@@ -0,0 +1,81 @@
+/// Frame index of a recording, written next to each recording file as
+/// '<recording>.idx' by the disk sink (see 'disksink.h'). The recording stays a
+/// plain Annex-B stream, the index locates each of its frames: a header then one
+/// fixed-width entry per frame, in recording order, in the byte order of the
+/// host, little-endian on the Pi.
+///
+/// Each entry also gives the key frame to start decoding from, so that seeking
+/// to a time is a binary search over the mapped index and extracting a clip is
+/// a copy of one contiguous range of the recording (see 'clip.c').
+///
+/// Entries are appended in batches, the number of valid entries is kept in the
+/// header and rewritten after each batch, so the entries of a crashed or reused
+/// file past that number are ignored.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define RECINDEX_MAGIC "bsrecidx"
+#define RECINDEX_VERSION 1
+#define RECINDEX_SUFFIX ".idx"
+
+/// The frame is a key frame.
+#define RECINDEX_FLAG_KEYFRAME 0x1
+
+/// Key frame of the frames recorded before the first key frame of the file.
+#define RECINDEX_NO_KEY UINT32_MAX
+
+struct recindex_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    /// Number of valid entries following the header.
+    uint32_t count;
+    uint32_t reserved;
+    /// Clocks sampled together when recording started, to date the capture
+    /// timestamps of the entries, which are monotonic.
+    int64_t realtime_us;
+    int64_t monotonic_us;
+    uint8_t padding[24];
+};
+
+struct recindex_entry {
+    /// Position of the frame in the recording file.
+    uint64_t offset;
+    /// Capture timestamp of the frame, in microseconds.
+    uint64_t timestamp_us;
+    uint32_t size;
+    uint32_t flags;
+    /// Entry of the last key frame up to this one, RECINDEX_NO_KEY if none.
+    uint32_t key;
+    uint32_t reserved;
+};
+
+_Static_assert(sizeof(struct recindex_header) == 64, "index header must be 64 bytes");
+_Static_assert(sizeof(struct recindex_entry) == 32, "index entry must be 32 bytes");
+
+/// Index mapped for reading.
+struct recindex {
+    int fd;
+    void *map;
+    size_t map_size;
+    const struct recindex_header *header;
+    const struct recindex_entry *entries;
+    unsigned count;
+};
+
+
+/// Fill a header with the current clocks and no entry.
+void recindex_header_init(struct recindex_header *header);
+
+/// Map the index of a recording file, return -1 and print the error on failure.
+int recindex_open(struct recindex *idx, const char *recording_path);
+void recindex_close(struct recindex *idx);
+
+/// Find the last frame captured at or before the given timestamp, or the first
+/// frame if they are all later, -1 if there is no frame.
+long recindex_find(const struct recindex *idx, uint64_t timestamp_us);
@@ -0,0 +1,286 @@
+/// File replay backend, it emulates the sensor from a raw capture (such as 'out.raw')
+/// or the encoder from an Annex-B H.264 stream (such as 'out.h264'). Files are
+/// replayed in a loop.
+
+#include "synth.h"
+#include "backend.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+/// Replay state of a raw sensor capture.
+struct replay_raw {
+    int fd;
+    off_t offset;
+};
+
+/// An access unit of the replayed H.264 stream.
+struct replay_au {
+    size_t offset;
+    size_t size;
+    bool idr;
+};
+
+/// Replay state of a H.264 stream.
+struct replay_h264 {
+    const unsigned char *data;
+    size_t size;
+    struct replay_au *aus;
+    size_t aus_count;
+    size_t next;
+};
+
+
+///
+/// RAW SENSOR
+///
+
+static void replay_raw_generate(struct synth_context *ctx, struct synth_buffer *cap) {
+
+    struct replay_raw *raw = ctx->priv;
+    unsigned size = cap->bytesused;
+
+    // Each frame has the size of the image, a truncated last frame is skipped.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        ssize_t len = pread(raw->fd, cap->start, size, raw->offset);
+        if (len == (ssize_t) size) {
+            raw->offset += size;
+            return;
+        }
+        raw->offset = 0;
+    }
+
+    cap->bytesused = 0;
+    cap->flags |= V4L2_BUF_FLAG_ERROR;
+
+}
+
+static void replay_raw_release(struct synth_context *ctx) {
+    struct replay_raw *raw = ctx->priv;
+    close(raw->fd);
+    free(raw);
+}
+
+static const struct synth_ops replay_raw_ops = {
+    .generate = replay_raw_generate,
+    .release = replay_raw_release,
+};
+
+static int replay_raw_open(const char *file, unsigned fps) {
+
+    struct replay_raw *raw = calloc(1, sizeof(struct replay_raw));
+    if (!raw)
+        return -1;
+
+    raw->fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (raw->fd == -1) {
+        free(raw);
+        return -1;
+    }
+
+    int fd = synth_open(&synth_kind_sensor, true, &replay_raw_ops, raw, fps);
+    if (fd == -1) {
+        close(raw->fd);
+        free(raw);
+    }
+
+    return fd;
+
+}
+
+///
+/// H.264 ENCODER
+///
+
+/// Split an Annex-B stream in access units. A new access unit starts at the first
+/// non-VCL NAL unit (SEI, SPS, PPS, AUD, ...) following a slice, or at a slice
+/// whose 'first_mb_in_slice' is zero.
+static int replay_h264_index(struct replay_h264 *h264) {
+
+    const unsigned char *data = h264->data;
+    size_t capacity = 256;
+    h264->aus = malloc(capacity * sizeof(struct replay_au));
+    if (!h264->aus)
+        return -1;
+
+    bool vcl_seen = false;
+    bool idr = false;
+    size_t au_start = 0;
+
+    for (size_t i = 0; i + 3 < h264->size; i++) {
+
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+            continue;
+
+        size_t nal_start = i > 0 && data[i - 1] == 0 ? i - 1 : i;
+        unsigned type = data[i + 3] & 0x1F;
+        bool vcl = type == 1 || type == 5;
+        bool first_mb = vcl && i + 4 < h264->size && (data[i + 4] & 0x80);
+
+        if (vcl_seen && ((!vcl && type >= 6 && type <= 9) || first_mb)) {
+
+            if (h264->aus_count == capacity) {
+                capacity *= 2;
+                struct replay_au *aus = realloc(h264->aus, capacity * sizeof(struct replay_au));
+                if (!aus)
+                    return -1;
+                h264->aus = aus;
+            }
+
+            h264->aus[h264->aus_count].offset = au_start;
+            h264->aus[h264->aus_count].size = nal_start - au_start;
+            h264->aus[h264->aus_count].idr = idr;
+            h264->aus_count++;
+
+            au_start = nal_start;
+            vcl_seen = false;
+            idr = false;
+
+        }
+
+        vcl_seen |= vcl;
+        idr |= type == 5;
+        i += 2;
+
+    }
+
+    if (vcl_seen) {
+        if (h264->aus_count == capacity) {
+            struct replay_au *aus = realloc(h264->aus, (capacity + 1) * sizeof(struct replay_au));
+            if (!aus)
+                return -1;
+            h264->aus = aus;
+        }
+        h264->aus[h264->aus_count].offset = au_start;
+        h264->aus[h264->aus_count].size = h264->size - au_start;
+        h264->aus[h264->aus_count].idr = idr;
+        h264->aus_count++;
+    }
+
+    if (!h264->aus_count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+
+}
+
+static void replay_h264_process(struct synth_context *ctx, struct synth_buffer *out, struct synth_buffer *cap) {
+
+    (void) out;
+
+    struct replay_h264 *h264 = ctx->priv;
+    struct replay_au *au = &h264->aus[h264->next];
+    h264->next = (h264->next + 1) % h264->aus_count;
+
+    size_t size = au->size > cap->length ? cap->length : au->size;
+    memcpy(cap->start, h264->data + au->offset, size);
+    cap->bytesused = size;
+    cap->flags |= au->idr ? V4L2_BUF_FLAG_KEYFRAME : V4L2_BUF_FLAG_PFRAME;
+
+}
+
+static void replay_h264_release(struct synth_context *ctx) {
+    struct replay_h264 *h264 = ctx->priv;
+    munmap((void *) h264->data, h264->size);
+    free(h264->aus);
+    free(h264);
+}
+
+static const struct synth_ops replay_h264_ops = {
+    .process = replay_h264_process,
+    .release = replay_h264_release,
+};
+
+static int replay_h264_open(const char *file) {
+
+    struct replay_h264 *h264 = calloc(1, sizeof(struct replay_h264));
+    if (!h264)
+        return -1;
+
+    int file_fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (file_fd == -1) {
+        free(h264);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(file_fd, &st) == -1) {
+        close(file_fd);
+        free(h264);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        close(file_fd);
+        free(h264);
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+    close(file_fd);
+    if (data == MAP_FAILED) {
+        free(h264);
+        return -1;
+    }
+
+    h264->data = data;
+    h264->size = st.st_size;
+
+    int fd = -1;
+    if (replay_h264_index(h264) == 0)
+        fd = synth_open(&synth_kind_encoder, true, &replay_h264_ops, h264, 0);
+
+    if (fd == -1) {
+        munmap(data, st.st_size);
+        free(h264->aus);
+        free(h264);
+    }
+
+    return fd;
+
+}
+
+static int replay_backend_open(const char *path) {
+
+    char arg[4096];
+    strncpy(arg, path, sizeof(arg) - 1);
+    arg[sizeof(arg) - 1] = '\0';
+    unsigned fps = synth_parse_fps(arg);
+
+    char *file = strchr(arg, ':');
+    if (!file) {
+        errno = ENODEV;
+        return -1;
+    }
+    *file++ = '\0';
+
+    if (strcmp(arg, "sensor") == 0)
+        return replay_raw_open(file, fps);
+    if (strcmp(arg, "encoder") == 0)
+        return replay_h264_open(file);
+
+    errno = ENODEV;
+    return -1;
+
+}
+
+const struct vid_backend vid_backend_replay = {
+    .name = "replay",
+    .prefix = "replay:",
+    .open = replay_backend_open,
+    .close = synth_close,
+    .ioctl = synth_ioctl,
+    .mmap = synth_mmap,
+    .revents = synth_revents,
+    .wait_fd = synth_wait_fd,
+};
@@ -0,0 +1,79 @@
+/// Lock-free single-producer/single-consumer ring of frame references, used to
+/// hand buffers over between pipeline stages running on different threads.
+
+#pragma once
+
+#include <sys/time.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+
+/// Capacity of rings, a power of two that can hold every buffer of a queue.
+#define RING_CAPACITY 32
+
+/// Reference to a buffer handed over between two stages.
+struct frame_ref {
+    unsigned index;
+    int dmabuf_fd;
+    unsigned bytesused;
+    unsigned length;
+    unsigned flags;
+    unsigned field;
+    struct timeval timestamp;
+};
+
+/// The ring, head is only written by the consumer and tail by the producer,
+/// both are kept on their own cache line to avoid false sharing.
+struct ring {
+    const char *name;
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    /// Occupancy statistics, only written by the producer.
+    unsigned long pushes;
+    unsigned long occupancy_sum;
+    unsigned occupancy_max;
+    _Alignas(64) struct frame_ref items[RING_CAPACITY];
+};
+
+
+static inline unsigned ring_len(struct ring *ring) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return tail - head;
+}
+
+/// Push a reference, return false if the ring is full.
+static inline bool ring_push(struct ring *ring, const struct frame_ref *ref) {
+
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == RING_CAPACITY)
+        return false;
+
+    ring->items[tail % RING_CAPACITY] = *ref;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    unsigned occupancy = tail + 1 - head;
+    ring->pushes++;
+    ring->occupancy_sum += occupancy;
+    if (occupancy > ring->occupancy_max)
+        ring->occupancy_max = occupancy;
+
+    return true;
+
+}
+
+/// Pop a reference, return false if the ring is empty.
+static inline bool ring_pop(struct ring *ring, struct frame_ref *ref) {
+
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail)
+        return false;
+
+    *ref = ring->items[head % RING_CAPACITY];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+
+}
@@ -0,0 +1,886 @@
+#define _GNU_SOURCE
+
+#include "rtsp.h"
+#include "net.h"
+
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <sys/uio.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+
+#define RTP_HEADER_SIZE 12
+#define RTP_PAYLOAD_TYPE 96
+#define RTP_NAL_FU_A 28
+/// Interleaved frames are prefixed with '$', the channel and their length.
+#define RTSP_INTERLEAVED_SIZE 4
+#define RTSP_DEFAULT_PORT "554"
+/// Seconds from 1900, the NTP epoch, to 1970.
+#define RTSP_NTP_OFFSET 2208988800ull
+#define RTSP_CNAME "bike-streamer"
+
+/// Headers are in the slab while payloads point into the encoded buffer. The
+/// interleaved prefix, RTP header and FU-A indicator and header of each packet
+/// are contiguous so that one vector covers the headers of both transports.
+struct rtsp_slab {
+    unsigned count;
+    uint8_t headers[RTSP_SLAB][RTSP_INTERLEAVED_SIZE + RTP_HEADER_SIZE + 2];
+    /// Size of the RTP header and FU-A bytes of each packet.
+    uint8_t header_sizes[RTSP_SLAB];
+    struct iovec iovs[RTSP_SLAB][2];
+    struct mmsghdr msgs[RTSP_SLAB];
+    /// Vectors of the interleaved packets, sent with one sendmsg call.
+    struct iovec stream_iovs[RTSP_SLAB * 2];
+};
+
+
+static uint64_t rtsp_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void rtsp_random(void *data, size_t size) {
+    // Without entropy, identifiers are only less unique.
+    if (getrandom(data, size, GRND_NONBLOCK) != (ssize_t) size)
+        memset(data, 0x5A, size);
+}
+
+static unsigned rtsp_port(const struct sockaddr_storage *addr) {
+    if (addr->ss_family == AF_INET6)
+        return ntohs(((const struct sockaddr_in6 *) addr)->sin6_port);
+    return ntohs(((const struct sockaddr_in *) addr)->sin_port);
+}
+
+static void rtsp_set_port(struct sockaddr_storage *addr, unsigned port) {
+    if (addr->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *) addr)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *) addr)->sin_port = htons(port);
+}
+
+static unsigned rtsp_local_port(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    return rtsp_port(&addr);
+}
+
+static int rtsp_bind_udp(int family, unsigned port) {
+
+    int fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "error: failed to open rtp socket (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    struct sockaddr_storage addr = {0};
+    addr.ss_family = family;
+    rtsp_set_port(&addr, port);
+    if (bind(fd, (struct sockaddr *) &addr, family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in)) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+
+}
+
+/// Open the RTP and RTCP sockets on an even port and the next one, of the same
+/// family as the RTSP socket so that they reach the addresses of its peers.
+static void rtsp_open_udp(struct rtsp *rtsp, int family) {
+
+    for (unsigned attempt = 0; attempt < 64; attempt++) {
+        rtsp->rtp_fd = rtsp_bind_udp(family, 0);
+        unsigned port = rtsp->rtp_fd == -1 ? 1 : rtsp_local_port(rtsp->rtp_fd);
+        rtsp->rtcp_fd = port % 2 ? -1 : rtsp_bind_udp(family, port + 1);
+        if (rtsp->rtcp_fd != -1)
+            return;
+        if (rtsp->rtp_fd != -1)
+            close(rtsp->rtp_fd);
+    }
+
+    // Peers usually accept any pair of ports.
+    rtsp->rtp_fd = rtsp_bind_udp(family, 0);
+    rtsp->rtcp_fd = rtsp_bind_udp(family, 0);
+    if (rtsp->rtp_fd == -1 || rtsp->rtcp_fd == -1) {
+        fprintf(stderr, "error: failed to bind rtp sockets (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+}
+
+static void rtsp_base64(const uint8_t *data, size_t size, char *out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < size; i += 3) {
+        uint32_t v = data[i] << 16;
+        if (i + 1 < size)
+            v |= data[i + 1] << 8;
+        if (i + 2 < size)
+            v |= data[i + 2];
+        *out++ = alphabet[(v >> 18) & 0x3F];
+        *out++ = alphabet[(v >> 12) & 0x3F];
+        *out++ = i + 1 < size ? alphabet[(v >> 6) & 0x3F] : '=';
+        *out++ = i + 2 < size ? alphabet[v & 0x3F] : '=';
+    }
+    *out = '\0';
+}
+
+/// Write the session description, with the parameter sets once known.
+static void rtsp_sdp(const struct rtsp *rtsp, char *sdp, size_t size) {
+
+    char fmtp[3 * RTSP_MAX_PARAMETER_SET + 64] = "";
+    if (rtsp->sps_size >= 4 && rtsp->pps_size) {
+        char sps[RTSP_MAX_PARAMETER_SET * 4 / 3 + 4], pps[RTSP_MAX_PARAMETER_SET * 4 / 3 + 4];
+        rtsp_base64(rtsp->sps, rtsp->sps_size, sps);
+        rtsp_base64(rtsp->pps, rtsp->pps_size, pps);
+        snprintf(fmtp, sizeof(fmtp), ";profile-level-id=%02X%02X%02X;sprop-parameter-sets=%s,%s",
+            rtsp->sps[1], rtsp->sps[2], rtsp->sps[3], sps, pps);
+    }
+
+    snprintf(sdp, size,
+        "v=0\r\n"
+        "o=- %u 1 IN IP4 0.0.0.0\r\n"
+        "s=bike-streamer\r\n"
+        "c=IN IP4 0.0.0.0\r\n"
+        "t=0 0\r\n"
+        "a=control:*\r\n"
+        "m=video 0 RTP/AVP %d\r\n"
+        "a=rtpmap:%d H264/90000\r\n"
+        "a=fmtp:%d packetization-mode=1%s\r\n"
+        "a=control:trackID=0\r\n",
+        rtsp->ssrc, RTP_PAYLOAD_TYPE, RTP_PAYLOAD_TYPE, RTP_PAYLOAD_TYPE, fmtp);
+
+}
+
+/// Find a header of a message, return its value up to the end of line or NULL.
+static const char *rtsp_header(const char *msg, const char *name, char *value, size_t size) {
+
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\r\n%s:", name);
+    const char *str = strcasestr(msg, pattern);
+    if (!str)
+        return NULL;
+
+    str += strlen(pattern);
+    while (*str == ' ')
+        str++;
+    size_t len = strcspn(str, "\r\n");
+    if (len >= size)
+        len = size - 1;
+    memcpy(value, str, len);
+    value[len] = '\0';
+    return value;
+
+}
+
+/// Read a whole message, headers and body, from a blocking socket into 'msg',
+/// return its size or -1.
+static ssize_t rtsp_read_message(int fd, char *msg, size_t size) {
+
+    size_t len = 0;
+    for (;;) {
+        msg[len] = '\0';
+        char *end = strstr(msg, "\r\n\r\n");
+        if (end) {
+            char value[32];
+            size_t total = end + 4 - msg;
+            if (rtsp_header(msg, "Content-Length", value, sizeof(value)))
+                total += strtoul(value, NULL, 10);
+            if (total >= size)
+                return -1;
+            if (len >= total)
+                return total;
+        }
+        if (len + 1 >= size)
+            return -1;
+        ssize_t ret = recv(fd, msg + len, size - 1 - len, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        len += ret;
+    }
+
+}
+
+static void rtsp_drop(struct rtsp *rtsp, struct rtsp_client *client) {
+    if (rtsp->listen_fd == -1)
+        printf("warn: rtsp server closed the session\n");
+    close(client->fd);
+    memset(client, 0, sizeof(struct rtsp_client));
+    client->fd = -1;
+}
+
+/// Append to a message of 'len' bytes, return false without appending anything
+/// more once it does not fit.
+static bool rtsp_append(char *msg, size_t size, size_t *len, const char *format, ...) {
+    if (*len >= size)
+        return false;
+    va_list args;
+    va_start(args, format);
+    int ret = vsnprintf(msg + *len, size - *len, format, args);
+    va_end(args);
+    if (ret < 0 || (size_t) ret >= size - *len) {
+        *len = size;
+        return false;
+    }
+    *len += ret;
+    return true;
+}
+
+static void rtsp_reply(struct rtsp_client *client, const char *status, unsigned cseq, const char *headers, const char *body) {
+
+    char msg[RTSP_REQUEST_SIZE];
+    size_t body_size = body ? strlen(body) : 0;
+    size_t len = 0;
+    bool fits = rtsp_append(msg, sizeof(msg), &len, "RTSP/1.0 %s\r\nCSeq: %u\r\nServer: bike-streamer\r\n%s", status, cseq, headers ? headers : "")
+        && (!body_size || rtsp_append(msg, sizeof(msg), &len, "Content-Length: %zu\r\n", body_size))
+        && rtsp_append(msg, sizeof(msg), &len, "\r\n%s", body ? body : "");
+
+    if (!fits || send(client->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) len)
+        client->closing = true;
+
+}
+
+static void rtsp_setup(struct rtsp *rtsp, struct rtsp_client *client, unsigned cseq, const char *transport) {
+
+    char headers[512];
+    unsigned rtp_port, rtcp_port, channel = 0, rtcp_channel = 1;
+
+    while (!client->session)
+        rtsp_random(&client->session, sizeof(client->session));
+
+    if (strstr(transport, "multicast")) {
+        rtsp_reply(client, "461 Unsupported Transport", cseq, NULL, NULL);
+        return;
+    }
+
+    if (strstr(transport, "RTP/AVP/TCP")) {
+        // RTCP goes on the channel following the one of RTP, both being bytes.
+        const char *str = strstr(transport, "interleaved=");
+        if (str && (sscanf(str + 12, "%u-%u", &channel, &rtcp_channel) != 2 || channel > 254 || rtcp_channel != channel + 1)) {
+            rtsp_reply(client, "461 Unsupported Transport", cseq, NULL, NULL);
+            return;
+        }
+        client->interleaved = true;
+        client->channel = channel;
+        snprintf(headers, sizeof(headers),
+            "Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u;ssrc=%08X\r\nSession: %016llX;timeout=%d\r\n",
+            channel, channel + 1, rtsp->ssrc, (unsigned long long) client->session, RTSP_SESSION_TIMEOUT);
+    } else {
+        const char *str = strstr(transport, "client_port=");
+        if (!str || sscanf(str + 12, "%u-%u", &rtp_port, &rtcp_port) != 2) {
+            rtsp_reply(client, "461 Unsupported Transport", cseq, NULL, NULL);
+            return;
+        }
+        client->interleaved = false;
+        client->addr_len = sizeof(client->rtp_addr);
+        getpeername(client->fd, (struct sockaddr *) &client->rtp_addr, &client->addr_len);
+        client->rtcp_addr = client->rtp_addr;
+        rtsp_set_port(&client->rtp_addr, rtp_port);
+        rtsp_set_port(&client->rtcp_addr, rtcp_port);
+        snprintf(headers, sizeof(headers),
+            "Transport: RTP/AVP;unicast;client_port=%u-%u;server_port=%u-%u;ssrc=%08X\r\nSession: %016llX;timeout=%d\r\n",
+            rtp_port, rtcp_port, rtsp_local_port(rtsp->rtp_fd), rtsp_local_port(rtsp->rtcp_fd), rtsp->ssrc,
+            (unsigned long long) client->session, RTSP_SESSION_TIMEOUT);
+    }
+
+    client->setup = true;
+    rtsp_reply(client, "200 OK", cseq, headers, NULL);
+
+}
+
+/// Answer a request of a player, responses of the server being published to
+/// are only consumed.
+static void rtsp_handle(struct rtsp *rtsp, struct rtsp_client *client, const char *msg) {
+
+    if (strncmp(msg, "RTSP/", 5) == 0)
+        return;
+
+    char method[32], url[512], value[512];
+    if (sscanf(msg, "%31s %511s", method, url) != 2) {
+        client->closing = true;
+        return;
+    }
+
+    unsigned cseq = rtsp_header(msg, "CSeq", value, sizeof(value)) ? strtoul(value, NULL, 10) : 0;
+    char session[64];
+    snprintf(session, sizeof(session), "Session: %016llX;timeout=%d\r\n", (unsigned long long) client->session, RTSP_SESSION_TIMEOUT);
+    rtsp->requests++;
+
+    if (strcmp(method, "OPTIONS") == 0) {
+        rtsp_reply(client, "200 OK", cseq, "Public: OPTIONS, DESCRIBE, SETUP, PLAY, TEARDOWN, GET_PARAMETER\r\n", NULL);
+    } else if (strcmp(method, "DESCRIBE") == 0) {
+        char sdp[1024], headers[640];
+        rtsp_sdp(rtsp, sdp, sizeof(sdp));
+        snprintf(headers, sizeof(headers), "Content-Base: %s/\r\nContent-Type: application/sdp\r\n", url);
+        rtsp_reply(client, "200 OK", cseq, headers, sdp);
+    } else if (strcmp(method, "SETUP") == 0) {
+        rtsp_setup(rtsp, client, cseq, rtsp_header(msg, "Transport", value, sizeof(value)) ? value : "");
+    } else if (strcmp(method, "PLAY") == 0) {
+        if (!client->setup) {
+            rtsp_reply(client, "455 Method Not Valid in This State", cseq, NULL, NULL);
+            return;
+        }
+        client->playing = true;
+        client->synced = false;
+        strcat(session, "Range: npt=0.000-\r\n");
+        rtsp_reply(client, "200 OK", cseq, session, NULL);
+    } else if (strcmp(method, "TEARDOWN") == 0) {
+        rtsp_reply(client, "200 OK", cseq, session, NULL);
+        client->closing = true;
+    } else if (strcmp(method, "GET_PARAMETER") == 0 || strcmp(method, "SET_PARAMETER") == 0) {
+        rtsp_reply(client, "200 OK", cseq, session, NULL);
+    } else {
+        rtsp_reply(client, "501 Not Implemented", cseq, NULL, NULL);
+    }
+
+}
+
+/// Read the pending messages of a connection without blocking, skipping the
+/// RTCP reports interleaved by the players.
+static void rtsp_read(struct rtsp *rtsp, struct rtsp_client *client, uint64_t now_us) {
+
+    for (;;) {
+        ssize_t len = recv(client->fd, client->request + client->request_size, RTSP_REQUEST_SIZE - client->request_size, MSG_DONTWAIT);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == 0 || (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            client->closing = true;
+            return;
+        }
+        if (len == -1)
+            break;
+        client->request_size += len;
+        client->activity_us = now_us;
+        if (client->request_size == RTSP_REQUEST_SIZE)
+            break;
+    }
+
+    char *request = client->request;
+    while (client->request_size && !client->closing) {
+
+        size_t total;
+        if (request[0] == '$') {
+            if (client->request_size < RTSP_INTERLEAVED_SIZE)
+                break;
+            total = RTSP_INTERLEAVED_SIZE + (((uint8_t) request[2] << 8) | (uint8_t) request[3]);
+        } else {
+            char *end = memmem(request, client->request_size, "\r\n\r\n", 4);
+            if (!end) {
+                // A request larger than the buffer is never complete.
+                if (client->request_size == RTSP_REQUEST_SIZE)
+                    client->closing = true;
+                break;
+            }
+            char msg[RTSP_REQUEST_SIZE + 1];
+            total = end + 4 - request;
+            memcpy(msg, request, total);
+            msg[total] = '\0';
+            char value[32];
+            if (rtsp_header(msg, "Content-Length", value, sizeof(value)))
+                total += strtoul(value, NULL, 10);
+            if (total > client->request_size)
+                break;
+            rtsp_handle(rtsp, client, msg);
+        }
+
+        if (total > client->request_size)
+            break;
+        client->request_size -= total;
+        memmove(request, request + total, client->request_size);
+
+    }
+
+    if (client->request_size == RTSP_REQUEST_SIZE)
+        client->closing = true;
+
+}
+
+/// Accept the new players, serve the pending requests and close the sessions
+/// that ended or timed out.
+static void rtsp_serve(struct rtsp *rtsp, uint64_t now_us) {
+
+    if (rtsp->listen_fd != -1) {
+        for (;;) {
+            int fd = accept4(rtsp->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd == -1)
+                break;
+            struct rtsp_client *client = NULL;
+            for (unsigned i = 0; i < RTSP_MAX_CLIENTS && !client; i++)
+                if (rtsp->clients[i].fd == -1)
+                    client = &rtsp->clients[i];
+            if (!client) {
+                close(fd);
+                rtsp->dropped_clients++;
+                continue;
+            }
+            client->fd = fd;
+            client->activity_us = now_us;
+            rtsp->accepted_clients++;
+        }
+    } else if (rtsp->clients[0].fd != -1 && now_us - rtsp->keepalive_us >= RTSP_SESSION_TIMEOUT * 1000000ull / 2) {
+        char msg[512];
+        int len = snprintf(msg, sizeof(msg), "OPTIONS %s RTSP/1.0\r\nCSeq: %u\r\nSession: %s\r\n\r\n", rtsp->url, ++rtsp->cseq, rtsp->session);
+        send(rtsp->clients[0].fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        rtsp->keepalive_us = now_us;
+    }
+
+    for (unsigned i = 0; i < RTSP_MAX_CLIENTS; i++) {
+        struct rtsp_client *client = &rtsp->clients[i];
+        if (client->fd == -1)
+            continue;
+        rtsp_read(rtsp, client, now_us);
+        if (rtsp->listen_fd != -1 && now_us - client->activity_us > RTSP_SESSION_TIMEOUT * 1000000ull)
+            client->closing = true;
+        if (client->closing)
+            rtsp_drop(rtsp, client);
+    }
+
+    // Receiver reports are not used.
+    char report[1500];
+    while (recv(rtsp->rtcp_fd, report, sizeof(report), MSG_DONTWAIT) >= 0 || errno == EINTR)
+        continue;
+    while (recv(rtsp->rtp_fd, report, sizeof(report), MSG_DONTWAIT) >= 0 || errno == EINTR)
+        continue;
+
+}
+
+/// Send a request of the publishing handshake and wait for its response,
+/// failures are fatal.
+static void rtsp_publish_request(struct rtsp *rtsp, int fd, const char *method, const char *url, const char *headers, const char *body, char *response, size_t size) {
+
+    char msg[RTSP_REQUEST_SIZE];
+    size_t body_size = body ? strlen(body) : 0;
+    size_t len = 0;
+    bool fits = rtsp_append(msg, sizeof(msg), &len, "%s %s RTSP/1.0\r\nCSeq: %u\r\nUser-Agent: bike-streamer\r\n%s", method, url, ++rtsp->cseq, headers ? headers : "")
+        && (!rtsp->session[0] || rtsp_append(msg, sizeof(msg), &len, "Session: %s\r\n", rtsp->session))
+        && (!body_size || rtsp_append(msg, sizeof(msg), &len, "Content-Length: %zu\r\n", body_size))
+        && rtsp_append(msg, sizeof(msg), &len, "\r\n%s", body ? body : "");
+    if (!fits) {
+        fprintf(stderr, "error: rtsp %s of '%s' too large\n", method, url);
+        exit(1);
+    }
+
+    unsigned status = 0;
+    if (send(fd, msg, len, MSG_NOSIGNAL) == (ssize_t) len && rtsp_read_message(fd, response, size) > 0)
+        sscanf(response, "RTSP/1.0 %u", &status);
+
+    if (status != 200) {
+        fprintf(stderr, "error: rtsp server refused %s of '%s' (%u)\n", method, url, status);
+        exit(1);
+    }
+
+}
+
+/// Announce the stream to the server and start recording over UDP.
+static void rtsp_publish(struct rtsp *rtsp, int fd) {
+
+    // Responses are awaited with a timeout, the socket is only read without
+    // blocking afterwards.
+    struct timeval timeout = { .tv_sec = 5 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char response[RTSP_REQUEST_SIZE], sdp[1024], headers[256], url[512], value[256];
+    rtsp_sdp(rtsp, sdp, sizeof(sdp));
+    rtsp_publish_request(rtsp, fd, "ANNOUNCE", rtsp->url, "Content-Type: application/sdp\r\n", sdp, response, sizeof(response));
+
+    snprintf(url, sizeof(url), "%s/trackID=0", rtsp->url);
+    snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%u-%u;mode=record\r\n",
+        rtsp_local_port(rtsp->rtp_fd), rtsp_local_port(rtsp->rtcp_fd));
+    rtsp_publish_request(rtsp, fd, "SETUP", url, headers, NULL, response, sizeof(response));
+
+    unsigned rtp_port, rtcp_port;
+    const char *str = rtsp_header(response, "Transport", value, sizeof(value)) ? strstr(value, "server_port=") : NULL;
+    if (!str || sscanf(str + 12, "%u-%u", &rtp_port, &rtcp_port) != 2) {
+        fprintf(stderr, "error: rtsp server didn't give its rtp ports\n");
+        exit(1);
+    }
+    if (rtsp_header(response, "Session", value, sizeof(value))) {
+        size_t len = strcspn(value, ";");
+        if (len >= sizeof(rtsp->session))
+            len = sizeof(rtsp->session) - 1;
+        memcpy(rtsp->session, value, len);
+        rtsp->session[len] = '\0';
+    }
+
+    rtsp_publish_request(rtsp, fd, "RECORD", rtsp->url, "Range: npt=0.000-\r\n", NULL, response, sizeof(response));
+
+    struct rtsp_client *client = &rtsp->clients[0];
+    client->fd = fd;
+    client->addr_len = sizeof(client->rtp_addr);
+    getpeername(fd, (struct sockaddr *) &client->rtp_addr, &client->addr_len);
+    client->rtcp_addr = client->rtp_addr;
+    rtsp_set_port(&client->rtp_addr, rtp_port);
+    rtsp_set_port(&client->rtcp_addr, rtcp_port);
+    client->setup = true;
+    client->playing = true;
+    rtsp->keepalive_us = rtsp_now_us();
+
+}
+
+void rtsp_open(struct rtsp *rtsp, const char *address, unsigned mtu) {
+
+    memset(rtsp, 0, sizeof(struct rtsp));
+    rtsp->listen_fd = -1;
+    rtsp->mtu = mtu;
+    for (unsigned i = 0; i < RTSP_MAX_CLIENTS; i++)
+        rtsp->clients[i].fd = -1;
+
+    rtsp_random(&rtsp->ssrc, sizeof(rtsp->ssrc));
+    rtsp_random(&rtsp->sequence, sizeof(rtsp->sequence));
+    rtsp_random(&rtsp->timestamp_offset, sizeof(rtsp->timestamp_offset));
+
+    struct rtsp_slab *slab = calloc(1, sizeof(struct rtsp_slab));
+    if (!slab) {
+        fprintf(stderr, "error: failed to allocate rtp slab\n");
+        exit(1);
+    }
+
+    for (unsigned i = 0; i < RTSP_SLAB; i++) {
+        slab->msgs[i].msg_hdr.msg_iov = slab->iovs[i];
+        slab->msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
+    rtsp->slab = slab;
+
+    int fd;
+    if (strncmp(address, "rtsp://", 7) == 0) {
+        // The URL is 'rtsp://host[:port]/path'.
+        char host[256];
+        const char *path = strchr(address + 7, '/');
+        size_t host_len = path ? (size_t) (path - address - 7) : strlen(address + 7);
+        if (!host_len || host_len >= sizeof(host) - sizeof(RTSP_DEFAULT_PORT) - 1) {
+            fprintf(stderr, "error: invalid rtsp url '%s'\n", address);
+            exit(1);
+        }
+        memcpy(host, address + 7, host_len);
+        host[host_len] = '\0';
+        if (!strchr(host, ':'))
+            strcat(host, ":" RTSP_DEFAULT_PORT);
+        rtsp->url = address;
+        fd = net_connect(host, SOCK_STREAM);
+    } else if (strncmp(address, "rtsp:", 5) == 0) {
+        rtsp->listen_fd = net_listen(address + 5, SOCK_STREAM | SOCK_NONBLOCK);
+        fd = rtsp->listen_fd;
+    } else {
+        fprintf(stderr, "error: invalid rtsp address '%s', expected rtsp:port or rtsp://host:port/path\n", address);
+        exit(1);
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    rtsp_open_udp(rtsp, addr.ss_family);
+
+    if (rtsp->listen_fd == -1)
+        rtsp_publish(rtsp, fd);
+
+}
+
+void rtsp_close(struct rtsp *rtsp) {
+
+    if (rtsp->listen_fd == -1 && rtsp->clients[0].fd != -1) {
+        char msg[512];
+        int len = snprintf(msg, sizeof(msg), "TEARDOWN %s RTSP/1.0\r\nCSeq: %u\r\nSession: %s\r\n\r\n", rtsp->url, ++rtsp->cseq, rtsp->session);
+        send(rtsp->clients[0].fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+
+    for (unsigned i = 0; i < RTSP_MAX_CLIENTS; i++)
+        if (rtsp->clients[i].fd != -1)
+            close(rtsp->clients[i].fd);
+    if (rtsp->listen_fd != -1)
+        close(rtsp->listen_fd);
+    close(rtsp->rtp_fd);
+    close(rtsp->rtcp_fd);
+    free(rtsp->slab);
+    rtsp->slab = NULL;
+    rtsp->listen_fd = -1;
+
+}
+
+/// Send the packets of the slab to every player in sync.
+static void rtsp_flush(struct rtsp *rtsp) {
+
+    struct rtsp_slab *slab = rtsp->slab;
+
+    for (unsigned c = 0; c < RTSP_MAX_CLIENTS; c++) {
+
+        struct rtsp_client *client = &rtsp->clients[c];
+        if (client->fd == -1 || !client->playing || !client->synced || client->closing)
+            continue;
+
+        if (client->interleaved) {
+            // A packet sent partially would corrupt the connection, a player that
+            // doesn't keep up is disconnected rather than waited for.
+            size_t total = 0;
+            for (unsigned i = 0; i < slab->count; i++) {
+                slab->headers[i][1] = client->channel;
+                slab->stream_iovs[2 * i].iov_base = slab->headers[i];
+                slab->stream_iovs[2 * i].iov_len = RTSP_INTERLEAVED_SIZE + slab->header_sizes[i];
+                slab->stream_iovs[2 * i + 1] = slab->iovs[i][1];
+                total += slab->stream_iovs[2 * i].iov_len + slab->iovs[i][1].iov_len;
+            }
+            struct msghdr msg = {0};
+            msg.msg_iov = slab->stream_iovs;
+            msg.msg_iovlen = 2 * slab->count;
+            ssize_t len;
+            do {
+                len = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            } while (len == -1 && errno == EINTR);
+            if (len != (ssize_t) total) {
+                client->closing = true;
+                rtsp->dropped_clients++;
+            }
+            continue;
+        }
+
+        for (unsigned i = 0; i < slab->count; i++) {
+            slab->msgs[i].msg_hdr.msg_name = &client->rtp_addr;
+            slab->msgs[i].msg_hdr.msg_namelen = client->addr_len;
+        }
+
+        unsigned sent = 0;
+        while (sent < slab->count) {
+            int ret = sendmmsg(rtsp->rtp_fd, slab->msgs + sent, slab->count - sent, 0);
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            } else if (ret == -1) {
+                // Datagrams are dropped like they would be on the network.
+                rtsp->errors += slab->count - sent;
+                break;
+            }
+            sent += ret;
+        }
+
+    }
+
+    slab->count = 0;
+
+}
+
+/// Add a packet to the slab, which is flushed first if full so that the last
+/// packet of a frame is always in the slab when the frame ends.
+static void rtsp_emit(struct rtsp *rtsp, const uint8_t *fu, const uint8_t *payload, size_t size, uint32_t timestamp) {
+
+    struct rtsp_slab *slab = rtsp->slab;
+    if (slab->count == RTSP_SLAB)
+        rtsp_flush(rtsp);
+
+    unsigned i = slab->count++;
+    uint8_t *header = slab->headers[i];
+    unsigned header_size = RTP_HEADER_SIZE + (fu ? 2 : 0);
+    size_t rtp_size = header_size + size;
+
+    header[0] = '$';
+    header[2] = rtp_size >> 8;
+    header[3] = rtp_size;
+
+    uint8_t *rtp = header + RTSP_INTERLEAVED_SIZE;
+    rtp[0] = 0x80;
+    rtp[1] = RTP_PAYLOAD_TYPE;
+    rtp[2] = rtsp->sequence >> 8;
+    rtp[3] = rtsp->sequence;
+    rtp[4] = timestamp >> 24;
+    rtp[5] = timestamp >> 16;
+    rtp[6] = timestamp >> 8;
+    rtp[7] = timestamp;
+    rtp[8] = rtsp->ssrc >> 24;
+    rtp[9] = rtsp->ssrc >> 16;
+    rtp[10] = rtsp->ssrc >> 8;
+    rtp[11] = rtsp->ssrc;
+    if (fu) {
+        rtp[12] = fu[0];
+        rtp[13] = fu[1];
+    }
+
+    slab->header_sizes[i] = header_size;
+    slab->iovs[i][0].iov_base = rtp;
+    slab->iovs[i][0].iov_len = header_size;
+    slab->iovs[i][1].iov_base = (void *) payload;
+    slab->iovs[i][1].iov_len = size;
+
+    rtsp->sequence++;
+    rtsp->rtp_packets++;
+    rtsp->rtp_octets += header_size - RTP_HEADER_SIZE + size;
+    rtsp->packets++;
+    rtsp->bytes += rtp_size;
+
+}
+
+/// Find the next Annex-B start code, including the leading zero of four bytes
+/// start codes, return 'end' if none.
+static const uint8_t *rtsp_next_nal(const uint8_t *ptr, const uint8_t *end) {
+    for (; ptr + 3 <= end; ptr++) {
+        if (ptr[0] == 0 && ptr[1] == 0 && ptr[2] == 1)
+            return ptr;
+        if (ptr + 4 <= end && ptr[0] == 0 && ptr[1] == 0 && ptr[2] == 0 && ptr[3] == 1)
+            return ptr;
+    }
+    return end;
+}
+
+/// Skip the start code of a NAL unit.
+static const uint8_t *rtsp_nal_payload(const uint8_t *nal, const uint8_t *end) {
+    while (nal < end && *nal == 0)
+        nal++;
+    return nal < end ? nal + 1 : end;
+}
+
+/// Keep the parameter sets of a key frame, which precede its slices.
+static void rtsp_parameter_sets(struct rtsp *rtsp, const uint8_t *data, size_t size) {
+
+    const uint8_t *end = data + size;
+    const uint8_t *nal = rtsp_next_nal(data, end);
+    while (nal < end) {
+        const uint8_t *payload = rtsp_nal_payload(nal, end);
+        if (payload == end)
+            break;
+        unsigned type = payload[0] & 0x1F;
+        if (type == 1 || type == 5)
+            break;
+        nal = rtsp_next_nal(payload, end);
+        size_t len = nal - payload;
+        if (type == 7 && len <= RTSP_MAX_PARAMETER_SET) {
+            memcpy(rtsp->sps, payload, len);
+            rtsp->sps_size = len;
+        } else if (type == 8 && len <= RTSP_MAX_PARAMETER_SET) {
+            memcpy(rtsp->pps, payload, len);
+            rtsp->pps_size = len;
+        }
+    }
+
+}
+
+/// Send a sender report and the name of the source to every player in sync.
+static void rtsp_send_report(struct rtsp *rtsp, uint64_t capture_us, uint32_t timestamp) {
+
+    // Capture timestamps are monotonic, the report gives their wall clock time.
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    int64_t offset_us = ((int64_t) realtime.tv_sec - monotonic.tv_sec) * 1000000 + (realtime.tv_nsec - monotonic.tv_nsec) / 1000;
+    uint64_t wallclock_us = capture_us + offset_us;
+    uint64_t ntp = (wallclock_us / 1000000 + RTSP_NTP_OFFSET) << 32 | ((wallclock_us % 1000000) << 32) / 1000000;
+
+    uint8_t report[RTSP_INTERLEAVED_SIZE + 28 + 24] = {0};
+    uint8_t *p = report + RTSP_INTERLEAVED_SIZE;
+    uint32_t words[] = {
+        0x80C80006, rtsp->ssrc, ntp >> 32, (uint32_t) ntp, timestamp, rtsp->rtp_packets, rtsp->rtp_octets,
+        0x81CA0005, rtsp->ssrc,
+    };
+    for (unsigned i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        uint32_t word = htonl(words[i]);
+        memcpy(p + 4 * i, &word, 4);
+    }
+    p[36] = 1;
+    p[37] = sizeof(RTSP_CNAME) - 1;
+    memcpy(p + 38, RTSP_CNAME, sizeof(RTSP_CNAME) - 1);
+
+    size_t size = sizeof(report) - RTSP_INTERLEAVED_SIZE;
+    report[0] = '$';
+    report[2] = size >> 8;
+    report[3] = size;
+
+    for (unsigned c = 0; c < RTSP_MAX_CLIENTS; c++) {
+        struct rtsp_client *client = &rtsp->clients[c];
+        if (client->fd == -1 || !client->playing || !client->synced || client->closing)
+            continue;
+        if (client->interleaved) {
+            report[1] = client->channel + 1;
+            if (send(client->fd, report, sizeof(report), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) sizeof(report)) {
+                client->closing = true;
+                rtsp->dropped_clients++;
+            }
+        } else if (sendto(rtsp->rtcp_fd, p, size, 0, (struct sockaddr *) &client->rtcp_addr, client->addr_len) == -1) {
+            rtsp->errors++;
+        }
+    }
+
+    rtsp->report_us = capture_us;
+    rtsp->reports++;
+
+}
+
+void rtsp_send_frame(struct rtsp *rtsp, const void *data, size_t size, const struct timeval *timestamp, bool keyframe) {
+
+    rtsp_serve(rtsp, rtsp_now_us());
+    if (!size)
+        return;
+
+    if (keyframe)
+        rtsp_parameter_sets(rtsp, data, size);
+
+    // Players start at a key frame, frames are only packetized when one reads them.
+    unsigned receivers = 0;
+    for (unsigned i = 0; i < RTSP_MAX_CLIENTS; i++) {
+        struct rtsp_client *client = &rtsp->clients[i];
+        if (client->fd == -1 || !client->playing)
+            continue;
+        if (keyframe)
+            client->synced = true;
+        if (client->synced)
+            receivers++;
+    }
+    if (!receivers)
+        return;
+
+    uint64_t capture_us = (uint64_t) timestamp->tv_sec * 1000000 + timestamp->tv_usec;
+    uint32_t rtp_timestamp = rtsp->timestamp_offset + (uint32_t) (capture_us * 9 / 100);
+    size_t payload_max = rtsp->mtu - RTP_HEADER_SIZE;
+
+    const uint8_t *end = (const uint8_t *) data + size;
+    const uint8_t *nal = rtsp_next_nal(data, end);
+    while (nal < end) {
+
+        const uint8_t *payload = rtsp_nal_payload(nal, end);
+        nal = rtsp_next_nal(payload, end);
+        size_t nal_size = nal - payload;
+        if (!nal_size)
+            continue;
+
+        if (nal_size <= payload_max) {
+            rtsp_emit(rtsp, NULL, payload, nal_size, rtp_timestamp);
+            continue;
+        }
+
+        // Fragments carry the NAL unit header in their FU-A indicator and header.
+        uint8_t fu[2] = { (payload[0] & 0xE0) | RTP_NAL_FU_A, payload[0] & 0x1F };
+        for (size_t offset = 1; offset < nal_size; offset += payload_max - 2) {
+            size_t len = nal_size - offset < payload_max - 2 ? nal_size - offset : payload_max - 2;
+            fu[1] = (payload[0] & 0x1F) | (offset == 1 ? 0x80 : 0) | (offset + len == nal_size ? 0x40 : 0);
+            rtsp_emit(rtsp, fu, payload + offset, len, rtp_timestamp);
+        }
+        rtsp->fragmented_nals++;
+
+    }
+
+    struct rtsp_slab *slab = rtsp->slab;
+    if (slab->count) {
+        // The marker bit ends the access unit.
+        slab->headers[slab->count - 1][RTSP_INTERLEAVED_SIZE + 1] |= 0x80;
+        rtsp_flush(rtsp);
+    }
+    rtsp->frames++;
+
+    if (!rtsp->reports || capture_us - rtsp->report_us >= RTSP_REPORT_INTERVAL_MS * 1000)
+        rtsp_send_report(rtsp, capture_us, rtp_timestamp);
+
+    for (unsigned i = 0; i < RTSP_MAX_CLIENTS; i++)
+        if (rtsp->clients[i].fd != -1 && rtsp->clients[i].closing)
+            rtsp_drop(rtsp, &rtsp->clients[i]);
+
+}
+
+void rtsp_report(const struct rtsp *rtsp) {
+    printf("info: rtsp %lu frames, %lu packets, %lu bytes, %lu fragmented nals, %lu requests, %lu clients accepted, %lu dropped, %lu reports, %lu errors\n",
+        rtsp->frames, rtsp->packets, rtsp->bytes, rtsp->fragmented_nals, rtsp->requests, rtsp->accepted_clients, rtsp->dropped_clients, rtsp->reports, rtsp->errors);
+}
@@ -0,0 +1,117 @@
+/// RTSP server and publisher of the encoded frames over RTP (RFC 2326, RFC 6184),
+/// in place of the MediaMTX 'rpiCamera' source and the ffmpeg relay of 'rpi.yml':
+///  - 'rtsp:port' serves players on any path with DESCRIBE, SETUP and PLAY, RTP
+///    being sent over UDP or interleaved in the RTSP connection, a new player
+///    starts at the next key frame and one that can't keep up is disconnected;
+///  - 'rtsp://host:port/path' publishes to a server with ANNOUNCE, SETUP and
+///    RECORD, RTP being sent over UDP like the relay did.
+///
+/// Access units are split along NAL units into single NAL unit packets and FU-A
+/// fragments whose payloads point into the encoder capture buffer, and are sent
+/// in slabs with one sendmmsg per receiver. The kernel copies the datagrams on
+/// send, so the encoder buffer is released immediately. RTP timestamps are the
+/// capture timestamps at 90 kHz, and RTCP sender reports map them to the wall
+/// clock time of the capture every second.
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define RTSP_MAX_CLIENTS 8
+/// Size of the pending requests of a connection.
+#define RTSP_REQUEST_SIZE 4096
+/// Session timeout announced to clients, which send keepalive requests within it,
+/// in seconds.
+#define RTSP_SESSION_TIMEOUT 60
+/// Interval of the RTCP sender reports, in milliseconds.
+#define RTSP_REPORT_INTERVAL_MS 1000
+/// Number of RTP packets of a slab, sent with one sendmmsg call per receiver.
+#define RTSP_SLAB 64
+/// Largest parameter set kept for the session description.
+#define RTSP_MAX_PARAMETER_SET 128
+
+struct rtsp_client {
+    /// RTSP connection, -1 for a free slot.
+    int fd;
+    char request[RTSP_REQUEST_SIZE];
+    size_t request_size;
+    /// RTP and RTCP destinations over UDP, or the interleaved channel of RTP
+    /// followed by the one of RTCP.
+    bool interleaved;
+    uint8_t channel;
+    struct sockaddr_storage rtp_addr;
+    struct sockaddr_storage rtcp_addr;
+    socklen_t addr_len;
+    bool setup;
+    bool playing;
+    /// The client received a key frame, it is sent all the frames.
+    bool synced;
+    /// The connection is closed after the frame being sent.
+    bool closing;
+    uint64_t session;
+    /// Time of the last request, in microseconds.
+    uint64_t activity_us;
+};
+
+/// Packets being built, see 'rtsp.c'.
+struct rtsp_slab;
+
+struct rtsp {
+    /// Listening socket when serving, -1 when publishing.
+    int listen_fd;
+    /// RTP and RTCP sockets, shared by all the UDP receivers.
+    int rtp_fd;
+    int rtcp_fd;
+    /// Maximum size of an RTP packet, header included.
+    unsigned mtu;
+    /// Published URL and session when publishing, the server is then the only
+    /// client, kept alive with a request every half timeout.
+    const char *url;
+    char session[64];
+    unsigned cseq;
+    uint64_t keepalive_us;
+    uint32_t ssrc;
+    uint16_t sequence;
+    uint32_t timestamp_offset;
+    struct rtsp_client clients[RTSP_MAX_CLIENTS];
+    /// Parameter sets of the last key frame, announced in the session description.
+    uint8_t sps[RTSP_MAX_PARAMETER_SET];
+    size_t sps_size;
+    uint8_t pps[RTSP_MAX_PARAMETER_SET];
+    size_t pps_size;
+    struct rtsp_slab *slab;
+    /// Capture time of the last sender report, in microseconds.
+    uint64_t report_us;
+    /// Packets and payload bytes sent since the start, for the sender reports.
+    uint32_t rtp_packets;
+    uint32_t rtp_octets;
+    unsigned long frames;
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long fragmented_nals;
+    unsigned long requests;
+    unsigned long accepted_clients;
+    unsigned long dropped_clients;
+    unsigned long reports;
+    /// Packets that could not be sent, such as when a player went away.
+    unsigned long errors;
+};
+
+
+/// Serve on 'rtsp:port' or publish to 'rtsp://host:port/path', errors are fatal.
+void rtsp_open(struct rtsp *rtsp, const char *address, unsigned mtu);
+void rtsp_close(struct rtsp *rtsp);
+
+/// Serve the pending requests, then packetize and send an Annex-B access unit
+/// to the players, the data is no longer read on return.
+void rtsp_send_frame(struct rtsp *rtsp, const void *data, size_t size, const struct timeval *timestamp, bool keyframe);
+
+/// Print the RTSP and RTP statistics.
+void rtsp_report(const struct rtsp *rtsp);
@@ -0,0 +1,541 @@
+/// Local RTSP player measuring a stream, to compare the RTSP server of the client
+/// (see 'rtsp.h') with the MediaMTX path of 'rpi.yml' on the Pi. The stream is
+/// played over UDP or TCP for a duration and the frames are timed on arrival:
+///  - setup time until the PLAY response, and first frame and key frame after it;
+///  - frame rate, packet losses, bitrate and interval between frames;
+///  - latency from capture to arrival, through the wall clock time the RTCP sender
+///    reports give to RTP timestamps, meaningful when the sender runs on the same
+///    host and its reports date the capture, like the client does;
+///  - CPU usage of the given processes over the run, such as the client, or
+///    MediaMTX and its ffmpeg relay.
+
+#define _GNU_SOURCE
+
+#include "net.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+
+#define RTSPBENCH_MAX_FRAMES (1 << 16)
+#define RTSPBENCH_MAX_PIDS 8
+#define RTSPBENCH_MESSAGE_SIZE 8192
+/// Interval of the keepalive requests, within the session timeouts of servers.
+#define RTSPBENCH_KEEPALIVE_S 15
+#define RTSPBENCH_NTP_OFFSET 2208988800ull
+
+struct rtspbench {
+    const char *url;
+    bool tcp;
+    double duration;
+    pid_t pids[RTSPBENCH_MAX_PIDS];
+    unsigned pid_count;
+    int fd;
+    unsigned cseq;
+    char session[128];
+    /// Stream read over TCP, interleaved packets and responses.
+    uint8_t stream[RTSPBENCH_MESSAGE_SIZE * 8];
+    size_t stream_size;
+    int rtp_fd;
+    int rtcp_fd;
+    bool started;
+    uint16_t sequence;
+    unsigned long packets;
+    unsigned long lost_packets;
+    unsigned long bytes;
+    /// RTP timestamp and arrival time of each frame, in microseconds.
+    uint32_t frame_timestamps[RTSPBENCH_MAX_FRAMES];
+    int64_t frame_arrivals_us[RTSPBENCH_MAX_FRAMES];
+    unsigned frames;
+    int64_t first_keyframe_us;
+    /// Last sender report, RTP timestamp and its wall clock time.
+    bool report;
+    uint32_t report_timestamp;
+    int64_t report_wallclock_us;
+};
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s url [-d seconds] [-t udp|tcp] [-p pid[,pid...]] [-o output]\n", prog);
+    fprintf(stderr, "  -d  duration of the run in seconds (10)\n");
+    fprintf(stderr, "  -t  transport of the RTP packets (udp)\n");
+    fprintf(stderr, "  -p  processes whose CPU usage is measured over the run\n");
+    fprintf(stderr, "  -o  output of the JSON report, '-' for stdout (-)\n");
+    fprintf(stderr, "such as, on the Pi:\n");
+    fprintf(stderr, "  %s rtsp://127.0.0.1:8554/live -p $(pidof main)\n", prog);
+    fprintf(stderr, "  %s rtsp://127.0.0.1:8554/cam -p $(pidof mediamtx),$(pidof ffmpeg)\n", prog);
+    exit(1);
+}
+
+static int64_t rtspbench_realtime_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t rtspbench_monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/// CPU time of a process, user and system, in clock ticks, -1 if it is gone.
+static long rtspbench_cpu_ticks(pid_t pid) {
+
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return -1;
+    size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+
+    // Fields follow the command name, which may contain spaces.
+    const char *str = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (!str || sscanf(str + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+    return utime + stime;
+
+}
+
+static const char *rtspbench_header(const char *msg, const char *name, char *value, size_t size) {
+
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), "\r\n%s:", name);
+    const char *str = strcasestr(msg, pattern);
+    if (!str)
+        return NULL;
+
+    str += strlen(pattern);
+    while (*str == ' ')
+        str++;
+    size_t len = strcspn(str, "\r\n");
+    if (len >= size)
+        len = size - 1;
+    memcpy(value, str, len);
+    value[len] = '\0';
+    return value;
+
+}
+
+/// Send a request and read its response, skipping the interleaved packets that
+/// precede it. Failures are fatal.
+static void rtspbench_request(struct rtspbench *b, const char *method, const char *url, const char *headers, char *response) {
+
+    char msg[RTSPBENCH_MESSAGE_SIZE];
+    int len = snprintf(msg, sizeof(msg), "%s %s RTSP/1.0\r\nCSeq: %u\r\nUser-Agent: rtspbench\r\n%s", method, url, ++b->cseq, headers ? headers : "");
+    if (b->session[0])
+        len += snprintf(msg + len, sizeof(msg) - len, "Session: %s\r\n", b->session);
+    len += snprintf(msg + len, sizeof(msg) - len, "\r\n");
+    if (send(b->fd, msg, len, MSG_NOSIGNAL) != len) {
+        fprintf(stderr, "error: failed to send %s (%s)\n", method, strerror(errno));
+        exit(1);
+    }
+
+    size_t size = 0;
+    for (;;) {
+        if (size && response[0] == '$') {
+            size_t total = size >= 4 ? 4 + (size_t) ((uint8_t) response[2] << 8 | (uint8_t) response[3]) : SIZE_MAX;
+            if (size >= total) {
+                size -= total;
+                memmove(response, response + total, size);
+                continue;
+            }
+        } else if (size) {
+            response[size] = '\0';
+            char *end = strstr(response, "\r\n\r\n");
+            if (end) {
+                char value[32];
+                size_t total = end + 4 - response;
+                if (rtspbench_header(response, "Content-Length", value, sizeof(value)))
+                    total += strtoul(value, NULL, 10);
+                if (size >= total) {
+                    response[total] = '\0';
+                    break;
+                }
+            }
+        }
+        if (size + 1 >= RTSPBENCH_MESSAGE_SIZE) {
+            fprintf(stderr, "error: response to %s too large\n", method);
+            exit(1);
+        }
+        ssize_t ret = recv(b->fd, response + size, RTSPBENCH_MESSAGE_SIZE - 1 - size, 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            fprintf(stderr, "error: no response to %s\n", method);
+            exit(1);
+        }
+        size += ret;
+    }
+
+    unsigned status = 0;
+    sscanf(response, "RTSP/1.0 %u", &status);
+    if (status != 200) {
+        fprintf(stderr, "error: server refused %s of '%s' (%u)\n", method, url, status);
+        exit(1);
+    }
+
+}
+
+static int rtspbench_open_udp(void) {
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "error: failed to open udp socket (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    int size = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    return fd;
+
+}
+
+static unsigned rtspbench_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    getsockname(fd, (struct sockaddr *) &addr, &len);
+    return ntohs(addr.sin_port);
+}
+
+static void rtspbench_rtp(struct rtspbench *b, const uint8_t *packet, size_t size, int64_t now_us) {
+
+    if (size < 12 || (packet[0] >> 6) != 2)
+        return;
+
+    uint16_t sequence = packet[2] << 8 | packet[3];
+    if (b->started && sequence != (uint16_t) (b->sequence + 1)) {
+        int16_t gap = sequence - (uint16_t) (b->sequence + 1);
+        if (gap > 0)
+            b->lost_packets += gap;
+    }
+    if (!b->started || (int16_t) (sequence - b->sequence) > 0)
+        b->sequence = sequence;
+    b->started = true;
+    b->packets++;
+    b->bytes += size;
+
+    size_t header = 12 + 4 * (packet[0] & 0x0F);
+    if (size <= header)
+        return;
+    unsigned type = packet[header] & 0x1F;
+    if (type == 28 && size > header + 1 && (packet[header + 1] & 0x80))
+        type = packet[header + 1] & 0x1F;
+    if ((type == 5 || type == 7) && !b->first_keyframe_us)
+        b->first_keyframe_us = now_us;
+
+    if ((packet[1] & 0x80) && b->frames < RTSPBENCH_MAX_FRAMES) {
+        b->frame_timestamps[b->frames] = (uint32_t) packet[4] << 24 | packet[5] << 16 | packet[6] << 8 | packet[7];
+        b->frame_arrivals_us[b->frames] = now_us;
+        b->frames++;
+    }
+
+}
+
+static void rtspbench_rtcp(struct rtspbench *b, const uint8_t *packet, size_t size) {
+
+    if (size < 28 || packet[1] != 200)
+        return;
+
+    uint32_t words[5];
+    for (unsigned i = 0; i < 5; i++) {
+        memcpy(&words[i], packet + 4 + 4 * i, 4);
+        words[i] = ntohl(words[i]);
+    }
+
+    b->report = true;
+    b->report_wallclock_us = ((int64_t) words[1] - (int64_t) RTSPBENCH_NTP_OFFSET) * 1000000 + ((uint64_t) words[2] * 1000000 >> 32);
+    b->report_timestamp = words[3];
+
+}
+
+/// Process the interleaved packets of the stream, skipping responses.
+static void rtspbench_stream(struct rtspbench *b, int64_t now_us) {
+
+    for (;;) {
+        uint8_t *data = b->stream;
+        size_t total;
+        if (b->stream_size >= 4 && data[0] == '$') {
+            total = 4 + (data[2] << 8 | data[3]);
+            if (b->stream_size < total)
+                return;
+            if (data[1] & 1)
+                rtspbench_rtcp(b, data + 4, total - 4);
+            else
+                rtspbench_rtp(b, data + 4, total - 4, now_us);
+        } else if (b->stream_size && data[0] != '$') {
+            uint8_t *end = memmem(data, b->stream_size, "\r\n\r\n", 4);
+            if (!end)
+                return;
+            total = end + 4 - data;
+        } else {
+            return;
+        }
+        b->stream_size -= total;
+        memmove(data, data + total, b->stream_size);
+    }
+
+}
+
+static int rtspbench_compare(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double rtspbench_percentile(const double *values, unsigned count, double p) {
+    if (!count)
+        return 0;
+    unsigned i = (unsigned) (p * (count - 1) + 0.5);
+    return values[i];
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 2 || argv[1][0] == '-')
+        usage(argv[0]);
+
+    static struct rtspbench bench;
+    struct rtspbench *b = &bench;
+    b->url = argv[1];
+    b->duration = 10;
+    b->rtp_fd = -1;
+    b->rtcp_fd = -1;
+    const char *out_path = "-";
+
+    int opt;
+    optind = 2;
+    while ((opt = getopt(argc, argv, "d:t:p:o:")) != -1) {
+        switch (opt) {
+        case 'd':
+            b->duration = strtod(optarg, NULL);
+            break;
+        case 't':
+            if (strcmp(optarg, "tcp") == 0)
+                b->tcp = true;
+            else if (strcmp(optarg, "udp") != 0)
+                usage(argv[0]);
+            break;
+        case 'p': {
+            char *str = optarg;
+            while (*str && b->pid_count < RTSPBENCH_MAX_PIDS) {
+                b->pids[b->pid_count++] = (pid_t) strtol(str, &str, 10);
+                if (*str == ',')
+                    str++;
+                else if (*str)
+                    usage(argv[0]);
+            }
+            break;
+        }
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    // The URL is 'rtsp://host[:port]/path'.
+    char host[256];
+    if (strncmp(b->url, "rtsp://", 7) != 0) {
+        fprintf(stderr, "error: invalid rtsp url '%s'\n", b->url);
+        return 1;
+    }
+    size_t host_len = strcspn(b->url + 7, "/");
+    if (!host_len || host_len >= sizeof(host) - 5) {
+        fprintf(stderr, "error: invalid rtsp url '%s'\n", b->url);
+        return 1;
+    }
+    memcpy(host, b->url + 7, host_len);
+    host[host_len] = '\0';
+    if (!strchr(host, ':'))
+        strcat(host, ":554");
+
+    static char response[RTSPBENCH_MESSAGE_SIZE];
+    char headers[512], value[512], setup_url[1024];
+
+    int64_t start_us = rtspbench_monotonic_us();
+    b->fd = net_connect(host, SOCK_STREAM);
+    rtspbench_request(b, "OPTIONS", b->url, NULL, response);
+    rtspbench_request(b, "DESCRIBE", b->url, "Accept: application/sdp\r\n", response);
+
+    char *sdp = strstr(response, "\r\n\r\n") + 4;
+    char *media = strstr(sdp, "m=video");
+    if (!media || !strstr(media, "H264/90000")) {
+        fprintf(stderr, "error: no H.264 video in the session description\n");
+        return 1;
+    }
+
+    // The control of the track is absolute or relative to the content base.
+    char control[512] = "";
+    char *str = strstr(media, "a=control:");
+    if (str)
+        sscanf(str + 10, "%511[^\r\n]", control);
+    const char *base = rtspbench_header(response, "Content-Base", value, sizeof(value)) ? value : b->url;
+    if (strncmp(control, "rtsp://", 7) == 0)
+        snprintf(setup_url, sizeof(setup_url), "%s", control);
+    else
+        snprintf(setup_url, sizeof(setup_url), "%s%s%s", base, base[strlen(base) - 1] == '/' || !control[0] ? "" : "/", control);
+
+    if (b->tcp) {
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+    } else {
+        b->rtp_fd = rtspbench_open_udp();
+        b->rtcp_fd = rtspbench_open_udp();
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%u-%u\r\n", rtspbench_port(b->rtp_fd), rtspbench_port(b->rtcp_fd));
+    }
+    rtspbench_request(b, "SETUP", setup_url, headers, response);
+
+    if (rtspbench_header(response, "Session", value, sizeof(value))) {
+        value[strcspn(value, ";")] = '\0';
+        snprintf(b->session, sizeof(b->session), "%.127s", value);
+    }
+
+    long start_ticks[RTSPBENCH_MAX_PIDS];
+    for (unsigned i = 0; i < b->pid_count; i++)
+        start_ticks[i] = rtspbench_cpu_ticks(b->pids[i]);
+
+    rtspbench_request(b, "PLAY", b->url, "Range: npt=0.000-\r\n", response);
+    int64_t play_us = rtspbench_monotonic_us();
+    int64_t play_realtime_us = rtspbench_realtime_us();
+    int64_t end_us = play_us + (int64_t) (b->duration * 1e6);
+    int64_t keepalive_us = play_us;
+
+    struct pollfd fds[2];
+    unsigned nfds = 0;
+    if (b->tcp) {
+        fds[nfds++] = (struct pollfd) { .fd = b->fd, .events = POLLIN };
+    } else {
+        fds[nfds++] = (struct pollfd) { .fd = b->rtp_fd, .events = POLLIN };
+        fds[nfds++] = (struct pollfd) { .fd = b->rtcp_fd, .events = POLLIN };
+    }
+
+    uint8_t packet[65536];
+    for (;;) {
+
+        int64_t now_us = rtspbench_monotonic_us();
+        if (now_us >= end_us)
+            break;
+
+        if (now_us - keepalive_us >= RTSPBENCH_KEEPALIVE_S * 1000000ll) {
+            char msg[512];
+            int len = snprintf(msg, sizeof(msg), "GET_PARAMETER %s RTSP/1.0\r\nCSeq: %u\r\nSession: %s\r\n\r\n", b->url, ++b->cseq, b->session);
+            send(b->fd, msg, len, MSG_NOSIGNAL);
+            keepalive_us = now_us;
+        }
+
+        int ret = poll(fds, nfds, (end_us - now_us) / 1000 + 1);
+        if (ret == -1 && errno != EINTR) {
+            fprintf(stderr, "error: failed to poll (%s)\n", strerror(errno));
+            return 1;
+        }
+
+        int64_t arrival_us = rtspbench_realtime_us();
+        if (b->tcp && (fds[0].revents & POLLIN)) {
+            ssize_t len = recv(b->fd, b->stream + b->stream_size, sizeof(b->stream) - b->stream_size, MSG_DONTWAIT);
+            if (len == 0) {
+                fprintf(stderr, "warn: server closed the connection\n");
+                break;
+            }
+            if (len > 0) {
+                b->stream_size += len;
+                rtspbench_stream(b, arrival_us);
+            }
+        } else if (!b->tcp) {
+            ssize_t len;
+            while ((len = recv(b->rtp_fd, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+                rtspbench_rtp(b, packet, len, arrival_us);
+            while ((len = recv(b->rtcp_fd, packet, sizeof(packet), MSG_DONTWAIT)) > 0)
+                rtspbench_rtcp(b, packet, len);
+        }
+
+    }
+
+    double elapsed = (rtspbench_monotonic_us() - play_us) / 1e6;
+    double cpu[RTSPBENCH_MAX_PIDS];
+    double cpu_total = 0;
+    for (unsigned i = 0; i < b->pid_count; i++) {
+        long ticks = rtspbench_cpu_ticks(b->pids[i]);
+        cpu[i] = ticks >= 0 && start_ticks[i] >= 0 ? (ticks - start_ticks[i]) * 100.0 / sysconf(_SC_CLK_TCK) / elapsed : -1;
+        if (cpu[i] > 0)
+            cpu_total += cpu[i];
+    }
+
+    char msg[512];
+    int len = snprintf(msg, sizeof(msg), "TEARDOWN %s RTSP/1.0\r\nCSeq: %u\r\nSession: %s\r\n\r\n", b->url, ++b->cseq, b->session);
+    send(b->fd, msg, len, MSG_NOSIGNAL);
+    close(b->fd);
+
+    // Frames are dated with the last sender report, the clocks of a local sender
+    // don't drift from the ones of the player.
+    static double latencies[RTSPBENCH_MAX_FRAMES], intervals[RTSPBENCH_MAX_FRAMES];
+    unsigned latency_count = 0, interval_count = 0;
+    double latency_sum = 0;
+    for (unsigned i = 0; i < b->frames; i++) {
+        if (b->report) {
+            int64_t capture_us = b->report_wallclock_us + (int64_t) (int32_t) (b->frame_timestamps[i] - b->report_timestamp) * 100 / 9;
+            latencies[latency_count] = (b->frame_arrivals_us[i] - capture_us) / 1e3;
+            latency_sum += latencies[latency_count++];
+        }
+        if (i)
+            intervals[interval_count++] = (b->frame_arrivals_us[i] - b->frame_arrivals_us[i - 1]) / 1e3;
+    }
+    qsort(latencies, latency_count, sizeof(double), rtspbench_compare);
+    qsort(intervals, interval_count, sizeof(double), rtspbench_compare);
+
+    double setup_ms = (play_us - start_us) / 1e3;
+    double first_frame_ms = b->frames ? (b->frame_arrivals_us[0] - play_realtime_us) / 1e3 : -1;
+    double first_keyframe_ms = b->first_keyframe_us ? (b->first_keyframe_us - play_realtime_us) / 1e3 : -1;
+    double fps = b->frames / elapsed;
+    double kbps = b->bytes * 8 / elapsed / 1e3;
+
+    FILE *out = stdout;
+    if (strcmp(out_path, "-") != 0) {
+        out = fopen(out_path, "w");
+        if (!out) {
+            fprintf(stderr, "error: failed to open output file (%s)\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    fprintf(out, "{\n  \"url\": \"%s\",\n  \"transport\": \"%s\",\n  \"elapsed_s\": %.3f,\n", b->url, b->tcp ? "tcp" : "udp", elapsed);
+    fprintf(out, "  \"setup_ms\": %.3f,\n  \"first_frame_ms\": %.3f,\n  \"first_keyframe_ms\": %.3f,\n", setup_ms, first_frame_ms, first_keyframe_ms);
+    fprintf(out, "  \"frames\": %u,\n  \"fps\": %.3f,\n  \"packets\": %lu,\n  \"lost_packets\": %lu,\n  \"kbps\": %.1f,\n",
+        b->frames, fps, b->packets, b->lost_packets, kbps);
+    if (latency_count)
+        fprintf(out, "  \"latency_ms\": { \"avg\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+            latency_sum / latency_count, rtspbench_percentile(latencies, latency_count, 0.5), rtspbench_percentile(latencies, latency_count, 0.9),
+            rtspbench_percentile(latencies, latency_count, 0.99), latencies[latency_count - 1]);
+    else
+        fprintf(out, "  \"latency_ms\": null,\n");
+    fprintf(out, "  \"interval_ms\": { \"p50\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+        rtspbench_percentile(intervals, interval_count, 0.5), rtspbench_percentile(intervals, interval_count, 0.99),
+        interval_count ? intervals[interval_count - 1] : 0);
+    fprintf(out, "  \"cpu\": [");
+    for (unsigned i = 0; i < b->pid_count; i++)
+        fprintf(out, "%s{ \"pid\": %d, \"percent\": %.2f }", i ? ", " : "", (int) b->pids[i], cpu[i]);
+    fprintf(out, "],\n  \"cpu_percent\": %.2f\n}\n", cpu_total);
+
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "info: %u frames at %.2f fps, %lu packets lost, setup %.1f ms, first key frame %.1f ms, latency p50 %.2f ms p99 %.2f ms, cpu %.2f%%\n",
+        b->frames, fps, b->lost_packets, setup_ms, first_keyframe_ms,
+        rtspbench_percentile(latencies, latency_count, 0.5), rtspbench_percentile(latencies, latency_count, 0.99), cpu_total);
+    return 0;
+
+}
@@ -0,0 +1,95 @@
+/// Reader of the metrics published by the client (see 'metrics.h'), printed
+/// once in the Prometheus text exposition format, to be run by an exporter or
+/// a textfile collector. The shared object is only mapped for reading, values
+/// of all the thread blocks are summed.
+
+#include "metrics.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [name]\n", prog);
+    fprintf(stderr, "  name  shared memory object of the metrics (%s)\n", METRICS_DEFAULT_NAME);
+}
+
+int main(int argc, char **argv) {
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/%s", argc == 2 ? argv[1] : METRICS_DEFAULT_NAME);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        fprintf(stderr, "error: failed to open shared memory '%s' (%s)\n", name, strerror(errno));
+        return 1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct metrics_shared)) {
+        fprintf(stderr, "error: shared memory '%s' is too small\n", name);
+        return 1;
+    }
+
+    const struct metrics_shared *shared = mmap(NULL, sizeof(struct metrics_shared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "error: failed to map shared memory '%s' (%s)\n", name, strerror(errno));
+        return 1;
+    }
+
+    if (memcmp(shared->magic, METRICS_MAGIC, sizeof(shared->magic)) != 0 || shared->version != METRICS_VERSION || shared->count > METRICS_MAX) {
+        fprintf(stderr, "error: shared memory '%s' does not hold metrics of version %d\n", name, METRICS_VERSION);
+        return 1;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    // Publishers killed without unlinking leave their object behind.
+    if (kill((pid_t) shared->pid, 0) == -1 && errno == ESRCH) {
+        fprintf(stderr, "error: process %llu publishing '%s' is gone\n", (unsigned long long) shared->pid, name);
+        return 1;
+    }
+
+    unsigned threads = atomic_load(&shared->threads);
+    if (threads > METRICS_THREADS)
+        threads = METRICS_THREADS;
+
+    for (unsigned i = 0; i < shared->count; i++) {
+
+        const struct metrics_desc *desc = &shared->descs[i];
+        if (i == 0 || strncmp(desc->name, shared->descs[i - 1].name, sizeof(desc->name)) != 0) {
+            printf("# HELP %.*s %.*s\n", (int) sizeof(desc->name), desc->name, (int) sizeof(desc->help), desc->help);
+            printf("# TYPE %.*s %s\n", (int) sizeof(desc->name), desc->name, desc->type == METRIC_GAUGE ? "gauge" : "counter");
+        }
+
+        long long value = 0;
+        for (unsigned t = 0; t < threads; t++)
+            value += atomic_load_explicit(&shared->blocks[t].values[i], memory_order_relaxed);
+
+        if (desc->labels[0])
+            printf("%.*s{%.*s} %lld\n", (int) sizeof(desc->name), desc->name, (int) sizeof(desc->labels), desc->labels, value);
+        else
+            printf("%.*s %lld\n", (int) sizeof(desc->name), desc->name, value);
+
+    }
+
+    printf("# HELP bike_streamer_start_time_seconds Start time of the process since the epoch.\n");
+    printf("# TYPE bike_streamer_start_time_seconds gauge\n");
+    printf("bike_streamer_start_time_seconds %llu\n", (unsigned long long) shared->start_time);
+
+    return 0;
+
+}
@@ -0,0 +1,234 @@
+/// Software ISP backend, it emulates the ISP with the demosaic of 'debayer.h' so
+/// that the pipeline runs on real frames without the hardware ISP. Both nodes
+/// are paired like the ISP ones, the options of the capture node select the
+/// interpolation and the number of threads:
+///
+///     soft:isp-output
+///     soft:isp-capture[:bilinear|edge[:threads]]
+
+#include "synth.h"
+#include "backend.h"
+#include "debayer.h"
+#include "bcm2835-isp.h"
+
+#include <linux/dma-buf.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+
+/// Mapping of a DMABUF output buffer, kept while the same file descriptor is
+/// queued at its index.
+struct softisp_mapping {
+    int fd;
+    void *start;
+    size_t length;
+};
+
+struct softisp {
+    struct debayer debayer;
+    struct softisp_mapping mappings[VIDEO_MAX_FRAME];
+};
+
+/// Options of the last opened capture node, applied when the first frame of a
+/// context is processed.
+static enum debayer_mode softisp_mode = DEBAYER_BILINEAR;
+static unsigned softisp_threads;
+
+
+static const __u32 softisp_raw_formats[] = { V4L2_PIX_FMT_SRGGB12P, V4L2_PIX_FMT_SRGGB10P, 0 };
+static const __u32 softisp_yuv_formats[] = { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_NV12, 0 };
+
+static const struct synth_ctrl_desc softisp_ctrls[] = {
+    { V4L2_CID_RED_BALANCE, V4L2_CTRL_TYPE_INTEGER, "Red Balance", 1, 7999, 1, 1000, 0 },
+    { V4L2_CID_BLUE_BALANCE, V4L2_CTRL_TYPE_INTEGER, "Blue Balance", 1, 7999, 1, 1000, 0 },
+    { V4L2_CID_DIGITAL_GAIN, V4L2_CTRL_TYPE_INTEGER, "Digital Gain", 1, 65535, 1, 1000, 0 },
+    { V4L2_CID_USER_BCM2835_ISP_LENS_SHADING, V4L2_CTRL_TYPE_U8, "Lens Shading", 0, 255, 1, 0, sizeof(struct bcm2835_isp_lens_shading) },
+};
+
+static const struct synth_kind softisp_kind = {
+    .name = "isp",
+    .card = "soft bcm2835-isp",
+    .out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+    .cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+    .out_formats = softisp_raw_formats,
+    .cap_formats = softisp_yuv_formats,
+    .width = 1920,
+    .height = 1080,
+    .ctrls = softisp_ctrls,
+    .ctrls_count = sizeof(softisp_ctrls) / sizeof(softisp_ctrls[0]),
+    .split = true,
+};
+
+/// Get the data of an output buffer, DMABUF buffers are mapped on first use.
+static const void *softisp_map(struct softisp *isp, struct synth_context *ctx, struct synth_buffer *out) {
+
+    if (out->start)
+        return out->start;
+
+    struct softisp_mapping *mapping = &isp->mappings[out - ctx->out.buffers];
+    if (mapping->start && (mapping->fd != out->dmabuf_fd || mapping->length != out->length)) {
+        munmap(mapping->start, mapping->length);
+        mapping->start = NULL;
+    }
+
+    if (!mapping->start) {
+        void *start = mmap(NULL, out->length, PROT_READ, MAP_SHARED, out->dmabuf_fd, 0);
+        if (start == MAP_FAILED) {
+            fprintf(stderr, "warn: failed to map the isp output buffer (%s)\n", strerror(errno));
+            return NULL;
+        }
+        mapping->fd = out->dmabuf_fd;
+        mapping->start = start;
+        mapping->length = out->length;
+    }
+
+    return mapping->start;
+
+}
+
+/// Bracket CPU access to a DMABUF buffer, memfd buffers of emulated devices do
+/// not support it.
+static void softisp_sync(struct synth_buffer *out, __u64 flags) {
+    if (out->start)
+        return;
+    struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+    ioctl(out->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+static void softisp_process(struct synth_context *ctx, struct synth_buffer *out, struct synth_buffer *cap) {
+
+    struct softisp *isp = ctx->priv;
+    if (!isp) {
+        isp = calloc(1, sizeof(struct softisp));
+        if (!isp) {
+            fprintf(stderr, "error: failed to allocate the software isp\n");
+            exit(1);
+        }
+        unsigned threads = softisp_threads;
+        if (!threads) {
+            long online = sysconf(_SC_NPROCESSORS_ONLN);
+            threads = online > 0 ? (unsigned) online : 1;
+        }
+        debayer_init(&isp->debayer, softisp_mode, threads);
+        ctx->priv = isp;
+    }
+
+    const struct v4l2_pix_format_mplane *out_fmt = &ctx->out.fmt;
+    const struct v4l2_pix_format_mplane *cap_fmt = &ctx->cap.fmt;
+
+    const void *data = softisp_map(isp, ctx, out);
+    if (!data || out->bytesused < out_fmt->plane_fmt[0].sizeimage) {
+        cap->bytesused = 0;
+        cap->flags |= V4L2_BUF_FLAG_ERROR;
+        return;
+    }
+
+    struct debayer_source src = {
+        .data = data,
+        .pixelformat = out_fmt->pixelformat,
+        .width = out_fmt->width,
+        .height = out_fmt->height,
+        .bytesperline = out_fmt->plane_fmt[0].bytesperline,
+        .crop = ctx->crop,
+    };
+    struct debayer_target dst = {
+        .data = cap->start,
+        .pixelformat = cap_fmt->pixelformat,
+        .width = cap_fmt->width,
+        .height = cap_fmt->height,
+        .bytesperline = cap_fmt->plane_fmt[0].bytesperline,
+    };
+    struct debayer_gains gains = {
+        .red = (unsigned) synth_ctrl_get(ctx, V4L2_CID_RED_BALANCE),
+        .blue = (unsigned) synth_ctrl_get(ctx, V4L2_CID_BLUE_BALANCE),
+        .digital = (unsigned) synth_ctrl_get(ctx, V4L2_CID_DIGITAL_GAIN),
+    };
+
+    softisp_sync(out, DMA_BUF_SYNC_START);
+    bool ok = debayer_frame(&isp->debayer, &src, &dst, &gains);
+    softisp_sync(out, DMA_BUF_SYNC_END);
+
+    if (ok) {
+        cap->bytesused = cap_fmt->plane_fmt[0].sizeimage;
+    } else {
+        cap->bytesused = 0;
+        cap->flags |= V4L2_BUF_FLAG_ERROR;
+    }
+
+}
+
+static void softisp_release(struct synth_context *ctx) {
+
+    struct softisp *isp = ctx->priv;
+    if (!isp)
+        return;
+
+    for (unsigned i = 0; i < VIDEO_MAX_FRAME; i++) {
+        if (isp->mappings[i].start)
+            munmap(isp->mappings[i].start, isp->mappings[i].length);
+    }
+
+    debayer_release(&isp->debayer);
+    free(isp);
+
+}
+
+static const struct synth_ops softisp_ops = {
+    .process = softisp_process,
+    .release = softisp_release,
+};
+
+static int softisp_backend_open(const char *path) {
+
+    char arg[64];
+    strncpy(arg, path, sizeof(arg) - 1);
+    arg[sizeof(arg) - 1] = '\0';
+
+    if (strcmp(arg, "isp-output") == 0)
+        return synth_open(&softisp_kind, false, &softisp_ops, NULL, 0);
+
+    char *options = strchr(arg, ':');
+    if (options)
+        *options++ = '\0';
+    if (strcmp(arg, "isp-capture") != 0) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    enum debayer_mode mode = DEBAYER_BILINEAR;
+    unsigned threads = 0;
+    if (options) {
+        char *count = strchr(options, ':');
+        if (count) {
+            *count++ = '\0';
+            threads = (unsigned) strtoul(count, NULL, 10);
+        }
+        if (!debayer_parse_mode(options, &mode)) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    softisp_mode = mode;
+    softisp_threads = threads;
+    return synth_open(&softisp_kind, true, &softisp_ops, NULL, 0);
+
+}
+
+const struct vid_backend vid_backend_soft = {
+    .name = "soft",
+    .prefix = "soft:",
+    .open = softisp_backend_open,
+    .close = synth_close,
+    .ioctl = synth_ioctl,
+    .mmap = synth_mmap,
+    .revents = synth_revents,
+    .wait_fd = synth_wait_fd,
+};
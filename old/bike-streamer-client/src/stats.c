@@ -0,0 +1,276 @@
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define STATS_SSE2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define STATS_NEON
+#endif
+
+
+///
+/// KERNELS
+///
+
+static void stats_row_scalar(uint32_t sums[4], uint16_t *luma, const uint16_t *const cells[UNPACK_CHANNELS], unsigned count, uint16_t saturation) {
+
+    const uint16_t *r = cells[UNPACK_R], *gr = cells[UNPACK_GR], *gb = cells[UNPACK_GB], *b = cells[UNPACK_B];
+
+    for (unsigned i = 0; i < count; i++) {
+        luma[i] = (uint16_t) ((r[i] + gr[i] + gb[i] + b[i]) >> 2);
+        if (r[i] < saturation && gr[i] < saturation && gb[i] < saturation && b[i] < saturation) {
+            sums[STATS_R] += r[i];
+            sums[STATS_G] += gr[i] + gb[i];
+            sums[STATS_B] += b[i];
+            sums[3]++;
+        }
+    }
+
+}
+
+#ifdef STATS_SSE2
+
+// Samples are at most 12 bits so that signed words hold them, and the sum of
+// two greens. Sums are widened to double words by multiplying-adding with ones.
+static void stats_row_sse2(uint32_t sums[4], uint16_t *luma, const uint16_t *const cells[UNPACK_CHANNELS], unsigned count, uint16_t saturation) {
+
+    const uint16_t *r = cells[UNPACK_R], *gr = cells[UNPACK_GR], *gb = cells[UNPACK_GB], *b = cells[UNPACK_B];
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i limit = _mm_set1_epi16((short) saturation);
+    __m128i acc_r = _mm_setzero_si128(), acc_g = _mm_setzero_si128(), acc_b = _mm_setzero_si128(), acc_n = _mm_setzero_si128();
+
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8) {
+
+        __m128i vr = _mm_loadu_si128((const __m128i *) (r + i));
+        __m128i vgr = _mm_loadu_si128((const __m128i *) (gr + i));
+        __m128i vgb = _mm_loadu_si128((const __m128i *) (gb + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        __m128i vg = _mm_add_epi16(vgr, vgb);
+        _mm_storeu_si128((__m128i *) (luma + i), _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(vr, vb), vg), 2));
+
+        __m128i max = _mm_max_epi16(_mm_max_epi16(vr, vb), _mm_max_epi16(vgr, vgb));
+        __m128i mask = _mm_cmplt_epi16(max, limit);
+        acc_r = _mm_add_epi32(acc_r, _mm_madd_epi16(_mm_and_si128(vr, mask), ones));
+        acc_g = _mm_add_epi32(acc_g, _mm_madd_epi16(_mm_and_si128(vg, mask), ones));
+        acc_b = _mm_add_epi32(acc_b, _mm_madd_epi16(_mm_and_si128(vb, mask), ones));
+        acc_n = _mm_add_epi32(acc_n, _mm_madd_epi16(_mm_srli_epi16(mask, 15), ones));
+
+    }
+
+    uint32_t lanes[4][4];
+    _mm_storeu_si128((__m128i *) lanes[0], acc_r);
+    _mm_storeu_si128((__m128i *) lanes[1], acc_g);
+    _mm_storeu_si128((__m128i *) lanes[2], acc_b);
+    _mm_storeu_si128((__m128i *) lanes[3], acc_n);
+    for (unsigned k = 0; k < 4; k++)
+        sums[k] += lanes[k][0] + lanes[k][1] + lanes[k][2] + lanes[k][3];
+
+    const uint16_t *const tail[UNPACK_CHANNELS] = { r + i, gr + i, gb + i, b + i };
+    stats_row_scalar(sums, luma + i, tail, count - i, saturation);
+
+}
+
+#endif
+
+#ifdef STATS_NEON
+
+static void stats_row_neon(uint32_t sums[4], uint16_t *luma, const uint16_t *const cells[UNPACK_CHANNELS], unsigned count, uint16_t saturation) {
+
+    const uint16_t *r = cells[UNPACK_R], *gr = cells[UNPACK_GR], *gb = cells[UNPACK_GB], *b = cells[UNPACK_B];
+    const uint16x8_t limit = vdupq_n_u16(saturation);
+    uint32x4_t acc_r = vdupq_n_u32(0), acc_g = vdupq_n_u32(0), acc_b = vdupq_n_u32(0), acc_n = vdupq_n_u32(0);
+
+    unsigned i = 0;
+    for (; i + 8 <= count; i += 8) {
+
+        uint16x8_t vr = vld1q_u16(r + i), vgr = vld1q_u16(gr + i), vgb = vld1q_u16(gb + i), vb = vld1q_u16(b + i);
+        uint16x8_t vg = vaddq_u16(vgr, vgb);
+        vst1q_u16(luma + i, vshrq_n_u16(vaddq_u16(vaddq_u16(vr, vb), vg), 2));
+
+        uint16x8_t max = vmaxq_u16(vmaxq_u16(vr, vb), vmaxq_u16(vgr, vgb));
+        uint16x8_t mask = vcltq_u16(max, limit);
+        acc_r = vpadalq_u16(acc_r, vandq_u16(vr, mask));
+        acc_g = vpadalq_u16(acc_g, vandq_u16(vg, mask));
+        acc_b = vpadalq_u16(acc_b, vandq_u16(vb, mask));
+        acc_n = vpadalq_u16(acc_n, vshrq_n_u16(mask, 15));
+
+    }
+
+    sums[STATS_R] += vaddvq_u32(acc_r);
+    sums[STATS_G] += vaddvq_u32(acc_g);
+    sums[STATS_B] += vaddvq_u32(acc_b);
+    sums[3] += vaddvq_u32(acc_n);
+
+    const uint16_t *const tail[UNPACK_CHANNELS] = { r + i, gr + i, gb + i, b + i };
+    stats_row_scalar(sums, luma + i, tail, count - i, saturation);
+
+}
+
+#endif
+
+static const struct stats_kernel stats_available[] = {
+    { "scalar", stats_row_scalar },
+#ifdef STATS_SSE2
+    { "sse2", stats_row_sse2 },
+#endif
+#ifdef STATS_NEON
+    { "neon", stats_row_neon },
+#endif
+};
+
+#define STATS_KERNELS_COUNT (sizeof(stats_available) / sizeof(stats_available[0]))
+
+static const struct stats_kernel *stats_selected = &stats_available[STATS_KERNELS_COUNT - 1];
+
+const struct stats_kernel *stats_kernels(unsigned *count) {
+    *count = STATS_KERNELS_COUNT;
+    return stats_available;
+}
+
+bool stats_select_kernel(const char *name) {
+    for (unsigned i = 0; i < STATS_KERNELS_COUNT; i++) {
+        if (strcmp(stats_available[i].name, name) == 0) {
+            stats_selected = &stats_available[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+///
+/// FRAMES
+///
+
+static double stats_ms(const struct timespec *ts) {
+    return ts->tv_sec * 1e3 + ts->tv_nsec / 1e6;
+}
+
+void stats_init(struct stats *stats, unsigned width, unsigned height, uint32_t pixelformat, unsigned bytesperline, unsigned decimation) {
+
+    memset(stats, 0, sizeof(struct stats));
+
+    const enum unpack_channel *layout;
+    if (!unpack_layout(pixelformat, &layout, &stats->depth)) {
+        fprintf(stderr, "error: statistics need a packed bayer sensor format\n");
+        exit(1);
+    }
+
+    // Unpacking works on groups of 4 columns.
+    stats->width = width & ~3u;
+    stats->height = height & ~1u;
+    stats->pixelformat = pixelformat;
+    stats->bytesperline = bytesperline;
+    stats->decimation = decimation ? decimation : 1;
+    stats->saturation = (uint16_t) ((1u << stats->depth) - (1u << (stats->depth - 6)));
+
+    if (stats->width / 2 < STATS_ZONES_X || stats->height / 2 < STATS_ZONES_Y * stats->decimation) {
+        fprintf(stderr, "error: frame too small for the statistics zones\n");
+        exit(1);
+    }
+
+    // Zones start on groups of 8 cells so that only the last one has a tail
+    // left to the scalar kernel.
+    unsigned columns = stats->width / 2;
+    for (unsigned x = 0; x < STATS_ZONES_X; x++)
+        stats->zone_columns[x] = columns * x / STATS_ZONES_X & ~7u;
+    stats->zone_columns[STATS_ZONES_X] = columns;
+
+    unpack_planes_alloc(&stats->planes, stats->width, 2);
+    stats->luma = malloc(columns * sizeof(uint16_t));
+    if (!stats->luma) {
+        fprintf(stderr, "error: failed to allocate statistics\n");
+        exit(1);
+    }
+
+}
+
+void stats_release(struct stats *stats) {
+    unpack_planes_free(&stats->planes);
+    free(stats->luma);
+    stats->luma = NULL;
+}
+
+void stats_frame(struct stats *stats, const void *data) {
+
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
+    memset(stats->zones, 0, sizeof(stats->zones));
+    uint32_t histograms[4][STATS_BINS] = { { 0 } };
+    stats->cells = 0;
+
+    // The sampled row is in the middle of each group of rows.
+    unsigned rows = stats->height / 2;
+    unsigned shift = stats->depth - 6;
+    const uint16_t *const cells[UNPACK_CHANNELS] = {
+        stats->planes.planes[UNPACK_R],
+        stats->planes.planes[UNPACK_GR],
+        stats->planes.planes[UNPACK_GB],
+        stats->planes.planes[UNPACK_B],
+    };
+
+    for (unsigned row = stats->decimation / 2; row < rows; row += stats->decimation) {
+
+        unpack_region(&stats->planes, data, stats->pixelformat, stats->bytesperline, 0, 2 * row, stats->width, 2);
+
+        struct stats_zone *zones = stats->zones[row * STATS_ZONES_Y / rows];
+        for (unsigned x = 0; x < STATS_ZONES_X; x++) {
+            unsigned from = stats->zone_columns[x], count = stats->zone_columns[x + 1] - from;
+            const uint16_t *const zone_cells[UNPACK_CHANNELS] = { cells[0] + from, cells[1] + from, cells[2] + from, cells[3] + from };
+            uint32_t sums[4] = { 0 };
+            stats_selected->row(sums, stats->luma + from, zone_cells, count, stats->saturation);
+            for (unsigned c = 0; c < STATS_CHANNELS; c++)
+                zones[x].sums[c] += sums[c];
+            zones[x].cells += sums[3];
+            zones[x].total += count;
+        }
+
+        // Consecutive cells often fall in the same bin, they are counted in
+        // separate histograms to not wait on each other's increment.
+        unsigned columns = stats->width / 2, i = 0;
+        for (; i + 4 <= columns; i += 4) {
+            histograms[0][stats->luma[i] >> shift]++;
+            histograms[1][stats->luma[i + 1] >> shift]++;
+            histograms[2][stats->luma[i + 2] >> shift]++;
+            histograms[3][stats->luma[i + 3] >> shift]++;
+        }
+        for (; i < columns; i++)
+            histograms[0][stats->luma[i] >> shift]++;
+        stats->cells += columns;
+
+    }
+
+    for (unsigned bin = 0; bin < STATS_BINS; bin++)
+        stats->histogram[bin] = histograms[0][bin] + histograms[1][bin] + histograms[2][bin] + histograms[3][bin];
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    double cpu_ms = stats_ms(&cpu_end) - stats_ms(&cpu_start);
+    stats->cpu_ms_sum += cpu_ms;
+    if (cpu_ms > stats->cpu_ms_max)
+        stats->cpu_ms_max = cpu_ms;
+
+    if (!stats->frames)
+        clock_gettime(CLOCK_MONOTONIC, &stats->first);
+    clock_gettime(CLOCK_MONOTONIC, &stats->last);
+    stats->frames++;
+
+}
+
+void stats_report(const struct stats *stats) {
+
+    if (!stats->frames)
+        return;
+
+    double elapsed = (stats_ms(&stats->last) - stats_ms(&stats->first)) / 1e3;
+    double fps = elapsed > 0 ? (stats->frames - 1) / elapsed : 0;
+    double avg = stats->cpu_ms_sum / stats->frames;
+    printf("info: stats %lu frames, cpu avg %.3f ms, max %.3f ms, %.2f%% of a core at %.1f fps (%s, 1/%u rows)\n",
+        stats->frames, avg, stats->cpu_ms_max, avg * fps / 10, fps, stats_selected->name, stats->decimation);
+
+}
@@ -0,0 +1,92 @@
+/// Per-frame statistics of the raw sensor frames, the input of the image control
+/// loops (see 'awb.h'). Only a decimated view of each frame is read: one row of
+/// 2x2 cells out of 'decimation' is unpacked with the kernels of 'unpack.h', then
+/// a row kernel sums the red, green and blue samples of the cells into zones of
+/// a fixed grid and computes their luma, counted in a histogram.
+///
+/// Cells with a saturated sample are left out of the zone sums since their color
+/// is clipped, they are still counted in the histogram. Row kernels are selected
+/// at build time between the scalar reference, SSE2 and NEON.
+
+#pragma once
+
+#include "unpack.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+
+#define STATS_ZONES_X 16
+#define STATS_ZONES_Y 12
+#define STATS_BINS 64
+
+enum stats_channel {
+    STATS_R,
+    /// Sum of both green samples of the cells.
+    STATS_G,
+    STATS_B,
+    STATS_CHANNELS,
+};
+
+struct stats_zone {
+    uint32_t sums[STATS_CHANNELS];
+    /// Unsaturated cells in the sums.
+    uint32_t cells;
+    /// Cells of the zone in the decimated view.
+    uint32_t total;
+};
+
+/// Row kernel, sum the unsaturated cells of the R, GR, GB and B samples into
+/// 'sums' (red, green, blue then the count of cells), and write the luma of each
+/// cell, the average of its four samples.
+typedef void (*stats_row_fn)(uint32_t sums[4], uint16_t *luma, const uint16_t *const cells[UNPACK_CHANNELS], unsigned count, uint16_t saturation);
+
+struct stats_kernel {
+    const char *name;
+    stats_row_fn row;
+};
+
+struct stats {
+    unsigned width;
+    unsigned height;
+    uint32_t pixelformat;
+    unsigned bytesperline;
+    unsigned decimation;
+    unsigned depth;
+    /// Samples at or above this value are saturated.
+    uint16_t saturation;
+    /// First column of cells of each zone, then the width in cells.
+    unsigned zone_columns[STATS_ZONES_X + 1];
+    /// One row of cells and their luma.
+    struct unpack_planes planes;
+    uint16_t *luma;
+    /// Statistics of the last frame.
+    struct stats_zone zones[STATS_ZONES_Y][STATS_ZONES_X];
+    uint32_t histogram[STATS_BINS];
+    uint32_t cells;
+    /// Cost of the statistics, in CPU time of the calling thread.
+    unsigned long frames;
+    double cpu_ms_sum;
+    double cpu_ms_max;
+    struct timespec first;
+    struct timespec last;
+};
+
+
+/// Get the kernels available on this CPU, the fastest last.
+const struct stats_kernel *stats_kernels(unsigned *count);
+
+/// Select a kernel by name, return false if it is not available.
+bool stats_select_kernel(const char *name);
+
+/// Initialize the statistics of frames of the given format, the decimation is
+/// the ratio of rows of cells skipped. Unsupported formats are fatal.
+void stats_init(struct stats *stats, unsigned width, unsigned height, uint32_t pixelformat, unsigned bytesperline, unsigned decimation);
+void stats_release(struct stats *stats);
+
+/// Compute the statistics of a frame.
+void stats_frame(struct stats *stats, const void *data);
+
+/// Print the cost of the statistics, as a share of one core at the frame rate.
+void stats_report(const struct stats *stats);
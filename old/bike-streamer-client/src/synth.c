@@ -0,0 +1,1278 @@
+#define _GNU_SOURCE
+
+#include "synth.h"
+#include "backend.h"
+#include "bcm2835-isp.h"
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+
+/// Maximum file descriptor that can be used by an emulated device.
+#define SYNTH_MAX_FD 1024
+
+/// Buffers offsets given by VIDIOC_QUERYBUF are cookies built from the queue
+/// and buffer index, page aligned like real drivers.
+#define SYNTH_OFFSET(queue, index) ((((queue) * VIDEO_MAX_FRAME) + (index)) << 12)
+
+
+/// Emulated device nodes by file descriptor.
+static struct synth_device *synth_devices[SYNTH_MAX_FD];
+
+/// Context of a split hardware with only one of its nodes opened.
+static struct synth_context *synth_unpaired;
+
+
+///
+/// FIFO
+///
+
+static void synth_fifo_push(struct synth_fifo *fifo, unsigned index) {
+    fifo->items[(fifo->head + fifo->len) % VIDEO_MAX_FRAME] = index;
+    fifo->len++;
+}
+
+static unsigned synth_fifo_pop(struct synth_fifo *fifo) {
+    unsigned index = fifo->items[fifo->head];
+    fifo->head = (fifo->head + 1) % VIDEO_MAX_FRAME;
+    fifo->len--;
+    return index;
+}
+
+///
+/// FORMATS
+///
+
+static bool synth_type_is_mplane(enum v4l2_buf_type type) {
+    return type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE || type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+}
+
+/// Compute the line stride and image size of a format.
+static void synth_format_size(struct v4l2_pix_format_mplane *fmt) {
+
+    unsigned bytesperline, sizeimage;
+    switch (fmt->pixelformat) {
+    case V4L2_PIX_FMT_SRGGB12P:
+        bytesperline = (fmt->width * 3 / 2 + 31) & ~31u;
+        sizeimage = bytesperline * fmt->height;
+        break;
+    case V4L2_PIX_FMT_SRGGB10P:
+        bytesperline = (fmt->width * 5 / 4 + 31) & ~31u;
+        sizeimage = bytesperline * fmt->height;
+        break;
+    case V4L2_PIX_FMT_RGB24:
+        bytesperline = fmt->width * 3;
+        sizeimage = bytesperline * fmt->height;
+        break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        bytesperline = fmt->width;
+        sizeimage = bytesperline * fmt->height * 3 / 2;
+        break;
+    default:
+        // Compressed formats, the buffer is sized for the worst case.
+        bytesperline = 0;
+        sizeimage = fmt->width * fmt->height / 2;
+        if (sizeimage < 65536)
+            sizeimage = 65536;
+        break;
+    }
+
+    fmt->num_planes = 1;
+    fmt->plane_fmt[0].bytesperline = bytesperline;
+    fmt->plane_fmt[0].sizeimage = sizeimage;
+
+}
+
+static void synth_format_init(struct synth_queue *queue, enum v4l2_buf_type type, const __u32 *formats, unsigned width, unsigned height) {
+    queue->type = type;
+    queue->formats = formats;
+    queue->fmt.width = width;
+    queue->fmt.height = height;
+    queue->fmt.pixelformat = formats ? formats[0] : 0;
+    queue->fmt.field = V4L2_FIELD_NONE;
+    queue->fmt.colorspace = V4L2_COLORSPACE_DEFAULT;
+    synth_format_size(&queue->fmt);
+}
+
+static bool synth_format_supported(struct synth_queue *queue, __u32 pixelformat) {
+    for (const __u32 *fmt = queue->formats; *fmt; fmt++) {
+        if (*fmt == pixelformat)
+            return true;
+    }
+    return false;
+}
+
+///
+/// CONTEXT
+///
+
+static const struct synth_ctrl_desc *synth_ctrl_desc(struct synth_context *ctx, __u32 id, unsigned *index) {
+    for (unsigned i = 0; i < ctx->kind->ctrls_count; i++) {
+        if (ctx->kind->ctrls[i].id == id) {
+            *index = i;
+            return &ctx->kind->ctrls[i];
+        }
+    }
+    return NULL;
+}
+
+__s64 synth_ctrl_get(struct synth_context *ctx, __u32 id) {
+    unsigned index;
+    if (!synth_ctrl_desc(ctx, id, &index))
+        return 0;
+    return ctx->ctrls[index];
+}
+
+void synth_ctrl_set(struct synth_context *ctx, __u32 id, __s64 value) {
+    unsigned index;
+    const struct synth_ctrl_desc *desc = synth_ctrl_desc(ctx, id, &index);
+    if (!desc)
+        return;
+    if (value < desc->minimum)
+        value = desc->minimum;
+    if (value > desc->maximum)
+        value = desc->maximum;
+    ctx->ctrls[index] = value;
+}
+
+static unsigned synth_ctrl_payload_size(const struct synth_ctrl_desc *desc) {
+    switch (desc->type) {
+    case V4L2_CTRL_TYPE_U16:
+        return desc->elems * 2;
+    case V4L2_CTRL_TYPE_U32:
+        return desc->elems * 4;
+    default:
+        return desc->elems;
+    }
+}
+
+static struct synth_context *synth_context_new(const struct synth_kind *kind, const struct synth_ops *ops, void *priv) {
+
+    struct synth_context *ctx = calloc(1, sizeof(struct synth_context));
+    if (!ctx)
+        return NULL;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    ctx->kind = kind;
+    ctx->ops = ops;
+    ctx->priv = priv;
+    ctx->timeperframe.numerator = 1;
+    ctx->timeperframe.denominator = 30;
+    ctx->crop.width = kind->width;
+    ctx->crop.height = kind->height;
+
+    if (kind->out_type)
+        synth_format_init(&ctx->out, kind->out_type, kind->out_formats, kind->width, kind->height);
+    if (kind->cap_type)
+        synth_format_init(&ctx->cap, kind->cap_type, kind->cap_formats, kind->width, kind->height);
+
+    for (unsigned i = 0; i < kind->ctrls_count; i++)
+        ctx->ctrls[i] = kind->ctrls[i].default_value;
+
+    return ctx;
+
+}
+
+static void synth_queue_free(struct synth_queue *queue) {
+    for (unsigned i = 0; i < queue->count; i++) {
+        struct synth_buffer *buf = &queue->buffers[i];
+        if (buf->start)
+            munmap(buf->start, buf->length);
+        if (buf->memfd != -1)
+            close(buf->memfd);
+    }
+    memset(queue->buffers, 0, sizeof(queue->buffers));
+    memset(&queue->queued, 0, sizeof(queue->queued));
+    memset(&queue->done, 0, sizeof(queue->done));
+    queue->count = 0;
+}
+
+static void synth_context_unref(struct synth_context *ctx) {
+    if (--ctx->refs > 0)
+        return;
+    if (synth_unpaired == ctx)
+        synth_unpaired = NULL;
+    synth_queue_free(&ctx->out);
+    synth_queue_free(&ctx->cap);
+    for (unsigned i = 0; i < SYNTH_MAX_CTRLS; i++)
+        free(ctx->payloads[i]);
+    if (ctx->ops->release)
+        ctx->ops->release(ctx);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+/// Signal the device owning the queue that a buffer has been completed.
+static void synth_signal(struct synth_queue *queue) {
+    struct synth_device *dev = queue->dev;
+    if (!dev || dev->timer)
+        return;
+    eventfd_write(dev->fd, 1);
+    int queue_fd = queue == dev->cap ? dev->cap_fd : dev->out_fd;
+    if (queue_fd != -1)
+        eventfd_write(queue_fd, 1);
+}
+
+/// Run memory-to-memory jobs while both queues have buffers.
+static void synth_run(struct synth_context *ctx) {
+
+    if (!ctx->ops->process)
+        return;
+
+    bool processed = false;
+    while (ctx->out.streaming && ctx->cap.streaming && ctx->out.queued.len && ctx->cap.queued.len) {
+
+        struct synth_buffer *out = &ctx->out.buffers[synth_fifo_pop(&ctx->out.queued)];
+        struct synth_buffer *cap = &ctx->cap.buffers[synth_fifo_pop(&ctx->cap.queued)];
+
+        cap->timestamp = out->timestamp;
+        cap->field = out->field;
+        cap->sequence = ctx->sequence++;
+        cap->flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+        cap->bytesused = cap->length;
+        ctx->ops->process(ctx, out, cap);
+
+        out->state = SYNTH_BUF_DONE;
+        cap->state = SYNTH_BUF_DONE;
+        synth_fifo_push(&ctx->out.done, out - ctx->out.buffers);
+        synth_fifo_push(&ctx->cap.done, cap - ctx->cap.buffers);
+        processed = true;
+
+    }
+
+    if (processed) {
+        synth_signal(&ctx->out);
+        synth_signal(&ctx->cap);
+    }
+
+}
+
+/// Capture-only sources: generate one frame for each expired timer period.
+static void synth_tick(struct synth_device *dev) {
+
+    struct synth_context *ctx = dev->ctx;
+
+    uint64_t expirations;
+    if (read(dev->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    for (; expirations > 0; expirations--) {
+
+        if (!ctx->cap.queued.len) {
+            ctx->sequence++;
+            ctx->dropped++;
+            continue;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        struct synth_buffer *cap = &ctx->cap.buffers[synth_fifo_pop(&ctx->cap.queued)];
+        cap->timestamp.tv_sec = now.tv_sec;
+        cap->timestamp.tv_usec = now.tv_nsec / 1000;
+        cap->field = V4L2_FIELD_NONE;
+        cap->sequence = ctx->sequence++;
+        cap->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        cap->bytesused = ctx->cap.fmt.plane_fmt[0].sizeimage;
+        ctx->ops->generate(ctx, cap);
+
+        cap->state = SYNTH_BUF_DONE;
+        synth_fifo_push(&ctx->cap.done, cap - ctx->cap.buffers);
+
+    }
+
+}
+
+/// Arm (or disarm) the frame period timer of a capture-only source.
+static void synth_arm_timer(struct synth_device *dev) {
+
+    struct synth_context *ctx = dev->ctx;
+    struct itimerspec spec = {0};
+
+    if (ctx->cap.streaming) {
+        unsigned long long period = 1000000000ull * ctx->timeperframe.numerator / ctx->timeperframe.denominator;
+        spec.it_interval.tv_sec = period / 1000000000ull;
+        spec.it_interval.tv_nsec = period % 1000000000ull;
+        spec.it_value = spec.it_interval;
+    }
+
+    timerfd_settime(dev->fd, 0, &spec, NULL);
+
+}
+
+///
+/// DEVICES
+///
+
+unsigned synth_parse_fps(char *path) {
+    char *at = strrchr(path, '@');
+    if (!at)
+        return 0;
+    *at = '\0';
+    return (unsigned) strtoul(at + 1, NULL, 10);
+}
+
+int synth_open(const struct synth_kind *kind, bool capture, const struct synth_ops *ops, void *priv, unsigned fps) {
+
+    struct synth_device *dev = calloc(1, sizeof(struct synth_device));
+    if (!dev)
+        return -1;
+
+    dev->timer = !kind->out_type;
+    if (dev->timer) {
+        dev->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    } else {
+        dev->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    if (dev->fd < 0 || dev->fd >= SYNTH_MAX_FD) {
+        if (dev->fd >= 0) {
+            close(dev->fd);
+            errno = EMFILE;
+        }
+        free(dev);
+        return -1;
+    }
+
+    struct synth_context *ctx;
+    if (kind->split && synth_unpaired && synth_unpaired->kind == kind && synth_unpaired->ops == ops
+        && !(capture ? synth_unpaired->cap.dev : synth_unpaired->out.dev)) {
+        ctx = synth_unpaired;
+        synth_unpaired = NULL;
+    } else {
+        ctx = synth_context_new(kind, ops, priv);
+        if (!ctx) {
+            close(dev->fd);
+            free(dev);
+            return -1;
+        }
+        if (kind->split)
+            synth_unpaired = ctx;
+    }
+
+    dev->ctx = ctx;
+    dev->out = (!kind->split || !capture) && ctx->out.type ? &ctx->out : NULL;
+    dev->cap = (!kind->split || capture) && ctx->cap.type ? &ctx->cap : NULL;
+
+    if (dev->out && dev->cap) {
+        dev->caps = synth_type_is_mplane(dev->cap->type) ? V4L2_CAP_VIDEO_M2M_MPLANE : V4L2_CAP_VIDEO_M2M;
+    } else if (dev->out) {
+        dev->caps = synth_type_is_mplane(dev->out->type) ? V4L2_CAP_VIDEO_OUTPUT_MPLANE : V4L2_CAP_VIDEO_OUTPUT;
+    } else {
+        dev->caps = synth_type_is_mplane(dev->cap->type) ? V4L2_CAP_VIDEO_CAPTURE_MPLANE : V4L2_CAP_VIDEO_CAPTURE;
+    }
+
+    if (dev->out)
+        dev->out->dev = dev;
+    if (dev->cap)
+        dev->cap->dev = dev;
+
+    // Without its own eventfds, a queue is waited through the node one.
+    dev->cap_fd = -1;
+    dev->out_fd = -1;
+    if (dev->out && dev->cap && !dev->timer) {
+        dev->cap_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        dev->out_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    if (dev->timer && fps)
+        ctx->timeperframe.denominator = fps;
+
+    ctx->refs++;
+    synth_devices[dev->fd] = dev;
+    return dev->fd;
+
+}
+
+static struct synth_device *synth_device_of(int fd) {
+    if (fd < 0 || fd >= SYNTH_MAX_FD || !synth_devices[fd]) {
+        errno = EBADF;
+        return NULL;
+    }
+    return synth_devices[fd];
+}
+
+static struct synth_queue *synth_queue_of(struct synth_device *dev, __u32 type) {
+    if (dev->out && dev->out->type == type)
+        return dev->out;
+    if (dev->cap && dev->cap->type == type)
+        return dev->cap;
+    errno = EINVAL;
+    return NULL;
+}
+
+int synth_close(int fd) {
+
+    struct synth_device *dev = synth_device_of(fd);
+    if (!dev)
+        return -1;
+
+    if (dev->out)
+        dev->out->dev = NULL;
+    if (dev->cap)
+        dev->cap->dev = NULL;
+
+    if (dev->cap_fd != -1)
+        close(dev->cap_fd);
+    if (dev->out_fd != -1)
+        close(dev->out_fd);
+
+    synth_devices[fd] = NULL;
+    synth_context_unref(dev->ctx);
+    free(dev);
+    return close(fd);
+
+}
+
+///
+/// IOCTLS
+///
+
+static int synth_querycap(struct synth_device *dev, struct v4l2_capability *cap) {
+    memset(cap, 0, sizeof(*cap));
+    strncpy((char *) cap->driver, "synth", sizeof(cap->driver) - 1);
+    strncpy((char *) cap->card, dev->ctx->kind->card, sizeof(cap->card) - 1);
+    strncpy((char *) cap->bus_info, "platform:synth", sizeof(cap->bus_info) - 1);
+    cap->version = 1;
+    cap->device_caps = dev->caps | V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    return 0;
+}
+
+static int synth_enum_fmt(struct synth_device *dev, struct v4l2_fmtdesc *desc) {
+
+    struct synth_queue *queue = synth_queue_of(dev, desc->type);
+    if (!queue)
+        return -1;
+
+    for (unsigned i = 0; queue->formats[i]; i++) {
+        if (i == desc->index) {
+            desc->flags = 0;
+            desc->pixelformat = queue->formats[i];
+            memset(desc->description, 0, sizeof(desc->description));
+            memcpy(desc->description, &desc->pixelformat, 4);
+            return 0;
+        }
+    }
+
+    errno = EINVAL;
+    return -1;
+
+}
+
+static void synth_fmt_to_user(struct synth_queue *queue, struct v4l2_format *fmt) {
+    if (synth_type_is_mplane(queue->type)) {
+        fmt->fmt.pix_mp = queue->fmt;
+    } else {
+        memset(&fmt->fmt.pix, 0, sizeof(fmt->fmt.pix));
+        fmt->fmt.pix.width = queue->fmt.width;
+        fmt->fmt.pix.height = queue->fmt.height;
+        fmt->fmt.pix.pixelformat = queue->fmt.pixelformat;
+        fmt->fmt.pix.field = queue->fmt.field;
+        fmt->fmt.pix.colorspace = queue->fmt.colorspace;
+        fmt->fmt.pix.bytesperline = queue->fmt.plane_fmt[0].bytesperline;
+        fmt->fmt.pix.sizeimage = queue->fmt.plane_fmt[0].sizeimage;
+    }
+}
+
+static int synth_g_fmt(struct synth_device *dev, struct v4l2_format *fmt) {
+    struct synth_queue *queue = synth_queue_of(dev, fmt->type);
+    if (!queue)
+        return -1;
+    synth_fmt_to_user(queue, fmt);
+    return 0;
+}
+
+static int synth_s_fmt(struct synth_device *dev, struct v4l2_format *fmt) {
+
+    struct synth_queue *queue = synth_queue_of(dev, fmt->type);
+    if (!queue)
+        return -1;
+
+    if (queue->count) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    // Fields are at the same offsets in both planar and non-planar formats.
+    unsigned width = fmt->fmt.pix.width;
+    unsigned height = fmt->fmt.pix.height;
+    __u32 pixelformat = fmt->fmt.pix.pixelformat;
+
+    if (width >= 16 && width <= 8192 && height >= 16 && height <= 8192) {
+        queue->fmt.width = width;
+        queue->fmt.height = height;
+    }
+
+    if (synth_format_supported(queue, pixelformat))
+        queue->fmt.pixelformat = pixelformat;
+
+    synth_format_size(&queue->fmt);
+    synth_fmt_to_user(queue, fmt);
+    return 0;
+
+}
+
+static int synth_g_parm(struct synth_device *dev, struct v4l2_streamparm *param) {
+
+    struct synth_queue *queue = synth_queue_of(dev, param->type);
+    if (!queue)
+        return -1;
+
+    memset(&param->parm, 0, sizeof(param->parm));
+    if (V4L2_TYPE_IS_OUTPUT(queue->type)) {
+        param->parm.output.capability = V4L2_CAP_TIMEPERFRAME;
+        param->parm.output.timeperframe = dev->ctx->timeperframe;
+    } else {
+        param->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+        param->parm.capture.timeperframe = dev->ctx->timeperframe;
+    }
+
+    return 0;
+
+}
+
+static int synth_s_parm(struct synth_device *dev, struct v4l2_streamparm *param) {
+
+    struct synth_queue *queue = synth_queue_of(dev, param->type);
+    if (!queue)
+        return -1;
+
+    struct v4l2_fract tpf = V4L2_TYPE_IS_OUTPUT(queue->type) ? param->parm.output.timeperframe : param->parm.capture.timeperframe;
+    if (tpf.numerator && tpf.denominator)
+        dev->ctx->timeperframe = tpf;
+
+    if (dev->timer)
+        synth_arm_timer(dev);
+
+    return synth_g_parm(dev, param);
+
+}
+
+static int synth_reqbufs(struct synth_device *dev, struct v4l2_requestbuffers *req) {
+
+    struct synth_queue *queue = synth_queue_of(dev, req->type);
+    if (!queue)
+        return -1;
+
+    if (queue->streaming) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_DMABUF) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    synth_queue_free(queue);
+
+    unsigned count = req->count > VIDEO_MAX_FRAME ? VIDEO_MAX_FRAME : req->count;
+    unsigned length = queue->fmt.plane_fmt[0].sizeimage;
+
+    for (unsigned i = 0; i < count; i++) {
+
+        struct synth_buffer *buf = &queue->buffers[i];
+        buf->memfd = -1;
+        buf->dmabuf_fd = -1;
+        buf->length = length;
+        queue->count = i + 1;
+
+        if (req->memory == V4L2_MEMORY_MMAP) {
+
+            buf->memfd = memfd_create("synth-buffer", MFD_CLOEXEC);
+            if (buf->memfd == -1 || ftruncate(buf->memfd, length) == -1) {
+                synth_queue_free(queue);
+                return -1;
+            }
+
+            void *start = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, buf->memfd, 0);
+            if (start == MAP_FAILED) {
+                synth_queue_free(queue);
+                return -1;
+            }
+
+            buf->start = start;
+            if (dev->ctx->ops->prepare)
+                dev->ctx->ops->prepare(dev->ctx, queue, buf);
+
+        }
+
+    }
+
+    queue->memory = req->memory;
+    req->count = count;
+    req->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP | V4L2_BUF_CAP_SUPPORTS_DMABUF;
+    return 0;
+
+}
+
+static int synth_expbuf(struct synth_device *dev, struct v4l2_exportbuffer *exp) {
+
+    struct synth_queue *queue = synth_queue_of(dev, exp->type);
+    if (!queue)
+        return -1;
+
+    if (exp->index >= queue->count || queue->memory != V4L2_MEMORY_MMAP || exp->plane != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = fcntl(queue->buffers[exp->index].memfd, F_DUPFD_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    exp->fd = fd;
+    return 0;
+
+}
+
+/// Copy the state of a buffer to the user structure.
+static int synth_buffer_to_user(struct synth_device *dev, struct synth_queue *queue, unsigned index, struct v4l2_buffer *user) {
+
+    struct synth_buffer *buf = &queue->buffers[index];
+    unsigned offset = SYNTH_OFFSET(queue == &dev->ctx->cap, index);
+
+    user->index = index;
+    user->memory = queue->memory;
+    user->bytesused = 0;
+    user->flags = buf->flags;
+    user->field = buf->field;
+    user->timestamp = buf->timestamp;
+    user->sequence = buf->sequence;
+
+    if (buf->state == SYNTH_BUF_QUEUED)
+        user->flags |= V4L2_BUF_FLAG_QUEUED;
+    else if (buf->state == SYNTH_BUF_DONE)
+        user->flags |= V4L2_BUF_FLAG_DONE;
+
+    if (synth_type_is_mplane(queue->type)) {
+        if (!user->m.planes || user->length < 1) {
+            errno = EINVAL;
+            return -1;
+        }
+        user->length = 1;
+        user->m.planes[0].length = buf->length;
+        user->m.planes[0].bytesused = buf->bytesused;
+        if (queue->memory == V4L2_MEMORY_MMAP)
+            user->m.planes[0].m.mem_offset = offset;
+        else
+            user->m.planes[0].m.fd = buf->dmabuf_fd;
+    } else {
+        user->length = buf->length;
+        user->bytesused = buf->bytesused;
+        if (queue->memory == V4L2_MEMORY_MMAP)
+            user->m.offset = offset;
+        else
+            user->m.fd = buf->dmabuf_fd;
+    }
+
+    return 0;
+
+}
+
+static int synth_querybuf(struct synth_device *dev, struct v4l2_buffer *user) {
+
+    struct synth_queue *queue = synth_queue_of(dev, user->type);
+    if (!queue)
+        return -1;
+
+    if (user->index >= queue->count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return synth_buffer_to_user(dev, queue, user->index, user);
+
+}
+
+static int synth_qbuf(struct synth_device *dev, struct v4l2_buffer *user) {
+
+    struct synth_queue *queue = synth_queue_of(dev, user->type);
+    if (!queue)
+        return -1;
+
+    if (user->index >= queue->count || user->memory != queue->memory) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct synth_buffer *buf = &queue->buffers[user->index];
+    if (buf->state != SYNTH_BUF_DEQUEUED) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bool mplane = synth_type_is_mplane(queue->type);
+    if (mplane && (!user->m.planes || user->length < 1)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (queue->memory == V4L2_MEMORY_DMABUF)
+        buf->dmabuf_fd = mplane ? user->m.planes[0].m.fd : user->m.fd;
+
+    if (V4L2_TYPE_IS_OUTPUT(queue->type)) {
+        buf->bytesused = mplane ? user->m.planes[0].bytesused : user->bytesused;
+        if (!buf->bytesused)
+            buf->bytesused = buf->length;
+        buf->timestamp = user->timestamp;
+        buf->field = user->field;
+    }
+
+    buf->state = SYNTH_BUF_QUEUED;
+    synth_fifo_push(&queue->queued, user->index);
+    synth_run(dev->ctx);
+
+    user->flags = (user->flags & ~V4L2_BUF_FLAG_DONE) | V4L2_BUF_FLAG_QUEUED;
+    return 0;
+
+}
+
+static int synth_dqbuf(struct synth_device *dev, struct v4l2_buffer *user) {
+
+    struct synth_queue *queue = synth_queue_of(dev, user->type);
+    if (!queue)
+        return -1;
+
+    if (!queue->streaming) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (dev->timer)
+        synth_tick(dev);
+
+    if (!queue->done.len) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    unsigned index = synth_fifo_pop(&queue->done);
+    queue->buffers[index].state = SYNTH_BUF_DEQUEUED;
+    return synth_buffer_to_user(dev, queue, index, user);
+
+}
+
+static int synth_streamon(struct synth_device *dev, const int *type) {
+
+    struct synth_queue *queue = synth_queue_of(dev, *type);
+    if (!queue)
+        return -1;
+
+    queue->streaming = true;
+    if (dev->timer)
+        synth_arm_timer(dev);
+
+    synth_run(dev->ctx);
+    return 0;
+
+}
+
+static int synth_streamoff(struct synth_device *dev, const int *type) {
+
+    struct synth_queue *queue = synth_queue_of(dev, *type);
+    if (!queue)
+        return -1;
+
+    queue->streaming = false;
+    if (dev->timer)
+        synth_arm_timer(dev);
+
+    // All buffers are returned to the application, like real drivers.
+    for (unsigned i = 0; i < queue->count; i++)
+        queue->buffers[i].state = SYNTH_BUF_DEQUEUED;
+    memset(&queue->queued, 0, sizeof(queue->queued));
+    memset(&queue->done, 0, sizeof(queue->done));
+    return 0;
+
+}
+
+static int synth_g_selection(struct synth_device *dev, struct v4l2_selection *sel) {
+    if (!synth_queue_of(dev, sel->type))
+        return -1;
+    sel->r = dev->ctx->crop;
+    return 0;
+}
+
+static int synth_s_selection(struct synth_device *dev, struct v4l2_selection *sel) {
+    if (!synth_queue_of(dev, sel->type))
+        return -1;
+    dev->ctx->crop = sel->r;
+    return 0;
+}
+
+static int synth_query_ext_ctrl(struct synth_device *dev, struct v4l2_query_ext_ctrl *query) {
+
+    const struct synth_kind *kind = dev->ctx->kind;
+    const struct synth_ctrl_desc *found = NULL;
+
+    __u32 id = query->id & ~(V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND);
+    bool next = query->id & (V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND);
+
+    for (unsigned i = 0; i < kind->ctrls_count; i++) {
+        const struct synth_ctrl_desc *desc = &kind->ctrls[i];
+        if (next ? desc->id > id && (!found || desc->id < found->id) : desc->id == id)
+            found = desc;
+    }
+
+    if (!found) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(query, 0, sizeof(*query));
+    query->id = found->id;
+    query->type = found->type;
+    strncpy(query->name, found->name, sizeof(query->name) - 1);
+    query->minimum = found->minimum;
+    query->maximum = found->maximum;
+    query->step = found->step;
+    query->default_value = found->default_value;
+    query->elems = 1;
+    query->elem_size = sizeof(__s32);
+    if (found->elems) {
+        query->elems = found->elems;
+        query->elem_size = synth_ctrl_payload_size(found) / found->elems;
+        query->nr_of_dims = 1;
+        query->dims[0] = found->elems;
+        query->flags = V4L2_CTRL_FLAG_HAS_PAYLOAD;
+    }
+    if (found->type == V4L2_CTRL_TYPE_BUTTON)
+        query->flags = V4L2_CTRL_FLAG_WRITE_ONLY;
+    return 0;
+
+}
+
+static int synth_ext_ctrls(struct synth_device *dev, struct v4l2_ext_controls *ctrls, bool set) {
+
+    for (unsigned i = 0; i < ctrls->count; i++) {
+
+        struct v4l2_ext_control *ctrl = &ctrls->controls[i];
+        unsigned index;
+        const struct synth_ctrl_desc *desc = synth_ctrl_desc(dev->ctx, ctrl->id, &index);
+        if (!desc) {
+            ctrls->error_idx = i;
+            errno = EINVAL;
+            return -1;
+        }
+
+        // Array controls are copied whole, unset ones read as zeros.
+        if (desc->elems) {
+            unsigned size = synth_ctrl_payload_size(desc);
+            if (ctrl->size < size) {
+                ctrl->size = size;
+                ctrls->error_idx = i;
+                errno = ENOSPC;
+                return -1;
+            }
+            void **payload = &dev->ctx->payloads[index];
+            if (set) {
+                if (!*payload && !(*payload = malloc(size))) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                memcpy(*payload, ctrl->ptr, size);
+            } else if (*payload) {
+                memcpy(ctrl->ptr, *payload, size);
+            } else {
+                memset(ctrl->ptr, 0, size);
+            }
+            continue;
+        }
+
+        // Like drivers, the clamped value is written back on set.
+        if (set)
+            synth_ctrl_set(dev->ctx, ctrl->id, ctrl->value);
+        ctrl->value = (__s32) synth_ctrl_get(dev->ctx, ctrl->id);
+
+    }
+
+    return 0;
+
+}
+
+static int synth_ioctl_locked(struct synth_device *dev, unsigned long request, void *arg) {
+    switch (request) {
+    case VIDIOC_QUERYCAP:
+        return synth_querycap(dev, arg);
+    case VIDIOC_ENUM_FMT:
+        return synth_enum_fmt(dev, arg);
+    case VIDIOC_G_FMT:
+        return synth_g_fmt(dev, arg);
+    case VIDIOC_S_FMT:
+        return synth_s_fmt(dev, arg);
+    case VIDIOC_G_PARM:
+        return synth_g_parm(dev, arg);
+    case VIDIOC_S_PARM:
+        return synth_s_parm(dev, arg);
+    case VIDIOC_REQBUFS:
+        return synth_reqbufs(dev, arg);
+    case VIDIOC_EXPBUF:
+        return synth_expbuf(dev, arg);
+    case VIDIOC_QUERYBUF:
+        return synth_querybuf(dev, arg);
+    case VIDIOC_QBUF:
+        return synth_qbuf(dev, arg);
+    case VIDIOC_DQBUF:
+        return synth_dqbuf(dev, arg);
+    case VIDIOC_STREAMON:
+        return synth_streamon(dev, arg);
+    case VIDIOC_STREAMOFF:
+        return synth_streamoff(dev, arg);
+    case VIDIOC_G_SELECTION:
+        return synth_g_selection(dev, arg);
+    case VIDIOC_S_SELECTION:
+        return synth_s_selection(dev, arg);
+    case VIDIOC_QUERY_EXT_CTRL:
+        return synth_query_ext_ctrl(dev, arg);
+    case VIDIOC_G_EXT_CTRLS:
+        return synth_ext_ctrls(dev, arg, false);
+    case VIDIOC_S_EXT_CTRLS:
+        return synth_ext_ctrls(dev, arg, true);
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+int synth_ioctl(int fd, unsigned long request, void *arg) {
+
+    struct synth_device *dev = synth_device_of(fd);
+    if (!dev)
+        return -1;
+
+    pthread_mutex_lock(&dev->ctx->lock);
+    int ret = synth_ioctl_locked(dev, request, arg);
+    pthread_mutex_unlock(&dev->ctx->lock);
+    return ret;
+
+}
+
+void *synth_mmap(int fd, size_t length, off_t offset) {
+
+    struct synth_device *dev = synth_device_of(fd);
+    if (!dev)
+        return MAP_FAILED;
+
+    unsigned cookie = (unsigned) offset >> 12;
+    struct synth_queue *queue = cookie >= VIDEO_MAX_FRAME ? &dev->ctx->cap : &dev->ctx->out;
+    unsigned index = cookie % VIDEO_MAX_FRAME;
+
+    if (index >= queue->count || !queue->buffers[index].start || length > queue->buffers[index].length) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    // The buffer is already mapped when allocated, the same mapping is shared.
+    return queue->buffers[index].start;
+
+}
+
+short synth_revents(int fd, short events) {
+
+    struct synth_device *dev = synth_device_of(fd);
+    if (!dev)
+        return POLLNVAL;
+
+    pthread_mutex_lock(&dev->ctx->lock);
+
+    if (dev->timer)
+        synth_tick(dev);
+
+    short revents = 0;
+    if (dev->cap && dev->cap->done.len)
+        revents |= POLLIN;
+    if (dev->out && dev->out->done.len)
+        revents |= POLLOUT;
+
+    // The node eventfd is only cleared once nothing is left to dequeue, because
+    // both queues of a node may be waited by different threads, each of which
+    // waits the eventfd of its own queue instead.
+    if (!dev->timer) {
+        eventfd_t value;
+        if (!revents)
+            eventfd_read(fd, &value);
+        if (dev->cap_fd != -1 && !(revents & POLLIN))
+            eventfd_read(dev->cap_fd, &value);
+        if (dev->out_fd != -1 && !(revents & POLLOUT))
+            eventfd_read(dev->out_fd, &value);
+    }
+
+    pthread_mutex_unlock(&dev->ctx->lock);
+    return revents & events;
+
+}
+
+int synth_wait_fd(int fd, short events) {
+
+    struct synth_device *dev = synth_device_of(fd);
+    if (!dev)
+        return fd;
+
+    short waited = events & (POLLIN | POLLOUT);
+    if (waited == POLLIN && dev->cap_fd != -1)
+        return dev->cap_fd;
+    if (waited == POLLOUT && dev->out_fd != -1)
+        return dev->out_fd;
+    return fd;
+
+}
+
+///
+/// SYNTHETIC GENERATORS
+///
+
+static const __u32 synth_raw_formats[] = { V4L2_PIX_FMT_SRGGB12P, V4L2_PIX_FMT_SRGGB10P, 0 };
+static const __u32 synth_yuv_formats[] = { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, 0 };
+static const __u32 synth_h264_formats[] = { V4L2_PIX_FMT_H264, 0 };
+
+static const struct synth_ctrl_desc synth_sensor_ctrls[] = {
+    { V4L2_CID_VFLIP, V4L2_CTRL_TYPE_BOOLEAN, "Vertical Flip", 0, 1, 1, 0, 0 },
+    { V4L2_CID_HFLIP, V4L2_CTRL_TYPE_BOOLEAN, "Horizontal Flip", 0, 1, 1, 0, 0 },
+    { V4L2_CID_EXPOSURE, V4L2_CTRL_TYPE_INTEGER, "Exposure", 4, 65515, 1, 1000, 0 },
+    { V4L2_CID_ANALOGUE_GAIN, V4L2_CTRL_TYPE_INTEGER, "Analogue Gain", 0, 978, 1, 0, 0 },
+    { V4L2_CID_VBLANK, V4L2_CTRL_TYPE_INTEGER, "Vertical Blanking", 4, 65471, 1, 2500, 0 },
+    { V4L2_CID_TEST_PATTERN, V4L2_CTRL_TYPE_MENU, "Test Pattern", 0, 4, 1, 0, 0 },
+};
+
+static const struct synth_ctrl_desc synth_isp_ctrls[] = {
+    { V4L2_CID_RED_BALANCE, V4L2_CTRL_TYPE_INTEGER, "Red Balance", 1, 7999, 1, 1000, 0 },
+    { V4L2_CID_BLUE_BALANCE, V4L2_CTRL_TYPE_INTEGER, "Blue Balance", 1, 7999, 1, 1000, 0 },
+    { V4L2_CID_DIGITAL_GAIN, V4L2_CTRL_TYPE_INTEGER, "Digital Gain", 1, 65535, 1, 1000, 0 },
+    { V4L2_CID_USER_BCM2835_ISP_LENS_SHADING, V4L2_CTRL_TYPE_U8, "Lens Shading", 0, 255, 1, 0, sizeof(struct bcm2835_isp_lens_shading) },
+};
+
+static const struct synth_ctrl_desc synth_encoder_ctrls[] = {
+    { V4L2_CID_MPEG_VIDEO_BITRATE_MODE, V4L2_CTRL_TYPE_MENU, "Video Bitrate Mode", 0, 1, 1, 0, 0 },
+    { V4L2_CID_MPEG_VIDEO_BITRATE, V4L2_CTRL_TYPE_INTEGER, "Video Bitrate", 25000, 25000000, 25000, 10000000, 0 },
+    { V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, V4L2_CTRL_TYPE_BOOLEAN, "Repeat Sequence Header", 0, 1, 1, 1, 0 },
+    { V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, V4L2_CTRL_TYPE_BUTTON, "Force Key Frame", 0, 0, 0, 0, 0 },
+    { V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, V4L2_CTRL_TYPE_INTEGER, "H264 I-Frame Period", 0, 2147483647, 1, 60, 0 },
+};
+
+const struct synth_kind synth_kind_sensor = {
+    .name = "sensor",
+    .card = "synth imx477",
+    .cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+    .cap_formats = synth_raw_formats,
+    .width = 2028,
+    .height = 1080,
+    .ctrls = synth_sensor_ctrls,
+    .ctrls_count = sizeof(synth_sensor_ctrls) / sizeof(synth_sensor_ctrls[0]),
+};
+
+const struct synth_kind synth_kind_isp = {
+    .name = "isp",
+    .card = "synth bcm2835-isp",
+    .out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT,
+    .cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+    .out_formats = synth_raw_formats,
+    .cap_formats = synth_yuv_formats,
+    .width = 1920,
+    .height = 1080,
+    .ctrls = synth_isp_ctrls,
+    .ctrls_count = sizeof(synth_isp_ctrls) / sizeof(synth_isp_ctrls[0]),
+    .split = true,
+};
+
+const struct synth_kind synth_kind_encoder = {
+    .name = "encoder",
+    .card = "synth bcm2835-codec-encode",
+    .out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+    .cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+    .out_formats = synth_yuv_formats,
+    .cap_formats = synth_h264_formats,
+    .width = 1920,
+    .height = 1080,
+    .ctrls = synth_encoder_ctrls,
+    .ctrls_count = sizeof(synth_encoder_ctrls) / sizeof(synth_encoder_ctrls[0]),
+};
+
+/// Brightness of the synthetic sensor, its bars are scaled by the exposure and
+/// analogue gain relative to their defaults so that exposure loops can be run
+/// against it. Buffers are only filled again when the scale changed.
+struct synth_sensor {
+    /// Scale of the pattern of each buffer in 1/256, zero if not yet filled.
+    unsigned scales[VIDEO_MAX_FRAME];
+};
+
+/// Fill a buffer with vertical bars of the given scale in 1/256.
+static void synth_fill_pattern(struct synth_queue *queue, struct synth_buffer *buf, unsigned scale) {
+    unsigned stride = queue->fmt.plane_fmt[0].bytesperline;
+    if (!stride)
+        return;
+    unsigned char *line = buf->start;
+    for (unsigned x = 0; x < stride; x++) {
+        unsigned value = (x * 8 / stride * 32) * scale >> 8;
+        line[x] = (unsigned char) (value > 255 ? 255 : value);
+    }
+    for (unsigned y = 1; y * stride + stride <= buf->length; y++)
+        memcpy(line + y * stride, line, stride);
+}
+
+/// Fill raw and RGB buffers with vertical bars once, frames then only stamp their
+/// sequence number on the first line to keep generation cheap.
+static void synth_prepare_pattern(struct synth_context *ctx, struct synth_queue *queue, struct synth_buffer *buf) {
+    (void) ctx;
+    synth_fill_pattern(queue, buf, 256);
+}
+
+static void synth_stamp(struct synth_queue *queue, struct synth_buffer *buf) {
+    unsigned stride = queue->fmt.plane_fmt[0].bytesperline;
+    if (stride && stride <= buf->length)
+        memset(buf->start, buf->sequence & 0xFF, stride);
+}
+
+static struct synth_sensor *synth_sensor_of(struct synth_context *ctx) {
+    if (!ctx->priv)
+        ctx->priv = calloc(1, sizeof(struct synth_sensor));
+    return ctx->priv;
+}
+
+/// New buffers are filled on their first frame.
+static void synth_sensor_prepare(struct synth_context *ctx, struct synth_queue *queue, struct synth_buffer *buf) {
+    struct synth_sensor *sensor = synth_sensor_of(ctx);
+    if (sensor)
+        sensor->scales[buf - queue->buffers] = 0;
+}
+
+static void synth_sensor_generate(struct synth_context *ctx, struct synth_buffer *cap) {
+
+    struct synth_sensor *sensor = synth_sensor_of(ctx);
+    if (!sensor)
+        return;
+
+    // Analogue gain codes of the IMX477 give a gain of 1024 / (1024 - code).
+    __s64 exposure = synth_ctrl_get(ctx, V4L2_CID_EXPOSURE);
+    __s64 code = synth_ctrl_get(ctx, V4L2_CID_ANALOGUE_GAIN);
+    unsigned long long scale = (unsigned long long) exposure * 256 * 1024 / (1024 - code) / 1000;
+    if (scale > 256 * 255)
+        scale = 256 * 255;
+
+    unsigned index = cap - ctx->cap.buffers;
+    if (sensor->scales[index] != scale) {
+        synth_fill_pattern(&ctx->cap, cap, (unsigned) scale);
+        sensor->scales[index] = (unsigned) scale;
+    }
+
+    synth_stamp(&ctx->cap, cap);
+
+}
+
+static void synth_sensor_release(struct synth_context *ctx) {
+    free(ctx->priv);
+}
+
+static void synth_isp_process(struct synth_context *ctx, struct synth_buffer *out, struct synth_buffer *cap) {
+    (void) out;
+    cap->bytesused = ctx->cap.fmt.plane_fmt[0].sizeimage;
+    synth_stamp(&ctx->cap, cap);
+}
+
+/// Parameter sets of a 1080p baseline stream, the slices that follow are filler
+/// and the resulting stream is only meant to exercise the transport, not decoders.
+static const unsigned char synth_h264_headers[] = {
+    0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0xC0, 0x28, 0xDA, 0x01, 0xE0, 0x08, 0x9F, 0x96, 0x10, 0x00,
+    0x00, 0x03, 0x00, 0x10, 0x00, 0x00, 0x03, 0x03, 0xC0, 0xF1, 0x83, 0x2A,
+    0x00, 0x00, 0x00, 0x01, 0x68, 0xCE, 0x3C, 0x80,
+};
+
+static void synth_encoder_process(struct synth_context *ctx, struct synth_buffer *out, struct synth_buffer *cap) {
+
+    (void) out;
+
+    __s64 bitrate = synth_ctrl_get(ctx, V4L2_CID_MPEG_VIDEO_BITRATE);
+    __s64 period = synth_ctrl_get(ctx, V4L2_CID_MPEG_VIDEO_H264_I_PERIOD);
+    bool idr = period <= 1 || cap->sequence % period == 0 || synth_ctrl_get(ctx, V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME);
+    synth_ctrl_set(ctx, V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 0);
+
+    // Size frames so that the bitrate is respected over a GOP, with IDR frames
+    // four times larger than predicted ones.
+    unsigned long long frame_size = (unsigned long long) bitrate / 8 * ctx->timeperframe.numerator / ctx->timeperframe.denominator;
+    if (period > 1)
+        frame_size = frame_size * period / (period + 3);
+    if (idr)
+        frame_size *= 4;
+
+    unsigned char *dst = cap->start;
+    unsigned pos = 0;
+
+    if (idr && synth_ctrl_get(ctx, V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER)) {
+        memcpy(dst, synth_h264_headers, sizeof(synth_h264_headers));
+        pos += sizeof(synth_h264_headers);
+    }
+
+    if (frame_size < pos + 6)
+        frame_size = pos + 6;
+    if (frame_size > cap->length)
+        frame_size = cap->length;
+
+    dst[pos++] = 0x00;
+    dst[pos++] = 0x00;
+    dst[pos++] = 0x00;
+    dst[pos++] = 0x01;
+    dst[pos++] = idr ? 0x65 : 0x41;
+    dst[pos++] = 0x88;
+    memset(dst + pos, 0x80 | (cap->sequence & 0x7F), frame_size - pos);
+
+    cap->bytesused = frame_size;
+    cap->flags |= idr ? V4L2_BUF_FLAG_KEYFRAME : V4L2_BUF_FLAG_PFRAME;
+
+}
+
+static const struct synth_ops synth_sensor_ops = {
+    .prepare = synth_sensor_prepare,
+    .generate = synth_sensor_generate,
+    .release = synth_sensor_release,
+};
+
+static const struct synth_ops synth_isp_ops = {
+    .prepare = synth_prepare_pattern,
+    .process = synth_isp_process,
+};
+
+static const struct synth_ops synth_encoder_ops = {
+    .process = synth_encoder_process,
+};
+
+static int synth_backend_open(const char *path) {
+
+    char kind[64];
+    strncpy(kind, path, sizeof(kind) - 1);
+    kind[sizeof(kind) - 1] = '\0';
+    unsigned fps = synth_parse_fps(kind);
+
+    if (strcmp(kind, "sensor") == 0)
+        return synth_open(&synth_kind_sensor, true, &synth_sensor_ops, NULL, fps);
+    if (strcmp(kind, "isp-output") == 0)
+        return synth_open(&synth_kind_isp, false, &synth_isp_ops, NULL, fps);
+    if (strcmp(kind, "isp-capture") == 0)
+        return synth_open(&synth_kind_isp, true, &synth_isp_ops, NULL, fps);
+    if (strcmp(kind, "encoder") == 0)
+        return synth_open(&synth_kind_encoder, true, &synth_encoder_ops, NULL, fps);
+
+    errno = ENODEV;
+    return -1;
+
+}
+
+const struct vid_backend vid_backend_synth = {
+    .name = "synth",
+    .prefix = "synth:",
+    .open = synth_backend_open,
+    .close = synth_close,
+    .ioctl = synth_ioctl,
+    .mmap = synth_mmap,
+    .revents = synth_revents,
+    .wait_fd = synth_wait_fd,
+};
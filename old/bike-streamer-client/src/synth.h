@@ -0,0 +1,176 @@
+/// Framework shared by the devices emulated in userspace (synthetic and replay
+/// backends). It implements the V4L2 queue semantics of MMAP and DMABUF streaming,
+/// so that generators only have to fill the buffers.
+
+#pragma once
+
+#include "v4l2.h"
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+
+
+#define SYNTH_MAX_CTRLS 16
+
+
+/// State of an emulated buffer.
+enum synth_buffer_state {
+    SYNTH_BUF_DEQUEUED = 0,
+    SYNTH_BUF_QUEUED,
+    SYNTH_BUF_DONE,
+};
+
+/// An emulated buffer, MMAP buffers are backed by a memfd that is also used
+/// when exporting them as DMABUF.
+struct synth_buffer {
+    enum synth_buffer_state state;
+    /// Userspace pointer where the buffer starts, NULL for DMABUF buffers.
+    void *start;
+    /// The length of the buffer.
+    unsigned length;
+    /// Memory file backing MMAP buffers, -1 for DMABUF.
+    int memfd;
+    /// DMABUF file descriptor given when queuing a DMABUF buffer.
+    int dmabuf_fd;
+    unsigned bytesused;
+    unsigned flags;
+    unsigned field;
+    unsigned sequence;
+    struct timeval timestamp;
+};
+
+/// A fixed size FIFO of buffer indices.
+struct synth_fifo {
+    unsigned items[VIDEO_MAX_FRAME];
+    unsigned head;
+    unsigned len;
+};
+
+/// An emulated buffer queue, either output or capture.
+struct synth_queue {
+    /// Device node exposing this queue, NULL if not yet opened.
+    struct synth_device *dev;
+    /// Buffer type of the queue, zero if the context has no such queue.
+    enum v4l2_buf_type type;
+    enum v4l2_memory memory;
+    /// Supported pixel formats, zero terminated.
+    const __u32 *formats;
+    /// Current format, also used for non-planar queues.
+    struct v4l2_pix_format_mplane fmt;
+    bool streaming;
+    unsigned count;
+    struct synth_buffer buffers[VIDEO_MAX_FRAME];
+    struct synth_fifo queued;
+    struct synth_fifo done;
+};
+
+/// Description of an emulated control.
+struct synth_ctrl_desc {
+    __u32 id;
+    __u32 type;
+    const char *name;
+    __s64 minimum;
+    __s64 maximum;
+    __u64 step;
+    __s64 default_value;
+    /// Number of elements of array controls, whose values are kept as a payload,
+    /// zero for scalar controls.
+    __u32 elems;
+};
+
+/// Static description of a kind of emulated hardware.
+struct synth_kind {
+    const char *name;
+    const char *card;
+    /// Type of the output and capture queues, zero if absent.
+    enum v4l2_buf_type out_type;
+    enum v4l2_buf_type cap_type;
+    const __u32 *out_formats;
+    const __u32 *cap_formats;
+    unsigned width;
+    unsigned height;
+    const struct synth_ctrl_desc *ctrls;
+    unsigned ctrls_count;
+    /// True for the hardware that is split in two device nodes, one for its output
+    /// queue and one for its capture queue.
+    bool split;
+};
+
+struct synth_context;
+
+/// Generator implementation of an emulated device.
+struct synth_ops {
+    /// Optional, initialize a newly allocated MMAP buffer.
+    void (*prepare)(struct synth_context *ctx, struct synth_queue *queue, struct synth_buffer *buf);
+    /// Capture-only sources: fill the capture buffer on each frame period.
+    void (*generate)(struct synth_context *ctx, struct synth_buffer *cap);
+    /// Memory-to-memory devices: process the output buffer into the capture buffer.
+    void (*process)(struct synth_context *ctx, struct synth_buffer *out, struct synth_buffer *cap);
+    /// Optional, release the private state.
+    void (*release)(struct synth_context *ctx);
+};
+
+/// Emulated hardware, shared between one or two device nodes. Its lock is held
+/// by every operation so nodes can be driven from different threads.
+struct synth_context {
+    pthread_mutex_t lock;
+    const struct synth_kind *kind;
+    const struct synth_ops *ops;
+    void *priv;
+    struct synth_queue out;
+    struct synth_queue cap;
+    struct v4l2_fract timeperframe;
+    struct v4l2_rect crop;
+    __s64 ctrls[SYNTH_MAX_CTRLS];
+    /// Payload of array controls, NULL until set.
+    void *payloads[SYNTH_MAX_CTRLS];
+    /// Sequence number of the next frame.
+    unsigned sequence;
+    /// Number of frames that were dropped because no capture buffer was queued.
+    unsigned dropped;
+    unsigned refs;
+};
+
+/// An emulated device node, its file descriptor is either an eventfd that is
+/// signaled on each completed buffer, or a timerfd ticking at the frame period for
+/// capture-only sources.
+struct synth_device {
+    int fd;
+    bool timer;
+    unsigned caps;
+    struct synth_context *ctx;
+    /// Queues exposed by this node, NULL if not exposed.
+    struct synth_queue *out;
+    struct synth_queue *cap;
+    /// Eventfds of the capture and output queues of a memory-to-memory node,
+    /// signaled along the node one, -1 for other nodes.
+    int cap_fd;
+    int out_fd;
+};
+
+
+extern const struct synth_kind synth_kind_sensor;
+extern const struct synth_kind synth_kind_isp;
+extern const struct synth_kind synth_kind_encoder;
+
+/// Open a device node of the given kind. For split kinds, 'capture' selects the
+/// node to open and nodes opened successively are paired to the same context.
+/// The frame rate is only used by capture-only sources, zero for default.
+int synth_open(const struct synth_kind *kind, bool capture, const struct synth_ops *ops, void *priv, unsigned fps);
+
+/// Parse the trailing '@fps' of a device path, it is removed from the string.
+unsigned synth_parse_fps(char *path);
+
+/// Get the current value of a control of the context.
+__s64 synth_ctrl_get(struct synth_context *ctx, __u32 id);
+void synth_ctrl_set(struct synth_context *ctx, __u32 id, __s64 value);
+
+/// Backend operations shared by all emulated devices.
+int synth_close(int fd);
+int synth_ioctl(int fd, unsigned long request, void *arg);
+void *synth_mmap(int fd, size_t length, off_t offset);
+short synth_revents(int fd, short events);
+int synth_wait_fd(int fd, short events);
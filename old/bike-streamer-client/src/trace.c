@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <sys/syscall.h>
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+#ifndef TRACE_DISABLED
+
+/// Events of each ring, a power of two, and rings of traced threads.
+#define TRACE_CAPACITY 8192
+#define TRACE_THREADS 32
+/// Interval of the flusher.
+#define TRACE_FLUSH_MS 20
+
+struct trace_event {
+    const char *category;
+    const char *name;
+    int arg;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+};
+
+/// Ring of a thread, head is only written by the flusher and tail by the thread.
+struct trace_ring {
+    int tid;
+    /// Name of the thread, read by the flusher once it has been set.
+    char thread_name[16];
+    _Alignas(64) atomic_uint head;
+    _Alignas(64) atomic_uint tail;
+    unsigned long dropped;
+    _Alignas(64) struct trace_event events[TRACE_CAPACITY];
+};
+
+bool trace_enabled;
+
+static FILE *trace_file;
+static pthread_t trace_flusher;
+static atomic_bool trace_stop;
+static _Atomic(struct trace_ring *) trace_rings[TRACE_THREADS];
+static atomic_uint trace_ring_count;
+static unsigned long trace_written;
+
+static _Thread_local struct trace_ring *trace_local;
+/// The calling thread came after all rings were claimed, its events are lost.
+static _Thread_local bool trace_overflow;
+static atomic_ulong trace_overflow_dropped;
+
+
+static struct trace_ring *trace_claim(void) {
+
+    unsigned index = atomic_fetch_add(&trace_ring_count, 1);
+    if (index >= TRACE_THREADS) {
+        trace_overflow = true;
+        return NULL;
+    }
+
+    struct trace_ring *ring = aligned_alloc(64, sizeof(struct trace_ring));
+    if (!ring) {
+        fprintf(stderr, "error: failed to allocate trace ring\n");
+        exit(1);
+    }
+
+    memset(ring, 0, sizeof(struct trace_ring));
+    ring->tid = syscall(SYS_gettid);
+    atomic_store_explicit(&trace_rings[index], ring, memory_order_release);
+    return ring;
+
+}
+
+void trace_emit(const char *category, const char *name, int arg, uint64_t begin_ns, uint64_t end_ns) {
+
+    struct trace_ring *ring = trace_local;
+    if (!ring) {
+        if (trace_overflow || !(ring = trace_local = trace_claim())) {
+            atomic_fetch_add_explicit(&trace_overflow_dropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == TRACE_CAPACITY) {
+        ring->dropped++;
+        return;
+    }
+
+    struct trace_event *event = &ring->events[tail % TRACE_CAPACITY];
+    event->category = category;
+    event->name = name;
+    event->arg = arg;
+    event->begin_ns = begin_ns;
+    event->end_ns = end_ns;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+}
+
+static void trace_write_separator(void) {
+    if (trace_written++)
+        fputs(",\n", trace_file);
+}
+
+/// Threads are usually named by their creator after they started, their name
+/// is read when their first events are drained, while they are still alive.
+static void trace_name_thread(struct trace_ring *ring) {
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/comm", ring->tid);
+    FILE *file = fopen(path, "r");
+    if (file && fgets(ring->thread_name, sizeof(ring->thread_name), file))
+        ring->thread_name[strcspn(ring->thread_name, "\n")] = 0;
+    else
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "%d", ring->tid);
+    if (file)
+        fclose(file);
+
+}
+
+/// Write the events pushed to a ring so far, timestamps are in microseconds.
+static void trace_drain(struct trace_ring *ring) {
+
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    pid_t pid = getpid();
+
+    if (head != tail && !ring->thread_name[0])
+        trace_name_thread(ring);
+
+    for (; head != tail; head++) {
+        const struct trace_event *event = &ring->events[head % TRACE_CAPACITY];
+        trace_write_separator();
+        fprintf(trace_file, "{\"cat\":\"%s\",\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+            event->category, event->name, pid, ring->tid, event->begin_ns / 1e3, (event->end_ns - event->begin_ns) / 1e3);
+        if (event->arg >= 0)
+            fprintf(trace_file, ",\"args\":{\"fd\":%d}", event->arg);
+        fputc('}', trace_file);
+    }
+
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+}
+
+static void trace_drain_all(void) {
+    for (unsigned i = 0; i < TRACE_THREADS; i++) {
+        struct trace_ring *ring = atomic_load_explicit(&trace_rings[i], memory_order_acquire);
+        if (ring)
+            trace_drain(ring);
+    }
+}
+
+static void *trace_flusher_main(void *arg) {
+    (void) arg;
+    while (!atomic_load(&trace_stop)) {
+        struct timespec delay = { 0, TRACE_FLUSH_MS * 1000000 };
+        nanosleep(&delay, NULL);
+        trace_drain_all();
+    }
+    return NULL;
+}
+
+void trace_open(const char *path) {
+
+    trace_file = fopen(path, "w");
+    if (!trace_file) {
+        fprintf(stderr, "error: failed to open trace file '%s' (%s)\n", path, strerror(errno));
+        exit(1);
+    }
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", trace_file);
+    trace_written = 0;
+
+    atomic_store(&trace_stop, false);
+    int err = pthread_create(&trace_flusher, NULL, trace_flusher_main, NULL);
+    if (err) {
+        fprintf(stderr, "error: failed to create trace thread (%s)\n", strerror(err));
+        exit(1);
+    }
+    pthread_setname_np(trace_flusher, "trace");
+
+    trace_enabled = true;
+    printf("info: tracing to '%s'\n", path);
+
+}
+
+void trace_close(void) {
+
+    if (!trace_file)
+        return;
+
+    trace_enabled = false;
+    atomic_store(&trace_stop, true);
+    pthread_join(trace_flusher, NULL);
+    trace_drain_all();
+
+    // Threads are named in metadata events. Rings are released, traced threads
+    // no longer use them once tracing is disabled.
+    unsigned long dropped = atomic_load(&trace_overflow_dropped);
+    for (unsigned i = 0; i < TRACE_THREADS; i++) {
+        struct trace_ring *ring = atomic_load(&trace_rings[i]);
+        if (!ring)
+            continue;
+        trace_write_separator();
+        fprintf(trace_file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            getpid(), ring->tid, ring->thread_name);
+        dropped += ring->dropped;
+        atomic_store(&trace_rings[i], NULL);
+        free(ring);
+    }
+    atomic_store(&trace_ring_count, 0);
+    trace_local = NULL;
+
+    fputs("\n]}\n", trace_file);
+    fclose(trace_file);
+    trace_file = NULL;
+
+    printf("info: trace of %lu events written, %lu dropped\n", trace_written, dropped);
+
+}
+
+#else
+
+void trace_open(const char *path) {
+    (void) path;
+    fprintf(stderr, "error: tracing is compiled out\n");
+    exit(1);
+}
+
+void trace_close(void) {
+}
+
+#endif
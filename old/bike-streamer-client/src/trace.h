@@ -0,0 +1,76 @@
+/// Timeline tracing of the device ioctls, the polls and the pipeline stages,
+/// written as a Chrome trace JSON file that Perfetto and chrome://tracing open.
+///
+/// Each traced span is one complete event, its begin and end, pushed at its end
+/// to a ring owned by the calling thread. Rings are single-producer and
+/// single-consumer, a flusher thread drains them to the file every few
+/// milliseconds and events are dropped, and counted, while a ring is full. A
+/// span costs two reads of the monotonic clock and a few stores when tracing is
+/// enabled, a load and a few stores when it is not, and nothing when compiled
+/// out with TRACE_DISABLED (make TRACE=0).
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+
+#ifndef TRACE_DISABLED
+
+/// Set once tracing is enabled, before any traced thread starts.
+extern bool trace_enabled;
+
+struct trace_span {
+    /// Tracing was enabled when the span began.
+    bool enabled;
+    const char *category;
+    const char *name;
+    int arg;
+    uint64_t begin_ns;
+};
+
+static inline uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/// Push a complete event to the ring of the calling thread.
+void trace_emit(const char *category, const char *name, int arg, uint64_t begin_ns, uint64_t end_ns);
+
+static inline void trace_begin(struct trace_span *span, const char *category, const char *name, int arg) {
+    span->category = category;
+    span->name = name;
+    span->arg = arg;
+    span->begin_ns = trace_now();
+}
+
+static inline void trace_end(const struct trace_span *span) {
+    trace_emit(span->category, span->name, span->arg, span->begin_ns, trace_now());
+}
+
+/// Declare and begin a span, names and categories must be static strings and
+/// are only evaluated if tracing is enabled, the argument is the file
+/// descriptor of the device or -1.
+#define TRACE_BEGIN(span, category, name, arg) \
+    struct trace_span span = { .enabled = trace_enabled }; \
+    if (span.enabled) \
+        trace_begin(&span, category, name, arg)
+
+#define TRACE_END(span) do { if (span.enabled) trace_end(&span); } while (0)
+
+#else
+
+#define TRACE_BEGIN(span, category, name, arg) do {} while (0)
+#define TRACE_END(span) do {} while (0)
+
+#endif
+
+/// Start writing the trace to the given file, errors are fatal, and fatal if
+/// tracing is compiled out.
+void trace_open(const char *path);
+
+/// Stop the flusher, drain the rings and close the file. Traced threads other
+/// than the calling one must have exited.
+void trace_close(void);
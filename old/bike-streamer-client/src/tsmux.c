@@ -0,0 +1,219 @@
+#include "tsmux.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+
+/// Bytes of a packet after its 4 bytes header.
+#define TS_PAYLOAD_SIZE 184
+/// PES header with a PTS.
+#define TSMUX_PES_HEADER 14
+/// Timestamps are counted on 33 bits at 90 kHz.
+#define TSMUX_TIMESTAMP_MASK ((1ull << 33) - 1)
+
+/// Sections are checked with the CRC-32 of MPEG-2, without reflection.
+static uint32_t tsmux_crc32(const uint8_t *data, size_t size) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= (uint32_t) data[i] << 24;
+        for (unsigned bit = 0; bit < 8; bit++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    return crc;
+}
+
+static uint8_t *tsmux_header(uint8_t *packet, unsigned pid, bool start, bool adaptation, uint8_t *cc) {
+    packet[0] = 0x47;
+    packet[1] = (start ? 0x40 : 0) | (pid >> 8);
+    packet[2] = pid & 0xFF;
+    packet[3] = (adaptation ? 0x30 : 0x10) | (*cc & 0x0F);
+    *cc = (*cc + 1) & 0x0F;
+    return packet + 4;
+}
+
+/// Write a section in its own packet, the size covers the section from its
+/// table id to its CRC excluded.
+static void tsmux_section(uint8_t *packet, unsigned pid, uint8_t *cc, const uint8_t *section, size_t size) {
+    uint8_t *p = tsmux_header(packet, pid, true, false, cc);
+    *p++ = 0;
+    memcpy(p, section, size);
+    uint32_t crc = tsmux_crc32(section, size);
+    p += size;
+    *p++ = crc >> 24;
+    *p++ = crc >> 16;
+    *p++ = crc >> 8;
+    *p++ = crc;
+    memset(p, 0xFF, packet + TS_PACKET_SIZE - p);
+}
+
+static void tsmux_pat(struct tsmux *mux, uint8_t *packet) {
+    static const uint8_t pat[] = {
+        0x00, 0xB0, 13,             // table id, section length
+        0x00, 0x01, 0xC1, 0x00, 0x00, // transport stream id, version, sections
+        0x00, 0x01,                 // program number
+        0xE0 | (TSMUX_PID_PMT >> 8), TSMUX_PID_PMT & 0xFF,
+    };
+    tsmux_section(packet, TSMUX_PID_PAT, &mux->cc_pat, pat, sizeof(pat));
+}
+
+static void tsmux_pmt(struct tsmux *mux, uint8_t *packet) {
+    static const uint8_t pmt[] = {
+        0x02, 0xB0, 18,             // table id, section length
+        0x00, 0x01, 0xC1, 0x00, 0x00, // program number, version, sections
+        0xE0 | (TSMUX_PID_VIDEO >> 8), TSMUX_PID_VIDEO & 0xFF, // PCR PID
+        0xF0, 0x00,                 // program info length
+        0x1B,                       // H.264 stream
+        0xE0 | (TSMUX_PID_VIDEO >> 8), TSMUX_PID_VIDEO & 0xFF,
+        0xF0, 0x00,                 // ES info length
+    };
+    tsmux_section(packet, TSMUX_PID_PMT, &mux->cc_pmt, pmt, sizeof(pmt));
+}
+
+static void tsmux_pes_header(uint8_t *header, uint64_t pts) {
+    header[0] = 0x00;
+    header[1] = 0x00;
+    header[2] = 0x01;
+    header[3] = 0xE0;
+    // Unbounded length, allowed for video streams.
+    header[4] = 0x00;
+    header[5] = 0x00;
+    header[6] = 0x80;
+    header[7] = 0x80;
+    header[8] = 5;
+    header[9] = 0x21 | ((pts >> 29) & 0x0E);
+    header[10] = pts >> 22;
+    header[11] = 0x01 | ((pts >> 14) & 0xFE);
+    header[12] = pts >> 7;
+    header[13] = 0x01 | ((pts << 1) & 0xFE);
+}
+
+void tsmux_init(struct tsmux *mux) {
+    memset(mux, 0, sizeof(struct tsmux));
+    // Frame and PES header, PAT and PMT, and the adaptation fields of the first
+    // and last packets.
+    mux->capacity = (TSMUX_MAX_FRAME + TSMUX_PES_HEADER) / TS_PAYLOAD_SIZE + 5;
+    mux->packets = malloc((size_t) mux->capacity * TS_PACKET_SIZE);
+    if (!mux->packets) {
+        fprintf(stderr, "error: failed to allocate transport stream packets\n");
+        exit(1);
+    }
+}
+
+void tsmux_free(struct tsmux *mux) {
+    free(mux->packets);
+    mux->packets = NULL;
+}
+
+unsigned tsmux_frame(struct tsmux *mux, const void *data, size_t size, const struct timeval *timestamp, bool keyframe) {
+
+    if (size > TSMUX_MAX_FRAME) {
+        mux->dropped_frames++;
+        return 0;
+    }
+
+    uint64_t now_us = (uint64_t) timestamp->tv_sec * 1000000 + timestamp->tv_usec;
+    uint64_t clock = now_us * 9 / 100;
+    uint8_t *packet = mux->packets;
+
+    if (!mux->started || keyframe || now_us - mux->psi_us >= TSMUX_PSI_INTERVAL_MS * 1000) {
+        tsmux_pat(mux, packet);
+        tsmux_pmt(mux, packet + TS_PACKET_SIZE);
+        packet += 2 * TS_PACKET_SIZE;
+        mux->psi_us = now_us;
+        mux->psi_count++;
+    }
+
+    bool pcr = !mux->started || keyframe || now_us - mux->pcr_us >= TSMUX_PCR_INTERVAL_MS * 1000;
+    if (pcr) {
+        mux->pcr_us = now_us;
+        mux->pcr_count++;
+    }
+    mux->started = true;
+
+    uint8_t pes_header[TSMUX_PES_HEADER];
+    tsmux_pes_header(pes_header, (clock + TSMUX_DELAY_MS * 90) & TSMUX_TIMESTAMP_MASK);
+
+    // The payload of the PES packet is its header then the access unit.
+    const uint8_t *frame = data;
+    size_t total = TSMUX_PES_HEADER + size;
+    size_t pos = 0;
+    bool first = true;
+
+    while (pos < total) {
+
+        // Adaptation field content, after its length byte: flags and PCR.
+        unsigned field = 0;
+        uint8_t flags = 0;
+        if (first && pcr) {
+            flags |= 0x10;
+            field = 7;
+        }
+        if (first && keyframe) {
+            flags |= 0x40;
+            if (!field)
+                field = 1;
+        }
+
+        // The last packet is completed with stuffing in the adaptation field,
+        // down to its length byte alone.
+        bool adaptation = flags != 0;
+        size_t remaining = total - pos;
+        if (remaining < TS_PAYLOAD_SIZE - (adaptation ? 1 + field : 0)) {
+            field = TS_PAYLOAD_SIZE - remaining - 1;
+            adaptation = true;
+        }
+
+        uint8_t *p = tsmux_header(packet, TSMUX_PID_VIDEO, first, adaptation, &mux->cc_video);
+        if (adaptation) {
+            *p++ = field;
+            if (field) {
+                *p++ = flags;
+                if (flags & 0x10) {
+                    uint64_t base = clock & TSMUX_TIMESTAMP_MASK;
+                    *p++ = base >> 25;
+                    *p++ = base >> 17;
+                    *p++ = base >> 9;
+                    *p++ = base >> 1;
+                    *p++ = ((base & 1) << 7) | 0x7E;
+                    *p++ = 0;
+                }
+                unsigned fill = field - 1 - (flags & 0x10 ? 6 : 0);
+                memset(p, 0xFF, fill);
+                p += fill;
+                mux->stuffing_bytes += fill;
+            }
+        }
+
+        // Copy the rest of the packet from the PES header then the frame.
+        size_t len = packet + TS_PACKET_SIZE - p;
+        while (len) {
+            size_t chunk;
+            if (pos < TSMUX_PES_HEADER) {
+                chunk = TSMUX_PES_HEADER - pos < len ? TSMUX_PES_HEADER - pos : len;
+                memcpy(p, pes_header + pos, chunk);
+            } else {
+                chunk = len;
+                memcpy(p, frame + pos - TSMUX_PES_HEADER, chunk);
+            }
+            p += chunk;
+            pos += chunk;
+            len -= chunk;
+        }
+
+        packet += TS_PACKET_SIZE;
+        first = false;
+
+    }
+
+    unsigned count = (packet - mux->packets) / TS_PACKET_SIZE;
+    mux->frames++;
+    mux->packets_count += count;
+    return count;
+
+}
+
+void tsmux_report(const struct tsmux *mux) {
+    printf("info: ts muxer %lu frames, %lu packets, %lu PAT/PMT, %lu PCR, %lu stuffing bytes, %lu dropped frames\n",
+        mux->frames, mux->packets_count, mux->psi_count, mux->pcr_count, mux->stuffing_bytes, mux->dropped_frames);
+}
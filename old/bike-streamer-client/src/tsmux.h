@@ -0,0 +1,69 @@
+/// MPEG transport stream muxer of the encoded frames, one program with one H.264
+/// stream. Each access unit becomes one PES packet timestamped from the V4L2
+/// capture timestamp, split into 188 bytes packets written into a buffer
+/// allocated once, read straight from the encoder capture buffer.
+///
+/// The PAT and PMT are repeated before key frames and at least every 100 ms,
+/// so that a receiver joining the stream starts decoding at the next key frame.
+/// The PCR is carried by the first video packet of a frame, at least every 40 ms
+/// and on every frame below 25 fps, such as when the bitrate adaptation halves
+/// the frame rate. The packets of a frame are sent in one burst at its capture
+/// time, there is no later clock to put in the middle of a frame.
+
+#pragma once
+
+#include <sys/time.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define TS_PACKET_SIZE 188
+
+#define TSMUX_PID_PAT 0x0000
+#define TSMUX_PID_PMT 0x1000
+#define TSMUX_PID_VIDEO 0x0100
+
+/// Maximum intervals between two PAT/PMT and two PCR, in milliseconds, unless
+/// the frames are further apart.
+#define TSMUX_PSI_INTERVAL_MS 100
+#define TSMUX_PCR_INTERVAL_MS 40
+/// Presentation timestamps are ahead of the PCR by this delay, in milliseconds,
+/// the time the receiver has to buffer a frame before presenting it.
+#define TSMUX_DELAY_MS 100
+
+/// Largest access unit muxed, larger ones are dropped.
+#define TSMUX_MAX_FRAME (2 << 20)
+
+struct tsmux {
+    /// Packets of the last muxed frame.
+    uint8_t *packets;
+    unsigned capacity;
+    /// Continuity counters of each PID.
+    uint8_t cc_pat;
+    uint8_t cc_pmt;
+    uint8_t cc_video;
+    bool started;
+    /// Capture time of the last PAT/PMT and PCR, in microseconds.
+    uint64_t psi_us;
+    uint64_t pcr_us;
+    unsigned long frames;
+    unsigned long packets_count;
+    unsigned long psi_count;
+    unsigned long pcr_count;
+    unsigned long stuffing_bytes;
+    unsigned long dropped_frames;
+};
+
+
+/// Allocate the packets of the largest frame, errors are fatal.
+void tsmux_init(struct tsmux *mux);
+void tsmux_free(struct tsmux *mux);
+
+/// Mux an Annex-B access unit into 'packets', return the number of packets,
+/// zero if the frame is too large.
+unsigned tsmux_frame(struct tsmux *mux, const void *data, size_t size, const struct timeval *timestamp, bool keyframe);
+
+/// Print the muxing statistics.
+void tsmux_report(const struct tsmux *mux);
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+
+#include "tssink.h"
+#include "net.h"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+
+
+void tssink_open(struct tssink *sink, const char *address) {
+
+    memset(sink, 0, sizeof(struct tssink));
+    sink->listen_fd = -1;
+    sink->udp_fd = -1;
+
+    if (strncmp(address, "tcp:", 4) == 0) {
+        sink->listen_fd = net_listen(address + 4, SOCK_STREAM | SOCK_NONBLOCK);
+    } else if (strncmp(address, "udp:", 4) == 0) {
+        sink->udp_fd = net_connect(address + 4, SOCK_DGRAM);
+    } else {
+        fprintf(stderr, "error: invalid transport stream address '%s', expected tcp:port or udp:host:port\n", address);
+        exit(1);
+    }
+
+    tsmux_init(&sink->mux);
+
+    if (sink->udp_fd != -1) {
+        unsigned count = (sink->mux.capacity + TSSINK_DATAGRAM_PACKETS - 1) / TSSINK_DATAGRAM_PACKETS;
+        sink->msgs = calloc(count, sizeof(struct mmsghdr));
+        sink->iovs = calloc(count, sizeof(struct iovec));
+        if (!sink->msgs || !sink->iovs) {
+            fprintf(stderr, "error: failed to allocate transport stream datagrams\n");
+            exit(1);
+        }
+        for (unsigned i = 0; i < count; i++) {
+            sink->iovs[i].iov_base = sink->mux.packets + (size_t) i * TSSINK_DATAGRAM_PACKETS * TS_PACKET_SIZE;
+            sink->msgs[i].msg_hdr.msg_iov = &sink->iovs[i];
+            sink->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+}
+
+void tssink_close(struct tssink *sink) {
+    for (unsigned i = 0; i < sink->client_count; i++)
+        close(sink->clients[i]);
+    if (sink->listen_fd != -1)
+        close(sink->listen_fd);
+    if (sink->udp_fd != -1)
+        close(sink->udp_fd);
+    tsmux_free(&sink->mux);
+    free(sink->msgs);
+    free(sink->iovs);
+    sink->msgs = NULL;
+    sink->iovs = NULL;
+    sink->client_count = 0;
+    sink->listen_fd = -1;
+    sink->udp_fd = -1;
+}
+
+static void tssink_accept(struct tssink *sink) {
+    for (;;) {
+        int fd = accept4(sink->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+            return;
+        if (sink->client_count == TSSINK_MAX_CLIENTS) {
+            close(fd);
+            sink->dropped_clients++;
+            continue;
+        }
+        sink->synced[sink->client_count] = false;
+        sink->clients[sink->client_count++] = fd;
+        sink->accepted_clients++;
+    }
+}
+
+/// Write the packets to a client, return -1 if it must be disconnected. A frame
+/// written partially would corrupt the stream, so a full socket buffer drops
+/// the client rather than waiting for it.
+static int tssink_write(struct tssink *sink, int fd, const uint8_t *data, size_t size) {
+    while (size) {
+        ssize_t len = send(fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        data += len;
+        size -= len;
+        sink->bytes += len;
+    }
+    return 0;
+}
+
+static void tssink_push(struct tssink *sink, unsigned packets) {
+
+    unsigned count = (packets + TSSINK_DATAGRAM_PACKETS - 1) / TSSINK_DATAGRAM_PACKETS;
+    for (unsigned i = 0; i < count; i++) {
+        unsigned n = i + 1 < count ? TSSINK_DATAGRAM_PACKETS : packets - i * TSSINK_DATAGRAM_PACKETS;
+        sink->iovs[i].iov_len = n * TS_PACKET_SIZE;
+    }
+
+    unsigned sent = 0;
+    while (sent < count) {
+        int ret = sendmmsg(sink->udp_fd, sink->msgs + sent, count - sent, 0);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        } else if (ret == -1) {
+            sink->errors += count - sent;
+            break;
+        }
+        for (int i = 0; i < ret; i++)
+            sink->bytes += sink->iovs[sent + i].iov_len;
+        sent += ret;
+    }
+    sink->datagrams += sent;
+
+}
+
+void tssink_send(struct tssink *sink, const void *data, size_t size, const struct timeval *timestamp, bool keyframe) {
+
+    if (sink->listen_fd != -1) {
+        tssink_accept(sink);
+        // Frames are only muxed when a client reads them.
+        bool readers = false;
+        for (unsigned i = 0; i < sink->client_count; i++)
+            readers |= sink->synced[i] || keyframe;
+        if (!readers)
+            return;
+    }
+
+    unsigned packets = tsmux_frame(&sink->mux, data, size, timestamp, keyframe);
+    if (!packets)
+        return;
+    sink->frames++;
+
+    if (sink->udp_fd != -1) {
+        tssink_push(sink, packets);
+        return;
+    }
+
+    size_t bytes = (size_t) packets * TS_PACKET_SIZE;
+    for (unsigned i = 0; i < sink->client_count;) {
+        if (!sink->synced[i] && !keyframe) {
+            i++;
+            continue;
+        }
+        sink->synced[i] = true;
+        if (tssink_write(sink, sink->clients[i], sink->mux.packets, bytes) == -1) {
+            close(sink->clients[i]);
+            sink->clients[i] = sink->clients[sink->client_count - 1];
+            sink->synced[i] = sink->synced[sink->client_count - 1];
+            sink->client_count--;
+            sink->dropped_clients++;
+            continue;
+        }
+        i++;
+    }
+
+}
+
+void tssink_report(const struct tssink *sink) {
+    tsmux_report(&sink->mux);
+    printf("info: ts sink %lu frames, %lu bytes, %lu datagrams, %lu clients accepted, %lu dropped, %lu errors\n",
+        sink->frames, sink->bytes, sink->datagrams, sink->accepted_clients, sink->dropped_clients, sink->errors);
+}
@@ -0,0 +1,57 @@
+/// Sink serving the encoded frames as an MPEG transport stream (see 'tsmux.h'),
+/// in place of the GStreamer 'mpegtsmux ! tcpserversink' of 'start-server.sh'.
+/// Each frame is muxed once and its packets are written to every reader:
+///  - 'tcp:port' serves the clients connecting to the port, a new client starts
+///    at the next key frame and a client that can't keep up is disconnected,
+///    the sink never blocks the pipeline;
+///  - 'udp:host:port' pushes the stream to a receiver, 7 packets per datagram.
+///
+/// The frame is copied into the packets, so the encoder buffer is released
+/// immediately.
+
+#pragma once
+
+#include "tsmux.h"
+
+#include <sys/time.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define TSSINK_MAX_CLIENTS 16
+/// Packets per UDP datagram, 1316 bytes that fit the Ethernet MTU.
+#define TSSINK_DATAGRAM_PACKETS 7
+
+struct tssink {
+    struct tsmux mux;
+    /// Listening socket with 'tcp:port', -1 with 'udp:host:port'.
+    int listen_fd;
+    /// Connected socket with 'udp:host:port', and its datagrams bound on open
+    /// to the packets of the largest frame.
+    int udp_fd;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    int clients[TSSINK_MAX_CLIENTS];
+    /// The client received a key frame, it is sent all the frames.
+    bool synced[TSSINK_MAX_CLIENTS];
+    unsigned client_count;
+    unsigned long frames;
+    unsigned long bytes;
+    unsigned long datagrams;
+    unsigned long accepted_clients;
+    unsigned long dropped_clients;
+    /// Datagrams that could not be sent, such as when no receiver is listening.
+    unsigned long errors;
+};
+
+
+/// Listen on 'tcp:port' or connect to 'udp:host:port', errors are fatal.
+void tssink_open(struct tssink *sink, const char *address);
+void tssink_close(struct tssink *sink);
+
+/// Mux and send an Annex-B access unit, the data is no longer read on return.
+void tssink_send(struct tssink *sink, const void *data, size_t size, const struct timeval *timestamp, bool keyframe);
+
+/// Print the muxing and send statistics.
+void tssink_report(const struct tssink *sink);
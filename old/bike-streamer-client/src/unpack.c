@@ -0,0 +1,366 @@
+#include "unpack.h"
+
+#include <linux/videodev2.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UNPACK_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define UNPACK_NEON
+#endif
+
+
+static pthread_once_t unpack_once = PTHREAD_ONCE_INIT;
+static const struct unpack_kernel *unpack_selected;
+
+
+///
+/// SCALAR
+///
+
+static void unpack_row12_scalar(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+    for (unsigned i = 0; i < pairs; i++, src += 3) {
+        even[i] = (uint16_t) (src[0] << 4 | (src[2] & 0x0F));
+        odd[i] = (uint16_t) (src[1] << 4 | src[2] >> 4);
+    }
+}
+
+static void unpack_row10_scalar(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+    for (unsigned i = 0; i + 1 < pairs; i += 2, src += 5) {
+        even[i] = (uint16_t) (src[0] << 2 | (src[4] & 3));
+        odd[i] = (uint16_t) (src[1] << 2 | (src[4] >> 2 & 3));
+        even[i + 1] = (uint16_t) (src[2] << 2 | (src[4] >> 4 & 3));
+        odd[i + 1] = (uint16_t) (src[3] << 2 | src[4] >> 6);
+    }
+}
+
+#ifdef UNPACK_X86
+
+// The 12-bit kernels shuffle each pair of pixels into two words, with the high
+// byte of the pixel above its low nibbles: the even word is then the high byte
+// shifted right by 4 with the low nibble kept, the odd word is shifted right by
+// 4. Four pairs are taken from each 16 bytes load.
+#define UNPACK_SHUFFLE12(o) \
+    (o) + 2, (o) + 0, (o) + 5, (o) + 3, (o) + 8, (o) + 6, (o) + 11, (o) + 9, \
+    (o) + 2, (o) + 1, (o) + 5, (o) + 4, (o) + 8, (o) + 7, (o) + 11, (o) + 10
+
+// The 10-bit kernels shuffle the high bytes of the pixels of two groups into
+// words, the even pixels then the odd ones, and the byte of low bits of each
+// group into the words of its two pixels. Low bits are moved to the top of
+// their byte with a per-word multiplication.
+#define UNPACK_SHUFFLE10_HIGH(o) \
+    (o) + 0, -1, (o) + 2, -1, (o) + 5, -1, (o) + 7, -1, \
+    (o) + 1, -1, (o) + 3, -1, (o) + 6, -1, (o) + 8, -1
+#define UNPACK_SHUFFLE10_LOW(o) \
+    (o) + 4, -1, (o) + 4, -1, (o) + 9, -1, (o) + 9, -1, \
+    -1, -1, -1, -1, -1, -1, -1, -1
+
+__attribute__((target("ssse3")))
+static void unpack_row12_ssse3(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+
+    unsigned i = 0;
+    const __m128i shuffle_lo = _mm_setr_epi8(UNPACK_SHUFFLE12(0));
+    const __m128i shuffle_hi = _mm_setr_epi8(UNPACK_SHUFFLE12(4));
+    const __m128i high = _mm_set1_epi16(0x0FF0);
+    const __m128i low = _mm_set1_epi16(0x000F);
+
+    for (; i + 8 <= pairs; i += 8, src += 24) {
+        __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) src), shuffle_lo);
+        __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + 8)), shuffle_hi);
+        __m128i e = _mm_unpacklo_epi64(lo, hi);
+        __m128i o = _mm_unpackhi_epi64(lo, hi);
+        e = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(e, 4), high), _mm_and_si128(e, low));
+        _mm_storeu_si128((__m128i *) (even + i), e);
+        _mm_storeu_si128((__m128i *) (odd + i), _mm_srli_epi16(o, 4));
+    }
+
+    unpack_row12_scalar(even + i, odd + i, src, pairs - i);
+
+}
+
+__attribute__((target("ssse3")))
+static void unpack_row10_ssse3(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+
+    unsigned i = 0;
+    const __m128i high_lo = _mm_setr_epi8(UNPACK_SHUFFLE10_HIGH(0));
+    const __m128i high_hi = _mm_setr_epi8(UNPACK_SHUFFLE10_HIGH(6));
+    const __m128i low_lo = _mm_setr_epi8(UNPACK_SHUFFLE10_LOW(0));
+    const __m128i low_hi = _mm_setr_epi8(UNPACK_SHUFFLE10_LOW(6));
+    const __m128i mul_even = _mm_setr_epi16(64, 4, 64, 4, 64, 4, 64, 4);
+    const __m128i mul_odd = _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1);
+    const __m128i mask = _mm_set1_epi16(3);
+
+    for (; i + 8 <= pairs; i += 8, src += 20) {
+        __m128i a = _mm_loadu_si128((const __m128i *) src);
+        __m128i b = _mm_loadu_si128((const __m128i *) (src + 4));
+        __m128i ha = _mm_shuffle_epi8(a, high_lo), hb = _mm_shuffle_epi8(b, high_hi);
+        __m128i l = _mm_unpacklo_epi64(_mm_shuffle_epi8(a, low_lo), _mm_shuffle_epi8(b, low_hi));
+        __m128i le = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(l, mul_even), 6), mask);
+        __m128i lo = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(l, mul_odd), 6), mask);
+        _mm_storeu_si128((__m128i *) (even + i), _mm_or_si128(_mm_slli_epi16(_mm_unpacklo_epi64(ha, hb), 2), le));
+        _mm_storeu_si128((__m128i *) (odd + i), _mm_or_si128(_mm_slli_epi16(_mm_unpackhi_epi64(ha, hb), 2), lo));
+    }
+
+    unpack_row10_scalar(even + i, odd + i, src, pairs - i);
+
+}
+
+/// Load two 16 bytes blocks in the lanes, the shuffles work within each lane.
+__attribute__((target("avx2")))
+static inline __m256i unpack_load2(const uint8_t *lo, const uint8_t *hi) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) lo)), _mm_loadu_si128((const __m128i *) hi), 1);
+}
+
+// The tails use the scalar kernel, mixing SSE with AVX instructions costs
+// more than a few scalar pixels.
+__attribute__((target("avx2")))
+static void unpack_row12_avx2(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+
+    unsigned i = 0;
+    const __m256i shuffle_lo = _mm256_setr_epi8(UNPACK_SHUFFLE12(0), UNPACK_SHUFFLE12(0));
+    const __m256i shuffle_hi = _mm256_setr_epi8(UNPACK_SHUFFLE12(4), UNPACK_SHUFFLE12(4));
+    const __m256i high = _mm256_set1_epi16(0x0FF0);
+    const __m256i low = _mm256_set1_epi16(0x000F);
+
+    for (; i + 16 <= pairs; i += 16, src += 48) {
+        __m256i lo = _mm256_shuffle_epi8(unpack_load2(src, src + 24), shuffle_lo);
+        __m256i hi = _mm256_shuffle_epi8(unpack_load2(src + 8, src + 32), shuffle_hi);
+        __m256i e = _mm256_unpacklo_epi64(lo, hi);
+        __m256i o = _mm256_unpackhi_epi64(lo, hi);
+        e = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(e, 4), high), _mm256_and_si256(e, low));
+        _mm256_storeu_si256((__m256i *) (even + i), e);
+        _mm256_storeu_si256((__m256i *) (odd + i), _mm256_srli_epi16(o, 4));
+    }
+
+    unpack_row12_scalar(even + i, odd + i, src, pairs - i);
+
+}
+
+__attribute__((target("avx2")))
+static void unpack_row10_avx2(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+
+    unsigned i = 0;
+    const __m256i high_lo = _mm256_setr_epi8(UNPACK_SHUFFLE10_HIGH(0), UNPACK_SHUFFLE10_HIGH(0));
+    const __m256i high_hi = _mm256_setr_epi8(UNPACK_SHUFFLE10_HIGH(6), UNPACK_SHUFFLE10_HIGH(6));
+    const __m256i low_lo = _mm256_setr_epi8(UNPACK_SHUFFLE10_LOW(0), UNPACK_SHUFFLE10_LOW(0));
+    const __m256i low_hi = _mm256_setr_epi8(UNPACK_SHUFFLE10_LOW(6), UNPACK_SHUFFLE10_LOW(6));
+    const __m256i mul_even = _mm256_setr_epi16(64, 4, 64, 4, 64, 4, 64, 4, 64, 4, 64, 4, 64, 4, 64, 4);
+    const __m256i mul_odd = _mm256_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1, 16, 1);
+    const __m256i mask = _mm256_set1_epi16(3);
+
+    for (; i + 16 <= pairs; i += 16, src += 40) {
+        __m256i a = unpack_load2(src, src + 20);
+        __m256i b = unpack_load2(src + 4, src + 24);
+        __m256i ha = _mm256_shuffle_epi8(a, high_lo), hb = _mm256_shuffle_epi8(b, high_hi);
+        __m256i l = _mm256_unpacklo_epi64(_mm256_shuffle_epi8(a, low_lo), _mm256_shuffle_epi8(b, low_hi));
+        __m256i le = _mm256_and_si256(_mm256_srli_epi16(_mm256_mullo_epi16(l, mul_even), 6), mask);
+        __m256i lo = _mm256_and_si256(_mm256_srli_epi16(_mm256_mullo_epi16(l, mul_odd), 6), mask);
+        _mm256_storeu_si256((__m256i *) (even + i), _mm256_or_si256(_mm256_slli_epi16(_mm256_unpacklo_epi64(ha, hb), 2), le));
+        _mm256_storeu_si256((__m256i *) (odd + i), _mm256_or_si256(_mm256_slli_epi16(_mm256_unpackhi_epi64(ha, hb), 2), lo));
+    }
+
+    unpack_row10_scalar(even + i, odd + i, src, pairs - i);
+
+}
+
+#endif
+
+#ifdef UNPACK_NEON
+
+/// Table lookup of 16 bytes, out of range indices give zero. AArch32 only has
+/// the 8 bytes variant.
+static inline uint8x16_t unpack_neon_lookup(uint8x16_t table, uint8x16_t index) {
+#ifdef __aarch64__
+    return vqtbl1q_u8(table, index);
+#else
+    uint8x8x2_t halves = { { vget_low_u8(table), vget_high_u8(table) } };
+    return vcombine_u8(vtbl2_u8(halves, vget_low_u8(index)), vtbl2_u8(halves, vget_high_u8(index)));
+#endif
+}
+
+/// The structured load splits the high bytes of the even and odd pixels and the
+/// byte of their low nibbles.
+static void unpack_row12_neon(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+
+    unsigned i = 0;
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+
+    for (; i + 16 <= pairs; i += 16, src += 48) {
+        uint8x16x3_t v = vld3q_u8(src);
+        uint8x16_t le = vandq_u8(v.val[2], mask);
+        uint8x16_t lo = vshrq_n_u8(v.val[2], 4);
+        vst1q_u16(even + i, vorrq_u16(vshll_n_u8(vget_low_u8(v.val[0]), 4), vmovl_u8(vget_low_u8(le))));
+        vst1q_u16(even + i + 8, vorrq_u16(vshll_n_u8(vget_high_u8(v.val[0]), 4), vmovl_u8(vget_high_u8(le))));
+        vst1q_u16(odd + i, vorrq_u16(vshll_n_u8(vget_low_u8(v.val[1]), 4), vmovl_u8(vget_low_u8(lo))));
+        vst1q_u16(odd + i + 8, vorrq_u16(vshll_n_u8(vget_high_u8(v.val[1]), 4), vmovl_u8(vget_high_u8(lo))));
+    }
+
+    unpack_row12_scalar(even + i, odd + i, src, pairs - i);
+
+}
+
+/// Same shuffles as the x86 kernel, the low bits are extracted with per-word
+/// shifts instead of multiplications.
+static void unpack_row10_neon(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs) {
+
+    static const uint8_t high_table[2][16] = {
+        { 0, 255, 2, 255, 5, 255, 7, 255, 1, 255, 3, 255, 6, 255, 8, 255 },
+        { 6, 255, 8, 255, 11, 255, 13, 255, 7, 255, 9, 255, 12, 255, 14, 255 },
+    };
+    static const uint8_t low_table[2][16] = {
+        { 4, 255, 4, 255, 9, 255, 9, 255, 255, 255, 255, 255, 255, 255, 255, 255 },
+        { 10, 255, 10, 255, 15, 255, 15, 255, 255, 255, 255, 255, 255, 255, 255, 255 },
+    };
+    static const int16_t shift_even[8] = { 0, -4, 0, -4, 0, -4, 0, -4 };
+    static const int16_t shift_odd[8] = { -2, -6, -2, -6, -2, -6, -2, -6 };
+
+    unsigned i = 0;
+    const uint8x16_t high_lo = vld1q_u8(high_table[0]), high_hi = vld1q_u8(high_table[1]);
+    const uint8x16_t low_lo = vld1q_u8(low_table[0]), low_hi = vld1q_u8(low_table[1]);
+    const int16x8_t se = vld1q_s16(shift_even), so = vld1q_s16(shift_odd);
+    const uint16x8_t mask = vdupq_n_u16(3);
+
+    for (; i + 8 <= pairs; i += 8, src += 20) {
+        uint8x16_t a = vld1q_u8(src);
+        uint8x16_t b = vld1q_u8(src + 4);
+        uint8x16_t ha = unpack_neon_lookup(a, high_lo), hb = unpack_neon_lookup(b, high_hi);
+        uint16x8_t he = vreinterpretq_u16_u8(vcombine_u8(vget_low_u8(ha), vget_low_u8(hb)));
+        uint16x8_t ho = vreinterpretq_u16_u8(vcombine_u8(vget_high_u8(ha), vget_high_u8(hb)));
+        uint16x8_t l = vreinterpretq_u16_u8(vcombine_u8(vget_low_u8(unpack_neon_lookup(a, low_lo)), vget_low_u8(unpack_neon_lookup(b, low_hi))));
+        vst1q_u16(even + i, vorrq_u16(vshlq_n_u16(he, 2), vandq_u16(vshlq_u16(l, se), mask)));
+        vst1q_u16(odd + i, vorrq_u16(vshlq_n_u16(ho, 2), vandq_u16(vshlq_u16(l, so), mask)));
+    }
+
+    unpack_row10_scalar(even + i, odd + i, src, pairs - i);
+
+}
+
+#endif
+
+static struct unpack_kernel unpack_available[4];
+static unsigned unpack_available_count;
+
+static void unpack_init_once(void) {
+
+    unpack_available[unpack_available_count++] = (struct unpack_kernel) { "scalar", unpack_row12_scalar, unpack_row10_scalar };
+#ifdef UNPACK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+        unpack_available[unpack_available_count++] = (struct unpack_kernel) { "ssse3", unpack_row12_ssse3, unpack_row10_ssse3 };
+    if (__builtin_cpu_supports("avx2"))
+        unpack_available[unpack_available_count++] = (struct unpack_kernel) { "avx2", unpack_row12_avx2, unpack_row10_avx2 };
+#endif
+#ifdef UNPACK_NEON
+    unpack_available[unpack_available_count++] = (struct unpack_kernel) { "neon", unpack_row12_neon, unpack_row10_neon };
+#endif
+
+    unpack_selected = &unpack_available[unpack_available_count - 1];
+
+}
+
+static void unpack_init(void) {
+    pthread_once(&unpack_once, unpack_init_once);
+}
+
+const struct unpack_kernel *unpack_kernels(unsigned *count) {
+    unpack_init();
+    *count = unpack_available_count;
+    return unpack_available;
+}
+
+const char *unpack_kernel_name(void) {
+    unpack_init();
+    return unpack_selected->name;
+}
+
+bool unpack_select_kernel(const char *name) {
+    unpack_init();
+    for (unsigned i = 0; i < unpack_available_count; i++) {
+        if (strcmp(unpack_available[i].name, name) == 0) {
+            unpack_selected = &unpack_available[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool unpack_layout(uint32_t pixelformat, const enum unpack_channel **layout, unsigned *depth) {
+
+    static const enum unpack_channel rggb[4] = { UNPACK_R, UNPACK_GR, UNPACK_GB, UNPACK_B };
+    static const enum unpack_channel grbg[4] = { UNPACK_GR, UNPACK_R, UNPACK_B, UNPACK_GB };
+    static const enum unpack_channel gbrg[4] = { UNPACK_GB, UNPACK_B, UNPACK_R, UNPACK_GR };
+    static const enum unpack_channel bggr[4] = { UNPACK_B, UNPACK_GB, UNPACK_GR, UNPACK_R };
+
+    switch (pixelformat) {
+    case V4L2_PIX_FMT_SRGGB12P: *layout = rggb; *depth = 12; return true;
+    case V4L2_PIX_FMT_SGRBG12P: *layout = grbg; *depth = 12; return true;
+    case V4L2_PIX_FMT_SGBRG12P: *layout = gbrg; *depth = 12; return true;
+    case V4L2_PIX_FMT_SBGGR12P: *layout = bggr; *depth = 12; return true;
+    case V4L2_PIX_FMT_SRGGB10P: *layout = rggb; *depth = 10; return true;
+    case V4L2_PIX_FMT_SGRBG10P: *layout = grbg; *depth = 10; return true;
+    case V4L2_PIX_FMT_SGBRG10P: *layout = gbrg; *depth = 10; return true;
+    case V4L2_PIX_FMT_SBGGR10P: *layout = bggr; *depth = 10; return true;
+    default: return false;
+    }
+
+}
+
+bool unpack_supported(uint32_t pixelformat) {
+    const enum unpack_channel *layout;
+    unsigned depth;
+    return unpack_layout(pixelformat, &layout, &depth);
+}
+
+void unpack_planes_alloc(struct unpack_planes *planes, unsigned width, unsigned height) {
+
+    planes->width = width / 2;
+    planes->height = height / 2;
+    // Rows start on 32 bytes.
+    planes->stride = (planes->width + 15) & ~15u;
+
+    for (unsigned c = 0; c < UNPACK_CHANNELS; c++) {
+        if (posix_memalign((void **) &planes->planes[c], 32, (size_t) planes->stride * planes->height * sizeof(uint16_t))) {
+            fprintf(stderr, "error: failed to allocate unpacked planes\n");
+            exit(1);
+        }
+    }
+
+}
+
+void unpack_planes_free(struct unpack_planes *planes) {
+    for (unsigned c = 0; c < UNPACK_CHANNELS; c++) {
+        free(planes->planes[c]);
+        planes->planes[c] = NULL;
+    }
+}
+
+bool unpack_frame(struct unpack_planes *planes, const void *data, uint32_t pixelformat, unsigned width, unsigned height, unsigned bytesperline) {
+    return unpack_region(planes, data, pixelformat, bytesperline, 0, 0, width, height);
+}
+
+bool unpack_region(struct unpack_planes *planes, const void *data, uint32_t pixelformat, unsigned bytesperline, unsigned left, unsigned top, unsigned width, unsigned height) {
+
+    const enum unpack_channel *layout;
+    unsigned depth;
+    if (!unpack_layout(pixelformat, &layout, &depth))
+        return false;
+
+    unpack_init();
+    unpack_row_fn row = depth == 12 ? unpack_selected->row12 : unpack_selected->row10;
+    const uint8_t *src = (const uint8_t *) data + (size_t) top * bytesperline + left * depth / 8;
+
+    for (unsigned y = 0; y < height; y++) {
+        const enum unpack_channel *pair = layout + (y & 1) * 2;
+        size_t offset = (size_t) (y / 2) * planes->stride;
+        row(planes->planes[pair[0]] + offset, planes->planes[pair[1]] + offset, src + (size_t) y * bytesperline, width / 2);
+    }
+
+    return true;
+
+}
@@ -0,0 +1,75 @@
+/// Unpacking of the packed raw Bayer formats of the sensor into one plane of
+/// 16-bit samples per color channel, each of half the width and height of the
+/// frame. Samples keep their native range, 0 to 4095 for 12-bit formats and 0
+/// to 1023 for 10-bit formats.
+///
+/// In 12-bit packed formats, 2 pixels are stored on 3 bytes: the 8 most
+/// significant bits of each pixel, then their 4 least significant bits, the
+/// first pixel in the low nibble. In 10-bit packed formats, 4 pixels are stored
+/// on 5 bytes: the 8 most significant bits of each pixel, then their 2 least
+/// significant bits, the first pixel in the low bits.
+///
+/// Rows are unpacked by a kernel splitting the even and odd columns, selected
+/// at runtime between the scalar reference, SSSE3, AVX2 and NEON.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+enum unpack_channel {
+    UNPACK_R,
+    /// Green pixels on the rows of red and blue pixels.
+    UNPACK_GR,
+    UNPACK_GB,
+    UNPACK_B,
+    UNPACK_CHANNELS,
+};
+
+/// Planes of a frame, the stride is in samples.
+struct unpack_planes {
+    uint16_t *planes[UNPACK_CHANNELS];
+    unsigned width;
+    unsigned height;
+    unsigned stride;
+};
+
+/// Row kernel, unpack the given number of pixel pairs into the samples of the
+/// even and odd columns.
+typedef void (*unpack_row_fn)(uint16_t *even, uint16_t *odd, const uint8_t *src, unsigned pairs);
+
+struct unpack_kernel {
+    const char *name;
+    unpack_row_fn row12;
+    unpack_row_fn row10;
+};
+
+
+/// Get the kernels available on this CPU, the fastest last.
+const struct unpack_kernel *unpack_kernels(unsigned *count);
+
+/// Get the name of the selected kernel, or select one by name, return false if
+/// it is not available.
+const char *unpack_kernel_name(void);
+bool unpack_select_kernel(const char *name);
+
+/// Check if the pixel format is a packed Bayer format that can be unpacked.
+bool unpack_supported(uint32_t pixelformat);
+
+/// Get the channels of the 2x2 pixels of a packed Bayer format, by row then
+/// column, and its depth. Return false if not supported.
+bool unpack_layout(uint32_t pixelformat, const enum unpack_channel **layout, unsigned *depth);
+
+/// Allocate the planes of a frame, aligned for the kernels, errors are fatal.
+void unpack_planes_alloc(struct unpack_planes *planes, unsigned width, unsigned height);
+void unpack_planes_free(struct unpack_planes *planes);
+
+/// Unpack a frame of the given size and format, the width must be a multiple of
+/// 4 and the height even. Return false if the format is not supported.
+bool unpack_frame(struct unpack_planes *planes, const void *data, uint32_t pixelformat, unsigned width, unsigned height, unsigned bytesperline);
+
+/// Unpack a region of a frame into the first rows of the planes, its left edge
+/// and width must be multiples of 4, its top edge and height even.
+bool unpack_region(struct unpack_planes *planes, const void *data, uint32_t pixelformat, unsigned bytesperline, unsigned left, unsigned top, unsigned width, unsigned height);
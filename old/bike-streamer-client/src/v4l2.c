@@ -1,61 +1,263 @@
 #include "v4l2.h"
+#include "backend.h"
+#include "trace.h"
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
 #include <malloc.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 
 
 /// This macro can be used to retry a failed syscall that may have returned 
 /// a 'EINTR' error code.
 #define RETRY_INT(expr) ({ int __res; do { __res = (expr); } while (__res == -1 && errno == EINTR); __res; })
 
+/// Maximum file descriptor that can be owned by a non-default backend.
+#define VID_MAX_FD 1024
+
 
 ///
-/// MISC FUNCTION FOR VIDEO DEVICE
+/// DEVICE BACKENDS
 ///
 
-enum vid_result vid_open(int *fd, const char *path) {
+static const struct vid_backend *vid_backends[] = {
+    &vid_backend_synth,
+    &vid_backend_replay,
+    &vid_backend_soft,
+};
+
+/// Backend of each file descriptor opened with 'vid_open', NULL for the default.
+static const struct vid_backend *vid_backends_by_fd[VID_MAX_FD];
+
+static const struct vid_backend *vid_backend_of(int fd) {
+    if (fd >= 0 && fd < VID_MAX_FD && vid_backends_by_fd[fd])
+        return vid_backends_by_fd[fd];
+    return &vid_backend_v4l2;
+}
+
+static int v4l2_open(const char *path) {
 
     struct stat st;
     if (stat(path, &st) == -1)
-        return VID_ERR_SYS;
+        return -1;
 
-    if (!S_ISCHR(st.st_mode))
-        return VID_ERR_NO_VIDEO;
+    if (!S_ISCHR(st.st_mode)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    return open(path, O_RDWR | O_NONBLOCK, 0);
+
+}
+
+static int v4l2_ioctl(int fd, unsigned long request, void *arg) {
+    return ioctl(fd, request, arg);
+}
 
-    int new_fd = open(path, O_RDWR | O_NONBLOCK, 0);
+static void *v4l2_mmap(int fd, size_t length, off_t offset) {
+    return mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+}
+
+const struct vid_backend vid_backend_v4l2 = {
+    .name = "v4l2",
+    .prefix = NULL,
+    .open = v4l2_open,
+    .close = close,
+    .ioctl = v4l2_ioctl,
+    .mmap = v4l2_mmap,
+    .revents = NULL,
+    .wait_fd = NULL,
+};
+
+#ifndef TRACE_DISABLED
+/// Name of the traced ioctls.
+static const char *vid_ioctl_name(unsigned long request) {
+    switch (request) {
+    case VIDIOC_QUERYCAP: return "VIDIOC_QUERYCAP";
+    case VIDIOC_STREAMON: return "VIDIOC_STREAMON";
+    case VIDIOC_STREAMOFF: return "VIDIOC_STREAMOFF";
+    case VIDIOC_G_SELECTION: return "VIDIOC_G_SELECTION";
+    case VIDIOC_S_SELECTION: return "VIDIOC_S_SELECTION";
+    case VIDIOC_ENUM_FMT: return "VIDIOC_ENUM_FMT";
+    case VIDIOC_G_FMT: return "VIDIOC_G_FMT";
+    case VIDIOC_S_FMT: return "VIDIOC_S_FMT";
+    case VIDIOC_G_PARM: return "VIDIOC_G_PARM";
+    case VIDIOC_S_PARM: return "VIDIOC_S_PARM";
+    case VIDIOC_REQBUFS: return "VIDIOC_REQBUFS";
+    case VIDIOC_EXPBUF: return "VIDIOC_EXPBUF";
+    case VIDIOC_QUERYBUF: return "VIDIOC_QUERYBUF";
+    case VIDIOC_QBUF: return "VIDIOC_QBUF";
+    case VIDIOC_DQBUF: return "VIDIOC_DQBUF";
+    case VIDIOC_QUERY_EXT_CTRL: return "VIDIOC_QUERY_EXT_CTRL";
+    case VIDIOC_G_EXT_CTRLS: return "VIDIOC_G_EXT_CTRLS";
+    case VIDIOC_S_EXT_CTRLS: return "VIDIOC_S_EXT_CTRLS";
+    default: return "VIDIOC";
+    }
+}
+#endif
+
+/// Issue an ioctl through the backend owning the file descriptor.
+static inline int vid_ioctl(int fd, unsigned long request, void *arg) {
+    TRACE_BEGIN(span, "ioctl", vid_ioctl_name(request), fd);
+    int ret = vid_backend_of(fd)->ioctl(fd, request, arg);
+    TRACE_END(span);
+    return ret;
+}
+
+///
+/// MISC FUNCTION FOR VIDEO DEVICE
+///
+
+enum vid_result vid_open(int *fd, const char *path) {
+
+    const struct vid_backend *backend = &vid_backend_v4l2;
+    for (unsigned i = 0; i < sizeof(vid_backends) / sizeof(vid_backends[0]); i++) {
+        size_t prefix_len = strlen(vid_backends[i]->prefix);
+        if (strncmp(path, vid_backends[i]->prefix, prefix_len) == 0) {
+            backend = vid_backends[i];
+            path += prefix_len;
+            break;
+        }
+    }
+
+    int new_fd = backend->open(path);
     if (new_fd == -1)
-        return VID_ERR_SYS;
+        return errno == ENODEV ? VID_ERR_NO_VIDEO : VID_ERR_SYS;
+
+    if (backend != &vid_backend_v4l2) {
+        if (new_fd >= VID_MAX_FD) {
+            backend->close(new_fd);
+            errno = EMFILE;
+            return VID_ERR_SYS;
+        }
+        vid_backends_by_fd[new_fd] = backend;
+    }
 
     struct v4l2_capability cap;
-    if (RETRY_INT(ioctl(new_fd, VIDIOC_QUERYCAP, &cap)) == -1)
+    if (RETRY_INT(vid_ioctl(new_fd, VIDIOC_QUERYCAP, &cap)) == -1) {
+        vid_close(new_fd);
         return VID_ERR_NO_VIDEO;
+    }
     
-    if (!(cap.capabilities & V4L2_CAP_STREAMING))
+    if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
+        vid_close(new_fd);
         return VID_ERR_NO_STREAMING;
+    }
 
     *fd = new_fd;
     return VID_OK;
 
 }
 
+enum vid_result vid_close(int fd) {
+    const struct vid_backend *backend = vid_backend_of(fd);
+    if (fd >= 0 && fd < VID_MAX_FD)
+        vid_backends_by_fd[fd] = NULL;
+    if (backend->close(fd) == -1)
+        return VID_ERR_SYS;
+    return VID_OK;
+}
+
+enum vid_result vid_mmap(int fd, unsigned length, unsigned offset, void **start) {
+    void *ptr = vid_backend_of(fd)->mmap(fd, length, offset);
+    if (ptr == MAP_FAILED)
+        return VID_ERR_SYS;
+    *start = ptr;
+    return VID_OK;
+}
+
+int vid_poll(struct pollfd *fds, nfds_t count, int timeout) {
+
+    struct pollfd sys_fds[count];
+    for (;;) {
+
+        // Devices emulated in userspace may already have pending events, in such
+        // case we don't want to wait on the kernel for other file descriptors.
+        bool pending = false;
+        for (nfds_t i = 0; i < count; i++) {
+            const struct vid_backend *backend = vid_backend_of(fds[i].fd);
+            sys_fds[i] = fds[i];
+            if (backend->revents) {
+                if (backend->revents(fds[i].fd, fds[i].events))
+                    pending = true;
+                if (backend->wait_fd)
+                    sys_fds[i].fd = backend->wait_fd(fds[i].fd, fds[i].events);
+                sys_fds[i].events = POLLIN;
+            }
+        }
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        TRACE_BEGIN(span, "poll", "poll", -1);
+        int sys_ret = poll(sys_fds, count, pending ? 0 : timeout);
+        TRACE_END(span);
+        if (sys_ret == -1)
+            return -1;
+
+        int ret = 0;
+        for (nfds_t i = 0; i < count; i++) {
+            const struct vid_backend *backend = vid_backend_of(fds[i].fd);
+            if (backend->revents) {
+                fds[i].revents = backend->revents(fds[i].fd, fds[i].events);
+            } else {
+                fds[i].revents = sys_fds[i].revents;
+            }
+            if (fds[i].revents)
+                ret++;
+        }
+
+        if (ret || (!pending && !sys_ret))
+            return ret;
+
+        // Pending events may have been consumed by another thread meanwhile, or
+        // the emulated device was woken for events that were not requested.
+        if (timeout > 0 && !pending) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            timeout = elapsed >= timeout ? 0 : timeout - elapsed;
+        }
+
+    }
+
+}
+
+/// Get the events to wait on the device file descriptor, with poll or epoll, in
+/// order to be notified of the requested device events.
+short vid_wait_events(int fd, short events) {
+    return vid_backend_of(fd)->revents ? POLLIN : events;
+}
+
+/// Get the pending events of a device after it has been drained following an
+/// epoll notification. Devices emulated in userspace are re-armed by this call,
+/// kernel devices always return zero because the kernel notifies them.
+short vid_pending_events(int fd, short events) {
+    const struct vid_backend *backend = vid_backend_of(fd);
+    return backend->revents ? backend->revents(fd, events) : 0;
+}
+
 enum vid_result vid_query_capability(int fd, struct v4l2_capability *dst) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_QUERYCAP, dst)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_QUERYCAP, dst)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_stream_on(int fd, enum v4l2_buf_type type) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_STREAMON, &type)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_STREAMON, &type)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_stream_off(int fd, enum v4l2_buf_type type) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_STREAMOFF, &type)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_STREAMOFF, &type)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
@@ -65,13 +267,13 @@ enum vid_result vid_stream_off(int fd, enum v4l2_buf_type type) {
 ///
 
 enum vid_result vid_get_selection(int fd, struct v4l2_selection *sel) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_G_SELECTION, sel)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_G_SELECTION, sel)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_set_selection(int fd, struct v4l2_selection *sel) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_S_SELECTION, sel)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_S_SELECTION, sel)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
@@ -81,19 +283,19 @@ enum vid_result vid_set_selection(int fd, struct v4l2_selection *sel) {
 ///
 
 enum vid_result vid_enum_format(int fd, struct v4l2_fmtdesc *dst) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_ENUM_FMT, dst)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_ENUM_FMT, dst)) == -1)
         return VID_ERR_STOP;
     return VID_OK;
 }
 
 enum vid_result vid_get_format(int fd, struct v4l2_format *dst) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_G_FMT, dst)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_G_FMT, dst)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_set_format(int fd, struct v4l2_format *src) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_S_FMT, src)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_S_FMT, src)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
@@ -103,13 +305,13 @@ enum vid_result vid_set_format(int fd, struct v4l2_format *src) {
 ///
 
 enum vid_result vid_get_param(int fd, struct v4l2_streamparm *param) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_G_PARM, param)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_G_PARM, param)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_set_param(int fd, struct v4l2_streamparm *param) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_S_PARM, param)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_S_PARM, param)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
@@ -119,25 +321,25 @@ enum vid_result vid_set_param(int fd, struct v4l2_streamparm *param) {
 ///
 
 enum vid_result vid_request_buffers(int fd, struct v4l2_requestbuffers *req) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_REQBUFS, req)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_REQBUFS, req)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_export_buffer(int fd, struct v4l2_exportbuffer *exp) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_EXPBUF, exp)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_EXPBUF, exp)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_query_buffer(int fd, struct v4l2_buffer *buf) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_QUERYBUF, buf)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_QUERYBUF, buf)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_queue_buffer(int fd, struct v4l2_buffer *buf) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_QBUF, buf)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_QBUF, buf)) == -1)
         return VID_ERR_SYS;
     if (buf->flags & V4L2_BUF_FLAG_ERROR)
         return VID_ERR_NEGOCIATION;
@@ -145,15 +347,15 @@ enum vid_result vid_queue_buffer(int fd, struct v4l2_buffer *buf) {
 }
 
 enum vid_result vid_unqueue_buffer(int fd, struct v4l2_buffer *buf) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_DQBUF, buf)) == -1) {
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_DQBUF, buf)) == -1) {
         if (errno == EAGAIN) {
             return VID_ERR_RETRY;
         } else {
             return VID_ERR_SYS;
         }
     }
-    if (buf->flags & V4L2_BUF_FLAG_ERROR)
-        return VID_ERR_NEGOCIATION;
+    // A buffer with V4L2_BUF_FLAG_ERROR is still dequeued, the caller queues it
+    // back (see 'pool_requeue_error').
     return VID_OK;
 }
 
@@ -162,19 +364,19 @@ enum vid_result vid_unqueue_buffer(int fd, struct v4l2_buffer *buf) {
 ///
 
 enum vid_result vid_query_control(int fd, struct v4l2_query_ext_ctrl *query) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_QUERY_EXT_CTRL, query)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_QUERY_EXT_CTRL, query)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_get_control(int fd, struct v4l2_ext_controls *ctrl) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_G_EXT_CTRLS, ctrl)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_G_EXT_CTRLS, ctrl)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
 
 enum vid_result vid_set_control(int fd, struct v4l2_ext_controls *ctrl) {
-    if (RETRY_INT(ioctl(fd, VIDIOC_S_EXT_CTRLS, ctrl)) == -1)
+    if (RETRY_INT(vid_ioctl(fd, VIDIOC_S_EXT_CTRLS, ctrl)) == -1)
         return VID_ERR_SYS;
     return VID_OK;
 }
@@ -1,5 +1,10 @@
 /// A Video4Linux2 abstraction layer to ease pipelining.
 /// This abstraction is specialized for streaming MMAP and DMABUF.
+/// Devices are opened through a backend chosen from their path, see 'backend.h'.
+
+#pragma once
+
+#include <poll.h>
 
 #include <linux/videodev2.h>
 #include <linux/v4l2-controls.h>
@@ -15,6 +20,11 @@ enum vid_result {
 };
 
 enum vid_result vid_open(int *fd, const char *path);
+enum vid_result vid_close(int fd);
+enum vid_result vid_mmap(int fd, unsigned length, unsigned offset, void **start);
+int vid_poll(struct pollfd *fds, nfds_t count, int timeout);
+short vid_wait_events(int fd, short events);
+short vid_pending_events(int fd, short events);
 enum vid_result vid_query_capability(int fd, struct v4l2_capability *dst);
 enum vid_result vid_stream_on(int fd, enum v4l2_buf_type type);
 enum vid_result vid_stream_off(int fd, enum v4l2_buf_type type);
@@ -40,7 +50,7 @@ enum vid_result vid_get_control(int fd, struct v4l2_ext_controls *ctrl);
 enum vid_result vid_set_control(int fd, struct v4l2_ext_controls *ctrl);
 
 // SHORTCUT FOR SELECTION //
-static enum vid_result vid_get_checked_selection(int fd, enum v4l2_buf_type type, unsigned target, struct v4l2_rect *rect) {
+static inline enum vid_result vid_get_checked_selection(int fd, enum v4l2_buf_type type, unsigned target, struct v4l2_rect *rect) {
     
     struct v4l2_selection sel = {0};
     sel.type = type;
@@ -55,7 +65,7 @@ static enum vid_result vid_get_checked_selection(int fd, enum v4l2_buf_type type
      
 }
 
-static enum vid_result vid_set_checked_selection(int fd, enum v4l2_buf_type type, unsigned target, unsigned flags, struct v4l2_rect rect) {
+static inline enum vid_result vid_set_checked_selection(int fd, enum v4l2_buf_type type, unsigned target, unsigned flags, struct v4l2_rect rect) {
     
     struct v4l2_selection sel = {0};
     sel.type = type;
@@ -74,7 +84,7 @@ static enum vid_result vid_set_checked_selection(int fd, enum v4l2_buf_type type
 }
 
 // SHORTCUT FOR FORMATS //
-static enum vid_result vid_set_checked_format(int fd, enum v4l2_buf_type type, unsigned width, unsigned height, unsigned pixelformat) {
+static inline enum vid_result vid_set_checked_format(int fd, enum v4l2_buf_type type, unsigned width, unsigned height, unsigned pixelformat) {
     
     struct v4l2_format fmt = {0};
     fmt.type = type;
@@ -93,7 +103,7 @@ static enum vid_result vid_set_checked_format(int fd, enum v4l2_buf_type type, u
 
 }
 
-static enum vid_result vid_set_checked_format_mp(int fd, enum v4l2_buf_type type, unsigned width, unsigned height, unsigned pixelformat, unsigned planes) {
+static inline enum vid_result vid_set_checked_format_mp(int fd, enum v4l2_buf_type type, unsigned width, unsigned height, unsigned pixelformat, unsigned planes) {
     
     struct v4l2_format fmt = {0};
     fmt.type = type;
@@ -114,7 +124,7 @@ static enum vid_result vid_set_checked_format_mp(int fd, enum v4l2_buf_type type
 }
 
 // SHORTCUT FOR REQUEST BUFFERS //
-static enum vid_result vid_request_checked_buffers(int fd, enum v4l2_buf_type type, enum v4l2_memory memory, unsigned count) {
+static inline enum vid_result vid_request_checked_buffers(int fd, enum v4l2_buf_type type, enum v4l2_memory memory, unsigned count) {
 
     struct v4l2_requestbuffers req = {0};
     req.type = type;
@@ -138,7 +148,7 @@ static inline enum vid_result vid_request_dma_buffers(int fd, enum v4l2_buf_type
     return vid_request_checked_buffers(fd, type, V4L2_MEMORY_DMABUF, count);
 }
 
-static enum vid_result vid_export_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned index, int *dmabuf_fd) {
+static inline enum vid_result vid_export_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned index, int *dmabuf_fd) {
 
     struct v4l2_exportbuffer exp = {0};
     exp.type = type;
@@ -153,7 +163,7 @@ static enum vid_result vid_export_mmap_buffer(int fd, enum v4l2_buf_type type, u
 
 }
 
-static enum vid_result vid_export_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned plane, int *dmabuf_fd) {
+static inline enum vid_result vid_export_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned plane, int *dmabuf_fd) {
 
     struct v4l2_exportbuffer exp = {0};
     exp.type = type;
@@ -170,7 +180,7 @@ static enum vid_result vid_export_mmap_buffer_mp(int fd, enum v4l2_buf_type type
 }
 
 // SHORTCUT FOR QUERY BUFFER (only for MMAP) //
-static enum vid_result vid_query_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned index, unsigned *length, unsigned *offset) {
+static inline enum vid_result vid_query_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned index, unsigned *length, unsigned *offset) {
     
     struct v4l2_buffer buf = {0};
     buf.type = type;
@@ -187,12 +197,13 @@ static enum vid_result vid_query_mmap_buffer(int fd, enum v4l2_buf_type type, un
 
 }
 
-static enum vid_result vid_query_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned planes_count, unsigned *planes_length, unsigned *planes_offset) {
+static inline enum vid_result vid_query_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned planes_count, unsigned *planes_length, unsigned *planes_offset) {
     
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
     struct v4l2_buffer buf = {0};
     buf.type = type;
     buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
     buf.m.planes = planes;
     buf.length = planes_count;
 
@@ -209,7 +220,7 @@ static enum vid_result vid_query_mmap_buffer_mp(int fd, enum v4l2_buf_type type,
 }
 
 // SHORTCUT FOR QUEUE/DEQUEUE MMAP BUFFER //
-static enum vid_result vid_queue_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned index) {
+static inline enum vid_result vid_queue_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned index) {
     struct v4l2_buffer buf = {0};
     buf.type = type;
     buf.memory = V4L2_MEMORY_MMAP;
@@ -217,7 +228,7 @@ static enum vid_result vid_queue_mmap_buffer(int fd, enum v4l2_buf_type type, un
     return vid_queue_buffer(fd, &buf);
 }
 
-static enum vid_result vid_queue_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned planes_count) {
+static inline enum vid_result vid_queue_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned planes_count) {
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
     struct v4l2_buffer buf = {0};
     buf.type = type;
@@ -228,7 +239,7 @@ static enum vid_result vid_queue_mmap_buffer_mp(int fd, enum v4l2_buf_type type,
     return vid_queue_buffer(fd, &buf);
 }
 
-static enum vid_result vid_unqueue_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned *index, unsigned *size) {
+static inline enum vid_result vid_unqueue_mmap_buffer(int fd, enum v4l2_buf_type type, unsigned *index, unsigned *size) {
     
     struct v4l2_buffer buf = {0};
     buf.type = type;
@@ -244,7 +255,7 @@ static enum vid_result vid_unqueue_mmap_buffer(int fd, enum v4l2_buf_type type,
 
 }
 
-static enum vid_result vid_unqueue_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned *index, unsigned planes_count, unsigned *planes_size) {
+static inline enum vid_result vid_unqueue_mmap_buffer_mp(int fd, enum v4l2_buf_type type, unsigned *index, unsigned planes_count, unsigned *planes_size) {
     
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
     struct v4l2_buffer buf = {0};
@@ -267,7 +278,7 @@ static enum vid_result vid_unqueue_mmap_buffer_mp(int fd, enum v4l2_buf_type typ
 }
 
 // SHORTCUT FOR QUEUE/DEQUEUE MMAP BUFFER //
-static enum vid_result vid_queue_dma_buffer(int fd, enum v4l2_buf_type type, unsigned index, int dmabuf_fd) {
+static inline enum vid_result vid_queue_dma_buffer(int fd, enum v4l2_buf_type type, unsigned index, int dmabuf_fd) {
     struct v4l2_buffer buf = {0};
     buf.type = type;
     buf.memory = V4L2_MEMORY_DMABUF;
@@ -276,7 +287,7 @@ static enum vid_result vid_queue_dma_buffer(int fd, enum v4l2_buf_type type, uns
     return vid_queue_buffer(fd, &buf);
 }
 
-static enum vid_result vid_queue_dma_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned planes_count, int *planes_dmabuf_fd) {
+static inline enum vid_result vid_queue_dma_buffer_mp(int fd, enum v4l2_buf_type type, unsigned index, unsigned planes_count, int *planes_dmabuf_fd) {
     
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
     for (unsigned i = 0; i < planes_count; i++) {
@@ -294,7 +305,7 @@ static enum vid_result vid_queue_dma_buffer_mp(int fd, enum v4l2_buf_type type,
 
 }
 
-static enum vid_result vid_unqueue_dma_buffer(int fd, enum v4l2_buf_type type, unsigned *index, unsigned *size, int *dmabuf_fd) {
+static inline enum vid_result vid_unqueue_dma_buffer(int fd, enum v4l2_buf_type type, unsigned *index, unsigned *size, int *dmabuf_fd) {
     
     struct v4l2_buffer buf = {0};
     buf.type = type;
@@ -311,7 +322,7 @@ static enum vid_result vid_unqueue_dma_buffer(int fd, enum v4l2_buf_type type, u
 
 }
 
-static enum vid_result vid_unqueue_dma_buffer_mp(int fd, enum v4l2_buf_type type, unsigned *index, unsigned planes_count, unsigned *planes_size, unsigned *planes_dmabuf_fd) {
+static inline enum vid_result vid_unqueue_dma_buffer_mp(int fd, enum v4l2_buf_type type, unsigned *index, unsigned planes_count, unsigned *planes_size, unsigned *planes_dmabuf_fd) {
     
     struct v4l2_plane planes[VIDEO_MAX_PLANES] = {0};
     struct v4l2_buffer buf = {0};
@@ -1,12 +1,18 @@
 #!/bin/bash
 
-export GST_PLUGIN_PATH=/home/theo/libcamera/build/src/gstreamer
+# The transport stream is muxed and served by the client itself (see 'src/tssink.h').
+./main -n 1000000 -Y tcp:5000
+
+# RTSP players are served the same way (see 'src/rtsp.h').
+# ./main -n 1000000 -V rtsp:8554
+
+# export GST_PLUGIN_PATH=/home/theo/libcamera/build/src/gstreamer
 # export LIBCAMERA_LOG_LEVELS=*:DEBUG
 
-gst-launch-1.0 libcamerasrc ! \
-     video/x-raw,colorimetry=bt709,format=NV12,width=1280,height=720,framerate=10/1 ! \
-     x264enc key-int-max=12 byte-stream=true ! mpegtsmux ! \
-     tcpserversink host=0.0.0.0 port=5000
+# gst-launch-1.0 libcamerasrc ! \
+#      video/x-raw,colorimetry=bt709,format=NV12,width=1280,height=720,framerate=10/1 ! \
+#      x264enc key-int-max=12 byte-stream=true ! mpegtsmux ! \
+#      tcpserversink host=0.0.0.0 port=5000
 
 # gst-launch-1.0 v4l2src device=/dev/video0 ! \
 #      x264enc key-int-max=12 byte-stream=true ! mpegtsmux ! \
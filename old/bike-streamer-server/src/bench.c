@@ -0,0 +1,391 @@
+/// Benchmark of the receiver against a local sender using the client packetizer.
+/// Datagrams go through a link emulating the losses of a 4G link with a
+/// Gilbert-Elliott model, and some reordering. The sender keeps a bounded number
+/// of frames in flight, waiting for the answers of the receiver. Each link is run
+/// without and with forward error correction, after a benchmark of the FEC kernels.
+
+#define _GNU_SOURCE
+
+#include "receiver.h"
+#include "link.h"
+#include "packetizer.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+
+
+/// Emulated links, losses and reordering only so that the receiver is the
+/// bottleneck (see 'link.h').
+static const struct link_model models[] = {
+    { "lossless",  0, 1, { { 0, 0, 0, 0, 0.0,   1.0,  0.0,   0.0, 0.0   } } },
+    { "random-1%", 0, 1, { { 0, 0, 0, 0, 0.0,   1.0,  0.01,  0.0, 0.0   } } },
+    { "4g-good",   0, 1, { { 0, 0, 0, 0, 0.002, 0.25, 0.001, 0.4, 0.001 } } },
+    { "4g-poor",   0, 1, { { 0, 0, 0, 0, 0.01,  0.1,  0.005, 0.6, 0.01  } } },
+};
+
+/// Forward error correction configurations run on each link.
+struct fec_config {
+    const char *name;
+    enum fec_scheme scheme;
+    unsigned key_percent;
+    unsigned percent;
+};
+
+static const struct fec_config fec_configs[] = {
+    { "none",     FEC_NONE, 0,  0  },
+    { "xor:34:10", FEC_XOR, 34, 10 },
+    { "rs:30:10", FEC_RS,   30, 10 },
+    { "rs:50:20", FEC_RS,   50, 20 },
+};
+
+struct link_thread {
+    struct link link;
+    atomic_bool stop;
+};
+
+static void *link_main(void *arg) {
+    struct link_thread *lt = arg;
+    link_run(&lt->link, &lt->stop);
+    return NULL;
+}
+
+struct receiver_thread {
+    struct receiver recv;
+    atomic_bool stop;
+};
+
+static void *receiver_main(void *arg) {
+    struct receiver_thread *rt = arg;
+    receiver_run(&rt->recv, &rt->stop);
+    return NULL;
+}
+
+/// Build a synthetic access unit like the encoder's: SPS, PPS and a slice whose
+/// payload contains no start code.
+static size_t bench_frame(uint8_t *data, size_t size, bool idr) {
+    static const uint8_t sps_pps[] = { 0, 0, 0, 1, 0x67, 0x64, 0x00, 0x28, 0xAC, 0, 0, 0, 1, 0x68, 0xEE, 0x3C, 0x80 };
+    size_t len = 0;
+    if (idr) {
+        memcpy(data, sps_pps, sizeof(sps_pps));
+        len = sizeof(sps_pps);
+    }
+    data[len++] = 0;
+    data[len++] = 0;
+    data[len++] = 0;
+    data[len++] = 1;
+    data[len++] = idr ? 0x65 : 0x41;
+    memset(data + len, 0xA5, size - len);
+    return size;
+}
+
+static double bench_elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/// Encode a block of shards into its parity shards.
+static void codec_encode(enum fec_scheme scheme, uint8_t **data, uint8_t **parity, unsigned k, unsigned m, size_t shard_size) {
+    for (unsigned j = 0; j < m; j++) {
+        memset(parity[j], 0, shard_size);
+        for (unsigned i = 0; i < k; i++)
+            fec_mul_add(parity[j], data[i], fec_coef(scheme, j, i), shard_size);
+    }
+}
+
+/// Rebuild the first 'm' data shards of a block, the same way as the reassembly.
+static bool codec_decode(enum fec_scheme scheme, uint8_t **data, uint8_t **parity, uint8_t **syndromes, unsigned k, unsigned m, size_t shard_size) {
+
+    uint8_t matrix[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    for (unsigned a = 0; a < m; a++)
+        for (unsigned b = 0; b < m; b++)
+            matrix[a * m + b] = fec_coef(scheme, a, b);
+    if (!fec_invert(matrix, m))
+        return false;
+
+    for (unsigned a = 0; a < m; a++) {
+        memcpy(syndromes[a], parity[a], shard_size);
+        for (unsigned i = m; i < k; i++)
+            fec_mul_add(syndromes[a], data[i], fec_coef(scheme, a, i), shard_size);
+    }
+
+    for (unsigned b = 0; b < m; b++) {
+        memset(data[b], 0, shard_size);
+        for (unsigned a = 0; a < m; a++)
+            fec_mul_add(data[b], syndromes[a], matrix[b * m + a], shard_size);
+    }
+
+    return true;
+
+}
+
+/// Measure the encoding and decoding throughput of a block with each kernel, in
+/// megabytes of data shards per second, and check the rebuilt shards.
+static void bench_codec(enum fec_scheme scheme, unsigned k, unsigned m, size_t shard_size) {
+
+    uint8_t *data[FEC_MAX_DATA], *parity[FEC_MAX_PARITY], *syndromes[FEC_MAX_PARITY];
+    uint8_t *original = malloc(k * shard_size);
+    for (unsigned i = 0; i < k; i++) {
+        data[i] = malloc(shard_size);
+        for (size_t j = 0; j < shard_size; j++)
+            data[i][j] = original[i * shard_size + j] = (uint8_t) (i * 31 + j * 7 + (j >> 8));
+    }
+    for (unsigned j = 0; j < m; j++) {
+        parity[j] = malloc(shard_size);
+        syndromes[j] = malloc(shard_size);
+    }
+
+    unsigned count;
+    const struct fec_kernel *kernels = fec_kernels(&count);
+    for (unsigned n = 0; n < count; n++) {
+
+        fec_select_kernel(kernels[n].name);
+
+        struct timespec start;
+        unsigned long blocks = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (unsigned i = 0; i < 16; i++, blocks++)
+                codec_encode(scheme, data, parity, k, m, shard_size);
+        } while (bench_elapsed(&start) < 0.2);
+        double encode = blocks * k * shard_size / bench_elapsed(&start) / 1e6;
+
+        bool ok = true;
+        blocks = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            for (unsigned i = 0; i < 16; i++, blocks++)
+                ok &= codec_decode(scheme, data, parity, syndromes, k, m, shard_size);
+        } while (bench_elapsed(&start) < 0.2);
+        double decode = blocks * k * shard_size / bench_elapsed(&start) / 1e6;
+
+        for (unsigned i = 0; i < k; i++)
+            ok &= memcmp(data[i], original + i * shard_size, shard_size) == 0;
+
+        printf("%-8s %-6s %3u+%-3u %10.0f %10.0f %6s\n", kernels[n].name, scheme == FEC_XOR ? "xor" : "rs",
+            k, m, encode, decode, ok ? "ok" : "FAILED");
+
+    }
+
+    // The fastest kernel is used by the link scenarios.
+    fec_select_kernel(kernels[count - 1].name);
+
+    for (unsigned i = 0; i < k; i++)
+        free(data[i]);
+    for (unsigned j = 0; j < m; j++) {
+        free(parity[j]);
+        free(syndromes[j]);
+    }
+    free(original);
+
+}
+
+static void restart_deliver(void *opaque, const struct reasm_frame *frame, bool complete) {
+    (void) frame;
+    if (complete)
+        (*(unsigned long *) opaque)++;
+}
+
+static void restart_push(struct reasm *r, uint32_t number, uint32_t sequence, const struct timespec *now) {
+    uint8_t packet[sizeof(struct packet_header) + 16] = {0};
+    struct packet_header header = {
+        .version = PACKET_VERSION,
+        .flags = PACKET_FLAG_NAL_START | PACKET_FLAG_NAL_END | PACKET_FLAG_FRAME_END,
+        .frame = htonl(number),
+        .sequence = htonl(sequence),
+    };
+    memcpy(packet, &header, sizeof(header));
+    reasm_push(r, packet, sizeof(packet), now);
+}
+
+/// Check that the reassembly follows a sender restarting at frame 0, the window
+/// being flushed once, while packets of frames just delivered are still late.
+static void bench_restart(void) {
+
+    struct reasm_config config = {
+        .window = 32,
+        .max_frame_size = 4096,
+        .max_fragments = 16,
+        .timeout_ms = 30,
+    };
+
+    unsigned long complete = 0;
+    struct reasm r;
+    if (reasm_init(&r, &config, restart_deliver, &complete) == -1) {
+        fprintf(stderr, "error: failed to allocate reassembly\n");
+        exit(1);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (unsigned i = 0; i < 5000; i++)
+        restart_push(&r, i, i, &now);
+    restart_push(&r, 4990, 4990, &now);
+    for (unsigned i = 0; i < 1000; i++)
+        restart_push(&r, i, i, &now);
+
+    bool ok = complete == 6000 && r.late == 1 && r.lost_frames == config.window;
+    printf("\nsender restart: %lu frames complete, %lu late, %lu lost, %s\n", complete, r.late, r.lost_frames, ok ? "ok" : "FAILED");
+    reasm_free(&r);
+
+}
+
+static void run_scenario(const struct link_model *model, const struct fec_config *fec, unsigned frames, unsigned mtu, unsigned inflight) {
+
+    struct reasm_config config = {
+        .window = 32,
+        .max_frame_size = 2 << 20,
+        .max_fragments = 2048,
+        .timeout_ms = 30,
+    };
+
+    struct receiver_thread rt;
+    if (receiver_open(&rt.recv, 0, &config, -1) == -1) {
+        fprintf(stderr, "error: failed to open receiver (%s)\n", strerror(errno));
+        exit(1);
+    }
+    atomic_init(&rt.stop, false);
+
+    struct link_thread lt;
+    if (link_open(&lt.link, model, receiver_port(&rt.recv), 0) == -1) {
+        fprintf(stderr, "error: failed to open link (%s)\n", strerror(errno));
+        exit(1);
+    }
+    atomic_init(&lt.stop, false);
+
+    pthread_t receiver_thread, link_thread;
+    pthread_create(&receiver_thread, NULL, receiver_main, &rt);
+    pthread_create(&link_thread, NULL, link_main, &lt);
+
+    char address[64];
+    snprintf(address, sizeof(address), "127.0.0.1:%u", link_port(&lt.link));
+
+    struct packetizer pkt;
+    packetizer_open(&pkt, address, mtu);
+    if (fec->scheme != FEC_NONE)
+        packetizer_set_fec(&pkt, fec->scheme, fec->key_percent, fec->percent);
+
+    static uint8_t idr_frame[150000], p_frame[40000];
+    bench_frame(idr_frame, sizeof(idr_frame), true);
+    bench_frame(p_frame, sizeof(p_frame), false);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (unsigned i = 0; i < frames; i++) {
+
+        // Bounded frames in flight, lost frames are answered after the timeout.
+        while (pkt.frames - pkt.answers >= inflight) {
+            struct pollfd pfd = { pkt.fd, POLLIN, 0 };
+            if (poll(&pfd, 1, 1000) == 0) {
+                fprintf(stderr, "warn: no answer from receiver, resuming\n");
+                pkt.answers = pkt.frames;
+            }
+            packetizer_read_answers(&pkt);
+        }
+
+        struct timeval timestamp;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timestamp.tv_sec = now.tv_sec;
+        timestamp.tv_usec = now.tv_nsec / 1000;
+
+        bool idr = i % 60 == 0;
+        packetizer_send_frame(&pkt, idr ? idr_frame : p_frame, idr ? sizeof(idr_frame) : sizeof(p_frame), &timestamp, idr);
+
+    }
+
+    // Wait for the last answers.
+    while (pkt.answers < pkt.frames) {
+        struct pollfd pfd = { pkt.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 500) == 0)
+            break;
+        packetizer_read_answers(&pkt);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    atomic_store(&rt.stop, true);
+    atomic_store(&lt.stop, true);
+    pthread_join(receiver_thread, NULL);
+    pthread_join(link_thread, NULL);
+
+    const struct reasm *r = &rt.recv.reasm;
+    unsigned long sent = lt.link.forwarded + lt.link.dropped;
+    printf("%-10s %-9s %10.0f %8.1f %7.2f%% %6lu %6lu %6lu %7.2f %7.1f %7.1f %7.1f %8lu %6.2f\n",
+        model->name, fec->name, r->packets / elapsed, r->bytes * 8 / elapsed / 1e6,
+        sent ? 100.0 * lt.link.dropped / sent : 0, r->complete_frames, r->lost_frames, r->recovered_frames,
+        r->complete_frames ? r->latency_sum / r->complete_frames : 0,
+        reasm_latency_percentile(r, 50), reasm_latency_percentile(r, 99), r->latency_max,
+        rt.recv.batches, rt.recv.batches ? (double) r->packets / rt.recv.batches : 0);
+
+    packetizer_close(&pkt);
+    receiver_close(&rt.recv);
+    link_close(&lt.link);
+
+}
+
+int main(int argc, char **argv) {
+
+    unsigned frames = 3000;
+    unsigned mtu = PACKETIZER_DEFAULT_MTU;
+    unsigned inflight = 8;
+    bool codec_only = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:M:f:c")) != -1) {
+        switch (opt) {
+        case 'n':
+            frames = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            mtu = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            inflight = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            codec_only = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n frames] [-M mtu] [-f frames in flight] [-c]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (mtu < 256 || mtu > 2048 || inflight < 1) {
+        fprintf(stderr, "error: mtu must be between 256 and 2048, and at least one frame in flight\n");
+        exit(1);
+    }
+
+    // Blocks of a full key frame and of a small frame, with shards of a packet.
+    printf("%-8s %-6s %7s %10s %10s %6s\n", "kernel", "fec", "k+m", "enc MB/s", "dec MB/s", "check");
+    bench_codec(FEC_XOR, 10, 1, mtu);
+    bench_codec(FEC_RS, 64, 20, mtu);
+    bench_codec(FEC_RS, 34, 4, mtu);
+    bench_restart();
+    if (codec_only)
+        return 0;
+
+    printf("\n%-10s %-9s %10s %8s %8s %6s %6s %6s %7s %7s %7s %7s %8s %6s\n",
+        "scenario", "fec", "packets/s", "mbit/s", "loss", "frames", "lost", "recov",
+        "avg ms", "p50 ms", "p99 ms", "max ms", "batches", "batch");
+
+    for (unsigned i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+        for (unsigned j = 0; j < sizeof(fec_configs) / sizeof(fec_configs[0]); j++)
+            run_scenario(&models[i], &fec_configs[j], frames, mtu, inflight);
+
+    return 0;
+
+}
@@ -0,0 +1,413 @@
+#define _GNU_SOURCE
+
+#include "link.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+
+/// Largest datagram relayed, larger ones are dropped.
+#define LINK_DATAGRAM 2048
+
+/// Datagrams received or sent by one call.
+#define LINK_BATCH 64
+
+/// Datagrams delayed at the same time, more are dropped by the queue.
+#define LINK_PENDING 4096
+
+struct link_datagram {
+    uint64_t deliver_ns;
+    /// Order of arrival, delivers datagrams due at the same time in order.
+    uint64_t order;
+    /// Sent to the client if set, otherwise to the receiver.
+    bool answer;
+    unsigned size;
+    uint8_t data[LINK_DATAGRAM];
+};
+
+/// Datagrams being delayed, a min-heap of their slots by delivery time.
+struct link_pending {
+    unsigned count;
+    unsigned free_count;
+    uint64_t order;
+    unsigned heap[LINK_PENDING];
+    unsigned free[LINK_PENDING];
+    struct link_datagram slots[LINK_PENDING];
+    /// Receive buffers and messages of a batch.
+    uint8_t buffers[LINK_BATCH][LINK_DATAGRAM];
+    struct iovec iovs[LINK_BATCH];
+    struct sockaddr_in addrs[LINK_BATCH];
+    struct mmsghdr msgs[LINK_BATCH];
+    struct iovec out_iovs[LINK_BATCH];
+    struct mmsghdr out_msgs[LINK_BATCH];
+    unsigned out_slots[LINK_BATCH];
+};
+
+
+static uint64_t link_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static double link_random(struct link *link) {
+    // xorshift64, seeded by the caller to replay a run.
+    link->rng ^= link->rng << 13;
+    link->rng ^= link->rng >> 7;
+    link->rng ^= link->rng << 17;
+    return (link->rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/// Get the phase of the link at the given time, phases are looped.
+static const struct link_phase *link_phase(const struct link *link, uint64_t now_ns) {
+
+    const struct link_model *model = link->model;
+    unsigned long long total_ms = 0;
+    for (unsigned i = 0; i < model->phase_count; i++) {
+        if (!model->phases[i].duration_ms)
+            break;
+        total_ms += model->phases[i].duration_ms;
+    }
+
+    unsigned long long elapsed_ms = (now_ns - link->start_ns) / 1000000;
+    for (unsigned i = 0; i < model->phase_count; i++) {
+        const struct link_phase *phase = &model->phases[i];
+        if (!phase->duration_ms || elapsed_ms < phase->duration_ms)
+            return phase;
+        elapsed_ms -= phase->duration_ms;
+    }
+
+    // Past the last phase, the trace starts again.
+    elapsed_ms %= total_ms;
+    for (unsigned i = 0; i < model->phase_count; i++) {
+        if (elapsed_ms < model->phases[i].duration_ms)
+            return &model->phases[i];
+        elapsed_ms -= model->phases[i].duration_ms;
+    }
+    return &model->phases[model->phase_count - 1];
+
+}
+
+static bool link_before(const struct link_pending *p, unsigned a, unsigned b) {
+    const struct link_datagram *da = &p->slots[a], *db = &p->slots[b];
+    return da->deliver_ns < db->deliver_ns || (da->deliver_ns == db->deliver_ns && da->order < db->order);
+}
+
+static void link_heap_push(struct link_pending *p, unsigned slot) {
+    unsigned i = p->count++;
+    p->heap[i] = slot;
+    while (i && link_before(p, p->heap[i], p->heap[(i - 1) / 2])) {
+        unsigned parent = (i - 1) / 2;
+        p->heap[i] = p->heap[parent];
+        p->heap[parent] = slot;
+        i = parent;
+    }
+}
+
+static unsigned link_heap_pop(struct link_pending *p) {
+    unsigned top = p->heap[0];
+    unsigned slot = p->heap[--p->count];
+    unsigned i = 0;
+    for (;;) {
+        unsigned child = 2 * i + 1;
+        if (child >= p->count)
+            break;
+        if (child + 1 < p->count && link_before(p, p->heap[child + 1], p->heap[child]))
+            child++;
+        if (!link_before(p, p->heap[child], slot))
+            break;
+        p->heap[i] = p->heap[child];
+        i = child;
+    }
+    if (p->count)
+        p->heap[i] = slot;
+    return top;
+}
+
+/// Delay a datagram until the given time, return false if no slot is free.
+static bool link_delay(struct link *link, const uint8_t *data, unsigned size, uint64_t deliver_ns, bool answer) {
+    struct link_pending *p = link->pending;
+    if (!p->free_count)
+        return false;
+    unsigned slot = p->free[--p->free_count];
+    struct link_datagram *dgram = &p->slots[slot];
+    dgram->deliver_ns = deliver_ns;
+    dgram->order = p->order++;
+    dgram->answer = answer;
+    dgram->size = size;
+    memcpy(dgram->data, data, size);
+    link_heap_push(p, slot);
+    return true;
+}
+
+/// Apply the conditions of the link to a datagram of the client.
+static void link_forward(struct link *link, const uint8_t *data, unsigned size, uint64_t now_ns) {
+
+    const struct link_phase *phase = link_phase(link, now_ns);
+
+    if (link->bad)
+        link->bad = link_random(link) >= phase->p_bad_good;
+    else
+        link->bad = link_random(link) < phase->p_good_bad;
+    if (link_random(link) < (link->bad ? phase->loss_bad : phase->loss_good)) {
+        link->dropped++;
+        return;
+    }
+
+    // Serialization behind the datagrams already queued, IP and UDP headers included.
+    uint64_t busy_ns = link->busy_ns > now_ns ? link->busy_ns : now_ns;
+    if (phase->rate_kbps) {
+        if (link->model->queue_ms && busy_ns - now_ns > (uint64_t) link->model->queue_ms * 1000000) {
+            link->queue_dropped++;
+            return;
+        }
+        busy_ns += (uint64_t) (size + 28) * 8 * 1000000 / phase->rate_kbps;
+    }
+
+    uint64_t deliver_ns = busy_ns + (uint64_t) phase->rtt_ms * 500000;
+    if (phase->jitter_ms)
+        deliver_ns += (uint64_t) (link_random(link) * phase->jitter_ms * 1000000);
+
+    // In order datagrams never overtake the previous ones, a reordered one is
+    // held for a millisecond or the jitter, and overtaken.
+    if (link_random(link) < phase->reorder) {
+        deliver_ns += (uint64_t) (phase->jitter_ms ? phase->jitter_ms : 1) * 1000000;
+        link->reordered++;
+    } else {
+        if (deliver_ns < link->last_ns)
+            deliver_ns = link->last_ns;
+        link->last_ns = deliver_ns;
+    }
+
+    if (!link_delay(link, data, size, deliver_ns, false)) {
+        link->queue_dropped++;
+        return;
+    }
+
+    link->busy_ns = busy_ns;
+
+}
+
+/// Send the datagrams due at the given time.
+static void link_deliver(struct link *link, uint64_t now_ns) {
+
+    struct link_pending *p = link->pending;
+
+    while (p->count && p->slots[p->heap[0]].deliver_ns <= now_ns) {
+
+        unsigned count = 0;
+        while (count < LINK_BATCH && p->count && p->slots[p->heap[0]].deliver_ns <= now_ns) {
+            unsigned slot = link_heap_pop(p);
+            struct link_datagram *dgram = &p->slots[slot];
+            p->out_slots[count] = slot;
+            p->out_iovs[count].iov_base = dgram->data;
+            p->out_iovs[count].iov_len = dgram->size;
+            memset(&p->out_msgs[count], 0, sizeof(struct mmsghdr));
+            p->out_msgs[count].msg_hdr.msg_iov = &p->out_iovs[count];
+            p->out_msgs[count].msg_hdr.msg_iovlen = 1;
+            p->out_msgs[count].msg_hdr.msg_name = dgram->answer ? &link->sender : &link->receiver;
+            p->out_msgs[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            count++;
+        }
+
+        // Datagrams that can't be sent are lost, like on the real link.
+        int sent = sendmmsg(link->fd, p->out_msgs, count, MSG_DONTWAIT);
+        for (unsigned i = 0; i < (unsigned) (sent > 0 ? sent : 0); i++) {
+            if (p->slots[p->out_slots[i]].answer)
+                link->answers++;
+            else
+                link->forwarded++;
+        }
+
+        for (unsigned i = 0; i < count; i++)
+            p->free[p->free_count++] = p->out_slots[i];
+
+    }
+
+}
+
+int link_load(struct link_model *model, const char *path) {
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "error: failed to open link trace '%s' (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    model->name = path;
+    model->phase_count = 0;
+
+    char line[256];
+    unsigned line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+
+        line_number++;
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == 0)
+            continue;
+
+        if (model->phase_count == LINK_MAX_PHASES) {
+            fprintf(stderr, "error: link trace '%s' has more than %u phases\n", path, LINK_MAX_PHASES);
+            fclose(file);
+            return -1;
+        }
+
+        struct link_phase *phase = &model->phases[model->phase_count];
+        if (sscanf(start, "%u %u %u %u %lf %lf %lf %lf %lf", &phase->duration_ms, &phase->rate_kbps,
+                &phase->rtt_ms, &phase->jitter_ms, &phase->p_good_bad, &phase->p_bad_good,
+                &phase->loss_good, &phase->loss_bad, &phase->reorder) != 9) {
+            fprintf(stderr, "error: invalid phase at line %u of link trace '%s'\n", line_number, path);
+            fclose(file);
+            return -1;
+        }
+
+        model->phase_count++;
+
+    }
+
+    fclose(file);
+
+    if (!model->phase_count) {
+        fprintf(stderr, "error: link trace '%s' has no phase\n", path);
+        return -1;
+    }
+
+    return 0;
+
+}
+
+int link_open(struct link *link, const struct link_model *model, unsigned receiver_port, uint64_t seed) {
+
+    memset(link, 0, sizeof(struct link));
+    link->fd = -1;
+    link->model = model;
+    link->rng = seed ? seed : 0x9E3779B97F4A7C15ull;
+    link->receiver.sin_family = AF_INET;
+    link->receiver.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    link->receiver.sin_port = htons(receiver_port);
+
+    link->pending = calloc(1, sizeof(struct link_pending));
+    if (!link->pending)
+        return -1;
+
+    struct link_pending *p = link->pending;
+    for (unsigned i = 0; i < LINK_PENDING; i++)
+        p->free[p->free_count++] = LINK_PENDING - 1 - i;
+    for (unsigned i = 0; i < LINK_BATCH; i++) {
+        p->iovs[i].iov_base = p->buffers[i];
+        p->iovs[i].iov_len = LINK_DATAGRAM;
+        p->msgs[i].msg_hdr.msg_iov = &p->iovs[i];
+        p->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    link->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (link->fd == -1) {
+        link_close(link);
+        return -1;
+    }
+
+    int bufsize = 8 << 20;
+    setsockopt(link->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(link->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(link->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        link_close(link);
+        return -1;
+    }
+
+    link->start_ns = link_now();
+    return 0;
+
+}
+
+void link_close(struct link *link) {
+    if (link->fd != -1)
+        close(link->fd);
+    free(link->pending);
+    link->fd = -1;
+    link->pending = NULL;
+}
+
+unsigned link_port(const struct link *link) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(link->fd, (struct sockaddr *) &addr, &len) == -1)
+        return 0;
+    return ntohs(addr.sin_port);
+}
+
+void link_run(struct link *link, atomic_bool *stop) {
+
+    struct link_pending *p = link->pending;
+
+    while (!atomic_load(stop)) {
+
+        // Wake up for the next delivery, or periodically to check the stop flag.
+        uint64_t now_ns = link_now();
+        struct timespec timeout = { 0, 10000000 };
+        if (p->count) {
+            uint64_t next_ns = p->slots[p->heap[0]].deliver_ns;
+            uint64_t wait_ns = next_ns > now_ns ? next_ns - now_ns : 0;
+            if (wait_ns < 10000000)
+                timeout.tv_nsec = wait_ns;
+        }
+
+        struct pollfd pfd = { link->fd, POLLIN, 0 };
+        if (ppoll(&pfd, 1, &timeout, NULL) == -1 && errno != EINTR) {
+            fprintf(stderr, "error: link poll error (%s)\n", strerror(errno));
+            return;
+        }
+
+        for (;;) {
+
+            for (unsigned i = 0; i < LINK_BATCH; i++) {
+                p->msgs[i].msg_hdr.msg_name = &p->addrs[i];
+                p->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+                p->msgs[i].msg_hdr.msg_flags = 0;
+            }
+
+            int count = recvmmsg(link->fd, p->msgs, LINK_BATCH, MSG_DONTWAIT, NULL);
+            if (count <= 0)
+                break;
+
+            now_ns = link_now();
+            for (int i = 0; i < count; i++) {
+
+                if (p->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                    link->dropped++;
+                    continue;
+                }
+
+                // Answers of the receiver go back to the client without loss.
+                if (p->addrs[i].sin_port == link->receiver.sin_port) {
+                    uint64_t rtt_ns = (uint64_t) link_phase(link, now_ns)->rtt_ms * 500000;
+                    link_delay(link, p->buffers[i], p->msgs[i].msg_len, now_ns + rtt_ns, true);
+                    continue;
+                }
+
+                link->sender = p->addrs[i];
+                link_forward(link, p->buffers[i], p->msgs[i].msg_len, now_ns);
+
+            }
+
+            if (count < LINK_BATCH)
+                break;
+
+        }
+
+        link_deliver(link, link_now());
+
+    }
+
+}
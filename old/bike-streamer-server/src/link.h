@@ -0,0 +1,92 @@
+/// Emulator of the mobile link between the client and the receiver, a UDP relay
+/// on the loopback. Datagrams of the client are lost following a Gilbert-Elliott
+/// model, serialized at the bandwidth of the link behind a bounded queue, and
+/// delivered after half the round trip time plus a random jitter, some of them
+/// after the next ones. Answers of the receiver go back after half the round
+/// trip time, without loss.
+///
+/// The conditions of the link follow phases, looped, either built-in or read
+/// from a trace file, and the random generator is seeded so that a run can be
+/// replayed with the same losses and delays.
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/// Maximum number of phases of a link.
+#define LINK_MAX_PHASES 64
+
+/// Conditions of the link during a phase.
+struct link_phase {
+    /// Duration of the phase, zero for the rest of the run.
+    unsigned duration_ms;
+    /// Bandwidth of the link, zero for no limit.
+    unsigned rate_kbps;
+    unsigned rtt_ms;
+    /// Maximum random delay added to each datagram of the client.
+    unsigned jitter_ms;
+    /// Transition probabilities between the good and bad states, per packet.
+    double p_good_bad;
+    double p_bad_good;
+    /// Loss probabilities in each state.
+    double loss_good;
+    double loss_bad;
+    /// Probability that a packet is delivered after the next ones.
+    double reorder;
+};
+
+struct link_model {
+    const char *name;
+    /// Time of queued data after which datagrams are dropped, zero for no limit.
+    unsigned queue_ms;
+    unsigned phase_count;
+    struct link_phase phases[LINK_MAX_PHASES];
+};
+
+/// Datagrams being delayed, see 'link.c'.
+struct link_pending;
+
+struct link {
+    int fd;
+    const struct link_model *model;
+    struct sockaddr_in receiver;
+    /// Address of the client, the sender of the last datagram not from the receiver.
+    struct sockaddr_in sender;
+    struct link_pending *pending;
+    uint64_t rng;
+    bool bad;
+    uint64_t start_ns;
+    /// End of the serialization of the last datagram queued.
+    uint64_t busy_ns;
+    /// Delivery time of the last datagram delivered in order.
+    uint64_t last_ns;
+    unsigned long forwarded;
+    /// Datagrams lost by the loss model, and dropped by the full queue.
+    unsigned long dropped;
+    unsigned long queue_dropped;
+    unsigned long reordered;
+    unsigned long answers;
+};
+
+
+/// Read the phases of a trace file, one per line: duration in milliseconds,
+/// bandwidth in kbit/s, round trip time and jitter in milliseconds, then the
+/// four Gilbert-Elliott probabilities and the reorder probability. Empty lines
+/// and lines starting with '#' are skipped. Return -1 and print the error on
+/// failure.
+int link_load(struct link_model *model, const char *path);
+
+/// Bind the relay on a loopback port forwarding to the receiver, return -1 on failure.
+int link_open(struct link *link, const struct link_model *model, unsigned receiver_port, uint64_t seed);
+void link_close(struct link *link);
+
+/// Get the bound UDP port, the client sends to it.
+unsigned link_port(const struct link *link);
+
+/// Relay until the stop flag is set.
+void link_run(struct link *link, atomic_bool *stop);
@@ -0,0 +1,107 @@
+#include "receiver.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+/// Command line configuration.
+struct config {
+    unsigned port;
+    /// Output file of the reassembled stream, "-" for the standard output.
+    const char *out_path;
+    struct reasm_config reasm;
+};
+
+static atomic_bool stop;
+
+
+static void on_sigint(int sig) {
+    (void) sig;
+    atomic_store(&stop, true);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-p port] [-o output] [-w window] [-t timeout]\n", prog);
+    fprintf(stderr, "  -p  udp port to listen on (5000)\n");
+    fprintf(stderr, "  -o  output file of the reassembled h264 stream, '-' for stdout (out.h264)\n");
+    fprintf(stderr, "  -w  number of frames in the reorder window (32)\n");
+    fprintf(stderr, "  -t  time waited for the missing packets of a frame, in milliseconds (200)\n");
+    exit(1);
+}
+
+static void parse_config(struct config *config, int argc, char **argv) {
+
+    config->port = 5000;
+    config->out_path = "out.h264";
+    config->reasm.window = 32;
+    config->reasm.max_frame_size = 2 << 20;
+    config->reasm.max_fragments = 2048;
+    config->reasm.timeout_ms = 200;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:o:w:t:")) != -1) {
+        switch (opt) {
+        case 'p':
+            config->port = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            config->out_path = optarg;
+            break;
+        case 'w':
+            config->reasm.window = (unsigned) strtoul(optarg, NULL, 10);
+            if (config->reasm.window < 1) {
+                fprintf(stderr, "error: window must hold at least one frame\n");
+                exit(1);
+            }
+            break;
+        case 't':
+            config->reasm.timeout_ms = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+}
+
+
+int main(int argc, char **argv) {
+
+    struct config config;
+    parse_config(&config, argc, argv);
+
+    int out_fd = STDOUT_FILENO;
+    if (strcmp(config.out_path, "-") != 0) {
+        out_fd = open(config.out_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd == -1) {
+            fprintf(stderr, "error: failed to open output file (%s)\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    struct receiver recv;
+    if (receiver_open(&recv, config.port, &config.reasm, out_fd) == -1) {
+        fprintf(stderr, "error: failed to open receiver (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    signal(SIGINT, on_sigint);
+    signal(SIGTERM, on_sigint);
+
+    fprintf(stderr, "info: receiving on udp port %u...\n", receiver_port(&recv));
+    receiver_run(&recv, &stop);
+
+    // Statistics go to stderr when the stream is written to stdout.
+    if (out_fd == STDOUT_FILENO)
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    receiver_report(&recv);
+
+    receiver_close(&recv);
+    return 0;
+
+}
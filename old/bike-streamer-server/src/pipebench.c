@@ -0,0 +1,451 @@
+/// Benchmark of the whole chain: the client runs its pipeline from a synthetic or
+/// replayed source into the UDP sink, through an emulated mobile link (see
+/// 'link.h') into a local receiver. Each scenario reports the sustained frame
+/// rate, the latency from capture to reassembly and the ratio of frames
+/// delivered, as JSON for regression tracking.
+///
+/// The client and the receiver run on the same host, so the capture timestamps
+/// of the client, in CLOCK_MONOTONIC, are compared to the delivery time.
+
+#define _GNU_SOURCE
+
+#include "receiver.h"
+#include "link.h"
+
+#include <sys/wait.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+
+/// Built-in links, from an ideal one to a handover between cells. The synthetic
+/// encoder streams about 10 Mbit/s at 30 fps.
+static const struct link_model models[] = {
+    { "loopback", 0, 1, {
+        { 0, 0, 0, 0, 0.0, 1.0, 0.0, 0.0, 0.0 },
+    } },
+    { "4g-good", 200, 1, {
+        { 0, 20000, 50, 10, 0.002, 0.25, 0.001, 0.4, 0.001 },
+    } },
+    { "4g-poor", 200, 1, {
+        { 0, 8000, 120, 40, 0.01, 0.1, 0.005, 0.6, 0.01 },
+    } },
+    { "4g-handover", 200, 3, {
+        { 4000, 15000, 60, 10, 0.002, 0.25, 0.001, 0.4, 0.001 },
+        { 500, 15000, 60, 10, 0.0, 1.0, 1.0, 1.0, 0.0 },
+        { 3000, 6000, 150, 30, 0.01, 0.1, 0.005, 0.6, 0.01 },
+    } },
+};
+
+/// Maximum number of link traces given on the command line.
+#define PIPEBENCH_MAX_TRACES 16
+
+/// Command line configuration.
+struct config {
+    /// Path of the client executable.
+    const char *client_path;
+    /// Arguments of the client selecting its devices and options.
+    char **client_args;
+    unsigned client_args_count;
+    unsigned frames;
+    uint64_t seed;
+    unsigned queue_ms;
+    /// Output of the JSON report, "-" for the standard output.
+    const char *out_path;
+    /// The output of the client goes to stderr instead of being discarded.
+    bool verbose;
+    struct reasm_config reasm;
+    unsigned trace_count;
+    struct link_model traces[PIPEBENCH_MAX_TRACES];
+};
+
+/// Frames delivered by the receiver during a scenario.
+struct observer {
+    unsigned long complete;
+    unsigned long lost;
+    unsigned long recovered;
+    /// Latency from capture to delivery of complete frames, in milliseconds.
+    double *latencies;
+    unsigned long capacity;
+    struct timespec first;
+    struct timespec last;
+};
+
+struct receiver_thread {
+    struct receiver recv;
+    atomic_bool stop;
+};
+
+struct link_thread {
+    struct link link;
+    atomic_bool stop;
+};
+
+/// Result of a scenario.
+struct result {
+    int client_status;
+    double elapsed;
+    double fps;
+    double delivery_ratio;
+    double latency_avg;
+    double latency_p50;
+    double latency_p90;
+    double latency_p99;
+    double latency_max;
+};
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-x client] [-n frames] [-l trace]... [-q queue] [-r seed] [-t timeout] [-o output] [-v] [-- client arguments]\n", prog);
+    fprintf(stderr, "  -x  client executable (../bike-streamer-client/main)\n");
+    fprintf(stderr, "  -n  number of frames streamed by the client in each scenario (300)\n");
+    fprintf(stderr, "  -l  link trace file replayed as a scenario instead of the built-in links, see 'link.h'\n");
+    fprintf(stderr, "  -q  queue of the traced links, in milliseconds (200)\n");
+    fprintf(stderr, "  -r  seed of the losses and delays of the links (1)\n");
+    fprintf(stderr, "  -t  time waited for the missing packets of a frame, in milliseconds (200)\n");
+    fprintf(stderr, "  -o  output of the JSON report, '-' for stdout (-)\n");
+    fprintf(stderr, "  -v  print the output of the client on stderr\n");
+    fprintf(stderr, "client arguments select its devices and options, '-S' by default, such as:\n");
+    fprintf(stderr, "  %s -- -s replay:sensor:out.raw@30 -e replay:encoder:out.h264 -i synth:isp-output -c synth:isp-capture\n", prog);
+    fprintf(stderr, "  %s -- -S -F rs:30:10 -A 500000:8000000\n", prog);
+    exit(1);
+}
+
+static void parse_config(struct config *config, int argc, char **argv) {
+
+    static char *default_args[] = { "-S" };
+
+    config->client_path = "../bike-streamer-client/main";
+    config->client_args = default_args;
+    config->client_args_count = 1;
+    config->frames = 300;
+    config->seed = 1;
+    config->queue_ms = 200;
+    config->out_path = "-";
+    config->verbose = false;
+    config->reasm.window = 32;
+    config->reasm.max_frame_size = 2 << 20;
+    config->reasm.max_fragments = 2048;
+    config->reasm.timeout_ms = 200;
+    config->trace_count = 0;
+
+    const char *trace_paths[PIPEBENCH_MAX_TRACES];
+
+    int opt;
+    while ((opt = getopt(argc, argv, "x:n:l:q:r:t:o:v")) != -1) {
+        switch (opt) {
+        case 'x':
+            config->client_path = optarg;
+            break;
+        case 'n':
+            config->frames = (unsigned) strtoul(optarg, NULL, 10);
+            if (!config->frames) {
+                fprintf(stderr, "error: at least one frame must be streamed\n");
+                exit(1);
+            }
+            break;
+        case 'l':
+            if (config->trace_count == PIPEBENCH_MAX_TRACES) {
+                fprintf(stderr, "error: at most %u link traces\n", PIPEBENCH_MAX_TRACES);
+                exit(1);
+            }
+            trace_paths[config->trace_count++] = optarg;
+            break;
+        case 'q':
+            config->queue_ms = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            config->seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            config->reasm.timeout_ms = (unsigned) strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            config->out_path = optarg;
+            break;
+        case 'v':
+            config->verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc) {
+        config->client_args = argv + optind;
+        config->client_args_count = argc - optind;
+    }
+
+    // Traces are loaded once the queue is known.
+    for (unsigned i = 0; i < config->trace_count; i++) {
+        if (link_load(&config->traces[i], trace_paths[i]) == -1)
+            exit(1);
+        config->traces[i].queue_ms = config->queue_ms;
+    }
+
+}
+
+static void observe(void *opaque, const struct reasm_frame *frame, bool complete) {
+
+    struct observer *obs = opaque;
+    if (!complete) {
+        obs->lost++;
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!obs->complete)
+        obs->first = now;
+    obs->last = now;
+    obs->complete++;
+    if (frame->recovered)
+        obs->recovered++;
+
+    uint64_t now_us = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    if (obs->complete <= obs->capacity)
+        obs->latencies[obs->complete - 1] = now_us > frame->timestamp ? (now_us - frame->timestamp) / 1e3 : 0;
+
+}
+
+static int compare_double(const void *a, const void *b) {
+    double da = *(const double *) a, db = *(const double *) b;
+    return (da > db) - (da < db);
+}
+
+static double percentile(const double *sorted, unsigned long count, double p) {
+    if (!count)
+        return 0;
+    unsigned long index = (unsigned long) (count * p / 100.0);
+    return sorted[index < count ? index : count - 1];
+}
+
+static double elapsed_between(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *receiver_main(void *arg) {
+    struct receiver_thread *rt = arg;
+    receiver_run(&rt->recv, &rt->stop);
+    return NULL;
+}
+
+static void *link_main(void *arg) {
+    struct link_thread *lt = arg;
+    link_run(&lt->link, &lt->stop);
+    return NULL;
+}
+
+/// Run the client to completion, streaming to the given port, return its exit
+/// status or -1 if it didn't exit normally.
+static int run_client(const struct config *config, unsigned port) {
+
+    char frames[16], address[32];
+    snprintf(frames, sizeof(frames), "%u", config->frames);
+    snprintf(address, sizeof(address), "127.0.0.1:%u", port);
+
+    // Metrics are kept private so that runs don't share the same object.
+    char *argv[config->client_args_count + 8];
+    unsigned argc = 0;
+    argv[argc++] = (char *) config->client_path;
+    argv[argc++] = "-R";
+    argv[argc++] = frames;
+    argv[argc++] = "-U";
+    argv[argc++] = address;
+    argv[argc++] = "-Q";
+    argv[argc++] = "none";
+    for (unsigned i = 0; i < config->client_args_count; i++)
+        argv[argc++] = config->client_args[i];
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        fprintf(stderr, "error: failed to fork the client (%s)\n", strerror(errno));
+        exit(1);
+    }
+
+    if (pid == 0) {
+        int out_fd = config->verbose ? STDERR_FILENO : open("/dev/null", O_WRONLY);
+        dup2(out_fd, STDOUT_FILENO);
+        if (!config->verbose)
+            dup2(out_fd, STDERR_FILENO);
+        execv(config->client_path, argv);
+        fprintf(stderr, "error: failed to run the client '%s' (%s)\n", config->client_path, strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            fprintf(stderr, "error: failed to wait for the client (%s)\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+}
+
+/// Longest time a datagram may spend in the link.
+static unsigned link_max_delay_ms(const struct link_model *model) {
+    unsigned max = 0;
+    for (unsigned i = 0; i < model->phase_count; i++) {
+        const struct link_phase *phase = &model->phases[i];
+        unsigned delay = phase->rtt_ms + 2 * phase->jitter_ms;
+        if (delay > max)
+            max = delay;
+    }
+    return max + model->queue_ms;
+}
+
+static void run_scenario(const struct config *config, const struct link_model *model, struct link *link_stats, struct observer *obs, struct result *res) {
+
+    struct receiver_thread rt;
+    if (receiver_open(&rt.recv, 0, &config->reasm, -1) == -1) {
+        fprintf(stderr, "error: failed to open receiver (%s)\n", strerror(errno));
+        exit(1);
+    }
+    atomic_init(&rt.stop, false);
+
+    memset(obs, 0, sizeof(struct observer));
+    obs->capacity = config->frames;
+    obs->latencies = malloc(obs->capacity * sizeof(double));
+    if (!obs->latencies) {
+        fprintf(stderr, "error: failed to allocate latencies\n");
+        exit(1);
+    }
+    rt.recv.observer = observe;
+    rt.recv.observer_opaque = obs;
+
+    struct link_thread lt;
+    if (link_open(&lt.link, model, receiver_port(&rt.recv), config->seed) == -1) {
+        fprintf(stderr, "error: failed to open link (%s)\n", strerror(errno));
+        exit(1);
+    }
+    atomic_init(&lt.stop, false);
+
+    pthread_t receiver_thread, link_thread;
+    pthread_create(&receiver_thread, NULL, receiver_main, &rt);
+    pthread_create(&link_thread, NULL, link_main, &lt);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res->client_status = run_client(config, link_port(&lt.link));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    res->elapsed = elapsed_between(&start, &end);
+
+    // Datagrams still in the link arrive, then incomplete frames expire.
+    unsigned drain_ms = link_max_delay_ms(model) + 2 * config->reasm.timeout_ms + 100;
+    struct timespec delay = { drain_ms / 1000, (drain_ms % 1000) * 1000000 };
+    nanosleep(&delay, NULL);
+
+    atomic_store(&lt.stop, true);
+    atomic_store(&rt.stop, true);
+    pthread_join(link_thread, NULL);
+    pthread_join(receiver_thread, NULL);
+
+    unsigned long count = obs->complete < obs->capacity ? obs->complete : obs->capacity;
+    qsort(obs->latencies, count, sizeof(double), compare_double);
+
+    double sum = 0;
+    for (unsigned long i = 0; i < count; i++)
+        sum += obs->latencies[i];
+
+    double span = elapsed_between(&obs->first, &obs->last);
+    res->fps = obs->complete > 1 && span > 0 ? (obs->complete - 1) / span : 0;
+    res->delivery_ratio = (double) obs->complete / config->frames;
+    res->latency_avg = count ? sum / count : 0;
+    res->latency_p50 = percentile(obs->latencies, count, 50);
+    res->latency_p90 = percentile(obs->latencies, count, 90);
+    res->latency_p99 = percentile(obs->latencies, count, 99);
+    res->latency_max = count ? obs->latencies[count - 1] : 0;
+
+    *link_stats = lt.link;
+    free(obs->latencies);
+    obs->latencies = NULL;
+
+    receiver_close(&rt.recv);
+    link_close(&lt.link);
+
+}
+
+static void print_json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', out);
+        if ((unsigned char) *str < 0x20)
+            fprintf(out, "\\u%04x", *str);
+        else
+            fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+
+int main(int argc, char **argv) {
+
+    struct config config;
+    parse_config(&config, argc, argv);
+
+    FILE *out = stdout;
+    if (strcmp(config.out_path, "-") != 0) {
+        out = fopen(config.out_path, "w");
+        if (!out) {
+            fprintf(stderr, "error: failed to open output file (%s)\n", strerror(errno));
+            exit(1);
+        }
+    }
+
+    const struct link_model *scenarios = config.trace_count ? config.traces : models;
+    unsigned scenario_count = config.trace_count ? config.trace_count : sizeof(models) / sizeof(models[0]);
+
+    fprintf(out, "{\n  \"frames\": %u,\n  \"seed\": %llu,\n  \"client\": [", config.frames, (unsigned long long) config.seed);
+    for (unsigned i = 0; i < config.client_args_count; i++) {
+        fputs(i ? ", " : "", out);
+        print_json_string(out, config.client_args[i]);
+    }
+    fprintf(out, "],\n  \"scenarios\": [\n");
+
+    // The summary goes to stderr, the report may be on stdout.
+    fprintf(stderr, "%-20s %6s %7s %6s %6s %6s %8s %8s %8s %8s %7s %7s\n",
+        "scenario", "status", "fps", "ratio", "lost", "recov", "avg ms", "p50 ms", "p90 ms", "p99 ms", "dropped", "queue");
+
+    for (unsigned i = 0; i < scenario_count; i++) {
+
+        struct link link;
+        struct observer obs;
+        struct result res;
+        run_scenario(&config, &scenarios[i], &link, &obs, &res);
+
+        fprintf(stderr, "%-20s %6d %7.2f %6.3f %6lu %6lu %8.1f %8.1f %8.1f %8.1f %7lu %7lu\n",
+            scenarios[i].name, res.client_status, res.fps, res.delivery_ratio, obs.lost, obs.recovered,
+            res.latency_avg, res.latency_p50, res.latency_p90, res.latency_p99, link.dropped, link.queue_dropped);
+
+        fprintf(out, "    {\n      \"name\": ");
+        print_json_string(out, scenarios[i].name);
+        fprintf(out, ",\n      \"client_status\": %d,\n      \"elapsed_s\": %.3f,\n      \"fps\": %.3f,\n      \"delivery_ratio\": %.4f,\n",
+            res.client_status, res.elapsed, res.fps, res.delivery_ratio);
+        fprintf(out, "      \"frames\": { \"complete\": %lu, \"lost\": %lu, \"recovered\": %lu },\n",
+            obs.complete, obs.lost, obs.recovered);
+        fprintf(out, "      \"latency_ms\": { \"avg\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f },\n",
+            res.latency_avg, res.latency_p50, res.latency_p90, res.latency_p99, res.latency_max);
+        fprintf(out, "      \"link\": { \"forwarded\": %lu, \"dropped\": %lu, \"queue_dropped\": %lu, \"reordered\": %lu, \"answers\": %lu }\n",
+            link.forwarded, link.dropped, link.queue_dropped, link.reordered, link.answers);
+        fprintf(out, "    }%s\n", i + 1 < scenario_count ? "," : "");
+
+    }
+
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+
+}
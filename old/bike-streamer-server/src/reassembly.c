@@ -0,0 +1,428 @@
+#include "reassembly.h"
+
+#include <arpa/inet.h>
+
+#include <endian.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+
+static double reasm_elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+int reasm_init(struct reasm *r, const struct reasm_config *config, reasm_deliver_fn deliver, void *opaque) {
+
+    memset(r, 0, sizeof(struct reasm));
+    r->config = *config;
+    r->deliver = deliver;
+    r->opaque = opaque;
+
+    fec_init();
+    r->frames = calloc(config->window, sizeof(struct reasm_frame));
+    r->fec_syndromes = malloc(FEC_MAX_PARITY * FEC_MAX_SHARD);
+    r->fec_shards = malloc(FEC_MAX_PARITY * FEC_MAX_SHARD);
+    if (!r->frames || !r->fec_syndromes || !r->fec_shards) {
+        reasm_free(r);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < config->window; i++) {
+        struct reasm_frame *frame = &r->frames[i];
+        frame->data = malloc(config->max_frame_size);
+        frame->fragments = calloc(config->max_fragments, sizeof(struct reasm_fragment));
+        frame->parity = calloc(config->max_fragments, sizeof(struct reasm_parity));
+        frame->iov = calloc(config->max_fragments, sizeof(struct iovec));
+        if (!frame->data || !frame->fragments || !frame->parity || !frame->iov) {
+            reasm_free(r);
+            return -1;
+        }
+    }
+
+    return 0;
+
+}
+
+void reasm_free(struct reasm *r) {
+    if (r->frames) {
+        for (unsigned i = 0; i < r->config.window; i++) {
+            free(r->frames[i].data);
+            free(r->frames[i].fragments);
+            free(r->frames[i].parity);
+            free(r->frames[i].iov);
+        }
+    }
+    free(r->frames);
+    free(r->fec_syndromes);
+    free(r->fec_shards);
+    r->frames = NULL;
+    r->fec_syndromes = NULL;
+    r->fec_shards = NULL;
+}
+
+static bool reasm_complete(const struct reasm_frame *frame) {
+    return frame->active && !frame->overflow && frame->last_fragment >= 0 && frame->received == (unsigned) frame->last_fragment + 1;
+}
+
+/// Deliver the next frame, complete or not, and advance the window.
+static void reasm_deliver_next(struct reasm *r, const struct timespec *now) {
+
+    struct reasm_frame *frame = &r->frames[r->next % r->config.window];
+    bool complete = reasm_complete(frame);
+
+    if (!frame->active) {
+        // No packet was received, the frame is reported with its number only.
+        frame->frame = r->next;
+        frame->received = 0;
+        frame->timestamp = 0;
+        frame->size = 0;
+    }
+
+    if (complete) {
+        frame->iov_count = frame->last_fragment + 1;
+        for (unsigned i = 0; i < frame->iov_count; i++) {
+            frame->iov[i].iov_base = frame->data + frame->fragments[i].offset;
+            frame->iov[i].iov_len = frame->fragments[i].size;
+        }
+        double latency = reasm_elapsed_ms(&frame->first_arrival, now);
+        r->latency_sum += latency;
+        if (latency > r->latency_max)
+            r->latency_max = latency;
+        unsigned bucket = latency * 10;
+        r->latency_hist[bucket < REASM_LATENCY_BUCKETS ? bucket : REASM_LATENCY_BUCKETS - 1]++;
+        r->complete_frames++;
+        if (frame->recovered)
+            r->recovered_frames++;
+    } else {
+        frame->iov_count = 0;
+        r->lost_frames++;
+    }
+
+    r->deliver(r->opaque, frame, complete);
+
+    if (frame->active) {
+        for (unsigned i = 0; i < frame->fragments_used; i++)
+            frame->fragments[i].present = false;
+        frame->active = false;
+    }
+
+    r->next++;
+
+}
+
+/// Store a data packet in the frame, return false if it is a duplicate.
+static bool reasm_store(struct reasm *r, struct reasm_frame *frame, unsigned fragment, uint8_t flags, const uint8_t *payload, size_t size) {
+
+    struct reasm_fragment *frag = &frame->fragments[fragment];
+    if (frag->present) {
+        r->duplicates++;
+        return false;
+    }
+
+    memcpy(frame->data + frame->size, payload, size);
+    frag->offset = frame->size;
+    frag->size = size;
+    frag->flags = flags;
+    frag->present = true;
+    frame->size += size;
+    frame->received++;
+    if (fragment >= frame->fragments_used)
+        frame->fragments_used = fragment + 1;
+
+    if (flags & PACKET_FLAG_FRAME_END)
+        frame->last_fragment = fragment;
+
+    return true;
+
+}
+
+/// Rebuild the missing data packets of a block when enough of its shards have
+/// been received. Parity shards are first reduced by the known data shards into
+/// syndromes of the missing ones, then the square system of the missing shards
+/// is inverted and applied to the syndromes.
+static void reasm_recover(struct reasm *r, struct reasm_frame *frame, unsigned block_start) {
+
+    const struct reasm_parity *parity[FEC_MAX_PARITY];
+    unsigned parity_count = 0;
+    for (unsigned i = 0; i < frame->parity_count && parity_count < FEC_MAX_PARITY; i++) {
+        const struct reasm_parity *other = &frame->parity[i];
+        if (other->block_start != block_start)
+            continue;
+        // Shards of a block are read with the layout of the first one, a parity
+        // packet that disagrees would be read past its end.
+        if (parity_count && (other->shard_size != parity[0]->shard_size || other->k != parity[0]->k || other->scheme != parity[0]->scheme)) {
+            r->malformed++;
+            continue;
+        }
+        parity[parity_count++] = other;
+    }
+    if (!parity_count)
+        return;
+
+    const unsigned k = parity[0]->k;
+    const unsigned shard_size = parity[0]->shard_size;
+    const enum fec_scheme scheme = parity[0]->scheme;
+    if (block_start + k > r->config.max_fragments)
+        return;
+
+    unsigned missing[FEC_MAX_PARITY];
+    unsigned missing_count = 0;
+    for (unsigned i = 0; i < k; i++) {
+        if (!frame->fragments[block_start + i].present) {
+            if (missing_count == parity_count)
+                return;
+            missing[missing_count++] = i;
+        }
+    }
+    if (!missing_count)
+        return;
+
+    uint8_t matrix[FEC_MAX_PARITY * FEC_MAX_PARITY];
+    for (unsigned a = 0; a < missing_count; a++)
+        for (unsigned b = 0; b < missing_count; b++)
+            matrix[a * missing_count + b] = fec_coef(scheme, parity[a]->index, missing[b]);
+    if (!fec_invert(matrix, missing_count)) {
+        r->malformed++;
+        return;
+    }
+
+    for (unsigned a = 0; a < missing_count; a++) {
+        uint8_t *syndrome = r->fec_syndromes + a * FEC_MAX_SHARD;
+        memcpy(syndrome, frame->data + parity[a]->offset, shard_size);
+        for (unsigned i = 0; i < k; i++) {
+            const struct reasm_fragment *frag = &frame->fragments[block_start + i];
+            if (!frag->present)
+                continue;
+            // Shards of the block have the same size, with zero padding.
+            if (frag->size > shard_size - FEC_SHARD_PREFIX) {
+                r->malformed++;
+                return;
+            }
+            uint8_t c = fec_coef(scheme, parity[a]->index, i);
+            uint8_t prefix[FEC_SHARD_PREFIX] = { frag->flags, frag->size >> 8, frag->size & 0xFF };
+            fec_mul_add(syndrome, prefix, c, FEC_SHARD_PREFIX);
+            fec_mul_add(syndrome + FEC_SHARD_PREFIX, frame->data + frag->offset, c, frag->size);
+        }
+    }
+
+    for (unsigned b = 0; b < missing_count; b++) {
+
+        uint8_t *shard = r->fec_shards + b * FEC_MAX_SHARD;
+        memset(shard, 0, shard_size);
+        for (unsigned a = 0; a < missing_count; a++)
+            fec_mul_add(shard, r->fec_syndromes + a * FEC_MAX_SHARD, matrix[b * missing_count + a], shard_size);
+
+        size_t size = (shard[1] << 8) | shard[2];
+        if (FEC_SHARD_PREFIX + size > shard_size || frame->size + size > r->config.max_frame_size) {
+            r->malformed++;
+            continue;
+        }
+
+        if (reasm_store(r, frame, block_start + missing[b], shard[0], shard + FEC_SHARD_PREFIX, size)) {
+            frame->recovered++;
+            r->recovered_packets++;
+        }
+
+    }
+
+}
+
+/// Store a parity packet in the frame, return the start of its block or -1 if
+/// it is invalid or a duplicate.
+static int reasm_store_parity(struct reasm *r, struct reasm_frame *frame, const uint8_t *payload, size_t size) {
+
+    struct fec_header fec;
+    if (size < sizeof(fec)) {
+        r->malformed++;
+        return -1;
+    }
+    memcpy(&fec, payload, sizeof(fec));
+
+    unsigned shard_size = ntohs(fec.shard_size);
+    if (size != sizeof(fec) + shard_size || shard_size > FEC_MAX_SHARD || shard_size < FEC_SHARD_PREFIX
+        || (fec.scheme != FEC_XOR && fec.scheme != FEC_RS) || !fec.k || fec.k > FEC_MAX_DATA || fec.index >= FEC_MAX_PARITY) {
+        r->malformed++;
+        return -1;
+    }
+
+    unsigned block_start = ntohs(fec.block_start);
+    for (unsigned i = 0; i < frame->parity_count; i++) {
+        if (frame->parity[i].block_start == block_start && frame->parity[i].index == fec.index) {
+            r->duplicates++;
+            return -1;
+        }
+    }
+
+    if (frame->parity_count == r->config.max_fragments || frame->size + shard_size > r->config.max_frame_size) {
+        r->malformed++;
+        return -1;
+    }
+
+    struct reasm_parity *parity = &frame->parity[frame->parity_count++];
+    memcpy(frame->data + frame->size, payload + sizeof(fec), shard_size);
+    parity->offset = frame->size;
+    parity->shard_size = shard_size;
+    parity->block_start = block_start;
+    parity->scheme = fec.scheme;
+    parity->k = fec.k;
+    parity->index = fec.index;
+    frame->size += shard_size;
+
+    return block_start;
+
+}
+
+void reasm_push(struct reasm *r, const uint8_t *data, size_t size, const struct timespec *now) {
+
+    if (size < sizeof(struct packet_header)) {
+        r->malformed++;
+        return;
+    }
+
+    struct packet_header header;
+    memcpy(&header, data, sizeof(header));
+    if (header.version != PACKET_VERSION) {
+        r->malformed++;
+        return;
+    }
+
+    uint32_t number = ntohl(header.frame);
+    uint32_t sequence = ntohl(header.sequence);
+    unsigned fragment = ntohs(header.fragment);
+    const uint8_t *payload = data + sizeof(header);
+    size_t payload_size = size - sizeof(header);
+
+    r->packets++;
+    r->bytes += size;
+    if (header.flags & PACKET_FLAG_PARITY)
+        r->parity_packets++;
+
+    if (!r->started) {
+        r->started = true;
+        r->next = number;
+        r->highest_sequence = sequence;
+    } else if ((int32_t) (sequence - r->highest_sequence) < 0) {
+        r->reordered++;
+    } else {
+        r->highest_sequence = sequence;
+    }
+
+    int32_t distance = (int32_t) (number - r->next);
+    if (distance < 0 && (uint32_t) -(int64_t) distance < 2 * r->config.window) {
+        // Parity of frames completed without it is expected to arrive late.
+        if (!(header.flags & PACKET_FLAG_PARITY))
+            r->late++;
+        return;
+    }
+
+    // A frame beyond the window pushes the oldest frames out. After a long gap
+    // either way, such as a sender restarting at frame 0, the window restarts at
+    // the new frame.
+    if (distance < 0 || (uint32_t) distance >= 2 * r->config.window) {
+        for (unsigned i = 0; i < r->config.window; i++)
+            reasm_deliver_next(r, now);
+        r->next = number;
+        r->highest_sequence = sequence;
+    }
+    while ((int32_t) (number - r->next) >= (int32_t) r->config.window)
+        reasm_deliver_next(r, now);
+
+    struct reasm_frame *frame = &r->frames[number % r->config.window];
+    if (!frame->active) {
+        frame->active = true;
+        frame->frame = number;
+        frame->timestamp = be64toh(header.timestamp);
+        frame->keyframe = header.flags & PACKET_FLAG_KEYFRAME;
+        frame->received = 0;
+        frame->fragments_used = 0;
+        frame->last_fragment = -1;
+        frame->parity_count = 0;
+        frame->recovered = 0;
+        frame->overflow = false;
+        frame->first_arrival = *now;
+        frame->size = 0;
+    }
+
+    if (header.flags & PACKET_FLAG_PARITY) {
+        int block_start = reasm_store_parity(r, frame, payload, payload_size);
+        if (block_start >= 0)
+            reasm_recover(r, frame, block_start);
+    } else {
+        if (fragment >= r->config.max_fragments || frame->size + payload_size > r->config.max_frame_size) {
+            frame->overflow = true;
+            r->malformed++;
+            return;
+        }
+        if (!reasm_store(r, frame, fragment, header.flags, payload, payload_size))
+            return;
+        // The packet may complete the shards of a block of which parity was received.
+        for (unsigned i = 0; i < frame->parity_count; i++) {
+            const struct reasm_parity *parity = &frame->parity[i];
+            if (fragment >= parity->block_start && fragment < (unsigned) parity->block_start + parity->k) {
+                reasm_recover(r, frame, parity->block_start);
+                break;
+            }
+        }
+    }
+
+    while (reasm_complete(&r->frames[r->next % r->config.window]))
+        reasm_deliver_next(r, now);
+
+}
+
+void reasm_expire(struct reasm *r, const struct timespec *now) {
+
+    while (r->started) {
+
+        struct reasm_frame *frame = &r->frames[r->next % r->config.window];
+        if (reasm_complete(frame)) {
+            reasm_deliver_next(r, now);
+            continue;
+        }
+
+        // The oldest frame of the window gives the waiting time, the next frame
+        // may have been entirely lost.
+        bool expired = false;
+        bool pending = false;
+        for (unsigned i = 0; i < r->config.window; i++) {
+            const struct reasm_frame *other = &r->frames[(r->next + i) % r->config.window];
+            if (other->active) {
+                pending = true;
+                expired = reasm_elapsed_ms(&other->first_arrival, now) >= r->config.timeout_ms;
+                break;
+            }
+        }
+
+        if (!pending || !expired)
+            break;
+
+        reasm_deliver_next(r, now);
+
+    }
+
+}
+
+double reasm_latency_percentile(const struct reasm *r, double percentile) {
+    unsigned long target = r->complete_frames * percentile / 100.0;
+    unsigned long count = 0;
+    for (unsigned i = 0; i < REASM_LATENCY_BUCKETS; i++) {
+        count += r->latency_hist[i];
+        if (count > target)
+            return (i + 1) / 10.0;
+    }
+    return REASM_LATENCY_BUCKETS / 10.0;
+}
+
+void reasm_report(const struct reasm *r) {
+    printf("info: reassembly %lu packets, %lu bytes, %lu duplicates, %lu late, %lu reordered, %lu malformed\n",
+        r->packets, r->bytes, r->duplicates, r->late, r->reordered, r->malformed);
+    if (r->parity_packets)
+        printf("info: fec (%s kernel) %lu parity packets, %lu recovered packets, %lu recovered frames\n",
+            fec_kernel_name(), r->parity_packets, r->recovered_packets, r->recovered_frames);
+    printf("info: reassembly %lu complete frames, %lu lost frames", r->complete_frames, r->lost_frames);
+    if (r->complete_frames)
+        printf(", latency avg %.2f ms, p50 %.1f ms, p99 %.1f ms, max %.2f ms", r->latency_sum / r->complete_frames,
+            reasm_latency_percentile(r, 50), reasm_latency_percentile(r, 99), r->latency_max);
+    printf("\n");
+}
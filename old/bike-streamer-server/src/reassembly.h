@@ -0,0 +1,129 @@
+/// Reassembly of the frames packetized by the client (see 'packetizer.h' in the
+/// client sources). Frames are reassembled in a reorder window and delivered in
+/// order, a frame leaves the window incomplete when a newer frame pushes it out
+/// or when it has been waiting longer than the timeout.
+///
+/// Parity packets are stored along data packets, as soon as a block of the frame
+/// has enough shards its missing data packets are rebuilt (see 'fec.h').
+
+#pragma once
+
+#include "packetizer.h"
+
+#include <sys/uio.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+
+/// Delivery latencies are counted in buckets of 0.1 ms, up to one second.
+#define REASM_LATENCY_BUCKETS 10000
+
+struct reasm_config {
+    /// Number of frames being reassembled at the same time.
+    unsigned window;
+    /// Maximum size and number of fragments of a frame, larger frames are lost.
+    unsigned max_frame_size;
+    unsigned max_fragments;
+    /// Time waited for the missing packets of the oldest frame.
+    unsigned timeout_ms;
+};
+
+struct reasm_fragment {
+    uint32_t offset;
+    uint16_t size;
+    uint8_t flags;
+    bool present;
+};
+
+/// A parity shard received for a block of the frame, stored in the frame data.
+struct reasm_parity {
+    uint32_t offset;
+    uint16_t shard_size;
+    uint16_t block_start;
+    uint8_t scheme;
+    uint8_t k;
+    uint8_t index;
+};
+
+/// A frame being reassembled, payloads are stored in arrival order and gathered
+/// in fragment order on delivery.
+struct reasm_frame {
+    bool active;
+    uint32_t frame;
+    uint64_t timestamp;
+    bool keyframe;
+    unsigned received;
+    /// Highest fragment index received plus one.
+    unsigned fragments_used;
+    /// Index of the last fragment, -1 until the packet ending the frame arrives.
+    int last_fragment;
+    /// Set when a packet didn't fit, the frame can't be completed.
+    bool overflow;
+    struct timespec first_arrival;
+    size_t size;
+    uint8_t *data;
+    struct reasm_fragment *fragments;
+    struct reasm_parity *parity;
+    unsigned parity_count;
+    /// Number of data packets rebuilt from parity packets.
+    unsigned recovered;
+    /// Payloads in fragment order, only valid for complete frames on delivery.
+    struct iovec *iov;
+    unsigned iov_count;
+};
+
+/// Called for each frame leaving the window in order, including frames of which
+/// no packet was received.
+typedef void (*reasm_deliver_fn)(void *opaque, const struct reasm_frame *frame, bool complete);
+
+struct reasm {
+    struct reasm_config config;
+    struct reasm_frame *frames;
+    reasm_deliver_fn deliver;
+    void *opaque;
+    bool started;
+    /// Next frame to deliver.
+    uint32_t next;
+    uint32_t highest_sequence;
+    unsigned long packets;
+    unsigned long bytes;
+    unsigned long duplicates;
+    /// Packets received for a frame already delivered.
+    unsigned long late;
+    unsigned long reordered;
+    unsigned long malformed;
+    unsigned long parity_packets;
+    unsigned long recovered_packets;
+    /// Complete frames that needed rebuilt packets.
+    unsigned long recovered_frames;
+    /// Scratch shards used to rebuild packets.
+    uint8_t *fec_syndromes;
+    uint8_t *fec_shards;
+    unsigned long complete_frames;
+    unsigned long lost_frames;
+    /// Time from the first packet of a complete frame to its delivery.
+    double latency_sum;
+    double latency_max;
+    unsigned latency_hist[REASM_LATENCY_BUCKETS];
+};
+
+
+/// Initialize the reassembly, all the memory is allocated here, return -1 on failure.
+int reasm_init(struct reasm *r, const struct reasm_config *config, reasm_deliver_fn deliver, void *opaque);
+void reasm_free(struct reasm *r);
+
+/// Process a received datagram.
+void reasm_push(struct reasm *r, const uint8_t *data, size_t size, const struct timespec *now);
+
+/// Deliver the frames that waited longer than the timeout, to be called
+/// periodically when no packets arrive.
+void reasm_expire(struct reasm *r, const struct timespec *now);
+
+/// Get the delivery latency percentile of complete frames, in milliseconds.
+double reasm_latency_percentile(const struct reasm *r, double percentile);
+
+/// Print the reassembly statistics.
+void reasm_report(const struct reasm *r);
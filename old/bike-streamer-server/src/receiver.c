@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+
+#include "receiver.h"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+
+
+/// Largest datagram that can be received.
+#define RECEIVER_DATAGRAM 65536
+
+/// Answers buffered before being sent with one sendmmsg call.
+#define RECEIVER_ANSWERS 64
+
+struct receiver_slab {
+    struct mmsghdr msgs[RECEIVER_BATCH];
+    struct iovec iovs[RECEIVER_BATCH];
+    struct sockaddr_storage addrs[RECEIVER_BATCH];
+    unsigned answers_count;
+    struct packet_answer answers[RECEIVER_ANSWERS];
+    struct iovec answers_iovs[RECEIVER_ANSWERS];
+    struct mmsghdr answers_msgs[RECEIVER_ANSWERS];
+    uint8_t buffers[RECEIVER_BATCH][RECEIVER_DATAGRAM];
+};
+
+
+static void receiver_flush_answers(struct receiver *recv) {
+
+    struct receiver_slab *slab = recv->slab;
+    for (unsigned i = 0; i < slab->answers_count; i++) {
+        slab->answers_msgs[i].msg_hdr.msg_name = &recv->peer;
+        slab->answers_msgs[i].msg_hdr.msg_namelen = recv->peer_len;
+    }
+
+    // Answers are best effort, like the stream itself.
+    if (slab->answers_count && sendmmsg(recv->fd, slab->answers_msgs, slab->answers_count, MSG_DONTWAIT) > 0)
+        recv->answers += slab->answers_count;
+
+    slab->answers_count = 0;
+
+}
+
+static void receiver_deliver(void *opaque, const struct reasm_frame *frame, bool complete) {
+
+    struct receiver *recv = opaque;
+    struct receiver_slab *slab = recv->slab;
+
+    if (complete && recv->out_fd != -1) {
+        for (unsigned i = 0; i < frame->iov_count; i += IOV_MAX) {
+            unsigned count = frame->iov_count - i < IOV_MAX ? frame->iov_count - i : IOV_MAX;
+            if (writev(recv->out_fd, frame->iov + i, count) == -1)
+                recv->write_errors++;
+        }
+    }
+
+    if (slab->answers_count == RECEIVER_ANSWERS)
+        receiver_flush_answers(recv);
+
+    struct packet_answer *answer = &slab->answers[slab->answers_count++];
+    answer->version = PACKET_VERSION;
+    answer->status = complete ? PACKET_ANSWER_COMPLETE : PACKET_ANSWER_LOST;
+    answer->packets = htons(frame->received > UINT16_MAX ? UINT16_MAX : frame->received);
+    answer->frame = htonl(frame->frame);
+    answer->timestamp = htobe64(frame->timestamp);
+
+    if (recv->observer)
+        recv->observer(recv->observer_opaque, frame, complete);
+
+}
+
+int receiver_open(struct receiver *recv, unsigned port, const struct reasm_config *config, int out_fd) {
+
+    memset(recv, 0, sizeof(struct receiver));
+    recv->fd = -1;
+    recv->out_fd = out_fd;
+
+    recv->slab = calloc(1, sizeof(struct receiver_slab));
+    if (!recv->slab)
+        return -1;
+
+    struct receiver_slab *slab = recv->slab;
+    for (unsigned i = 0; i < RECEIVER_BATCH; i++) {
+        slab->iovs[i].iov_base = slab->buffers[i];
+        slab->iovs[i].iov_len = RECEIVER_DATAGRAM;
+        slab->msgs[i].msg_hdr.msg_iov = &slab->iovs[i];
+        slab->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (unsigned i = 0; i < RECEIVER_ANSWERS; i++) {
+        slab->answers_iovs[i].iov_base = &slab->answers[i];
+        slab->answers_iovs[i].iov_len = sizeof(struct packet_answer);
+        slab->answers_msgs[i].msg_hdr.msg_iov = &slab->answers_iovs[i];
+        slab->answers_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if (reasm_init(&recv->reasm, config, receiver_deliver, recv) == -1) {
+        free(recv->slab);
+        return -1;
+    }
+
+    recv->fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (recv->fd == -1) {
+        receiver_close(recv);
+        return -1;
+    }
+
+    // Accept both IPv4 and IPv6 clients, and absorb bursts of key frames.
+    int zero = 0, rcvbuf = 4 << 20;
+    setsockopt(recv->fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+    setsockopt(recv->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    struct sockaddr_in6 addr = {0};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+
+    if (bind(recv->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        receiver_close(recv);
+        return -1;
+    }
+
+    return 0;
+
+}
+
+void receiver_close(struct receiver *recv) {
+    if (recv->fd != -1)
+        close(recv->fd);
+    reasm_free(&recv->reasm);
+    free(recv->slab);
+    recv->fd = -1;
+    recv->slab = NULL;
+}
+
+unsigned receiver_port(const struct receiver *recv) {
+    struct sockaddr_in6 addr;
+    socklen_t len = sizeof(addr);
+    if (getsockname(recv->fd, (struct sockaddr *) &addr, &len) == -1)
+        return 0;
+    return ntohs(addr.sin6_port);
+}
+
+void receiver_run(struct receiver *recv, atomic_bool *stop) {
+
+    struct receiver_slab *slab = recv->slab;
+    unsigned timeout = recv->reasm.config.timeout_ms / 2;
+
+    while (!atomic_load(stop)) {
+
+        struct pollfd pfd = { recv->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeout ? timeout : 1) == -1 && errno != EINTR) {
+            fprintf(stderr, "error: receiver poll error (%s)\n", strerror(errno));
+            return;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // Drain the socket, each call receives up to a whole batch.
+        for (;;) {
+
+            for (unsigned i = 0; i < RECEIVER_BATCH; i++) {
+                slab->msgs[i].msg_hdr.msg_name = &slab->addrs[i];
+                slab->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+            }
+
+            int count = recvmmsg(recv->fd, slab->msgs, RECEIVER_BATCH, MSG_DONTWAIT, NULL);
+            if (count == -1 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                break;
+
+            recv->batches++;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            for (int i = 0; i < count; i++)
+                reasm_push(&recv->reasm, slab->buffers[i], slab->msgs[i].msg_len, &now);
+
+            memcpy(&recv->peer, &slab->addrs[count - 1], slab->msgs[count - 1].msg_hdr.msg_namelen);
+            recv->peer_len = slab->msgs[count - 1].msg_hdr.msg_namelen;
+
+            if (count < RECEIVER_BATCH)
+                break;
+
+        }
+
+        reasm_expire(&recv->reasm, &now);
+        if (recv->peer_len)
+            receiver_flush_answers(recv);
+        else
+            slab->answers_count = 0;
+
+    }
+
+}
+
+void receiver_report(const struct receiver *recv) {
+    const struct reasm *r = &recv->reasm;
+    reasm_report(r);
+    printf("info: receiver %lu batches (%.2f packets per batch), %lu answers, %lu write errors\n",
+        recv->batches, recv->batches ? (double) r->packets / recv->batches : 0, recv->answers, recv->write_errors);
+}
@@ -0,0 +1,49 @@
+/// UDP receiver of the client stream. Datagrams are pulled in batches with
+/// recvmmsg and reassembled, complete frames are written to the output and an
+/// answer is sent back to the client for every frame.
+
+#pragma once
+
+#include "reassembly.h"
+
+#include <sys/socket.h>
+
+#include <stdatomic.h>
+
+
+/// Maximum number of datagrams received by one recvmmsg call.
+#define RECEIVER_BATCH 64
+
+/// Receive buffers, see 'receiver.c'.
+struct receiver_slab;
+
+struct receiver {
+    int fd;
+    /// Complete frames are written to this file descriptor, -1 if none.
+    int out_fd;
+    struct reasm reasm;
+    /// Called for each frame after it has been written and answered, NULL if none.
+    reasm_deliver_fn observer;
+    void *observer_opaque;
+    struct receiver_slab *slab;
+    /// Address of the client, answers are sent to the sender of the last datagram.
+    struct sockaddr_storage peer;
+    socklen_t peer_len;
+    unsigned long batches;
+    unsigned long answers;
+    unsigned long write_errors;
+};
+
+
+/// Bind the receiver on the given UDP port, zero for any port, return -1 on failure.
+int receiver_open(struct receiver *recv, unsigned port, const struct reasm_config *config, int out_fd);
+void receiver_close(struct receiver *recv);
+
+/// Get the bound UDP port.
+unsigned receiver_port(const struct receiver *recv);
+
+/// Receive and reassemble until the stop flag is set.
+void receiver_run(struct receiver *recv, atomic_bool *stop);
+
+/// Print the receiver and reassembly statistics.
+void receiver_report(const struct receiver *recv);